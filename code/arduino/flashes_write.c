@@ -1,12 +1,15 @@
 /**
 
-  @file    flash_write.h
+  @file    flashes_write.c
   @brief   Write program to flash.
   @author  Pekka Lehtikoski
   @version 1.0
   @date    24.9.2018
 
-  X...
+  STM32 implementation of flashes_write.h using the HAL flash driver. New program is written
+  to the bank which is not running, erasing sectors as needed, and boot bank is switched once
+  the image is complete. Erase can also be started ahead without waiting for it, so that the
+  device can keep receiving data while flash is busy.
 
   Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
   modified, and distributed under the terms of the project licensing. By continuing to use, modify,
@@ -46,13 +49,113 @@
 #define ADDR_BANK_2_START       ((uint32_t)0x08100000)
 #define FIRST_BANK_2_SECTOR     FLASH_SECTOR_12
 
+/* Program parallelism in bytes: 1, 2, 4 or 8. This must match supply voltage: 8 (double word)
+   needs external VPP, 4 (word) 2.7 - 3.6 V, 2 (half word) 2.1 - 3.6 V and 1 (byte) works with
+   any supply. Narrower program operations are used for unaligned head and tail of data.
+ */
+#ifndef FLASHES_PROGRAM_WIDTH
+#define FLASHES_PROGRAM_WIDTH 4
+#endif
+
+/* Voltage range for erase, selected by program parallelism.
+ */
+#if FLASHES_PROGRAM_WIDTH >= 8
+#define FLASHES_VOLTAGE_RANGE FLASH_VOLTAGE_RANGE_4
+#elif FLASHES_PROGRAM_WIDTH >= 4
+#define FLASHES_VOLTAGE_RANGE FLASH_VOLTAGE_RANGE_3
+#elif FLASHES_PROGRAM_WIDTH >= 2
+#define FLASHES_VOLTAGE_RANGE FLASH_VOLTAGE_RANGE_2
+#else
+#define FLASHES_VOLTAGE_RANGE FLASH_VOLTAGE_RANGE_1
+#endif
+
+/* Use fast 256 byte row programming, if the chip supports it (not STM32F4 family).
+ */
+#ifndef FLASHES_FAST_PROGRAM
+#ifdef FLASH_TYPEPROGRAM_FAST
+#define FLASHES_FAST_PROGRAM 1
+#else
+#define FLASHES_FAST_PROGRAM 0
+#endif
+#endif
+#define FLASHES_FAST_ROW_SZ 256
+
+/* Time out for waiting previous flash operation to complete, ms.
+ */
+#define FLASHES_FLASH_TIMEOUT_MS 50000
+
 /* In boot loaded mode
  */
 #define APPLICATION_BASE_ADDR ADDR_FLASH_SECTOR_5
 
+/* Size of area the image is written to: Whole bank in dual bank mode, rest of bank 1 after
+   the boot loader in boot loader mode.
+ */
+#if FLASHES_DUAL_BANK_MODE
+#define FLASHES_WRITABLE_SIZE FLASHES_BANK_SIZE
+#else
+#define FLASHES_WRITABLE_SIZE (FLASHES_BANK_SIZE - (APPLICATION_BASE_ADDR - ADDR_BANK_1_START))
+#endif
+
+/* Address where transfer progress record is kept. Backup SRAM keeps its content over reset,
+   and over power off if VBAT pin is connected to battery.
+ */
+#ifndef FLASHES_PROGRESS_ADDR
+#define FLASHES_PROGRESS_ADDR BKPSRAM_BASE
+#endif
+
+/* Address of loader request flag word in backup SRAM, after progress record.
+ */
+#ifndef FLASHES_LOADER_REQUEST_ADDR
+#define FLASHES_LOADER_REQUEST_ADDR (FLASHES_PROGRESS_ADDR + sizeof(flashesProgress))
+#endif
+
+/* Address of installed image record in backup SRAM, after loader request flag word.
+ */
+#ifndef FLASHES_IMAGE_INFO_ADDR
+#define FLASHES_IMAGE_INFO_ADDR (FLASHES_LOADER_REQUEST_ADDR + sizeof(os_uint))
+#endif
+
+/* Flash sector being erased by flashes_start_erase(), or -1 if no erase is in progress.
+ */
+static os_int flashes_erasing_sector = -1;
+
+/* Error from flashes_start_erase() erase, reported by next flashes_write() call.
+ */
+static osalStatus flashes_erase_status = OSAL_SUCCESS;
+
+#if FLASHES_STATS
+/* Cycle counter value when background erase was started.
+ */
+static os_uint flashes_erase_start;
+#endif
+
+static osalStatus flashes_check_range(
+    os_uint addr,
+    os_uint nbytes);
+
 static os_uint flashes_get_sector(
     os_uint addr);
 
+static os_uint flashes_get_sector_addr(
+    os_uint sector,
+    os_uint *nbytes);
+
+static os_boolean flashes_is_sector_blank(
+    os_uint sector);
+
+static osalStatus flashes_program(
+    os_uint progaddr,
+    os_uchar *buf,
+    os_uint nbytes);
+
+static void flashes_enable_backup_sram(void);
+
+#if FLASHES_CRC32_HW
+static os_uint flashes_crc32_unshift(
+    os_uint state);
+#endif
+
 /**
 ****************************************************************************************************
 
@@ -64,16 +167,18 @@ static os_uint flashes_get_sector(
   one. This allows erashing flash as needed.
 
   @param   addr Flash address. Address 0 is the beginning of the flags. This is bank 1
-           address. To write to bank 2 use bank 1 address, but set bank2 flag. This address
-           needs to be divisible by by 4 (minimum write size is dword).
+           address. To write to bank 2 use bank 1 address, but set bank2 flag. Any alignment
+           works, but FLASHES_PROGRAM_WIDTH aligned address is fastest.
   @param   buf Pointer to data to write.
-  @param   nbytes This needs to be divisible by 4 (minimum write size is dword).
+  @param   nbytes Number of bytes to write. Any number, but FLASHES_PROGRAM_WIDTH multiple
+           is fastest.
   @param   bank2 OS_FALSE to write to bank1, OS_TRUE to write to bank 2.
   @param   next_sector_to_erase Pointer to erase tracking variable. Set to value of
            next_sector_to_erase to zero before the first flash_write() call. For following
            calls, pass the same pointer. This function modifies the variable as needed.
 
-  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+  @return  OSAL_SUCCESS if all is fine. OSAL_PENDING if erase started by flashes_start_erase()
+           is still running, nothing was written. Other values indicate an error.
 
 ****************************************************************************************************
 */
@@ -85,12 +190,19 @@ osalStatus flashes_write(
     os_uint *next_sector_to_erase)
 {
     static FLASH_EraseInitTypeDef eraseprm;
-    os_uint first_sector, last_sector, progaddr;
+    os_uint first_sector, last_sector, sector, progaddr;
     uint32_t secerror = 0;
-    const os_uint dword_sz = sizeof(uint32_t);
     osalStatus err_rval = OSAL_STATUS_FAILED;
+#if FLASHES_STATS
+    os_uint t;
+#endif
+
+    if (flashes_check_range(addr, nbytes)) return OSAL_STATUS_FAILED;
 
-    os_char strbuf[64];
+    /* If erase started by flashes_start_erase() is still running, do not spin waiting for it.
+       The caller's loop tries again once flashes_is_busy() returns OS_FALSE.
+     */
+    if (flashes_is_busy()) return OSAL_PENDING;
 
 #if FLASHES_DUAL_BANK_MODE
     /* Move to the beginning of STM32 flash banks.
@@ -107,17 +219,16 @@ osalStatus flashes_write(
     progaddr = addr;
 #endif
 
-#if OSAL_TRACE >= 2
-    osal_console_write("writing ");
-    osal_int_to_string(strbuf, sizeof(strbuf), nbytes);
-    osal_console_write(strbuf);
-    osal_console_write(" bytes at bank ");
-    osal_console_write(bank2 ? "2" : "1");
-    osal_console_write(" address ");
-    osal_int_to_string(strbuf, sizeof(strbuf), addr);
-    osal_console_write(strbuf);
-    osal_console_write("\n");
-#endif
+    FLASHES_TRACE(2, FLASHES_TRACE_WRITE, addr, nbytes | (bank2 ? FLASHES_TRACE_BANK2_FLAG : 0));
+
+    /* Report error from erase started by flashes_start_erase().
+     */
+    if (flashes_erase_status)
+    {
+        err_rval = flashes_erase_status;
+        flashes_erase_status = OSAL_SUCCESS;
+        return err_rval;
+    }
 
     /* Unlock the flash.
      */
@@ -128,7 +239,8 @@ osalStatus flashes_write(
     first_sector = flashes_get_sector(addr);
     last_sector = flashes_get_sector(addr + nbytes - 1);
 
-    /* Erase if not done already
+    /* Erase if not done already. Sectors which are already blank, for example after aborted
+       transfer, are not erased again.
      */
     if (last_sector >= *next_sector_to_erase)
     {
@@ -137,30 +249,29 @@ osalStatus flashes_write(
             first_sector = *next_sector_to_erase;
         }
 
-        /* Set erase parameter structure
-         */
-        os_memclear(&eraseprm, sizeof(eraseprm));
-        eraseprm.TypeErase = TYPEERASE_SECTORS;
-        eraseprm.VoltageRange = VOLTAGE_RANGE_3;
-        eraseprm.Sector = first_sector;
-        eraseprm.NbSectors = last_sector - first_sector + 1;
-
-#if OSAL_TRACE >= 2
-        osal_console_write("erasing ");
-        osal_int_to_string(strbuf, sizeof(strbuf), eraseprm.NbSectors);
-        osal_console_write(strbuf);
-        osal_console_write(" sectors starting from  ");
-        osal_int_to_string(strbuf, sizeof(strbuf), eraseprm.Sector);
-        osal_console_write(strbuf);
-        osal_console_write("\n");
-#endif
-
-        /* Erase the flags as we go.
-         */
-        if (HAL_FLASHEx_Erase(&eraseprm, &secerror) != HAL_OK)
+        for (sector = first_sector; sector <= last_sector; sector++)
         {
-            osal_debug_error("HAL_FLASHEx_Erase failed");
-            goto failed;
+            if (flashes_is_sector_blank(sector)) continue;
+
+            /* Set erase parameter structure
+             */
+            os_memclear(&eraseprm, sizeof(eraseprm));
+            eraseprm.TypeErase = TYPEERASE_SECTORS;
+            eraseprm.VoltageRange = FLASHES_VOLTAGE_RANGE;
+            eraseprm.Sector = sector;
+            eraseprm.NbSectors = 1;
+
+            FLASHES_TRACE(2, FLASHES_TRACE_ERASE, sector, 0);
+
+            /* Erase the flags as we go.
+             */
+            FLASHES_STATS_BEGIN(t);
+            if (HAL_FLASHEx_Erase(&eraseprm, &secerror) != HAL_OK)
+            {
+                osal_debug_error("HAL_FLASHEx_Erase failed");
+                goto failed;
+            }
+            FLASHES_STATS_END(FLASHES_STAT_ERASE, t);
         }
 
         /* Maintain next unerased sector.
@@ -169,52 +280,321 @@ osalStatus flashes_write(
     }
 
 
-#if 0
-// fast_block_sz = 256
-    /* FAST 8 x 32 bytes. Calculate number of 256 byte writes.
+    /* Program the data.
+     * Your flash start address when programming should always be 0x08100000 (2 MB flash).
      */
-    n = nbytes / fast_block_sz;
-    for (i = 0; i<n; i++)
-    {
-        if (HAL_FLASH_Program(i == n-1 ? FLASH_TYPEPROGRAM_FAST_AND_LAST
-            : FLASH_TYPEPROGRAM_FAST, addr, (uint32_t)buf) == HAL_OK)
-        {
-            osal_debug_error("HAL_FLASH_Program failed");
-            goto failed;
-        }
+    FLASHES_STATS_BEGIN(t);
+    err_rval = flashes_program(progaddr, buf, nbytes);
+    if (err_rval) goto failed;
+    FLASHES_STATS_END(FLASHES_STAT_PROGRAM, t);
+
+    /* Lock the flash.
+     */
+    HAL_FLASH_Lock();
+    return OSAL_SUCCESS;
+
+failed:
+    HAL_FLASH_Lock();
+    return err_rval;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Program data to erased flash.
+  @anchor flashes_program
+
+  The flashes_program() function programs data using the widest program operation allowed by
+  FLASHES_PROGRAM_WIDTH and address alignment. Program units are read straight from aligned
+  data, like receive arena of flashes_socket.c. Unaligned data is copied to a program unit
+  first, so any buffer works. Unaligned head and tail, for example last block of odd size
+  binary, are programmed with narrower operations. If the chip supports fast row programming
+  and data is aligned, whole aligned 256 byte rows are written with it.
+
+  Program units and rows which flash already holds are skipped. Flash is erased, so these are
+  typically erased value bytes, but after aborted or repeated transfer also data programmed
+  earlier. Programming these would not change anything, but would take time and wear flash.
+
+  Flash must be unlocked by the caller.
 
-        buf += fast_block_sz;
-        addr += fast_block_sz;
-        nbytes -= fast_block_sz;
+  @param   progaddr Physical flash address to program.
+  @param   buf Pointer to data to write.
+  @param   nbytes Number of bytes to write, any number.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_program(
+    os_uint progaddr,
+    os_uchar *buf,
+    os_uint nbytes)
+{
+    union
+    {
+        uint64_t u64;
+        uint32_t u32;
+        uint16_t u16;
+        uint8_t u8;
     }
-#endif
+    unit;
+    const os_uchar *src;
+    os_uint width;
+    uint32_t type_program;
+    uint64_t data;
 
-    /* Write rest as dwords
-     * Your flash start address when programming should always be 0x08100000 (2 MB flash).
-     */
     while (nbytes > 0)
     {
-        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, progaddr, *(uint32_t*)buf) == HAL_OK)
+#if FLASHES_FAST_PROGRAM
+        /* Fast row programming. Row is given as pointer to data, which must be word aligned.
+         */
+        if ((progaddr % FLASHES_FAST_ROW_SZ) == 0 && nbytes >= FLASHES_FAST_ROW_SZ &&
+            ((os_uint)buf % sizeof(uint64_t)) == 0)
+        {
+            if (os_memcmp((const void*)progaddr, buf, FLASHES_FAST_ROW_SZ) &&
+                HAL_FLASH_Program(FLASH_TYPEPROGRAM_FAST, progaddr, (uint32_t)buf) != HAL_OK)
+            {
+                osal_debug_error("HAL_FLASH_Program fast failed");
+                return OSAL_STATUS_FAILED;
+            }
+            buf += FLASHES_FAST_ROW_SZ;
+            progaddr += FLASHES_FAST_ROW_SZ;
+            nbytes -= FLASHES_FAST_ROW_SZ;
+            continue;
+        }
+#endif
+
+        /* Select widest program unit, which is allowed, aligned and fits into data left.
+         */
+        width = FLASHES_PROGRAM_WIDTH;
+        while (width > 1 && ((progaddr & (width - 1)) || nbytes < width))
+        {
+            width >>= 1;
+        }
+
+        /* Skip if flash already holds the value.
+         */
+        if (!os_memcmp((const void*)progaddr, buf, width))
+        {
+            buf += width;
+            progaddr += width;
+            nbytes -= width;
+            continue;
+        }
+
+        /* Read program unit straight from aligned data, copy unaligned data to unit first.
+         */
+        src = buf;
+        if ((os_uint)buf & (width - 1))
+        {
+            os_memcpy(&unit, buf, width);
+            src = (const os_uchar*)&unit;
+        }
+        switch (width)
         {
-            buf += dword_sz;
-            progaddr += dword_sz;
-            nbytes -= dword_sz;
+#if FLASHES_PROGRAM_WIDTH >= 8
+            case 8:
+                type_program = FLASH_TYPEPROGRAM_DOUBLEWORD;
+                data = *(const uint64_t*)src;
+                break;
+#endif
+            case 4:
+                type_program = FLASH_TYPEPROGRAM_WORD;
+                data = *(const uint32_t*)src;
+                break;
+
+            case 2:
+                type_program = FLASH_TYPEPROGRAM_HALFWORD;
+                data = *(const uint16_t*)src;
+                break;
+
+            default:
+                type_program = FLASH_TYPEPROGRAM_BYTE;
+                data = *src;
+                break;
         }
-        else
+
+        if (HAL_FLASH_Program(type_program, progaddr, data) != HAL_OK)
         {
             osal_debug_error("HAL_FLASH_Program failed");
-            goto failed;
+            return OSAL_STATUS_FAILED;
         }
+
+        buf += width;
+        progaddr += width;
+        nbytes -= width;
     }
 
-    /* Lock the flash.
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Start erasing next flash sector needed for write.
+  @anchor flashes_start_erase
+
+  The flashes_start_erase() function checks if writing nbytes at addr needs a flash sector which
+  has not been erased yet. If so, erase of the first such sector is started and the function
+  returns without waiting for it to complete. Use flashes_is_busy() to check when erase is done.
+  Calling this function repeatedly, until started is OS_FALSE, erases all sectors needed.
+  The flashes_write() function can then be called without it blocking for erase. While erase
+  runs flashes_write() returns OSAL_PENDING without writing.
+
+  In dual bank mode we are erasing the bank we are not running from, so code execution and
+  network communication can continue while erase runs. In boot loader mode CPU is stalled while
+  reading flash during erase, so no overlap is gained, but the result is correct.
+
+  @param   addr Flash address, as for flashes_write().
+  @param   nbytes Number of bytes to be written.
+  @param   bank2 OS_FALSE to write to bank1, OS_TRUE to write to bank 2.
+  @param   next_sector_to_erase Pointer to erase tracking variable, as for flashes_write().
+  @param   started Set to OS_TRUE if erase was started, OS_FALSE if nothing needs erasing.
+
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_start_erase(
+    os_uint addr,
+    os_uint nbytes,
+    os_boolean bank2,
+    os_uint *next_sector_to_erase,
+    os_boolean *started)
+{
+    os_uint first_sector, last_sector;
+
+    *started = OS_FALSE;
+    if (nbytes == 0 || flashes_is_busy()) return OSAL_SUCCESS;
+    if (flashes_check_range(addr, nbytes)) return OSAL_STATUS_FAILED;
+
+#if FLASHES_DUAL_BANK_MODE
+    addr += bank2 ? ADDR_BANK_2_START : ADDR_BANK_1_START;
+#else
+    addr += APPLICATION_BASE_ADDR;
+#endif
+
+    first_sector = flashes_get_sector(addr);
+    last_sector = flashes_get_sector(addr + nbytes - 1);
+    if (last_sector < *next_sector_to_erase) return OSAL_SUCCESS;
+    if (first_sector < *next_sector_to_erase)
+    {
+        first_sector = *next_sector_to_erase;
+    }
+
+    /* Sectors which are already blank need no erase.
      */
-    HAL_FLASH_Lock();
+    while (first_sector <= last_sector && flashes_is_sector_blank(first_sector))
+    {
+        first_sector++;
+    }
+    *next_sector_to_erase = first_sector;
+    if (first_sector > last_sector) return OSAL_SUCCESS;
+
+    FLASHES_TRACE(2, FLASHES_TRACE_ERASE_START, first_sector, 0);
+
+    /* Start erase of one sector, this is what HAL_FLASHEx_Erase() does without waiting.
+       Flash is left unlocked until the erase completes.
+     */
+    HAL_FLASH_Unlock();
+    if (FLASH_WaitForLastOperation(FLASHES_FLASH_TIMEOUT_MS) != HAL_OK)
+    {
+        HAL_FLASH_Lock();
+        osal_debug_error("flash busy");
+        return OSAL_STATUS_FAILED;
+    }
+    FLASHES_STATS_BEGIN(flashes_erase_start);
+    FLASH_Erase_Sector(first_sector, FLASHES_VOLTAGE_RANGE);
+
+    flashes_erasing_sector = (os_int)first_sector;
+    *next_sector_to_erase = first_sector + 1;
+    *started = OS_TRUE;
     return OSAL_SUCCESS;
+}
 
-failed:
+
+/**
+****************************************************************************************************
+
+  @brief Check if flash erase is in progress.
+  @anchor flashes_is_busy
+
+  The flashes_is_busy() function checks if sector erase started by flashes_start_erase() is still
+  running. When the erase completes, this function finishes the erase operation: Clears sector
+  erase bits and locks the flash.
+
+  @return  OS_TRUE if erase is still running, OS_FALSE if flash is free.
+
+****************************************************************************************************
+*/
+os_boolean flashes_is_busy(void)
+{
+    if (flashes_erasing_sector < 0) return OS_FALSE;
+    if (__HAL_FLASH_GET_FLAG(FLASH_FLAG_BSY)) return OS_TRUE;
+    FLASHES_STATS_END(FLASHES_STAT_ERASE, flashes_erase_start);
+    FLASHES_TRACE(2, FLASHES_TRACE_ERASE_DONE, flashes_erasing_sector, 0);
+
+    /* Erase done. Check for errors and clear sector erase bits, as HAL does.
+     */
+    if (__HAL_FLASH_GET_FLAG(FLASH_FLAG_OPERR) || __HAL_FLASH_GET_FLAG(FLASH_FLAG_WRPERR) ||
+        __HAL_FLASH_GET_FLAG(FLASH_FLAG_PGAERR) || __HAL_FLASH_GET_FLAG(FLASH_FLAG_PGSERR))
+    {
+        osal_debug_error("flash sector erase failed");
+        flashes_erase_status = OSAL_STATUS_FAILED;
+    }
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR |
+        FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+    CLEAR_BIT(FLASH->CR, (FLASH_CR_SER | FLASH_CR_SNB));
     HAL_FLASH_Lock();
-    return err_rval;
+
+    flashes_erasing_sector = -1;
+    return OS_FALSE;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Read data from flash bank.
+  @anchor flashes_read
+
+  The flashes_read() function copies data from flash memory to buffer. The bank we are running
+  from is always mapped at beginning of flash, and the other bank after it.
+
+  In boot loader mode there is only one image, the application area, which is read when bank2
+  is OS_TRUE. The bank we run from cannot be read as separate image in boot loader mode.
+
+  @param   addr Flash address, as for flashes_write().
+  @param   buf Buffer where to store the data.
+  @param   nbytes Number of bytes to read.
+  @param   bank2 OS_FALSE to read bank1, OS_TRUE to read bank 2.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_read(
+    os_uint addr,
+    os_uchar *buf,
+    os_uint nbytes,
+    os_boolean bank2)
+{
+#if FLASHES_DUAL_BANK_MODE
+    os_boolean running_bank2;
+#endif
+
+    if (flashes_check_range(addr, nbytes)) return OSAL_STATUS_FAILED;
+
+#if FLASHES_DUAL_BANK_MODE
+    running_bank2 = (LL_SYSCFG_GetFlashBankMode() == LL_SYSCFG_BANKMODE_BANK2) ? OS_TRUE : OS_FALSE;
+    addr += ((bank2 ? OS_TRUE : OS_FALSE) == running_bank2) ? ADDR_BANK_1_START : ADDR_BANK_2_START;
+#else
+    if (!bank2) return OSAL_STATUS_FAILED;
+    addr += APPLICATION_BASE_ADDR;
+#endif
+
+    os_memcpy(buf, (const os_uchar*)addr, nbytes);
+    return OSAL_SUCCESS;
 }
 
 
@@ -276,12 +656,7 @@ os_boolean flashes_is_bank2_selected(void)
     HAL_FLASH_OB_Lock();
     HAL_FLASH_Lock();
 
-#if OSAL_TRACE >= 2
-    osal_console_write("check for selected bank, ");
-    osal_console_write(bank2 ? "bank 2 returned\n" : "bank 1 returned\n");
-    osal_console_write("bank mode, ");
-    osal_console_write(bankmode ==  LL_SYSCFG_BANKMODE_BANK2 ? "bank 2\n" : "bank 1\n");
-#endif
+    FLASHES_TRACE(1, FLASHES_TRACE_BANK_QUERY, bank2, bankmode ==  LL_SYSCFG_BANKMODE_BANK2);
 
     if (bank2 && bankmode !=  LL_SYSCFG_BANKMODE_BANK2)
     {
@@ -347,16 +722,357 @@ osalStatus flashes_select_bank(
     HAL_FLASH_OB_Lock();
     HAL_FLASH_Lock();
 
-#if OSAL_TRACE >= 2
-    osal_console_write("setting boot bank boot: ");
-    osal_console_write(bank2 ? "bank 2\n" : "bank 1\n");
-#endif
+    FLASHES_TRACE(1, FLASHES_TRACE_SELECT_BANK, bank2, 0);
 
 #endif
     return rval;
 }
 
 
+/**
+****************************************************************************************************
+
+  @brief Save transfer progress record so that it survives reboot.
+  @anchor flashes_save_progress
+
+  The flashes_save_progress() function copies progress record to backup SRAM. This is called
+  after every written block, so flash is not used for it.
+
+  @param   progress Progress record to save.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_save_progress(
+    const flashesProgress *progress)
+{
+    flashes_enable_backup_sram();
+    os_memcpy((void*)FLASHES_PROGRESS_ADDR, progress, sizeof(flashesProgress));
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Load transfer progress record.
+  @anchor flashes_load_progress
+
+  The flashes_load_progress() function copies progress record from backup SRAM. After power
+  loss without backup battery the content is garbage, the caller checks the record.
+
+  @param   progress Where to store the progress record.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_load_progress(
+    flashesProgress *progress)
+{
+    flashes_enable_backup_sram();
+    os_memcpy(progress, (const void*)FLASHES_PROGRESS_ADDR, sizeof(flashesProgress));
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Ask boot loader to stay listening after next reboot.
+  @anchor flashes_request_loader
+
+  The flashes_request_loader() function sets flag word in backup SRAM. The application calls
+  this before rebooting for an update, so that the boot loader listens for program transfer
+  instead of starting the application at once. Backup SRAM keeps the flag over reset. After
+  power loss the content is garbage, which matches the flag value only by chance, and then
+  costs only one listen period.
+
+  @param   enable OS_TRUE to request, OS_FALSE to cancel the request.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_request_loader(
+    os_boolean enable)
+{
+    flashes_enable_backup_sram();
+    *(volatile os_uint*)FLASHES_LOADER_REQUEST_ADDR = enable ? FLASHES_LOADER_REQUEST_MAGIC : 0;
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Check and clear boot loader request.
+  @anchor flashes_take_loader_request
+
+  The flashes_take_loader_request() function checks flag word in backup SRAM and clears it,
+  so that the request is served only once.
+
+  @return  OS_TRUE if staying in boot loader was requested.
+
+****************************************************************************************************
+*/
+os_boolean flashes_take_loader_request(void)
+{
+    os_boolean requested;
+
+    flashes_enable_backup_sram();
+    requested = (os_boolean)(*(volatile os_uint*)FLASHES_LOADER_REQUEST_ADDR ==
+        FLASHES_LOADER_REQUEST_MAGIC);
+    *(volatile os_uint*)FLASHES_LOADER_REQUEST_ADDR = 0;
+    return requested;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Save record of installed image so that it survives reboot.
+  @anchor flashes_save_image_info
+
+  The flashes_save_image_info() function copies the record to backup SRAM.
+
+  @param   info Image record to save.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_save_image_info(
+    const flashesImageInfo *info)
+{
+    flashes_enable_backup_sram();
+    os_memcpy((void*)FLASHES_IMAGE_INFO_ADDR, info, sizeof(flashesImageInfo));
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Load record of installed image.
+  @anchor flashes_load_image_info
+
+  The flashes_load_image_info() function copies the record from backup SRAM. As with progress
+  record, the caller checks it.
+
+  @param   info Where to store the image record.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_load_image_info(
+    flashesImageInfo *info)
+{
+    flashes_enable_backup_sram();
+    os_memcpy(info, (const void*)FLASHES_IMAGE_INFO_ADDR, sizeof(flashesImageInfo));
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get unique id of the device.
+  @anchor flashes_get_device_id
+
+  The flashes_get_device_id() function copies 96 bit unique device id, which is programmed
+  to STM32 at the factory.
+
+  @param   id Buffer for FLASHES_DEVICE_ID_SZ bytes.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_get_device_id(
+    os_uchar *id)
+{
+    os_memcpy(id, (const void*)UID_BASE, FLASHES_DEVICE_ID_SZ);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Enable access to backup SRAM.
+  @anchor flashes_enable_backup_sram
+
+  The flashes_enable_backup_sram() function enables clock and write access to backup SRAM,
+  and the backup regulator which keeps it powered from VBAT while VDD is off. The HAL waits
+  until the regulator is ready, or times out. Without the regulator content is still kept over
+  reset, so access is enabled either way.
+
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_enable_backup_sram(void)
+{
+    __HAL_RCC_PWR_CLK_ENABLE();
+    HAL_PWR_EnableBkUpAccess();
+    __HAL_RCC_BKPSRAM_CLK_ENABLE();
+
+    if (HAL_PWREx_EnableBkUpReg() != HAL_OK)
+    {
+        osal_debug_error("backup regulator not ready");
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Check that data fits in the area image is written to.
+  @anchor flashes_check_range
+
+  The flashes_check_range() function makes sure that addr and nbytes from caller do not reach
+  past the bank. Otherwise writing bank 1 could erase bank 2 we are running from.
+
+  @param   addr Flash address within bank, as for flashes_write().
+  @param   nbytes Number of bytes.
+  @return  OSAL_SUCCESS if range is within the bank. OSAL_STATUS_FAILED if not.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_check_range(
+    os_uint addr,
+    os_uint nbytes)
+{
+    if (addr > FLASHES_WRITABLE_SIZE || nbytes > FLASHES_WRITABLE_SIZE - addr)
+    {
+        osal_debug_error("flash address out of bank");
+        return OSAL_STATUS_FAILED;
+    }
+    return OSAL_SUCCESS;
+}
+
+/**
+****************************************************************************************************
+
+  @brief Get cycle counter value.
+  @anchor flashes_stats_cycles
+
+  The flashes_stats_cycles() function returns DWT cycle counter. The counter is enabled on
+  first call, if debugger has not done it already. At 168 MHz the counter wraps around in
+  about 25 seconds.
+
+  @return  Number of CPU cycles.
+
+****************************************************************************************************
+*/
+os_uint flashes_stats_cycles(void)
+{
+    if ((DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk) == 0)
+    {
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+    return DWT->CYCCNT;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get number of cycle counter ticks per microsecond.
+  @anchor flashes_stats_cycles_per_us
+
+  @return  CPU clock frequency in MHz.
+
+****************************************************************************************************
+*/
+os_uint flashes_stats_cycles_per_us(void)
+{
+    return SystemCoreClock / 1000000;
+}
+
+
+#if FLASHES_CRC32_HW
+/**
+****************************************************************************************************
+
+  @brief Calculate CRC-32 checksum with CRC unit.
+  @anchor flashes_crc32_hw
+
+  The flashes_crc32_hw() function calculates the same checksum as flashes_crc32_sw(), but
+  uses STM32F4 CRC unit for whole words. The CRC unit uses the same polynomial, but shifts
+  most significant bit first, has no bit reversal options and always starts from 0xFFFFFFFF.
+  So each word is bit reversed before feeding, and the result after. To continue from given
+  CRC, the first word fed is selected so that it brings the unit to that state. Bytes before
+  first aligned word and after the last one are calculated in software.
+
+  @param   crc FLASHES_CRC32_INIT to start new checksum, or CRC returned by previous call.
+  @param   buf Pointer to data.
+  @param   nbytes Number of data bytes.
+  @return  CRC-32 checksum.
+
+****************************************************************************************************
+*/
+os_uint flashes_crc32_hw(
+    os_uint crc,
+    const os_uchar *buf,
+    os_memsz nbytes)
+{
+    const uint32_t *p;
+    os_memsz n;
+
+    n = (4 - ((os_uint)buf & 3)) & 3;
+    if (n > nbytes) n = nbytes;
+    crc = flashes_crc32_sw(crc, buf, n);
+    buf += n;
+    nbytes -= n;
+
+    n = nbytes / 4;
+    if (n)
+    {
+        __HAL_RCC_CRC_CLK_ENABLE();
+        CRC->CR = CRC_CR_RESET;
+        CRC->DR = ~flashes_crc32_unshift(__RBIT(~crc));
+
+        p = (const uint32_t*)buf;
+        while (n--)
+        {
+            CRC->DR = __RBIT(*(p++));
+        }
+        crc = ~__RBIT(CRC->DR);
+        buf = (const os_uchar*)p;
+        nbytes &= 3;
+    }
+
+    return flashes_crc32_sw(crc, buf, nbytes);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Undo 32 steps of CRC unit.
+  @anchor flashes_crc32_unshift
+
+  The CRC unit XORs data word to its state and shifts 32 times. Bit 0 after a shift is set
+  only if polynomial was XORed, so the shifts can be undone.
+
+  @param   state Desired state of the CRC unit.
+  @return  Value which becomes the state after 32 shifts.
+
+****************************************************************************************************
+*/
+static os_uint flashes_crc32_unshift(
+    os_uint state)
+{
+    os_int i;
+
+    for (i = 0; i < 32; i++)
+    {
+        state = (state & 1) ? ((state ^ 0x04C11DB7U) >> 1) | 0x80000000U : state >> 1;
+    }
+    return state;
+}
+#endif
+
+
 
 /**
 ****************************************************************************************************
@@ -411,6 +1127,83 @@ static os_uint flashes_get_sector(
 }
 
 
+/**
+****************************************************************************************************
+
+  @brief Get sector address and size.
+  @anchor flashes_get_sector_addr
+
+  The flashes_get_sector_addr() function is inverse of flashes_get_sector().
+
+  @param   sector Sector number.
+  @param   nbytes Pointer where to store sector size in bytes.
+  @return  Flash address of the beginning of the sector.
+
+****************************************************************************************************
+*/
+static os_uint flashes_get_sector_addr(
+    os_uint sector,
+    os_uint *nbytes)
+{
+    if (sector >= FIRST_BANK_2_SECTOR)
+    {
+        return flashes_get_sector_addr(sector - FIRST_BANK_2_SECTOR, nbytes)
+            - ADDR_BANK_1_START + ADDR_BANK_2_START;
+    }
+
+    if (sector < FLASH_SECTOR_4)
+    {
+        *nbytes = 0x4000; // 16 Kbytes
+        return ADDR_FLASH_SECTOR_0 + sector * 0x4000;
+    }
+    if (sector == FLASH_SECTOR_4)
+    {
+        *nbytes = 0x10000; // 64 Kbytes
+        return ADDR_FLASH_SECTOR_4;
+    }
+    *nbytes = 0x20000; // 128 Kbytes
+    return ADDR_FLASH_SECTOR_5 + (sector - FLASH_SECTOR_5) * 0x20000;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Check if flash sector is already erased.
+  @anchor flashes_is_sector_blank
+
+  The flashes_is_sector_blank() function reads the sector 16 bytes at a time as words. Reading
+  128 kB takes well under millisecond, erasing it about a second.
+
+  In dual bank mode the bank being written is always mapped after the bank we run from, so
+  the sector is read through that address, like it is programmed.
+
+  @param   sector Sector number.
+  @return  OS_TRUE if all bytes of the sector are FLASHES_ERASED_BYTE.
+
+****************************************************************************************************
+*/
+static os_boolean flashes_is_sector_blank(
+    os_uint sector)
+{
+    const uint32_t *p;
+    os_uint addr, nbytes, n;
+
+    addr = flashes_get_sector_addr(sector, &nbytes);
+#if FLASHES_DUAL_BANK_MODE
+    addr -= (sector >= FIRST_BANK_2_SECTOR) ? ADDR_BANK_2_START : ADDR_BANK_1_START;
+    addr += ADDR_BANK_2_START;
+#endif
+
+    p = (const uint32_t*)addr;
+    for (n = nbytes / 16; n; n--, p += 4)
+    {
+        if ((p[0] & p[1] & p[2] & p[3]) != 0xFFFFFFFFU) return OS_FALSE;
+    }
+    return OS_TRUE;
+}
+
+
 #if 0
 void nvicDisableInterrupts() {
     NVIC_TypeDef *rNVIC = (NVIC_TypeDef *) NVIC_BASE;
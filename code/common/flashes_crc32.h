@@ -0,0 +1,62 @@
+/**
+
+  @file    flashes_crc32.h
+  @brief   CRC-32 checksum.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  CRC-32 as used by Ethernet and zlib, used to compare flash blocks. The same function is
+  used by the microcontroller and by the program sending the binary, so checksums match.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#ifndef FLASHES_CRC32_INCLUDED
+#define FLASHES_CRC32_INCLUDED
+
+/** Initial CRC value. Pass this as crc argument when starting new checksum.
+ */
+#define FLASHES_CRC32_INIT 0
+
+/** Use small 16 entry table instead of slicing-by-8 tables, 8 kB.
+ */
+#ifndef FLASHES_CRC32_SMALL
+#define FLASHES_CRC32_SMALL 0
+#endif
+
+/** Set to 1 to calculate CRC with microcontroller's CRC unit. The flash layer must then
+    implement flashes_crc32_hw(). The CRC unit must not be used by anything else meanwhile.
+ */
+#ifndef FLASHES_CRC32_HW
+#define FLASHES_CRC32_HW 0
+#endif
+
+/* Calculate or continue calculating CRC-32 checksum.
+ */
+os_uint flashes_crc32(
+    os_uint crc,
+    const os_uchar *buf,
+    os_memsz nbytes);
+
+/* Calculate CRC-32 checksum in software.
+ */
+os_uint flashes_crc32_sw(
+    os_uint crc,
+    const os_uchar *buf,
+    os_memsz nbytes);
+
+#if FLASHES_CRC32_HW
+/* Calculate CRC-32 checksum with CRC unit, implemented by flash layer.
+ */
+os_uint flashes_crc32_hw(
+    os_uint crc,
+    const os_uchar *buf,
+    os_memsz nbytes);
+#endif
+
+#endif
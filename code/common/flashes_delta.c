@@ -0,0 +1,198 @@
+/**
+
+  @file    flashes_delta.c
+  @brief   Apply binary delta patch from running image.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Streaming decoder for delta patch, see flashes_delta.h for the patch format. Old image
+  is read from the flash bank we are running from by flashes_read(), output is written to
+  caller's buffer, which is then programmed into the other bank.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashes.h"
+
+/* Decoder steps.
+ */
+#define FLASHES_DELTA_STEP_OP 0
+#define FLASHES_DELTA_STEP_LEN 1
+#define FLASHES_DELTA_STEP_SEEK 2
+#define FLASHES_DELTA_STEP_DATA 3
+
+
+/**
+****************************************************************************************************
+
+  @brief Initialize delta decoder.
+  @anchor flashes_delta_init
+
+  The flashes_delta_init() function prepares decoder state for new patch.
+
+  @param   d Delta decoder state.
+  @param   old_bank2 Flash bank containing old image: OS_FALSE for bank 1, OS_TRUE for bank 2.
+  @param   old_size Size of flash area which may be read as old image.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_delta_init(
+    flashesDelta *d,
+    os_boolean old_bank2,
+    os_uint old_size)
+{
+    os_memclear(d, sizeof(flashesDelta));
+    d->old_bank2 = old_bank2;
+    d->old_size = old_size;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Decode piece of patch.
+  @anchor flashes_delta_decode
+
+  The flashes_delta_decode() function processes patch bytes and appends resulting image bytes
+  to output buffer. It returns when output buffer is full, or when all input has been used
+  and no more output can be produced without more input. Copy operation produces output
+  without input, so the function should be called again with zero input bytes after the
+  output buffer has been emptied.
+
+  @param   d Delta decoder state.
+  @param   in Pointer to patch bytes.
+  @param   in_n Number of patch bytes available.
+  @param   in_used Set to number of patch bytes used.
+  @param   out Output buffer.
+  @param   out_sz Output buffer size in bytes.
+  @param   out_n Number of bytes in output buffer. Decoded bytes are appended after these
+           and this is updated.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate corrupted patch or that old image
+           could not be read.
+
+****************************************************************************************************
+*/
+osalStatus flashes_delta_decode(
+    flashesDelta *d,
+    const os_uchar *in,
+    os_uint in_n,
+    os_uint *in_used,
+    os_uchar *out,
+    os_uint out_sz,
+    os_uint *out_n)
+{
+    os_uint n, i, used, seek;
+    os_uchar c;
+    osalStatus s;
+
+    used = 0;
+    while (*out_n < out_sz)
+    {
+        if (d->step == FLASHES_DELTA_STEP_DATA)
+        {
+            /* Produce as much of the operation's output as we can.
+             */
+            n = out_sz - *out_n;
+            if (n > d->len) n = d->len;
+            if (d->op != FLASHES_DELTA_COPY)
+            {
+                if (n > in_n - used) n = in_n - used;
+                if (n == 0) break;
+            }
+
+            switch (d->op)
+            {
+                case FLASHES_DELTA_COPY:
+                case FLASHES_DELTA_ADD:
+                    if (d->old_pos > d->old_size || n > d->old_size - d->old_pos)
+                    {
+                        return OSAL_STATUS_FAILED;
+                    }
+                    s = flashes_read(d->old_pos, out + *out_n, n, d->old_bank2);
+                    if (s) return s;
+                    d->old_pos += n;
+                    if (d->op == FLASHES_DELTA_ADD)
+                    {
+                        for (i = 0; i < n; i++)
+                        {
+                            out[*out_n + i] += in[used + i];
+                        }
+                        used += n;
+                    }
+                    break;
+
+                default:
+                    os_memcpy(out + *out_n, in + used, n);
+                    used += n;
+                    break;
+            }
+
+            *out_n += n;
+            d->len -= n;
+            if (d->len == 0) d->step = FLASHES_DELTA_STEP_OP;
+            continue;
+        }
+
+        /* Parsing op code or variable length integers needs input.
+         */
+        if (used >= in_n) break;
+        c = in[used++];
+
+        switch (d->step)
+        {
+            case FLASHES_DELTA_STEP_OP:
+                if (c < FLASHES_DELTA_COPY || c > FLASHES_DELTA_INSERT) return OSAL_STATUS_FAILED;
+                d->op = c;
+                d->varint = 0;
+                d->shift = 0;
+                d->step = FLASHES_DELTA_STEP_LEN;
+                break;
+
+            default:
+                if (d->shift > 28) return OSAL_STATUS_FAILED;
+                d->varint |= (os_uint)(c & 0x7F) << d->shift;
+                d->shift += 7;
+                if (c & 0x80) break;
+
+                if (d->step == FLASHES_DELTA_STEP_LEN)
+                {
+                    d->len = d->varint;
+                    d->varint = 0;
+                    d->shift = 0;
+                    d->step = (d->op == FLASHES_DELTA_INSERT)
+                        ? FLASHES_DELTA_STEP_DATA : FLASHES_DELTA_STEP_SEEK;
+                }
+                else
+                {
+                    /* Seek must stay within old image, odd values seek backwards.
+                     */
+                    seek = d->varint >> 1;
+                    if (d->varint & 1)
+                    {
+                        if (seek >= d->old_pos) return OSAL_STATUS_FAILED;
+                        d->old_pos -= seek + 1;
+                    }
+                    else
+                    {
+                        if (seek > d->old_size - d->old_pos) return OSAL_STATUS_FAILED;
+                        d->old_pos += seek;
+                    }
+                    d->step = FLASHES_DELTA_STEP_DATA;
+                }
+                if (d->step == FLASHES_DELTA_STEP_DATA && d->len == 0)
+                {
+                    d->step = FLASHES_DELTA_STEP_OP;
+                }
+                break;
+        }
+    }
+
+    *in_used = used;
+    return OSAL_SUCCESS;
+}
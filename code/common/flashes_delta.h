@@ -0,0 +1,99 @@
+/**
+
+  @file    flashes_delta.h
+  @brief   Apply binary delta patch from running image.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Delta patch describes new image as operations on the image the device is currently running
+  (old image). The patch is a sequence of operations. Each operation starts with op code byte,
+  followed by length as variable length unsigned integer: 7 bits per byte, less significant
+  first, bit 7 set if more bytes follow.
+
+  - FLASHES_DELTA_COPY: Length, seek and nothing else. Seek is signed variable length integer,
+    zig-zag encoded (0, -1, 1, -2, 2... as 0, 1, 2, 3, 4...), which is added to old image
+    position before the operation. Length bytes are copied from old image.
+  - FLASHES_DELTA_ADD: Length, seek and length difference bytes. Output is byte from old image
+    plus difference byte, modulo 256. This handles areas where only addresses have changed.
+  - FLASHES_DELTA_INSERT: Length and length literal bytes, which are output as is.
+
+  Old image position starts from 0 and moves forward by length of COPY and ADD operations.
+  Output is always written sequentially. The decoder keeps only a few integers of state, so
+  it can be fed the patch in arbitrary pieces and stopped whenever output buffer is full.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#ifndef FLASHES_DELTA_INCLUDED
+#define FLASHES_DELTA_INCLUDED
+
+/** Patch operation codes.
+ */
+#define FLASHES_DELTA_COPY 1
+#define FLASHES_DELTA_ADD 2
+#define FLASHES_DELTA_INSERT 3
+
+/** Delta decoder state.
+ */
+typedef struct
+{
+    /* Parser state: Waiting for op code, length, seek or operation data.
+     */
+    os_int step;
+
+    /* Current operation code.
+     */
+    os_uchar op;
+
+    /* Variable length integer being parsed and bit position in it.
+     */
+    os_uint varint;
+    os_int shift;
+
+    /* Number of bytes left in current operation.
+     */
+    os_uint len;
+
+    /* Position in old image.
+     */
+    os_uint old_pos;
+
+    /* Size of old image area which may be read.
+     */
+    os_uint old_size;
+
+    /* Bank from which old image is read.
+     */
+    os_boolean old_bank2;
+}
+flashesDelta;
+
+
+/* Initialize delta decoder.
+ */
+void flashes_delta_init(
+    flashesDelta *d,
+    os_boolean old_bank2,
+    os_uint old_size);
+
+/* Decode piece of patch.
+ */
+osalStatus flashes_delta_decode(
+    flashesDelta *d,
+    const os_uchar *in,
+    os_uint in_n,
+    os_uint *in_used,
+    os_uchar *out,
+    os_uint out_sz,
+    os_uint *out_n);
+
+/* Check that patch ended at operation boundary.
+ */
+#define flashes_delta_is_complete(d) ((d)->step == 0)
+
+#endif
@@ -0,0 +1,315 @@
+/**
+
+  @file    flashes_discovery.c
+  @brief   Answer UDP discovery queries.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Queries are received on one multicast socket and replies sent through another, to the reply
+  group. The reply is not sent at once: The query tells time over which replies should be
+  spread, and the device picks its delay from CRC-32 of its id. The loop function never
+  blocks, pending reply is sent by a later call once the delay has passed.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashes.h"
+
+/** Maximum number of queries handled by one flashes_discovery_loop() call. Anything more
+    is either repeated query or garbage.
+ */
+#define FLASHES_DISCOVERY_MAX_RX 4
+
+/** Longest reply spread accepted from query, ms.
+ */
+#define FLASHES_DISCOVERY_MAX_SPREAD_MS 5000
+
+/** Receive buffer size, bytes. Longer queries are accepted, extra bytes are ignored.
+ */
+#define FLASHES_DISCOVERY_BUF_SZ 64
+
+#if FLASHES_DISCOVERY
+
+/* Discovery state.
+ */
+typedef struct
+{
+    /* Socket to receive queries from and socket to send replies to.
+     */
+    osalStream query_socket;
+    osalStream reply_socket;
+
+    /* Unique id of this device and CRC-32 of it.
+     */
+    os_uchar id[FLASHES_DEVICE_ID_SZ];
+    os_uint id_crc;
+
+    /* Set when query has been received and reply is waiting to be sent. Nonce to copy to
+       the reply, time when the query was received and delay before replying.
+     */
+    os_boolean reply_pending;
+    os_uint nonce;
+    os_timer query_timer;
+    os_int delay_ms;
+}
+flashesDiscoveryState;
+
+static flashesDiscoveryState fldisc;
+
+static void flashes_discovery_reply(
+    os_boolean busy);
+
+
+#endif
+
+static os_uint flashes_discovery_image_check(
+    const flashesImageInfo *info);
+
+
+#if FLASHES_DISCOVERY
+
+/**
+****************************************************************************************************
+
+  @brief Open UDP socket to listen for discovery queries.
+  @anchor flashes_discovery_setup
+
+  The flashes_discovery_setup() function joins the query multicast group and opens socket
+  for sending replies. If this fails, the device just doesn't answer discovery, program
+  transfer works without it.
+
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_discovery_setup(void)
+{
+    os_memclear(&fldisc, sizeof(fldisc));
+    flashes_get_device_id(fldisc.id);
+    fldisc.id_crc = flashes_crc32(FLASHES_CRC32_INIT, fldisc.id, FLASHES_DEVICE_ID_SZ);
+
+    fldisc.query_socket = osal_stream_open(OSAL_SOCKET_IFACE, FLASHES_DISCOVERY_QUERY_ADDR,
+        OS_NULL, OS_NULL, OSAL_STREAM_MULTICAST|OSAL_STREAM_LISTEN|OSAL_STREAM_NO_SELECT);
+    fldisc.reply_socket = osal_stream_open(OSAL_SOCKET_IFACE, FLASHES_DISCOVERY_REPLY_ADDR,
+        OS_NULL, OS_NULL, OSAL_STREAM_MULTICAST|OSAL_STREAM_NO_SELECT);
+    if (fldisc.query_socket == OS_NULL || fldisc.reply_socket == OS_NULL)
+    {
+        osal_debug_error("discovery socket open failed");
+        flashes_discovery_cleanup();
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Receive discovery queries and send replies when due.
+  @anchor flashes_discovery_loop
+
+  The flashes_discovery_loop() function reads queries waiting in the socket, and sends reply
+  to the latest one once its delay has passed. Repeated query before the reply has been sent
+  restarts the delay, so one reply is sent per query burst.
+
+  @param   busy OS_TRUE if program transfer connection is open, reported in reply flags.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_discovery_loop(
+    os_boolean busy)
+{
+    os_uchar buf[FLASHES_DISCOVERY_BUF_SZ];
+    os_memsz n_read;
+    os_uint spread;
+    os_int i;
+
+    if (fldisc.query_socket == OS_NULL) return;
+
+    for (i = 0; i < FLASHES_DISCOVERY_MAX_RX; i++)
+    {
+        if (osal_stream_receive_packet(fldisc.query_socket, (os_char*)buf, sizeof(buf),
+            &n_read, OS_NULL, 0, OSAL_STREAM_DEFAULT)) break;
+        if (n_read == 0) break;
+
+        if (n_read < FLASHES_DISCOVERY_QUERY_SZ ||
+            flashes_get_uint(buf, 4) != FLASHES_DISCOVERY_QUERY_MAGIC ||
+            buf[4] != FLASHES_DISCOVERY_VERSION)
+        {
+            continue;
+        }
+
+        /* Delay is CRC-32 of device id modulo spread, so devices pick different delays
+           but the same device always the same one.
+         */
+        fldisc.nonce = flashes_get_uint(buf + 5, 4);
+        spread = flashes_get_uint(buf + 9, 2);
+        if (spread > FLASHES_DISCOVERY_MAX_SPREAD_MS) spread = FLASHES_DISCOVERY_MAX_SPREAD_MS;
+        fldisc.delay_ms = spread ? (os_int)(fldisc.id_crc % spread) : 0;
+        os_get_timer(&fldisc.query_timer);
+        fldisc.reply_pending = OS_TRUE;
+    }
+
+    if (fldisc.reply_pending && os_elapsed(&fldisc.query_timer, fldisc.delay_ms))
+    {
+        flashes_discovery_reply(busy);
+        fldisc.reply_pending = OS_FALSE;
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Close discovery sockets.
+  @anchor flashes_discovery_cleanup
+
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_discovery_cleanup(void)
+{
+    osal_stream_close(fldisc.query_socket);
+    osal_stream_close(fldisc.reply_socket);
+    fldisc.query_socket = fldisc.reply_socket = OS_NULL;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Send discovery reply.
+  @anchor flashes_discovery_reply
+
+  The flashes_discovery_reply() function reports the running image, see
+  flashes_discovery_get_image().
+
+  @param   busy OS_TRUE if program transfer connection is open.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_discovery_reply(
+    os_boolean busy)
+{
+    os_uchar buf[FLASHES_DISCOVERY_REPLY_SZ];
+    os_uint image_size, image_crc;
+    os_boolean bank2;
+    os_uchar flags;
+
+    bank2 = flashes_is_bank2_selected();
+    flashes_discovery_get_image(&image_size, &image_crc);
+
+    flags = 0;
+    if (bank2) flags |= FLASHES_DISCOVERY_BANK2;
+    if (busy) flags |= FLASHES_DISCOVERY_BUSY;
+
+    flashes_put_uint(buf, FLASHES_DISCOVERY_REPLY_MAGIC, 4);
+    buf[4] = FLASHES_DISCOVERY_VERSION;
+    buf[5] = flags;
+    flashes_put_uint(buf + 6, fldisc.nonce, 4);
+    os_memcpy(buf + 10, fldisc.id, FLASHES_DEVICE_ID_SZ);
+    flashes_put_uint(buf + 10 + FLASHES_DEVICE_ID_SZ, FLASHES_SOCKET_PORT, 2);
+    flashes_put_uint(buf + 12 + FLASHES_DEVICE_ID_SZ, image_size, 4);
+    flashes_put_uint(buf + 16 + FLASHES_DEVICE_ID_SZ, image_crc, 4);
+    flashes_put_uint(buf + 20 + FLASHES_DEVICE_ID_SZ, FLASHES_BANK_SIZE, 4);
+
+    osal_stream_send_packet(fldisc.reply_socket, (const os_char*)buf, sizeof(buf),
+        OSAL_STREAM_DEFAULT);
+}
+
+
+#endif
+
+
+/**
+****************************************************************************************************
+
+  @brief Record image written by completed transfer.
+  @anchor flashes_discovery_set_image
+
+  The flashes_discovery_set_image() function is called by flashes_socket.c when transfer has
+  been verified, before switching to the new bank. The record is kept over reboots, after
+  which the device runs the image and reports it.
+
+  @param   bank2 OS_TRUE if the image was written to bank 2.
+  @param   image_size Image size in bytes.
+  @param   image_crc CRC-32 of the whole image.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_discovery_set_image(
+    os_boolean bank2,
+    os_uint image_size,
+    os_uint image_crc)
+{
+    flashesImageInfo info;
+
+    os_memclear(&info, sizeof(info));
+    info.magic = FLASHES_IMAGE_INFO_MAGIC;
+    info.bank2 = (os_uint)bank2;
+    info.image_size = image_size;
+    info.image_crc = image_crc;
+    info.check = flashes_discovery_image_check(&info);
+    flashes_save_image_info(&info);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get size and CRC-32 of the running image.
+  @anchor flashes_discovery_get_image
+
+  The flashes_discovery_get_image() function reports the image only if the record of installed
+  image is valid and written to the bank we are running from.
+
+  @param   image_size Where to store image size, 0 if not known.
+  @param   image_crc Where to store CRC-32 of the image, 0 if not known.
+  @return  OSAL_SUCCESS (0) if the image is known, OSAL_STATUS_FAILED if not.
+
+****************************************************************************************************
+*/
+osalStatus flashes_discovery_get_image(
+    os_uint *image_size,
+    os_uint *image_crc)
+{
+    flashesImageInfo info;
+
+    *image_size = *image_crc = 0;
+    if (flashes_load_image_info(&info) != OSAL_SUCCESS ||
+        info.magic != FLASHES_IMAGE_INFO_MAGIC ||
+        info.check != flashes_discovery_image_check(&info) ||
+        info.bank2 != (os_uint)flashes_is_bank2_selected())
+    {
+        return OSAL_STATUS_FAILED;
+    }
+    *image_size = info.image_size;
+    *image_crc = info.image_crc;
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Calculate check value of image record.
+  @anchor flashes_discovery_image_check
+
+  @param   info Image record.
+  @return  CRC-32 of all fields before check.
+
+****************************************************************************************************
+*/
+static os_uint flashes_discovery_image_check(
+    const flashesImageInfo *info)
+{
+    return flashes_crc32(FLASHES_CRC32_INIT, (const os_uchar*)info,
+        (os_memsz)((const os_uchar*)&info->check - (const os_uchar*)info));
+}
@@ -0,0 +1,72 @@
+/**
+
+  @file    flashes_discovery.h
+  @brief   Answer UDP discovery queries.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  The device listens for discovery queries on a UDP multicast group and replies with its id,
+  running bank and image, so that flashit can list all devices on the network in one round
+  trip. See flashes_protocol.h for packet format. The flashes_socket_setup(), _loop() and
+  _cleanup() functions call the discovery functions, the application does not need to.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#ifndef FLASHES_DISCOVERY_INCLUDED
+#define FLASHES_DISCOVERY_INCLUDED
+
+/** Set 0 to leave discovery responder out.
+ */
+#ifndef FLASHES_DISCOVERY
+#define FLASHES_DISCOVERY 1
+#endif
+
+
+/**
+****************************************************************************************************
+
+  @name Discovery functions
+
+****************************************************************************************************
+ */
+/*@{*/
+
+#if FLASHES_DISCOVERY
+
+/* Open UDP socket to listen for discovery queries.
+ */
+void flashes_discovery_setup(void);
+
+/* Receive discovery queries and send replies when due.
+ */
+void flashes_discovery_loop(
+    os_boolean busy);
+
+/* Close discovery sockets.
+ */
+void flashes_discovery_cleanup(void);
+
+#endif
+
+/* Record image written by completed transfer, to be reported to discovery queries.
+ */
+void flashes_discovery_set_image(
+    os_boolean bank2,
+    os_uint image_size,
+    os_uint image_crc);
+
+/* Get size and CRC-32 of the running image, if known.
+ */
+osalStatus flashes_discovery_get_image(
+    os_uint *image_size,
+    os_uint *image_crc);
+
+/*@}*/
+
+#endif
@@ -0,0 +1,365 @@
+/**
+
+  @file    flashes_lz.c
+  @brief   Compressed image stream.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Decoder used by the device and encoder used by flashit, see flashes_lz.h for the format.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashes.h"
+
+/* Decoder steps.
+ */
+#define FLASHES_LZ_STEP_TAG 0
+#define FLASHES_LZ_STEP_LITERAL 1
+#define FLASHES_LZ_STEP_LEN 2
+#define FLASHES_LZ_STEP_DIST0 3
+#define FLASHES_LZ_STEP_DIST1 4
+#define FLASHES_LZ_STEP_MATCH 5
+
+#define FLASHES_LZ_MASK (FLASHES_LZ_WINDOW - 1)
+
+/* Encoder hash of 3 bytes.
+ */
+#define FLASHES_LZ_HASH(p) (((((os_uint)(p)[0] << 16) | ((os_uint)(p)[1] << 8) | (p)[2]) \
+    * 2654435761U) >> (32 - FLASHES_LZ_HASH_BITS))
+
+/* Number of hash chain candidates checked and shortest match worth encoding: 3 byte match
+   takes as much space as the literals and would only break literal runs.
+ */
+#define FLASHES_LZ_MAX_CHAIN 64
+#define FLASHES_LZ_GOOD_MATCH 4
+
+static os_memsz flashes_lz_find(
+    flashesLzEncoder *e,
+    const os_uchar *in,
+    os_memsz in_sz,
+    os_memsz p,
+    os_memsz *dist);
+
+static os_memsz flashes_lz_put_literals(
+    const os_uchar *lit,
+    os_memsz n,
+    os_uchar *out,
+    os_memsz out_sz);
+
+
+/**
+****************************************************************************************************
+
+  @brief Initialize decoder.
+  @anchor flashes_lz_init
+
+  The flashes_lz_init() function prepares decoder state for new stream.
+
+  @param   lz Decoder state.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_lz_init(
+    flashesLz *lz)
+{
+    lz->step = FLASHES_LZ_STEP_TAG;
+    lz->n = lz->dist = 0;
+    lz->shift = 0;
+    lz->total = 0;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Decompress piece of stream.
+  @anchor flashes_lz_decode
+
+  The flashes_lz_decode() function processes compressed bytes and appends decompressed data
+  to output buffer. It returns when output buffer is full, or when all input has been used.
+  Match may produce output without input, so the function should be called again with zero
+  input bytes after the output buffer has been emptied.
+
+  @param   lz Decoder state.
+  @param   in Pointer to compressed bytes.
+  @param   in_n Number of compressed bytes available.
+  @param   in_used Set to number of compressed bytes used.
+  @param   out Output buffer.
+  @param   out_sz Output buffer size in bytes.
+  @param   out_n Number of bytes in output buffer. Decompressed bytes are appended after these
+           and this is updated.
+  @return  OSAL_SUCCESS if all is fine. OSAL_STATUS_FAILED indicates corrupted stream.
+
+****************************************************************************************************
+*/
+osalStatus flashes_lz_decode(
+    flashesLz *lz,
+    const os_uchar *in,
+    os_uint in_n,
+    os_uint *in_used,
+    os_uchar *out,
+    os_uint out_sz,
+    os_uint *out_n)
+{
+    os_uint used, o, src;
+    os_uchar c;
+
+    used = 0;
+    o = *out_n;
+    while (o < out_sz)
+    {
+        if (lz->step == FLASHES_LZ_STEP_MATCH)
+        {
+            src = lz->total - lz->dist;
+            while (lz->n && o < out_sz)
+            {
+                c = lz->window[src++ & FLASHES_LZ_MASK];
+                lz->window[lz->total++ & FLASHES_LZ_MASK] = c;
+                out[o++] = c;
+                lz->n--;
+            }
+            if (lz->n == 0) lz->step = FLASHES_LZ_STEP_TAG;
+            continue;
+        }
+
+        if (used >= in_n) break;
+        c = in[used++];
+
+        switch (lz->step)
+        {
+            case FLASHES_LZ_STEP_TAG:
+                if (c & 0x80)
+                {
+                    lz->n = (c & 0x7F) + FLASHES_LZ_MIN_MATCH;
+                    lz->shift = 0;
+                    lz->dist = 0;
+                    lz->step = ((c & 0x7F) == 0x7F) ? FLASHES_LZ_STEP_LEN : FLASHES_LZ_STEP_DIST0;
+                }
+                else
+                {
+                    lz->n = (os_uint)c + 1;
+                    lz->step = FLASHES_LZ_STEP_LITERAL;
+                }
+                break;
+
+            case FLASHES_LZ_STEP_LITERAL:
+                lz->window[lz->total++ & FLASHES_LZ_MASK] = c;
+                out[o++] = c;
+                if (--(lz->n) == 0) lz->step = FLASHES_LZ_STEP_TAG;
+                break;
+
+            case FLASHES_LZ_STEP_LEN:
+                if (lz->shift > 28) return OSAL_STATUS_FAILED;
+                lz->n += (os_uint)(c & 0x7F) << lz->shift;
+                lz->shift += 7;
+                if ((c & 0x80) == 0) lz->step = FLASHES_LZ_STEP_DIST0;
+                break;
+
+            case FLASHES_LZ_STEP_DIST0:
+                lz->dist = c;
+                lz->step = FLASHES_LZ_STEP_DIST1;
+                break;
+
+            default:
+                lz->dist |= (os_uint)c << 8;
+                if (lz->dist == 0 || lz->dist > FLASHES_LZ_WINDOW || lz->dist > lz->total)
+                {
+                    return OSAL_STATUS_FAILED;
+                }
+                lz->step = FLASHES_LZ_STEP_MATCH;
+                break;
+        }
+    }
+
+    *out_n = o;
+    *in_used = used;
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Compress data.
+  @anchor flashes_lz_compress
+
+  The flashes_lz_compress() function compresses whole data buffer. Matches are found by hash
+  chains of 3 byte sequences within the window. This is meant for the computer sending the
+  image, the device only decodes.
+
+  @param   e Encoder work memory.
+  @param   in Data to compress.
+  @param   in_sz Data size in bytes.
+  @param   out Buffer for compressed data, FLASHES_LZ_MAX_COMPRESSED_SZ(in_sz) bytes is enough.
+  @param   out_sz Buffer size in bytes.
+  @return  Compressed size in bytes, 0 if output buffer was too small.
+
+****************************************************************************************************
+*/
+os_memsz flashes_lz_compress(
+    flashesLzEncoder *e,
+    const os_uchar *in,
+    os_memsz in_sz,
+    os_uchar *out,
+    os_memsz out_sz)
+{
+    os_memsz p, lit, n, len, best_len, best_dist, x;
+    os_int i;
+    os_uint h;
+
+    for (i = 0; i < FLASHES_LZ_HASH_SZ; i++) e->head[i] = -1;
+
+    n = 0;
+    p = lit = 0;
+    while (p + FLASHES_LZ_MIN_MATCH <= in_sz)
+    {
+        /* Find longest match. If the next position has longer one, output this byte as
+           literal instead (lazy matching).
+         */
+        best_len = flashes_lz_find(e, in, in_sz, p, &best_dist);
+        h = FLASHES_LZ_HASH(in + p);
+        e->prev[p & FLASHES_LZ_MASK] = e->head[h];
+        e->head[h] = (os_int)p;
+
+        if (best_len < FLASHES_LZ_GOOD_MATCH ||
+            (p + 1 + FLASHES_LZ_MIN_MATCH <= in_sz &&
+             flashes_lz_find(e, in, in_sz, p + 1, &x) > best_len))
+        {
+            p++;
+            continue;
+        }
+
+        /* Write pending literals and the match.
+         */
+        x = flashes_lz_put_literals(in + lit, p - lit, out + n, out_sz - n);
+        if (x == 0 && p > lit) return 0;
+        n += x;
+        if (n + 10 > out_sz) return 0;
+
+        len = best_len - FLASHES_LZ_MIN_MATCH;
+        if (len < 0x7F)
+        {
+            out[n++] = (os_uchar)(0x80 | len);
+        }
+        else
+        {
+            out[n++] = 0xFF;
+            len -= 0x7F;
+            while (len >= 0x80)
+            {
+                out[n++] = (os_uchar)(len | 0x80);
+                len >>= 7;
+            }
+            out[n++] = (os_uchar)len;
+        }
+        out[n++] = (os_uchar)best_dist;
+        out[n++] = (os_uchar)(best_dist >> 8);
+
+        /* Index positions within the match, so following data can refer to them.
+         */
+        for (x = 1; x < best_len && p + x + FLASHES_LZ_MIN_MATCH <= in_sz; x++)
+        {
+            h = FLASHES_LZ_HASH(in + p + x);
+            e->prev[(p + x) & FLASHES_LZ_MASK] = e->head[h];
+            e->head[h] = (os_int)(p + x);
+        }
+        p += best_len;
+        lit = p;
+    }
+
+    x = flashes_lz_put_literals(in + lit, in_sz - lit, out + n, out_sz - n);
+    if (x == 0 && in_sz > lit) return 0;
+    return n + x;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Find longest match within window.
+  @anchor flashes_lz_find
+
+  The flashes_lz_find() function follows hash chain of 3 byte sequence at position p, newest
+  candidates first.
+
+  @param   e Encoder work memory.
+  @param   in Data being compressed.
+  @param   in_sz Data size in bytes.
+  @param   p Position to find match for.
+  @param   dist Set to match distance.
+  @return  Match length, 0 if none.
+
+****************************************************************************************************
+*/
+static os_memsz flashes_lz_find(
+    flashesLzEncoder *e,
+    const os_uchar *in,
+    os_memsz in_sz,
+    os_memsz p,
+    os_memsz *dist)
+{
+    os_memsz len, best_len;
+    os_int cand, i, chain;
+
+    best_len = *dist = 0;
+    cand = e->head[FLASHES_LZ_HASH(in + p)];
+    for (chain = 0; cand >= 0 && chain < FLASHES_LZ_MAX_CHAIN; chain++)
+    {
+        if (p - (os_memsz)cand > FLASHES_LZ_WINDOW) break;
+        len = 0;
+        while (p + len < in_sz && in[cand + len] == in[p + len]) len++;
+        if (len > best_len)
+        {
+            best_len = len;
+            *dist = p - (os_memsz)cand;
+        }
+        i = e->prev[cand & FLASHES_LZ_MASK];
+        if (i >= cand) break;
+        cand = i;
+    }
+    return best_len;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Write literal runs.
+  @anchor flashes_lz_put_literals
+
+  @param   lit Literal bytes.
+  @param   n Number of literal bytes.
+  @param   out Where to write.
+  @param   out_sz Space available.
+  @return  Number of bytes written, 0 if no space.
+
+****************************************************************************************************
+*/
+static os_memsz flashes_lz_put_literals(
+    const os_uchar *lit,
+    os_memsz n,
+    os_uchar *out,
+    os_memsz out_sz)
+{
+    os_memsz k, o;
+
+    o = 0;
+    while (n > 0)
+    {
+        k = n < FLASHES_LZ_MAX_LITERALS ? n : FLASHES_LZ_MAX_LITERALS;
+        if (o + k + 1 > out_sz) return 0;
+        out[o++] = (os_uchar)(k - 1);
+        os_memcpy(out + o, lit, k);
+        o += k;
+        lit += k;
+        n -= k;
+    }
+    return o;
+}
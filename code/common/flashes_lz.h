@@ -0,0 +1,115 @@
+/**
+
+  @file    flashes_lz.h
+  @brief   Compressed image stream.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Simple LZ77 compression for transferring the image. The device needs only fixed size window
+  of recent output, no dynamic memory, and decoding can be stopped and continued at any byte.
+
+  Compressed stream is a sequence of items, each starting with tag byte:
+  - 0x00 - 0x7F: Literal run. Tag + 1 bytes follow, which are output as is.
+  - 0x80 - 0xFF: Match. Length is (tag & 0x7F) + FLASHES_LZ_MIN_MATCH. If (tag & 0x7F) is 0x7F,
+    variable length integer follows (7 bits per byte, less significant first, bit 7 set if more
+    bytes follow) and is added to length. Then distance back in output, 2 bytes, less significant
+    first, 1 - FLASHES_LZ_WINDOW. Distance may be less than length, distance 1 repeats the last
+    byte. This compresses long runs of 0xFF padding in binaries to few bytes.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#ifndef FLASHES_LZ_INCLUDED
+#define FLASHES_LZ_INCLUDED
+
+/** Window size, bytes. Must be power of two and same on both ends, this is part of protocol.
+ */
+#define FLASHES_LZ_WINDOW 2048
+
+/** Shortest match.
+ */
+#define FLASHES_LZ_MIN_MATCH 3
+
+/** Longest literal run in one item.
+ */
+#define FLASHES_LZ_MAX_LITERALS 128
+
+/** Encoder hash table size as bits.
+ */
+#define FLASHES_LZ_HASH_BITS 12
+#define FLASHES_LZ_HASH_SZ (1 << FLASHES_LZ_HASH_BITS)
+
+/** Maximum compressed size for n bytes of input, when data doesn't compress at all.
+ */
+#define FLASHES_LZ_MAX_COMPRESSED_SZ(n) ((n) + (n) / FLASHES_LZ_MAX_LITERALS + 16)
+
+/** Decoder state.
+ */
+typedef struct
+{
+    /* Parser state: Waiting for tag, literals, match length, distance or copying match.
+     */
+    os_int step;
+
+    /* Number of bytes left in current literal run or match.
+     */
+    os_uint n;
+
+    /* Match distance and variable length integer being parsed.
+     */
+    os_uint dist;
+    os_int shift;
+
+    /* Recent output. Position where next byte is stored and total number of bytes output,
+       wraps around.
+     */
+    os_uchar window[FLASHES_LZ_WINDOW];
+    os_uint total;
+}
+flashesLz;
+
+/** Encoder work memory, about 24 kB. This is not needed on the device.
+ */
+typedef struct
+{
+    os_int head[FLASHES_LZ_HASH_SZ];
+    os_int prev[FLASHES_LZ_WINDOW];
+}
+flashesLzEncoder;
+
+
+/* Initialize decoder.
+ */
+void flashes_lz_init(
+    flashesLz *lz);
+
+/* Decompress piece of stream.
+ */
+osalStatus flashes_lz_decode(
+    flashesLz *lz,
+    const os_uchar *in,
+    os_uint in_n,
+    os_uint *in_used,
+    os_uchar *out,
+    os_uint out_sz,
+    os_uint *out_n);
+
+/* Check that stream ended at item boundary.
+ */
+#define flashes_lz_is_complete(lz) ((lz)->step == 0)
+
+/* Compress data.
+ */
+os_memsz flashes_lz_compress(
+    flashesLzEncoder *e,
+    const os_uchar *in,
+    os_memsz in_sz,
+    os_uchar *out,
+    os_memsz out_sz);
+
+#endif
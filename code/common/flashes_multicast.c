@@ -0,0 +1,643 @@
+/**
+
+  @file    flashes_multicast.c
+  @brief   Receive program image multicast to many devices.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Blocks of multicast image arrive in any order and some not at all, so flash for the whole
+  image is erased before the first block is written. Blocks which arrive during erase are
+  dropped, the sender waits for devices to finish erasing, and repairs anything lost later.
+  Each block is written with flashes_write() at its offset, and marked in a bitmap. When the
+  bitmap is full, the image is read back from flash a few blocks per loop call and CRC-32
+  is compared to the sender's. If it doesn't match, the device starts over. The boot bank is
+  switched only by sender's commit, and only if the image has been verified.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashes.h"
+
+/** Maximum number of packets handled by one flashes_multicast_loop() call.
+ */
+#ifndef FLASHES_MCAST_MAX_RX
+#define FLASHES_MCAST_MAX_RX 8
+#endif
+
+/** Number of blocks read back for verification by one flashes_multicast_loop() call.
+ */
+#ifndef FLASHES_MCAST_VERIFY_BLOCKS
+#define FLASHES_MCAST_VERIFY_BLOCKS 16
+#endif
+
+/** Longest reply spread accepted from poll, ms.
+ */
+#define FLASHES_MCAST_MAX_SPREAD_MS 5000
+
+/** Delay from commit to reboot, ms. The sender repeats commit, and the device keeps answering
+    polls meanwhile, so that the sender sees it done.
+ */
+#ifndef FLASHES_MCAST_REBOOT_DELAY_MS
+#define FLASHES_MCAST_REBOOT_DELAY_MS 1000
+#endif
+
+/** Maximum number of blocks in image, and bitmap size in bytes.
+ */
+#define FLASHES_MCAST_NBLOCKS (FLASHES_BANK_SIZE / FLASHES_TRANSFER_BLOCK_SIZE)
+#define FLASHES_MCAST_BITMAP_SZ ((FLASHES_MCAST_NBLOCKS + 7) / 8)
+
+/** Space before block in receive buffer, at least FLASHES_MCAST_DATA_HDR_SZ. Multiple of 8,
+    so that the block is aligned for flashes_write() when packet is received so that header
+    ends right before it.
+ */
+#define FLASHES_MCAST_PAD 32
+
+#if FLASHES_MULTICAST
+
+/* Receive buffer, also used to read back flash and to build status reply.
+ */
+typedef union
+{
+    os_uchar buf[FLASHES_MCAST_PAD + FLASHES_TRANSFER_BLOCK_SIZE];
+    os_int64 align_i;
+    os_double align_d;
+}
+flashesMcastBuf;
+
+/* Multicast receive state.
+ */
+typedef struct
+{
+    /* Socket to receive image and polls from, and socket to send status to.
+     */
+    osalStream data_socket;
+    osalStream status_socket;
+
+    /* Unique id of this device and CRC-32 of it.
+     */
+    os_uchar id[FLASHES_DEVICE_ID_SZ];
+    os_uint id_crc;
+
+    /* Set once packet of an image has been received. Session id from latest packet, size and
+       CRC-32 of the image, number of blocks and bank being written.
+     */
+    os_boolean active;
+    os_uint session;
+    os_uint image_size;
+    os_uint image_crc;
+    os_uint nblocks;
+    os_boolean bank2;
+
+    /* Erase tracking for flashes_write(), set when flash for whole image has been erased.
+     */
+    os_uint next_sector_to_erase;
+    os_boolean erased;
+
+    /* Bit for every block written, number of blocks written.
+     */
+    os_uchar bitmap[FLASHES_MCAST_BITMAP_SZ];
+    os_uint nreceived;
+
+    /* Verification: Number of blocks read back and their CRC-32.
+     */
+    os_uint verify_block;
+    os_uint verify_crc;
+
+    /* Status flags FLASHES_MCAST_DONE, FLASHES_MCAST_CURRENT and FLASHES_MCAST_FAILED.
+     */
+    os_uint flags;
+
+    /* Set when poll has been received and status reply is waiting to be sent. Time when
+       the poll was received and delay before replying.
+     */
+    os_boolean reply_pending;
+    os_timer poll_timer;
+    os_int delay_ms;
+
+    /* Set when image has been committed and the device reboots once
+       FLASHES_MCAST_REBOOT_DELAY_MS has passed since commit_timer.
+     */
+    os_boolean reboot_pending;
+    os_timer commit_timer;
+
+#if FLASHES_MULTICAST_TEST
+    /* Random number state for dropping packets in test.
+     */
+    os_uint rand;
+#endif
+
+    flashesMcastBuf rx;
+}
+flashesMcastState;
+
+static flashesMcastState flmcast;
+
+#if FLASHES_MULTICAST_TEST
+/* Percentage of data packets to drop, set by flashes_multicast_set_drop().
+ */
+static os_int flmcast_drop_pct;
+#endif
+
+static void flashes_multicast_start(
+    os_uint image_size,
+    os_uint image_crc);
+
+static void flashes_multicast_data(
+    os_uint block,
+    os_uchar *data,
+    os_uint nbytes);
+
+static void flashes_multicast_erase(void);
+
+static void flashes_multicast_verify(void);
+
+static void flashes_multicast_commit(void);
+
+static void flashes_multicast_reply(
+    os_boolean busy);
+
+
+/**
+****************************************************************************************************
+
+  @brief Join multicast group to receive image.
+  @anchor flashes_multicast_setup
+
+  The flashes_multicast_setup() function opens socket to receive image and polls, and socket
+  to send status replies. If this fails, multicast distribution is not available, TCP
+  transfer works without it.
+
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_multicast_setup(void)
+{
+    os_memclear(&flmcast, sizeof(flmcast));
+    flashes_get_device_id(flmcast.id);
+    flmcast.id_crc = flashes_crc32(FLASHES_CRC32_INIT, flmcast.id, FLASHES_DEVICE_ID_SZ);
+#if FLASHES_MULTICAST_TEST
+    flmcast.rand = flmcast.id_crc | 1;
+#endif
+
+    flmcast.data_socket = osal_stream_open(OSAL_SOCKET_IFACE, FLASHES_MCAST_DATA_ADDR,
+        OS_NULL, OS_NULL, OSAL_STREAM_MULTICAST|OSAL_STREAM_LISTEN|OSAL_STREAM_NO_SELECT);
+    flmcast.status_socket = osal_stream_open(OSAL_SOCKET_IFACE, FLASHES_MCAST_STATUS_ADDR,
+        OS_NULL, OS_NULL, OSAL_STREAM_MULTICAST|OSAL_STREAM_NO_SELECT);
+    if (flmcast.data_socket == OS_NULL || flmcast.status_socket == OS_NULL)
+    {
+        osal_debug_error("multicast socket open failed");
+        flashes_multicast_cleanup();
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Receive and write image blocks, answer polls.
+  @anchor flashes_multicast_loop
+
+  The flashes_multicast_loop() function handles packets waiting in socket, moves erase or
+  verification forward, and sends status reply once its delay has passed. While TCP transfer
+  is running, image packets are ignored and the image received so far is dropped, since
+  the TCP transfer writes the same bank. Polls are still answered, with busy flag.
+
+  @param   busy OS_TRUE if TCP program transfer connection is open.
+  @return  OS_TRUE if multicast image is being received, waits for commit or reboot is
+           pending. The boot loader then keeps listening.
+
+****************************************************************************************************
+*/
+os_boolean flashes_multicast_loop(
+    os_boolean busy)
+{
+    os_uchar *p;
+    os_memsz n_read;
+    os_uint type, image_size, image_crc, spread;
+    os_int i;
+
+    if (flmcast.data_socket == OS_NULL) return OS_FALSE;
+    if (busy) flmcast.active = OS_FALSE;
+
+    /* Receive so that data packet header ends where the block should start.
+     */
+    p = flmcast.rx.buf + FLASHES_MCAST_PAD - FLASHES_MCAST_DATA_HDR_SZ;
+    for (i = 0; i < FLASHES_MCAST_MAX_RX; i++)
+    {
+        if (osal_stream_receive_packet(flmcast.data_socket, (os_char*)p,
+            FLASHES_MCAST_DATA_HDR_SZ + FLASHES_TRANSFER_BLOCK_SIZE, &n_read, OS_NULL, 0,
+            OSAL_STREAM_DEFAULT)) break;
+        if (n_read == 0) break;
+
+        if (n_read < FLASHES_MCAST_HDR_SZ ||
+            flashes_get_uint(p, 4) != FLASHES_MCAST_MAGIC)
+        {
+            continue;
+        }
+        type = p[4];
+        flmcast.session = flashes_get_uint(p + 5, 4);
+        image_size = flashes_get_uint(p + 9, 4);
+        image_crc = flashes_get_uint(p + 13, 4);
+
+        if (type == FLASHES_MCAST_POLL && n_read >= FLASHES_MCAST_POLL_SZ)
+        {
+            spread = flashes_get_uint(p + FLASHES_MCAST_HDR_SZ, 2);
+            if (spread > FLASHES_MCAST_MAX_SPREAD_MS) spread = FLASHES_MCAST_MAX_SPREAD_MS;
+            flmcast.delay_ms = spread ? (os_int)(flmcast.id_crc % spread) : 0;
+            os_get_timer(&flmcast.poll_timer);
+            flmcast.reply_pending = OS_TRUE;
+        }
+        if (busy || flmcast.reboot_pending) continue;
+
+        /* Any packet of new image starts receiving it.
+         */
+        if (!flmcast.active || image_size != flmcast.image_size ||
+            image_crc != flmcast.image_crc)
+        {
+            flashes_multicast_start(image_size, image_crc);
+        }
+
+        switch (type)
+        {
+            case FLASHES_MCAST_DATA:
+                if (n_read < FLASHES_MCAST_DATA_HDR_SZ) break;
+#if FLASHES_MULTICAST_TEST
+                if (flmcast_drop_pct)
+                {
+                    flmcast.rand ^= flmcast.rand << 13;
+                    flmcast.rand ^= flmcast.rand >> 17;
+                    flmcast.rand ^= flmcast.rand << 5;
+                    if ((os_int)(flmcast.rand % 100) < flmcast_drop_pct) break;
+                }
+#endif
+                flashes_multicast_data(flashes_get_uint(p + FLASHES_MCAST_HDR_SZ, 4),
+                    flmcast.rx.buf + FLASHES_MCAST_PAD,
+                    (os_uint)(n_read - FLASHES_MCAST_DATA_HDR_SZ));
+                break;
+
+            case FLASHES_MCAST_COMMIT:
+                flashes_multicast_commit();
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if (flmcast.active && !(flmcast.flags & (FLASHES_MCAST_FAILED|FLASHES_MCAST_CURRENT)))
+    {
+        if (!flmcast.erased)
+        {
+            flashes_multicast_erase();
+        }
+        else if (flmcast.nreceived == flmcast.nblocks && !(flmcast.flags & FLASHES_MCAST_DONE))
+        {
+            flashes_multicast_verify();
+        }
+    }
+
+    if (flmcast.reply_pending && os_elapsed(&flmcast.poll_timer, flmcast.delay_ms))
+    {
+        flashes_multicast_reply(busy);
+        flmcast.reply_pending = OS_FALSE;
+    }
+
+    /* Reboot to run committed image, once the sender's remaining commits have passed.
+     */
+    if (flmcast.reboot_pending &&
+        os_elapsed(&flmcast.commit_timer, FLASHES_MCAST_REBOOT_DELAY_MS))
+    {
+        osal_reboot(0);
+    }
+
+    return (os_boolean)((flmcast.active &&
+        !(flmcast.flags & (FLASHES_MCAST_FAILED|FLASHES_MCAST_CURRENT))) ||
+        flmcast.reboot_pending);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Leave multicast group.
+  @anchor flashes_multicast_cleanup
+
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_multicast_cleanup(void)
+{
+    osal_stream_close(flmcast.data_socket);
+    osal_stream_close(flmcast.status_socket);
+    flmcast.data_socket = flmcast.status_socket = OS_NULL;
+}
+
+
+#if FLASHES_MULTICAST_TEST
+/**
+****************************************************************************************************
+
+  @brief Drop received data packets at random.
+  @anchor flashes_multicast_set_drop
+
+  The flashes_multicast_set_drop() function makes the device ignore given percentage of image
+  data packets, as if these were lost on the network. This is for testing repair with
+  simulated devices on one computer, where multicast is not lost, see flashes-loopback
+  example. Each device draws from its own sequence, seeded by its id, so devices miss
+  different blocks.
+
+  @param   drop_pct Percentage of data packets to drop, 0 to keep all.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_multicast_set_drop(
+    os_int drop_pct)
+{
+    flmcast_drop_pct = drop_pct;
+}
+#endif
+
+
+/**
+****************************************************************************************************
+
+  @brief Start receiving new image.
+  @anchor flashes_multicast_start
+
+  The flashes_multicast_start() function clears state of earlier image. If the device already
+  runs the image, it is marked current and nothing is written. Otherwise transfer progress
+  record of TCP transfer is cleared, since we are about to overwrite the bank.
+
+  @param   image_size Image size in bytes.
+  @param   image_crc CRC-32 of the whole image.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_multicast_start(
+    os_uint image_size,
+    os_uint image_crc)
+{
+    flashesProgress progress;
+    os_uint running_size, running_crc;
+
+    flmcast.active = OS_TRUE;
+    flmcast.image_size = image_size;
+    flmcast.image_crc = image_crc;
+    flmcast.nblocks = (image_size + FLASHES_TRANSFER_BLOCK_SIZE - 1) / FLASHES_TRANSFER_BLOCK_SIZE;
+    flmcast.bank2 = !flashes_is_bank2_selected();
+    flmcast.next_sector_to_erase = 0;
+    flmcast.erased = OS_FALSE;
+    os_memclear(flmcast.bitmap, sizeof(flmcast.bitmap));
+    flmcast.nreceived = 0;
+    flmcast.verify_block = 0;
+    flmcast.verify_crc = FLASHES_CRC32_INIT;
+    flmcast.flags = 0;
+
+    if (image_size == 0 || image_size > FLASHES_BANK_SIZE)
+    {
+        flmcast.flags = FLASHES_MCAST_FAILED;
+        return;
+    }
+    if (flashes_discovery_get_image(&running_size, &running_crc) == OSAL_SUCCESS &&
+        running_size == image_size && running_crc == image_crc)
+    {
+        flmcast.flags = FLASHES_MCAST_CURRENT;
+        return;
+    }
+
+    FLASHES_TRACE(1, FLASHES_TRACE_CONNECT, flmcast.bank2, 0);
+    os_memclear(&progress, sizeof(progress));
+    flashes_save_progress(&progress);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Write received block.
+  @anchor flashes_multicast_data
+
+  The flashes_multicast_data() function writes the block to its offset in flash, unless
+  it has been written already. Blocks received before erase is complete are dropped, they
+  are reported missing and sent again.
+
+  @param   block Block number.
+  @param   data Pointer to block data, aligned.
+  @param   nbytes Number of data bytes in packet.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_multicast_data(
+    os_uint block,
+    os_uchar *data,
+    os_uint nbytes)
+{
+    os_uint addr, n;
+    osalStatus s;
+
+    if (flmcast.flags || !flmcast.erased || block >= flmcast.nblocks) return;
+    if (flmcast.bitmap[block >> 3] & (1 << (block & 7))) return;
+
+    addr = block * FLASHES_TRANSFER_BLOCK_SIZE;
+    n = flmcast.image_size - addr;
+    if (n > FLASHES_TRANSFER_BLOCK_SIZE) n = FLASHES_TRANSFER_BLOCK_SIZE;
+    if (nbytes < n) return;
+
+    s = flashes_write(addr, data, n, flmcast.bank2, &flmcast.next_sector_to_erase);
+    if (s)
+    {
+        osal_debug_error("multicast block write failed");
+        flmcast.flags = FLASHES_MCAST_FAILED;
+        return;
+    }
+    flmcast.bitmap[block >> 3] |= (os_uchar)(1 << (block & 7));
+    flmcast.nreceived++;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Erase flash for the whole image.
+  @anchor flashes_multicast_erase
+
+  The flashes_multicast_erase() function starts erase of the next sector when previous one
+  is done, and sets erased flag once all sectors of the image have been erased.
+
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_multicast_erase(void)
+{
+    os_boolean started;
+
+    if (flashes_is_busy()) return;
+    if (flashes_start_erase(0, flmcast.image_size, flmcast.bank2,
+        &flmcast.next_sector_to_erase, &started))
+    {
+        osal_debug_error("multicast erase failed");
+        flmcast.flags = FLASHES_MCAST_FAILED;
+        return;
+    }
+    if (!started) flmcast.erased = OS_TRUE;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Read image back from flash and check it.
+  @anchor flashes_multicast_verify
+
+  The flashes_multicast_verify() function reads FLASHES_MCAST_VERIFY_BLOCKS blocks per call
+  and calculates CRC-32. Once the whole image has been read, the CRC is compared to one from
+  the sender. If it matches, the image is done. Otherwise something went wrong in writing,
+  so the device starts over with the same image.
+
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_multicast_verify(void)
+{
+    os_uchar *buf;
+    os_uint addr, n;
+    os_int i;
+
+    buf = flmcast.rx.buf + FLASHES_MCAST_PAD;
+    for (i = 0; i < FLASHES_MCAST_VERIFY_BLOCKS && flmcast.verify_block < flmcast.nblocks; i++)
+    {
+        addr = flmcast.verify_block * FLASHES_TRANSFER_BLOCK_SIZE;
+        n = flmcast.image_size - addr;
+        if (n > FLASHES_TRANSFER_BLOCK_SIZE) n = FLASHES_TRANSFER_BLOCK_SIZE;
+        if (flashes_read(addr, buf, n, flmcast.bank2))
+        {
+            flmcast.flags = FLASHES_MCAST_FAILED;
+            return;
+        }
+        flmcast.verify_crc = flashes_crc32(flmcast.verify_crc, buf, n);
+        flmcast.verify_block++;
+    }
+    if (flmcast.verify_block < flmcast.nblocks) return;
+
+    if (flmcast.verify_crc == flmcast.image_crc)
+    {
+        flmcast.flags = FLASHES_MCAST_DONE;
+        return;
+    }
+
+    osal_debug_error("multicast image verification failed");
+    FLASHES_TRACE(1, FLASHES_TRACE_VERIFY_FAILED, flmcast.image_size, flmcast.verify_crc);
+    flashes_multicast_start(flmcast.image_size, flmcast.image_crc);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Switch to the received image.
+  @anchor flashes_multicast_commit
+
+  The flashes_multicast_commit() function selects the bank to boot from, if the image has
+  been verified, and schedules reboot to run it, like after TCP transfer. The reboot is done
+  by flashes_multicast_loop() after FLASHES_MCAST_REBOOT_DELAY_MS, so the caller's loop keeps
+  running meanwhile. The image record for discovery replies is saved before, so it tells the
+  new image after reboot. Commit to device which is not done is ignored, it keeps running its
+  image.
+
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_multicast_commit(void)
+{
+    if (flmcast.flags != FLASHES_MCAST_DONE) return;
+
+    flashes_discovery_set_image(flmcast.bank2, flmcast.image_size, flmcast.image_crc);
+    if (flashes_select_bank(flmcast.bank2))
+    {
+        flmcast.flags = FLASHES_MCAST_FAILED;
+        return;
+    }
+    flmcast.active = OS_FALSE;
+    flmcast.reboot_pending = OS_TRUE;
+    os_get_timer(&flmcast.commit_timer);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Send status reply.
+  @anchor flashes_multicast_reply
+
+  The flashes_multicast_reply() function sends flags and ranges of missing blocks, at most
+  FLASHES_MCAST_MAX_RANGES of these. Missing blocks are reported also during erase, so the
+  sender knows the device is there.
+
+  @param   busy OS_TRUE if TCP program transfer connection is open.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_multicast_reply(
+    os_boolean busy)
+{
+    os_uchar *buf, *r;
+    os_uint flags, block, first, nranges;
+
+    flags = flmcast.active ? flmcast.flags : 0;
+    if (flmcast.active && !flags && !flmcast.erased) flags |= FLASHES_MCAST_ERASING;
+    if (busy) flags |= FLASHES_MCAST_BUSY;
+
+    /* Missing block ranges, with number of blocks limited to 16 bits.
+     */
+    buf = flmcast.rx.buf;
+    r = buf + FLASHES_MCAST_STATUS_HDR_SZ;
+    nranges = 0;
+    if (flmcast.active && !flmcast.flags)
+    {
+        block = 0;
+        while (block < flmcast.nblocks && nranges < FLASHES_MCAST_MAX_RANGES)
+        {
+            if (flmcast.bitmap[block >> 3] & (1 << (block & 7)))
+            {
+                block++;
+                continue;
+            }
+            first = block;
+            while (block < flmcast.nblocks && block - first < 0xFFFF &&
+                !(flmcast.bitmap[block >> 3] & (1 << (block & 7))))
+            {
+                block++;
+            }
+            flashes_put_uint(r, first, 4);
+            flashes_put_uint(r + 4, block - first, 2);
+            r += FLASHES_MCAST_RANGE_SZ;
+            nranges++;
+        }
+    }
+
+    flashes_put_uint(buf, FLASHES_MCAST_STATUS_MAGIC, 4);
+    flashes_put_uint(buf + 4, flmcast.session, 4);
+    buf[8] = (os_uchar)flags;
+    os_memcpy(buf + 9, flmcast.id, FLASHES_DEVICE_ID_SZ);
+    flashes_put_uint(buf + 9 + FLASHES_DEVICE_ID_SZ, nranges, 2);
+
+    osal_stream_send_packet(flmcast.status_socket, (const os_char*)buf,
+        (os_memsz)(r - buf), OSAL_STREAM_DEFAULT);
+}
+
+
+#endif
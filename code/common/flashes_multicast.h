@@ -0,0 +1,73 @@
+/**
+
+  @file    flashes_multicast.h
+  @brief   Receive program image multicast to many devices.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  The device joins the multicast group where flashit sends the image once to all devices,
+  writes blocks as they come, and asks missing blocks again when polled. The boot bank is
+  switched only after the whole image has been received and verified, and the sender commits
+  the update. See flashes_protocol.h for packet format. Like discovery, this is run by
+  flashes_socket_setup(), _loop() and _cleanup().
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#ifndef FLASHES_MULTICAST_INCLUDED
+#define FLASHES_MULTICAST_INCLUDED
+
+/** Set 0 to leave multicast distribution out.
+ */
+#ifndef FLASHES_MULTICAST
+#define FLASHES_MULTICAST 1
+#endif
+
+/** Set 1 to build flashes_multicast_set_drop(), to test repair with simulated devices.
+ */
+#ifndef FLASHES_MULTICAST_TEST
+#define FLASHES_MULTICAST_TEST 0
+#endif
+
+
+/**
+****************************************************************************************************
+
+  @name Multicast distribution functions
+
+****************************************************************************************************
+ */
+/*@{*/
+
+#if FLASHES_MULTICAST
+
+/* Join multicast group to receive image.
+ */
+void flashes_multicast_setup(void);
+
+/* Receive and write image blocks, answer polls.
+ */
+os_boolean flashes_multicast_loop(
+    os_boolean busy);
+
+/* Leave multicast group.
+ */
+void flashes_multicast_cleanup(void);
+
+#if FLASHES_MULTICAST_TEST
+/* Drop received data packets at random, for testing on simulated devices.
+ */
+void flashes_multicast_set_drop(
+    os_int drop_pct);
+#endif
+
+#endif
+
+/*@}*/
+
+#endif
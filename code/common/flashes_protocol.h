@@ -0,0 +1,337 @@
+/**
+
+  @file    flashes_protocol.h
+  @brief   Program transfer protocol definitions.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Definitions shared by the microcontroller end (flashes_socket.c) and the program which sends
+  the binary (flashit). This header depends only on eosal types, so it can be included by
+  tools which do not link with the flashes library.
+
+  The binary is transferred as frames. Each frame starts with two byte header, less significant
+  byte first. Bits 0 - 10 are payload size in bytes, bits 11 - 14 frame type and bit 15 is
+  acknowledge request flag. The payload follows the header.
+
+  The original stop and wait protocol is frame type 0 (FLASHES_FRAME_BLOCK) without flags:
+  The device replies 'o' to every block once it has been written. Zero size block terminates
+  the transfer, the device selects the bank to boot from and replies 'o'.
+
+  Windowed transfer uses FLASHES_FRAME_DATA frames. The device counts received frames of
+  any type, the first frame of connection has sequence number 1. Data frames are not replied
+  unless FLASHES_FRAME_ACK flag is set. Then the device replies 'a' followed by the frame's
+  sequence number, 2 bytes, less significant first. Since TCP keeps the order, this cumulatively
+  acknowledges all frames up to the sequence number. The sender can thus keep several blocks
+  in flight. Transfer is still terminated with zero size FLASHES_FRAME_BLOCK.
+
+  FLASHES_FRAME_IMAGE_INFO may be sent as the first frame to announce total image size, 4 bytes,
+  less significant first. The device then erases flash sectors of the image ahead of the write
+  position while the sender pauses, instead of erasing each sector when the first write lands
+  on it. If the image does not fit in the flash bank, the device replies 'e' and closes the
+  connection.
+
+  Block deduplication: FLASHES_FRAME_HASH_QUERY asks CRC-32 checksums of blocks of the image
+  the device is currently running. Payload is first block number, 4 bytes, and number of
+  blocks, 2 bytes, at most FLASHES_HASH_QUERY_MAX. Block size is FLASHES_TRANSFER_BLOCK_SIZE.
+  The device replies 'h', number of checksums, 2 bytes, and the checksums, 4 bytes each.
+  Number of checksums is zero if the device cannot copy from running image, for example in
+  boot loader mode. The sender then replaces blocks which match by FLASHES_FRAME_COPY, with
+  payload of number of bytes, 4 bytes. The device copies these from the running image at the
+  current write position. All multi byte values are less significant byte first.
+
+  Delta update: FLASHES_FRAME_PATCH frames carry binary delta patch, see flashes_delta.h,
+  instead of image data. The device decodes the patch against the running image and writes
+  the result sequentially. The patch stream may be split into frames at any byte. Patch
+  frames are not mixed with data or copy frames within one transfer.
+
+  Compressed transfer: FLASHES_FRAME_COMPRESSED frames carry the image compressed as described
+  in flashes_lz.h. The device decompresses it and writes the result sequentially. Like patch,
+  the stream may be split into frames at any byte and is not mixed with other data frames.
+
+  Sparse image: FLASHES_FRAME_SKIP, with payload of number of bytes, 4 bytes, tells that the
+  image continues with so many FLASHES_ERASED_BYTE bytes. The device only makes sure that the
+  flash area is erased and moves the write position forward. This is used with data and copy
+  frames.
+
+  Resume: The device keeps record of transfer progress over reconnects and reboots. Sender
+  may start the transfer with FLASHES_FRAME_RESUME, payload image size and CRC-32 of the whole
+  image, 4 bytes each. If an earlier transfer of the same image to the same bank was interrupted,
+  the device replies 'r' followed by image position, 4 bytes, where to continue. The position
+  is at block boundary, data before it has been written. Otherwise the device replies 'r' with
+  position 0. Resume works with data, copy and skip frames, not with patch or compressed ones.
+
+  Verification: The device calculates CRC-32 of the image as it is written. Before the
+  terminating block the sender may send FLASHES_FRAME_DIGEST, payload image size and CRC-32
+  of the whole image, 4 bytes each. If these do not match what was written, the device replies
+  'e' to the terminating block instead of 'o', and does not switch the boot bank.
+
+  Statistics: FLASHES_FRAME_STATS asks timing statistics of the device, see flashes_stats.h.
+  Payload is optional flags byte, FLASHES_STATS_RESET clears statistics after reply. The device
+  replies 's', number of phases and number of histogram bins, 1 byte each. For each phase
+  follow count, min, max and sum in microseconds, and histogram bins, 4 bytes each.
+
+  Trace: FLASHES_FRAME_TRACE asks the newest events from trace ring buffer, see flashes_trace.h.
+  The device replies 't', number of events, 2 bytes, and cycle counter ticks per microsecond,
+  4 bytes. Each event follows as time stamp, event id and two arguments, 4 bytes each.
+
+  Discovery: Devices answer UDP queries sent to multicast group FLASHES_DISCOVERY_QUERY_ADDR,
+  so that the sender can find all devices on the network with one query instead of probing
+  addresses. The query is magic FLASHES_DISCOVERY_QUERY_MAGIC, 4 bytes, protocol version,
+  1 byte, nonce, 4 bytes, and reply spread in milliseconds, 2 bytes. The device waits for
+  a time derived from its id, less than spread, and replies to multicast group
+  FLASHES_DISCOVERY_REPLY_ADDR. Spreading replies keeps a few hundred devices from all
+  replying in the same millisecond. The reply is magic FLASHES_DISCOVERY_REPLY_MAGIC, 4 bytes,
+  protocol version, 1 byte, flags, 1 byte, nonce copied from the query, 4 bytes, device id,
+  FLASHES_DEVICE_ID_SZ bytes, TCP port for program transfer, 2 bytes, size and CRC-32 of the
+  running image, 4 bytes each, and flash bank size, 4 bytes. Image size and CRC-32 are zero
+  if not known, for example if the running image was not written by flashes. The sender
+  knows device address from where the reply came from.
+
+  Multicast distribution: To update many devices at once, the sender multicasts the image
+  once to group FLASHES_MCAST_DATA_ADDR, instead of a TCP transfer to each device. Every
+  packet from the sender starts with FLASHES_MCAST_HDR_SZ header: Magic FLASHES_MCAST_MAGIC,
+  4 bytes, packet type, 1 byte, session id, 4 bytes, and image size and CRC-32, 4 bytes each,
+  so a device can join from any packet. FLASHES_MCAST_DATA packet follows with block number,
+  4 bytes, and the block, FLASHES_TRANSFER_BLOCK_SIZE bytes or the rest of the image. The
+  device erases flash for the whole image first, then writes blocks in any order and keeps
+  a bitmap of blocks received. FLASHES_MCAST_POLL, followed by reply spread in ms, 2 bytes,
+  asks every device to report its status to group FLASHES_MCAST_STATUS_ADDR, delayed like
+  discovery replies. The status is magic FLASHES_MCAST_STATUS_MAGIC, 4 bytes, session id,
+  4 bytes, flags, 1 byte, device id, FLASHES_DEVICE_ID_SZ bytes, and number of missing block
+  ranges, 2 bytes, followed by the ranges as first block, 4 bytes, and number of blocks,
+  2 bytes. The missing ranges are the NACK, the sender multicasts these blocks again and polls
+  again. Once all blocks are there, the device reads the image back from flash and checks
+  CRC-32. Then it reports FLASHES_MCAST_DONE, and when it receives FLASHES_MCAST_COMMIT it
+  switches the boot bank and reboots. The bank is never switched to an incomplete or corrupt
+  image.
+
+  Gateway report: A store-and-forward gateway receives the image like a device and then
+  updates devices of its site, see examples/flashes-gateway. FLASHES_FRAME_REPORT asks how
+  this is going. The gateway replies 'g', state, 1 byte, FLASHES_REPORT_NONE, _RUNNING or
+  _DONE, size and CRC-32 of the image being distributed, 4 bytes each, number of devices,
+  devices updated and devices failed, 2 bytes each, time used in ms, 4 bytes, and length of
+  text, 2 bytes, followed by the text: One line for each failed device. A device which is not
+  a gateway replies FLASHES_REPORT_NONE with zero counts.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#ifndef FLASHES_PROTOCOL_INCLUDED
+#define FLASHES_PROTOCOL_INCLUDED
+
+/** Default flashes library socket port as string. This can be appended to IP address.
+ */
+#define FLASHES_SOCKET_PORT_STR ":6827"
+#define FLASHES_SOCKET_PORT 6827
+
+/** Block size for transfer, bytes. Selected so that it easily fits on RAM of microcontroller and
+    in one Ethernet frame. This also needs to be divisible by 256, which is typical fast write
+    block size for flash. USING VALUES OTHER THAN 1024 MAY CAUSE PROBLEMS.
+ */
+#define FLASHES_TRANSFER_BLOCK_SIZE 1024
+
+/** Frame header size and bit fields.
+ */
+#define FLASHES_FRAME_HDR_SZ 2
+#define FLASHES_FRAME_SIZE_MASK 0x07FF
+#define FLASHES_FRAME_TYPE_MASK 0x7800
+#define FLASHES_FRAME_TYPE_SHIFT 11
+#define FLASHES_FRAME_ACK 0x8000
+
+/** Frame types.
+ */
+#define FLASHES_FRAME_BLOCK 0
+#define FLASHES_FRAME_DATA 1
+#define FLASHES_FRAME_IMAGE_INFO 2
+#define FLASHES_FRAME_HASH_QUERY 3
+#define FLASHES_FRAME_COPY 4
+#define FLASHES_FRAME_PATCH 5
+#define FLASHES_FRAME_COMPRESSED 6
+#define FLASHES_FRAME_SKIP 7
+#define FLASHES_FRAME_RESUME 8
+#define FLASHES_FRAME_DIGEST 9
+#define FLASHES_FRAME_STATS 10
+#define FLASHES_FRAME_TRACE 11
+#define FLASHES_FRAME_REPORT 12
+
+/** Payload sizes of control frames.
+ */
+#define FLASHES_IMAGE_INFO_SZ 4
+#define FLASHES_HASH_QUERY_SZ 6
+#define FLASHES_COPY_SZ 4
+#define FLASHES_SKIP_SZ 4
+#define FLASHES_RESUME_SZ 8
+#define FLASHES_DIGEST_SZ 8
+
+/** Statistics query flag: Clear statistics after reply.
+ */
+#define FLASHES_STATS_RESET 1
+
+/** Value of erased flash byte.
+ */
+#define FLASHES_ERASED_BYTE 0xFF
+
+/** Maximum number of block checksums asked by one hash query.
+ */
+#define FLASHES_HASH_QUERY_MAX 256
+
+/** Reply characters from the device.
+ */
+#define FLASHES_REPLY_OK 'o'
+#define FLASHES_REPLY_ACK 'a'
+#define FLASHES_REPLY_HASH 'h'
+#define FLASHES_REPLY_RESUME 'r'
+#define FLASHES_REPLY_ERROR 'e'
+#define FLASHES_REPLY_STATS 's'
+#define FLASHES_REPLY_TRACE 't'
+#define FLASHES_REPLY_REPORT 'g'
+
+/** Size of 'h' reply header, character and number of checksums.
+ */
+#define FLASHES_HASH_REPLY_HDR_SZ 3
+
+/** Size of 'a' reply, character and sequence number.
+ */
+#define FLASHES_ACK_REPLY_SZ 3
+
+/** Size of 'r' reply, character and image position.
+ */
+#define FLASHES_RESUME_REPLY_SZ 5
+
+/** Size of 's' reply header, character, number of phases and number of histogram bins.
+ */
+#define FLASHES_STATS_REPLY_HDR_SZ 3
+
+/** Size of 't' reply header, character, number of events and ticks per microsecond. Size of
+    one event in reply, and max number of events in reply, so that events fit in a block.
+ */
+#define FLASHES_TRACE_REPLY_HDR_SZ 7
+#define FLASHES_TRACE_EVENT_SZ 16
+#define FLASHES_TRACE_REPLY_MAX (FLASHES_TRANSFER_BLOCK_SIZE / FLASHES_TRACE_EVENT_SZ)
+
+/** Size of 'g' reply header, and max length of text which follows it.
+ */
+#define FLASHES_REPORT_REPLY_HDR_SZ 22
+#define FLASHES_REPORT_TEXT_MAX 512
+
+/** Gateway report states: Nothing distributed yet, distributing image, done.
+ */
+#define FLASHES_REPORT_NONE 0
+#define FLASHES_REPORT_RUNNING 1
+#define FLASHES_REPORT_DONE 2
+
+/** Default number of frames which the sender may have unacknowledged in flight. Sender
+    waits for reply to the first frame before filling the window, and falls back to stop
+    and wait if the MCU closes connection or does not reply, as loaders without windowing do.
+ */
+#define FLASHES_DEFAULT_WINDOW 8
+
+/** Maximum window, must be well below 32768 for 16 bit sequence number wrap around.
+ */
+#define FLASHES_MAX_WINDOW 256
+
+/** Discovery multicast groups and ports, for queries and for replies. Replies go to different
+    group, so that devices do not receive each other's replies.
+ */
+#define FLASHES_DISCOVERY_QUERY_ADDR "239.255.68.27:6828"
+#define FLASHES_DISCOVERY_REPLY_ADDR "239.255.68.28:6828"
+
+/** Discovery packet magic numbers, "FLDQ" and "FLDR" as little endian, and protocol version.
+ */
+#define FLASHES_DISCOVERY_QUERY_MAGIC 0x51444C46
+#define FLASHES_DISCOVERY_REPLY_MAGIC 0x52444C46
+#define FLASHES_DISCOVERY_VERSION 1
+
+/** Size of unique device id in discovery reply, bytes.
+ */
+#define FLASHES_DEVICE_ID_SZ 12
+
+/** Discovery query and reply sizes. Longer packets are accepted, so that fields can be
+    added to the end.
+ */
+#define FLASHES_DISCOVERY_QUERY_SZ 11
+#define FLASHES_DISCOVERY_REPLY_SZ (24 + FLASHES_DEVICE_ID_SZ)
+
+/** Discovery reply flags: Device is running from bank 2, program transfer is in progress.
+ */
+#define FLASHES_DISCOVERY_BANK2 1
+#define FLASHES_DISCOVERY_BUSY 2
+
+/** Multicast distribution groups and ports: Image data and polls from the sender, status
+    replies from devices.
+ */
+#define FLASHES_MCAST_DATA_ADDR "239.255.68.29:6829"
+#define FLASHES_MCAST_STATUS_ADDR "239.255.68.30:6829"
+
+/** Multicast packet magic numbers, "FLMC" and "FLMS" as little endian.
+ */
+#define FLASHES_MCAST_MAGIC 0x434D4C46
+#define FLASHES_MCAST_STATUS_MAGIC 0x534D4C46
+
+/** Multicast packet types from the sender.
+ */
+#define FLASHES_MCAST_DATA 1
+#define FLASHES_MCAST_POLL 2
+#define FLASHES_MCAST_COMMIT 3
+
+/** Multicast header size, data packet header size with block number, poll packet size,
+    status reply header size and size of one missing block range in status reply.
+ */
+#define FLASHES_MCAST_HDR_SZ 17
+#define FLASHES_MCAST_DATA_HDR_SZ (FLASHES_MCAST_HDR_SZ + 4)
+#define FLASHES_MCAST_POLL_SZ (FLASHES_MCAST_HDR_SZ + 2)
+#define FLASHES_MCAST_STATUS_HDR_SZ (11 + FLASHES_DEVICE_ID_SZ)
+#define FLASHES_MCAST_RANGE_SZ 6
+
+/** Maximum number of missing block ranges in one status reply. More are reported by next
+    poll, once these have been repaired.
+ */
+#define FLASHES_MCAST_MAX_RANGES 64
+
+/** Status reply flags: Image is complete and verified, flash is being erased and data is not
+    accepted yet, device already runs this image, device failed (image too big, write error),
+    device is busy with TCP transfer and does not take part.
+ */
+#define FLASHES_MCAST_DONE 1
+#define FLASHES_MCAST_ERASING 2
+#define FLASHES_MCAST_CURRENT 4
+#define FLASHES_MCAST_FAILED 8
+#define FLASHES_MCAST_BUSY 16
+
+/** Macros to build and parse frame header.
+ */
+#define FLASHES_FRAME_HDR(type, nbytes, flags) \
+    ((os_ushort)(((os_uint)(type) << FLASHES_FRAME_TYPE_SHIFT) | (os_uint)(nbytes) | (os_uint)(flags)))
+#define FLASHES_FRAME_GET_TYPE(hdr) (((os_uint)(hdr) & FLASHES_FRAME_TYPE_MASK) >> FLASHES_FRAME_TYPE_SHIFT)
+#define FLASHES_FRAME_GET_SIZE(hdr) ((os_uint)(hdr) & FLASHES_FRAME_SIZE_MASK)
+
+/** Get and store little endian unsigned integer of n bytes, 2 or 4, in frame payload, reply,
+    discovery or multicast packet. Inline, so that tools need not link the flashes library.
+ */
+static inline os_uint flashes_get_uint(
+    const os_uchar *p,
+    os_int n)
+{
+    os_uint x = 0;
+    while (n--) x = (x << 8) | p[n];
+    return x;
+}
+
+static inline void flashes_put_uint(
+    os_uchar *p,
+    os_uint x,
+    os_int n)
+{
+    while (n-- > 0)
+    {
+        *(p++) = (os_uchar)x;
+        x >>= 8;
+    }
+}
+
+#endif
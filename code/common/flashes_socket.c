@@ -11,6 +11,13 @@
   connections. If one is establised, the binary program is read from it and written to flash.
   The flashes_socket_cleanup() does the clean up.
 
+  The transfer is a state machine which never waits for socket or flash erase. Each
+  flashes_socket_loop() call reads what the socket has and processes received frames in small
+  units: One block programmed, copied, skipped or checksummed. Units are processed until the
+  work budget of the call, bytes or microseconds set by flashes_socket_set_budget(), is used.
+  So with dual bank flash the application keeps running while the other bank is written, and
+  worst case loop latency is one unit plus the budget.
+
   Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
   modified, and distributed under the terms of the project licensing. By continuing to use, modify,
   or distribute this file you indicate that you have read the license and understand and accept
@@ -27,30 +34,309 @@
 
 #include "flashes.h"
 
+/** Number of receive buffers. Two buffers allow receiving next block while the previous one
+    is waiting for flash sector erase to complete.
+ */
+#ifndef FLASHES_RX_BUFFERS
+#define FLASHES_RX_BUFFERS 2
+#endif
+
+/** Erase ahead of write position at most this many bytes, when image size is known, once
+    nothing has been received for FLASHES_ERASE_AHEAD_IDLE_MS. Flash cannot be programmed while
+    erase runs, so erasing far ahead, or between frames of one burst, would keep data which
+    arrives for the current position waiting.
+ */
+#ifndef FLASHES_ERASE_AHEAD_SZ
+#define FLASHES_ERASE_AHEAD_SZ 16384
+#endif
+#ifndef FLASHES_ERASE_AHEAD_IDLE_MS
+#define FLASHES_ERASE_AHEAD_IDLE_MS 20
+#endif
+
+/** Time out if transfer connection becomes silent, ms.
+ */
+#define FLASHES_SOCKET_TIMEOUT_MS 10000
+
+/** Write timeout of transfer socket, ms. Frames are read without waiting, but replies are
+    written with OSAL_STREAM_WAIT. They are a few bytes each and fit in the socket's send
+    buffer unless the sender has stopped reading, so this only limits how long one
+    flashes_socket_loop() call can block before such connection is dropped.
+ */
+#ifndef FLASHES_SOCKET_WRITE_TIMEOUT_MS
+#define FLASHES_SOCKET_WRITE_TIMEOUT_MS 500
+#endif
+
+/** Default work budget of one flashes_socket_loop() call: Number of bytes programmed, copied,
+    skipped or checksummed, and time in microseconds. 0 is no limit. At least one unit of work
+    is done on every call, so the transfer always moves forward.
+ */
+#ifndef FLASHES_SOCKET_BUDGET_BYTES
+#define FLASHES_SOCKET_BUDGET_BYTES (FLASHES_RX_BUFFERS * FLASHES_TRANSFER_BLOCK_SIZE)
+#endif
+#ifndef FLASHES_SOCKET_BUDGET_US
+#define FLASHES_SOCKET_BUDGET_US 0
+#endif
+
+/** Boot loader listen time when update is pending, ms: The application requested it with
+    flashes_request_loader() before reboot, or a transfer was interrupted. The same time is
+    waited after a transfer connection breaks, for the sender to reconnect.
+ */
+#ifndef FLASHES_LOADER_WAIT_MS
+#define FLASHES_LOADER_WAIT_MS 30000
+#endif
+
+/** Boot loader listen time when no update is pending, ms. This fallback window allows
+    updating a device whose application cannot request the loader. Set 0 to start the
+    application at once.
+ */
+#ifndef FLASHES_BOOT_WINDOW_MS
+#define FLASHES_BOOT_WINDOW_MS 500
+#endif
+
+/** Number of block checksums calculated and written as one unit of work when replying to
+    hash query.
+ */
+#define FLASHES_SOCKET_HASH_GROUP 16
+
+/** Read every written block back from flash and compare it to the data. This makes the
+    image CRC and resume position tell what really is in flash, at cost of extra 1 kB RAM.
+ */
+#ifndef FLASHES_VERIFY_READBACK
+#define FLASHES_VERIFY_READBACK 0
+#endif
+
+/** Number of blocks in receive arena: Receive buffers, decoded output block and readback
+    buffer if used.
+ */
+#define FLASHES_ARENA_OUT FLASHES_RX_BUFFERS
+#define FLASHES_ARENA_VERIFY (FLASHES_RX_BUFFERS + 1)
+#define FLASHES_ARENA_BLOCKS (FLASHES_RX_BUFFERS + 1 + FLASHES_VERIFY_READBACK)
+
 static osalStream listening_socket;
 
+/** Received frame waiting to be processed.
+ */
+typedef struct
+{
+    /* Frame payload, FLASHES_TRANSFER_BLOCK_SIZE bytes in receive arena.
+     */
+    os_uchar *buf;
+
+    /* Frame header as received and payload size in bytes.
+     */
+    os_ushort frame_hdr;
+    os_ushort nbytes;
+
+    /* Sequence number of the frame.
+     */
+    os_ushort frame_seq;
+
+    /* Number of bytes still to copy from running image, for copy frame, or to skip, for
+       skip frame. Number of blocks still to checksum for hash query, and bytes of image
+       still to checksum from flash for resume.
+     */
+    os_uint run_left;
+
+    /* Flash address of the next block to checksum for hash query.
+     */
+    os_uint run_addr;
+
+    /* Number of payload bytes already processed, for patch and compressed frames. Set to
+       payload size once hash query or resume payload has been parsed.
+     */
+    os_ushort pos;
+}
+flashesRxBuffer;
+
 typedef struct
 {
+    /* Receive arena. Frame payloads are read from socket straight into these blocks, and
+       flash is programmed from them without copying. Blocks are aligned for word and row
+       programming, and static, so that no large buffers are on the main loop stack.
+     */
+    flashesBlockBuf arena[FLASHES_ARENA_BLOCKS];
+
     osalStream socket;
 
     os_uint addr;
 
     os_uint next_sector_to_erase;
 
+    /* Number of frames received through this connection, wraps around at 65536.
+     */
+    os_ushort frame_seq;
+
     /* OS_TRUE if we are programming flash bank 2.
      */
     os_boolean bank2;
+
+    /* Image size announced by the sender, 0 if not known. Used to erase flash ahead.
+     */
+    os_uint image_size;
+
+    /* Receive ring buffer. Frames are processed in order they were received, rx_head is
+       index of the oldest one and rx_count number of frames in the ring.
+     */
+    flashesRxBuffer rx[FLASHES_RX_BUFFERS];
+    os_int rx_head;
+    os_int rx_count;
+
+    /* Partially received frame header. Once header is complete, receiving flag is set and
+       payload is read into the free ring buffer, payload_n bytes so far.
+     */
+    os_uchar hdr[FLASHES_FRAME_HDR_SZ];
+    os_int hdr_n;
+    os_boolean receiving;
+    os_ushort payload_n;
+
+    /* Work done by this flashes_socket_loop() call, bytes.
+     */
+    os_uint work_n;
+
+    /* Timer to detect silent connection.
+     */
+    os_timer rx_timer;
+
+    /* Delta patch decoder, decompressor and block of decoded image waiting to be written,
+       in receive arena.
+     */
+    flashesDelta delta;
+    flashesLz lz;
+    os_uchar *out;
+    os_uint out_n;
+
+    /* Transfer progress record. If the sender asked to resume, resumable is set and the record
+       is saved after every write. Otherwise progress_cleared is set once earlier record has
+       been cleared, because this transfer overwrites the bank.
+     */
+    flashesProgress progress;
+    os_boolean resumable;
+    os_boolean progress_cleared;
+
+    /* CRC-32 of image written so far. Image size and CRC-32 from digest frame, checked
+       before switching boot bank.
+     */
+    os_uint crc;
+    os_uint digest_size;
+    os_uint digest_crc;
+    os_boolean digest_received;
+
+#if FLASHES_VERIFY_READBACK
+    /* Buffer for reading back written data, in receive arena.
+     */
+    os_uchar *verify;
+#endif
+
+#if FLASHES_STATS
+    /* Set when all received frames have been processed and we wait for more data from socket,
+       cycle counter value when waiting started.
+     */
+    os_boolean idle;
+    os_uint idle_start;
+#endif
 }
 flashesProgrammingState;
 
 static flashesProgrammingState flsock_state;
 
+/** Number of frames received while flash erase was running.
+ */
+static os_uint flsock_frames_during_erase;
+
+/* Boot loader listen time and timer. Application is started once boot_wait_ms has passed
+   without transfer connection.
+ */
 static os_timer boot_timer;
+static os_int boot_wait_ms;
+
+/* Work budget of one flashes_socket_loop() call, bytes and microseconds. 0 is no limit.
+ */
+static os_uint flsock_budget_bytes = FLASHES_SOCKET_BUDGET_BYTES;
+static os_uint flsock_budget_us = FLASHES_SOCKET_BUDGET_US;
+
+/* Function to answer gateway report queries, OS_NULL if this is not a gateway. Gateway
+   doesn't run discovery or multicast.
+ */
+static flashes_report_func *flsock_report_func;
 
 
+static void flashes_socket_init(
+    flashesProgrammingState *state,
+    osalStream socket);
+
 static void flashes_socket_program(
     flashesProgrammingState *state);
 
+static osalStatus flashes_socket_receive_frames(
+    flashesProgrammingState *state,
+    os_int max_count,
+    os_uint start);
+
+static osalStatus flashes_socket_receive(
+    flashesProgrammingState *state);
+
+static os_boolean flashes_socket_budget_used(
+    flashesProgrammingState *state,
+    os_uint start);
+
+static os_boolean flashes_socket_update_pending(void);
+
+static osalStatus flashes_socket_process_frame(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf,
+    os_boolean *done);
+
+static osalStatus flashes_socket_decode(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf,
+    os_boolean *done);
+
+static osalStatus flashes_socket_write(
+    flashesProgrammingState *state,
+    const os_uchar *buf,
+    os_uint nbytes);
+
+static osalStatus flashes_socket_skip(
+    flashesProgrammingState *state,
+    os_uchar *tmp,
+    os_uint nbytes);
+
+static os_uint flashes_socket_write_sz(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf);
+
+static osalStatus flashes_socket_reply_hashes(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf,
+    os_boolean *done);
+
+static osalStatus flashes_socket_ack(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf);
+
+static osalStatus flashes_socket_resume(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf,
+    os_boolean *done);
+
+static osalStatus flashes_socket_reply_stats(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf);
+
+static osalStatus flashes_socket_reply_trace(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf);
+
+static osalStatus flashes_socket_reply_report(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf);
+
+static void flashes_socket_save_progress(
+    flashesProgrammingState *state);
+
+static os_uint flashes_socket_progress_check(
+    const flashesProgress *progress);
+
 
 /**
 ****************************************************************************************************
@@ -58,7 +344,10 @@ static void flashes_socket_program(
   @brief Open listening socket port to wait for binary program.
   @anchor flashes_socket_setup
 
-  The flashes_socket_setup() function...
+  The flashes_socket_setup() function opens the listening socket and decides how long the
+  boot loader listens before starting the application. If the application requested the loader
+  before reboot, or a transfer was interrupted, we listen for FLASHES_LOADER_WAIT_MS. Otherwise
+  only the short FLASHES_BOOT_WINDOW_MS fallback window, so that normal boot is not delayed.
 
   @return  None.
 
@@ -73,9 +362,24 @@ void flashes_socket_setup(void)
         osal_debug_error("osal_stream_open failed");
     }
     os_memclear(&flsock_state, sizeof(flsock_state));
+    flsock_frames_during_erase = 0;
     osal_trace("listening for socket connections");
 
+    /* Gateway is not a device of its site, it doesn't answer discovery or take multicast.
+     */
+    if (flsock_report_func == OS_NULL)
+    {
+#if FLASHES_DISCOVERY
+        flashes_discovery_setup();
+#endif
+#if FLASHES_MULTICAST
+        flashes_multicast_setup();
+#endif
+    }
+
     os_get_timer(&boot_timer);
+    boot_wait_ms = flashes_socket_update_pending()
+        ? FLASHES_LOADER_WAIT_MS : FLASHES_BOOT_WINDOW_MS;
 
     /* Only to display the trace
     flashes_is_bank2_selected(); */
@@ -93,7 +397,9 @@ void flashes_socket_setup(void)
   checks for incoming socket connections. If one is establised, the binary program is read
   from it and written to flash.
 
-  Only one connection as accepted at a time.
+  Only one connection as accepted at a time. Once a connection has been accepted, the boot
+  loader keeps listening for FLASHES_LOADER_WAIT_MS after it closes, so that broken transfer
+  can be resumed.
 
   @return  None.
 
@@ -102,19 +408,20 @@ void flashes_socket_setup(void)
 void flashes_socket_loop(void)
 {
     osalStream accepted_socket;
+    os_boolean busy;
 
     osal_socket_maintain();
 
-    accepted_socket = osal_stream_accept(listening_socket, OS_NULL, OSAL_STREAM_DEFAULT);
+    /* Acknowledgements are a few bytes each, do not let Nagle's algorithm hold them back.
+     */
+    accepted_socket = osal_stream_accept(listening_socket, OS_NULL, OSAL_STREAM_TCP_NODELAY);
     if (accepted_socket)
     {
         if (flsock_state.socket == OS_NULL)
         {
             osal_trace("socket connection accepted");
-            os_memclear(&flsock_state, sizeof(flsock_state));
-            flsock_state.socket = accepted_socket;
-            flsock_state.socket->read_timeout_ms = 10000;
-            flsock_state.socket->write_timeout_ms = 10000;
+            flashes_socket_init(&flsock_state, accepted_socket);
+            boot_wait_ms = FLASHES_LOADER_WAIT_MS;
         }
         else
         {
@@ -123,12 +430,30 @@ void flashes_socket_loop(void)
         }
     }
 
+    busy = (os_boolean)(flsock_state.socket != OS_NULL);
+    if (flsock_report_func == OS_NULL)
+    {
+#if FLASHES_MULTICAST
+        /* Multicast image being received keeps the boot loader listening, like TCP connection.
+         */
+        if (flashes_multicast_loop(busy))
+        {
+            os_get_timer(&boot_timer);
+            boot_wait_ms = FLASHES_LOADER_WAIT_MS;
+            busy = OS_TRUE;
+        }
+#endif
+#if FLASHES_DISCOVERY
+        flashes_discovery_loop(busy);
+#endif
+    }
+
     if (flsock_state.socket)
     {
         flashes_socket_program(&flsock_state);
         os_get_timer(&boot_timer);
     }
-    else if (os_elapsed(&boot_timer, 5000))
+    else if (os_elapsed(&boot_timer, boot_wait_ms))
     {
         flashes_jump_to_application();
     }
@@ -142,7 +467,7 @@ void flashes_socket_loop(void)
   @anchor flashes_socket_cleanup
 
   The flashes_socket_cleanup() function closes socket currently used for program transfer, if any,
-  and the socket listening for new incoming connections.
+  the socket listening for new incoming connections, discovery and multicast sockets.
 
   @return  None.
 
@@ -152,6 +477,160 @@ void flashes_socket_cleanup(void)
 {
     osal_stream_close(flsock_state.socket);
     osal_stream_close(listening_socket);
+#if FLASHES_DISCOVERY
+    flashes_discovery_cleanup();
+#endif
+#if FLASHES_MULTICAST
+    flashes_multicast_cleanup();
+#endif
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get number of frames received while flash erase was running.
+  @anchor flashes_socket_frames_during_erase
+
+  The flashes_socket_frames_during_erase() function tells how many frames have been received
+  into free ring buffers, while sector erase started for an earlier frame was still running,
+  since flashes_socket_setup(). Nonzero count shows that receive overlaps erase.
+
+  @return  Number of frames.
+
+****************************************************************************************************
+*/
+os_uint flashes_socket_frames_during_erase(void)
+{
+    return flsock_frames_during_erase;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Check if program update is pending at boot.
+  @anchor flashes_socket_update_pending
+
+  The flashes_socket_update_pending() function checks and clears loader request flag set by
+  the application, and checks if there is valid progress record of an interrupted transfer.
+
+  @return  OS_TRUE if boot loader should keep listening for program transfer.
+
+****************************************************************************************************
+*/
+static os_boolean flashes_socket_update_pending(void)
+{
+    flashesProgress progress;
+    os_boolean requested;
+
+    requested = flashes_take_loader_request();
+    if (requested) return OS_TRUE;
+
+    return (os_boolean)(flashes_load_progress(&progress) == OSAL_SUCCESS &&
+        progress.magic == FLASHES_PROGRESS_MAGIC &&
+        progress.check == flashes_socket_progress_check(&progress));
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Set work budget of one flashes_socket_loop() call.
+  @anchor flashes_socket_set_budget
+
+  The flashes_socket_set_budget() function limits how much one flashes_socket_loop() call
+  does, so that application main loop which calls it keeps its timing during transfer. The
+  call returns once either limit is reached. Smaller budget gives shorter loop latency, but
+  the transfer takes more loop rounds. One unit of work, like programming one block, is done
+  on every call regardless of the budget.
+
+  @param   max_bytes Number of bytes to program, copy, skip or checksum per call, 0 for no
+           limit. Default is FLASHES_SOCKET_BUDGET_BYTES.
+  @param   max_us Time to use per call, microseconds, 0 for no limit. Default is
+           FLASHES_SOCKET_BUDGET_US.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_socket_set_budget(
+    os_uint max_bytes,
+    os_uint max_us)
+{
+    flsock_budget_bytes = max_bytes;
+    flsock_budget_us = max_us;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Set function to answer gateway report queries.
+  @anchor flashes_socket_set_report_func
+
+  The flashes_socket_set_report_func() function is called by store-and-forward gateway, which
+  receives the image like a device and then distributes it to devices of its site. The report
+  function tells sender how distribution is going, see FLASHES_FRAME_REPORT. It is called from
+  flashes_socket_loop().
+
+  Setting report function also switches the library to gateway mode: The gateway doesn't
+  answer discovery queries or take part in multicast, so that flashit does not list or update
+  it as a device of the site. Call this before flashes_socket_setup().
+
+  @param   func Report function, OS_NULL if this is not a gateway.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_socket_set_report_func(
+    flashes_report_func *func)
+{
+    flsock_report_func = func;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Set up programming state for new connection.
+  @anchor flashes_socket_init
+
+  The flashes_socket_init() function clears state of earlier connection and points receive
+  buffers, decoded output and readback buffer to receive arena.
+
+  @param   state Programming state.
+  @param   socket Accepted socket.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_socket_init(
+    flashesProgrammingState *state,
+    osalStream socket)
+{
+    os_int i;
+
+    os_memclear(state, sizeof(flashesProgrammingState));
+    for (i = 0; i < FLASHES_RX_BUFFERS; i++)
+    {
+        state->rx[i].buf = state->arena[i].buf;
+    }
+    state->out = state->arena[FLASHES_ARENA_OUT].buf;
+#if FLASHES_VERIFY_READBACK
+    state->verify = state->arena[FLASHES_ARENA_VERIFY].buf;
+#endif
+
+    state->socket = socket;
+    state->socket->write_timeout_ms = FLASHES_SOCKET_WRITE_TIMEOUT_MS;
+    os_get_timer(&state->rx_timer);
+
+    /* Check from which flash bank we are currently running on, and setup to
+       load the software to the another bank.
+     */
+    state->bank2 = !flashes_is_bank2_selected();
+    FLASHES_TRACE(1, FLASHES_TRACE_CONNECT, state->bank2, 0);
+    flashes_delta_init(&state->delta, !state->bank2, FLASHES_BANK_SIZE);
+    flashes_lz_init(&state->lz);
 }
 
 
@@ -161,8 +640,19 @@ void flashes_socket_cleanup(void)
   @brief Read program from socket and transfer it.
   @anchor flashes_socket_program
 
-  The flashes_socket_program() function reads a program from socket and writes it to flash,
-  block by block.
+  The flashes_socket_program() function receives frames from socket and writes data blocks
+  to flash. See flashes_protocol.h for the frame format.
+
+  Received frames are queued in a small ring buffer. If no frame is queued, one is received
+  before processing. After processing all frames which have arrived are received into free
+  buffers, so a windowed sender's burst is taken in one call. When a block needs a new flash
+  sector, the sector erase is started and this function returns without waiting for it.
+  Following frames are received into free ring buffers while the erase runs, so TCP receive
+  window stays open and the sender is not stalled for the duration of the erase.
+
+  Frames are processed one unit at a time, until work budget of the call is used. Frames
+  which span many blocks, copy, skip, patch, compressed, hash query and resume, continue on
+  the next call where they were left.
 
   @return  None.
 
@@ -171,77 +661,1187 @@ void flashes_socket_cleanup(void)
 static void flashes_socket_program(
     flashesProgrammingState *state)
 {
-    os_uchar bytecount[2];
-    os_uchar buf[FLASHES_TRANSFER_BLOCK_SIZE];
-    os_memsz n_read, n_written;
-    os_uint nbytes;
+    flashesRxBuffer *rxbuf;
+    os_uint write_sz, start;
+    os_int units;
+    os_boolean started, done;
     osalStatus s;
 
-    /* Read number of bytes
-     */
-    s = osal_stream_read(state->socket, bytecount, sizeof(bytecount), &n_read, OSAL_STREAM_WAIT);
-    if (s || n_read != sizeof(bytecount)) goto broken;
-
-    nbytes = (os_uint)bytecount[0] | (((os_uint)bytecount[1]) << 8);
-    if (nbytes > sizeof(buf)) goto broken;
+    start = flashes_stats_cycles();
+    state->work_n = 0;
+    units = 0;
 
-    s = osal_stream_read(state->socket, buf, nbytes, &n_read, OSAL_STREAM_WAIT);
-    if (s || n_read != nbytes) goto broken;
+    /* Receive a frame to process, if none is queued. The rest are received after processing,
+       so that if processing starts a sector erase, they are received while it runs.
+     */
+    s = flashes_socket_receive_frames(state, 1, start);
+    if (s) goto broken;
 
-    /* If this is terminating zero length block
+    /* Process received frames in order, as long as flash is not busy erasing.
      */
-    if (nbytes == 0)
+    while (state->rx_count > 0 && !flashes_is_busy())
     {
-        /* Set bank to boot from and reboot.
-        */
-        s = flashes_select_bank(state->bank2);
-        if (s) goto broken;
+        /* Leave rest for next call once work budget has been used.
+         */
+        if (units++ && flashes_socket_budget_used(state, start)) break;
+        rxbuf = state->rx + state->rx_head;
 
-        /* Write recipt that block was succesfully written
+        /* If data needs a flash sector which is not erased yet, start erasing it.
+           Come back to write the data once erase has completed.
          */
-        s = osal_stream_write(state->socket, (const os_uchar*)"o", 1, &n_written, OSAL_STREAM_WAIT);
-        if (s || n_written != 1) goto broken;
+        write_sz = flashes_socket_write_sz(state, rxbuf);
+        if (write_sz > FLASHES_BANK_SIZE - state->addr)
+        {
+            osal_debug_error("write past end of flash bank");
+            s = OSAL_STATUS_FAILED;
+            goto broken;
+        }
+        if (write_sz)
+        {
+            s = flashes_start_erase(state->addr, write_sz, state->bank2,
+                &state->next_sector_to_erase, &started);
+            if (s) goto broken;
+            if (started) break;
+        }
+
+        s = flashes_socket_process_frame(state, rxbuf, &done);
+        if (s) goto broken;
 
-        /* Close the socket, we are finished with it.
+        /* If transfer completed and socket was closed, we are done.
          */
-        osal_stream_close(state->socket);
-        state->socket = OS_NULL;
+        if (state->socket == OS_NULL) return;
 
-        /* Reboot the computer.
+        /* Copy, patch and compressed frames are processed one block at a time.
          */
-os_sleep(1000);
-        osal_reboot(0);
-        return;
+        if (!done) continue;
+
+        if (++(state->rx_head) >= FLASHES_RX_BUFFERS) state->rx_head = 0;
+        state->rx_count--;
     }
 
-    /* Otherwise data block
+    /* Refill buffers freed by processing.
      */
-    else
-    {
-        /* Check from which flash bank we are currently running on, and setup to
-           load the software to the another bank.
-         */
-        if (state->addr == 0)
-        {
-            state->bank2 = !flashes_is_bank2_selected();
-        }
+    s = flashes_socket_receive_frames(state, FLASHES_RX_BUFFERS, start);
+    if (s) goto broken;
 
-        /* Write program binary to flash memory.
-         */
-        s = flashes_write(state->addr, buf, nbytes, state->bank2, &state->next_sector_to_erase);
+    /* If image size is known and sender has paused, erase next sector of the image ahead
+       of the write position.
+     */
+    if (state->image_size > state->addr && state->rx_count == 0 &&
+        os_elapsed(&state->rx_timer, FLASHES_ERASE_AHEAD_IDLE_MS))
+    {
+        write_sz = state->image_size - state->addr;
+        if (write_sz > FLASHES_ERASE_AHEAD_SZ) write_sz = FLASHES_ERASE_AHEAD_SZ;
+        s = flashes_start_erase(state->addr, write_sz, state->bank2,
+            &state->next_sector_to_erase, &started);
         if (s) goto broken;
-        state->addr += nbytes;
     }
 
-    /* Write recipt that block was succesfully written
+#if FLASHES_STATS
+    /* Everything received has been processed, time until next frame is read wait.
      */
-    s = osal_stream_write(state->socket, (const os_uchar*)"o", 1, &n_written, OSAL_STREAM_WAIT);
-    if (s || n_written != 1) goto broken;
-
-   return;
+    if (state->rx_count == 0 && !state->idle)
+    {
+        state->idle = OS_TRUE;
+        FLASHES_STATS_BEGIN(state->idle_start);
+    }
+#endif
+    return;
 
 broken:
     osal_debug_error("socket connection broken");
+    FLASHES_TRACE(1, FLASHES_TRACE_DISCONNECT, state->addr, s);
     osal_stream_close(state->socket);
     state->socket = OS_NULL;
+
+    /* Show trace of the connection, now that timing doesn't matter.
+     */
+#if FLASHES_TRACE_PRINT
+    flashes_trace_print();
+#endif
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Receive frames which have arrived into free receive buffers.
+  @anchor flashes_socket_receive_frames
+
+  The flashes_socket_receive_frames() function receives frames until max_count frames are
+  queued in the ring buffer, no complete frame is available from socket, or time budget of the
+  call has been used.
+
+  @param   state Programming state.
+  @param   max_count Receive until this many frames are queued, at most FLASHES_RX_BUFFERS.
+  @param   start Cycle counter value when flashes_socket_loop() call started.
+  @return  OSAL_SUCCESS if all is fine, even if no frame was received. Other values indicate
+           broken connection or protocol error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_socket_receive_frames(
+    flashesProgrammingState *state,
+    os_int max_count,
+    os_uint start)
+{
+    os_int rx_count;
+    osalStatus s;
+
+    while (state->rx_count < max_count && !flashes_socket_budget_used(state, start))
+    {
+        rx_count = state->rx_count;
+        s = flashes_socket_receive(state);
+        if (s) return s;
+        if (state->rx_count == rx_count) break;
+    }
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Receive a frame from socket into free receive buffer.
+  @anchor flashes_socket_receive
+
+  The flashes_socket_receive() function checks if frame header is available from socket, without
+  waiting. Once whole header has been received, the payload is read into free ring buffer as
+  it arrives. The frame is queued once the whole payload is in.
+
+  @param   state Programming state.
+  @return  OSAL_SUCCESS if all is fine, even if no frame was received. Other values indicate
+           broken connection or protocol error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_socket_receive(
+    flashesProgrammingState *state)
+{
+    flashesRxBuffer *rxbuf;
+    os_memsz n_read;
+    os_uint frame_hdr, nbytes;
+    os_int i;
+    osalStatus s;
+
+    i = state->rx_head + state->rx_count;
+    if (i >= FLASHES_RX_BUFFERS) i -= FLASHES_RX_BUFFERS;
+    rxbuf = state->rx + i;
+
+    /* Read frame header: number of bytes, frame type and flags. Do not wait for it.
+     */
+    if (!state->receiving)
+    {
+        s = osal_stream_read(state->socket, state->hdr + state->hdr_n,
+            FLASHES_FRAME_HDR_SZ - state->hdr_n, &n_read, OSAL_STREAM_DEFAULT);
+        if (s) return s;
+        if (n_read) os_get_timer(&state->rx_timer);
+        state->hdr_n += (os_int)n_read;
+        if (state->hdr_n < FLASHES_FRAME_HDR_SZ) goto check_timeout;
+        state->hdr_n = 0;
+
+        frame_hdr = flashes_get_uint(state->hdr, 2);
+        nbytes = FLASHES_FRAME_GET_SIZE(frame_hdr);
+        if (nbytes > FLASHES_TRANSFER_BLOCK_SIZE) return OSAL_STATUS_FAILED;
+        rxbuf->frame_hdr = (os_ushort)frame_hdr;
+        rxbuf->nbytes = (os_ushort)nbytes;
+        state->payload_n = 0;
+        state->receiving = OS_TRUE;
+    }
+
+    /* Payload follows header, read it into the free buffer as it arrives.
+     */
+    if (state->payload_n < rxbuf->nbytes)
+    {
+        s = osal_stream_read(state->socket, rxbuf->buf + state->payload_n,
+            rxbuf->nbytes - state->payload_n, &n_read, OSAL_STREAM_DEFAULT);
+        if (s) return s;
+        if (n_read) os_get_timer(&state->rx_timer);
+        state->payload_n += (os_ushort)n_read;
+        if (state->payload_n < rxbuf->nbytes) goto check_timeout;
+    }
+    state->receiving = OS_FALSE;
+
+    rxbuf->run_left = 0;
+    rxbuf->pos = 0;
+    if (FLASHES_FRAME_GET_TYPE(rxbuf->frame_hdr) == FLASHES_FRAME_COPY ||
+        FLASHES_FRAME_GET_TYPE(rxbuf->frame_hdr) == FLASHES_FRAME_SKIP)
+    {
+        if (rxbuf->nbytes < FLASHES_COPY_SZ) return OSAL_STATUS_FAILED;
+        rxbuf->run_left = flashes_get_uint(rxbuf->buf, 4);
+        if (rxbuf->run_left > FLASHES_BANK_SIZE) return OSAL_STATUS_FAILED;
+    }
+    rxbuf->frame_seq = ++(state->frame_seq);
+    state->rx_count++;
+    if (flashes_is_busy()) flsock_frames_during_erase++;
+
+#if FLASHES_STATS
+    if (state->idle)
+    {
+        FLASHES_STATS_END(FLASHES_STAT_READ_WAIT, state->idle_start);
+        state->idle = OS_FALSE;
+    }
+#endif
+    return OSAL_SUCCESS;
+
+check_timeout:
+    if (os_elapsed(&state->rx_timer, FLASHES_SOCKET_TIMEOUT_MS))
+    {
+        osal_debug_error("socket timeout");
+        return OSAL_STATUS_TIMEOUT;
+    }
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Check if work budget of flashes_socket_loop() call has been used.
+  @anchor flashes_socket_budget_used
+
+  @param   state Programming state, work_n is number of bytes processed by this call.
+  @param   start Cycle counter value when the call started.
+  @return  OS_TRUE if byte or time budget has been used.
+
+****************************************************************************************************
+*/
+static os_boolean flashes_socket_budget_used(
+    flashesProgrammingState *state,
+    os_uint start)
+{
+    if (flsock_budget_bytes && state->work_n >= flsock_budget_bytes) return OS_TRUE;
+    if (flsock_budget_us &&
+        (flashes_stats_cycles() - start) / flashes_stats_cycles_per_us() >= flsock_budget_us)
+    {
+        return OS_TRUE;
+    }
+    return OS_FALSE;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Process a received frame.
+  @anchor flashes_socket_process_frame
+
+  The flashes_socket_process_frame() function writes data block to the flash bank which we are
+  not running from and acknowledges it, or completes the transfer on terminating zero length
+  block. Flash sectors needed for the data must have been erased already.
+
+  Copy, skip, patch and compressed frames are processed one block at a time,
+  flashes_socket_write_sz() gives size of the next piece. Hash query and resume frames
+  checksum flash in pieces. The done flag is set once whole frame has been processed.
+  Progress record is updated whenever write position moves.
+
+  @param   state Programming state.
+  @param   rxbuf Received frame.
+  @param   done Set to OS_TRUE if frame has been processed completely.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_socket_process_frame(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf,
+    os_boolean *done)
+{
+    os_memsz n_written;
+    os_uint nbytes, addr;
+    osalStatus s;
+#if FLASHES_STATS
+    os_uint t;
+#endif
+
+    *done = OS_TRUE;
+    addr = state->addr;
+    switch (FLASHES_FRAME_GET_TYPE(rxbuf->frame_hdr))
+    {
+        case FLASHES_FRAME_BLOCK:
+            /* If this is terminating zero length block
+             */
+            if (rxbuf->nbytes == 0)
+            {
+                /* Write end of image decoded from delta patch or compressed stream.
+                 */
+                if (!flashes_delta_is_complete(&state->delta) ||
+                    !flashes_lz_is_complete(&state->lz))
+                {
+                    return OSAL_STATUS_FAILED;
+                }
+                if (state->out_n)
+                {
+                    s = flashes_socket_write(state, state->out, state->out_n);
+                    if (s) return s;
+                    state->out_n = 0;
+                }
+
+                /* Transfer is complete or failed verification, there is nothing to resume.
+                 */
+                os_memclear(&state->progress, sizeof(flashesProgress));
+                flashes_save_progress(&state->progress);
+
+                /* Compare written image to digest from the sender. If it doesn't match, tell
+                   the sender and keep booting the image we have.
+                 */
+                if (state->digest_received &&
+                    (state->addr != state->digest_size || state->crc != state->digest_crc))
+                {
+                    osal_debug_error("image verification failed");
+                    FLASHES_TRACE(1, FLASHES_TRACE_VERIFY_FAILED, state->addr, state->crc);
+                    osal_stream_write(state->socket, (const os_uchar*)"e", 1, &n_written,
+                        OSAL_STREAM_WAIT);
+                    return OSAL_STATUS_FAILED;
+                }
+
+                /* Remember what we installed, for discovery replies after reboot. Set bank
+                   to boot from and reboot.
+                */
+                flashes_discovery_set_image(state->bank2, state->addr, state->crc);
+                FLASHES_STATS_BEGIN(t);
+                s = flashes_select_bank(state->bank2);
+                if (s) return s;
+                FLASHES_STATS_END(FLASHES_STAT_BANK_SWITCH, t);
+
+                /* Write recipt that block was succesfully written
+                 */
+                s = osal_stream_write(state->socket, (const os_uchar*)"o", 1, &n_written, OSAL_STREAM_WAIT);
+                if (s || n_written != 1) return OSAL_STATUS_FAILED;
+
+                /* Close the socket, we are finished with it.
+                 */
+                FLASHES_TRACE(1, FLASHES_TRACE_DISCONNECT, state->addr, 0);
+                osal_stream_close(state->socket);
+                state->socket = OS_NULL;
+#if FLASHES_TRACE_PRINT
+                flashes_trace_print();
+#endif
+
+                /* Reboot the computer.
+                 */
+os_sleep(1000);
+                osal_reboot(0);
+                return OSAL_SUCCESS;
+            }
+
+            /* Otherwise stop and wait data block, write it and recipt.
+             */
+            s = flashes_socket_write(state, rxbuf->buf, rxbuf->nbytes);
+            if (s) return s;
+
+            FLASHES_STATS_BEGIN(t);
+            s = osal_stream_write(state->socket, (const os_uchar*)"o", 1, &n_written, OSAL_STREAM_WAIT);
+            if (s || n_written != 1) return OSAL_STATUS_FAILED;
+            FLASHES_STATS_END(FLASHES_STAT_ACK, t);
+            break;
+
+        case FLASHES_FRAME_DATA:
+            /* Windowed data block. Write it and acknowledge only if requested.
+             */
+            if (rxbuf->nbytes == 0) return OSAL_STATUS_FAILED;
+            s = flashes_socket_write(state, rxbuf->buf, rxbuf->nbytes);
+            if (s) return s;
+
+            s = flashes_socket_ack(state, rxbuf);
+            if (s) return s;
+            break;
+
+        case FLASHES_FRAME_IMAGE_INFO:
+            /* Image size announcement. Sectors are erased ahead by flashes_socket_program().
+               Image which doesn't fit in the bank is rejected before anything is erased.
+             */
+            if (rxbuf->nbytes < FLASHES_IMAGE_INFO_SZ) return OSAL_STATUS_FAILED;
+            nbytes = flashes_get_uint(rxbuf->buf, 4);
+            if (nbytes > FLASHES_BANK_SIZE)
+            {
+                osal_debug_error("image does not fit in flash bank");
+                osal_stream_write(state->socket, (const os_uchar*)"e", 1, &n_written,
+                    OSAL_STREAM_WAIT);
+                return OSAL_STATUS_FAILED;
+            }
+            state->image_size = nbytes;
+            s = flashes_socket_ack(state, rxbuf);
+            if (s) return s;
+            break;
+
+        case FLASHES_FRAME_HASH_QUERY:
+            s = flashes_socket_reply_hashes(state, rxbuf, done);
+            if (s) return s;
+            break;
+
+        case FLASHES_FRAME_COPY:
+            /* Copy next block from running image. The frame payload has been parsed
+               already, so we can use the frame buffer for data.
+             */
+            nbytes = flashes_socket_write_sz(state, rxbuf);
+            if (nbytes)
+            {
+                s = flashes_read(state->addr, rxbuf->buf, nbytes, !state->bank2);
+                if (s) return s;
+                s = flashes_socket_write(state, rxbuf->buf, nbytes);
+                if (s) return s;
+                rxbuf->run_left -= nbytes;
+            }
+
+            if (rxbuf->run_left)
+            {
+                *done = OS_FALSE;
+                break;
+            }
+            s = flashes_socket_ack(state, rxbuf);
+            if (s) return s;
+            break;
+
+        case FLASHES_FRAME_PATCH:
+        case FLASHES_FRAME_COMPRESSED:
+            /* Decoder state is not saved, so these cannot be resumed.
+             */
+            state->resumable = OS_FALSE;
+            s = flashes_socket_decode(state, rxbuf, done);
+            if (s) return s;
+            break;
+
+        case FLASHES_FRAME_SKIP:
+            /* Erased area of image, one block at a time. Flash sectors for it have been
+               erased already. The frame payload has been parsed, use the buffer for erased
+               data.
+             */
+            nbytes = rxbuf->run_left < FLASHES_TRANSFER_BLOCK_SIZE
+                ? rxbuf->run_left : FLASHES_TRANSFER_BLOCK_SIZE;
+            s = flashes_socket_skip(state, rxbuf->buf, nbytes);
+            if (s) return s;
+            rxbuf->run_left -= nbytes;
+
+            if (rxbuf->run_left)
+            {
+                *done = OS_FALSE;
+                break;
+            }
+            s = flashes_socket_ack(state, rxbuf);
+            if (s) return s;
+            break;
+
+        case FLASHES_FRAME_RESUME:
+            s = flashes_socket_resume(state, rxbuf, done);
+            if (s) return s;
+            break;
+
+        case FLASHES_FRAME_DIGEST:
+            /* Image size and CRC-32 to check before switching bank.
+             */
+            if (rxbuf->nbytes < FLASHES_DIGEST_SZ) return OSAL_STATUS_FAILED;
+            state->digest_size = flashes_get_uint(rxbuf->buf, 4);
+            state->digest_crc = flashes_get_uint(rxbuf->buf + 4, 4);
+            state->digest_received = OS_TRUE;
+            s = flashes_socket_ack(state, rxbuf);
+            if (s) return s;
+            break;
+
+        case FLASHES_FRAME_STATS:
+            s = flashes_socket_reply_stats(state, rxbuf);
+            if (s) return s;
+            break;
+
+        case FLASHES_FRAME_TRACE:
+            s = flashes_socket_reply_trace(state, rxbuf);
+            if (s) return s;
+            break;
+
+        case FLASHES_FRAME_REPORT:
+            s = flashes_socket_reply_report(state, rxbuf);
+            if (s) return s;
+            break;
+
+        default:
+            osal_debug_error("unknown frame type");
+            return OSAL_STATUS_FAILED;
+    }
+
+    if (state->addr != addr)
+    {
+        flashes_socket_save_progress(state);
+    }
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Process delta patch or compressed frame.
+  @anchor flashes_socket_decode
+
+  The flashes_socket_decode() function writes decoded block, if one is full, and then decodes
+  bytes from frame until next block is full or the frame has been used. Decoded data is
+  written one full block at a time, so that flash sectors can be erased before each write.
+  The last partial block is written when the transfer is terminated.
+
+  @param   state Programming state.
+  @param   rxbuf Received patch or compressed frame.
+  @param   done Set to OS_FALSE if frame still has data to decode.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_socket_decode(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf,
+    os_boolean *done)
+{
+    os_uint used;
+    osalStatus s;
+
+    if (state->out_n >= FLASHES_TRANSFER_BLOCK_SIZE)
+    {
+        s = flashes_socket_write(state, state->out, state->out_n);
+        if (s) return s;
+        state->out_n = 0;
+    }
+
+    if (FLASHES_FRAME_GET_TYPE(rxbuf->frame_hdr) == FLASHES_FRAME_PATCH)
+    {
+        s = flashes_delta_decode(&state->delta, rxbuf->buf + rxbuf->pos,
+            rxbuf->nbytes - rxbuf->pos, &used, state->out, FLASHES_TRANSFER_BLOCK_SIZE,
+            &state->out_n);
+    }
+    else
+    {
+        s = flashes_lz_decode(&state->lz, rxbuf->buf + rxbuf->pos,
+            rxbuf->nbytes - rxbuf->pos, &used, state->out, FLASHES_TRANSFER_BLOCK_SIZE,
+            &state->out_n);
+    }
+    if (s)
+    {
+        osal_debug_error("decoding patch or compressed data failed");
+        return s;
+    }
+    rxbuf->pos += (os_ushort)used;
+
+    /* If output block got full, the decoder may have more to give even without input.
+     */
+    if (state->out_n >= FLASHES_TRANSFER_BLOCK_SIZE)
+    {
+        *done = OS_FALSE;
+        return OSAL_SUCCESS;
+    }
+
+    return flashes_socket_ack(state, rxbuf);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Write data to flash at write position.
+  @anchor flashes_socket_write
+
+  The flashes_socket_write() function writes data to the bank being programmed, optionally
+  reads it back to check it, adds it to image CRC and moves write position forward.
+
+  @param   state Programming state.
+  @param   buf Data to write.
+  @param   nbytes Number of bytes, at most FLASHES_TRANSFER_BLOCK_SIZE.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_socket_write(
+    flashesProgrammingState *state,
+    const os_uchar *buf,
+    os_uint nbytes)
+{
+    osalStatus s;
+
+    s = flashes_write(state->addr, (os_uchar*)buf, nbytes, state->bank2,
+        &state->next_sector_to_erase);
+    if (s) return s;
+
+#if FLASHES_VERIFY_READBACK
+    s = flashes_read(state->addr, state->verify, nbytes, state->bank2);
+    if (s) return s;
+    if (os_memcmp(state->verify, buf, nbytes))
+    {
+        osal_debug_error("flash readback mismatch");
+        return OSAL_STATUS_FAILED;
+    }
+#endif
+
+    state->crc = flashes_crc32(state->crc, buf, nbytes);
+    state->addr += nbytes;
+    state->work_n += nbytes;
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Skip erased area of image.
+  @anchor flashes_socket_skip
+
+  The flashes_socket_skip() function moves write position over area of erased value bytes,
+  which is not written. Image CRC is updated as if the bytes were written. With readback the
+  area is checked to be erased.
+
+  @param   state Programming state.
+  @param   tmp Buffer of FLASHES_TRANSFER_BLOCK_SIZE bytes, used for erased value bytes.
+  @param   nbytes Number of bytes to skip.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_socket_skip(
+    flashesProgrammingState *state,
+    os_uchar *tmp,
+    os_uint nbytes)
+{
+    os_uint n;
+#if FLASHES_VERIFY_READBACK
+    osalStatus s;
+#endif
+
+    for (n = 0; n < FLASHES_TRANSFER_BLOCK_SIZE; n++)
+    {
+        tmp[n] = FLASHES_ERASED_BYTE;
+    }
+
+    while (nbytes)
+    {
+        n = nbytes < FLASHES_TRANSFER_BLOCK_SIZE ? nbytes : FLASHES_TRANSFER_BLOCK_SIZE;
+
+#if FLASHES_VERIFY_READBACK
+        s = flashes_read(state->addr, state->verify, n, state->bank2);
+        if (s) return s;
+        if (os_memcmp(state->verify, tmp, n))
+        {
+            osal_debug_error("skipped flash area not erased");
+            return OSAL_STATUS_FAILED;
+        }
+#endif
+
+        state->crc = flashes_crc32(state->crc, tmp, n);
+        state->addr += n;
+        state->work_n += n;
+        nbytes -= n;
+    }
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Acknowledge a frame, if the sender requested it.
+  @anchor flashes_socket_ack
+
+  The flashes_socket_ack() function writes 'a' reply with frame sequence number, if acknowledge
+  flag is set in frame header. This acknowledges all frames up to this one.
+
+  @param   state Programming state.
+  @param   rxbuf Processed frame.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_socket_ack(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf)
+{
+    os_uchar reply[FLASHES_ACK_REPLY_SZ];
+    os_memsz n_written;
+    osalStatus s;
+#if FLASHES_STATS
+    os_uint t;
+#endif
+
+    if ((rxbuf->frame_hdr & FLASHES_FRAME_ACK) == 0) return OSAL_SUCCESS;
+
+    reply[0] = FLASHES_REPLY_ACK;
+    flashes_put_uint(reply + 1, rxbuf->frame_seq, 2);
+    FLASHES_STATS_BEGIN(t);
+    s = osal_stream_write(state->socket, reply, sizeof(reply), &n_written, OSAL_STREAM_WAIT);
+    if (s || n_written != sizeof(reply)) return OSAL_STATUS_FAILED;
+    FLASHES_STATS_END(FLASHES_STAT_ACK, t);
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get number of bytes the next processing step of frame will write to flash.
+  @anchor flashes_socket_write_sz
+
+  The flashes_socket_write_sz() function is used to erase flash before processing the frame.
+
+  @param   state Programming state.
+  @param   rxbuf Received frame.
+  @return  Number of bytes to write, 0 if frame doesn't write flash.
+
+****************************************************************************************************
+*/
+static os_uint flashes_socket_write_sz(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf)
+{
+    switch (FLASHES_FRAME_GET_TYPE(rxbuf->frame_hdr))
+    {
+        case FLASHES_FRAME_BLOCK:
+            /* Terminating block flushes end of decoded patch or compressed stream.
+             */
+            return rxbuf->nbytes ? rxbuf->nbytes : state->out_n;
+
+        case FLASHES_FRAME_DATA:
+            return rxbuf->nbytes;
+
+        case FLASHES_FRAME_PATCH:
+        case FLASHES_FRAME_COMPRESSED:
+            return state->out_n >= FLASHES_TRANSFER_BLOCK_SIZE ? state->out_n : 0;
+
+        case FLASHES_FRAME_COPY:
+            return rxbuf->run_left < FLASHES_TRANSFER_BLOCK_SIZE
+                ? rxbuf->run_left : FLASHES_TRANSFER_BLOCK_SIZE;
+
+        case FLASHES_FRAME_SKIP:
+            /* Rest of skipped area needs to be erased, but is not written.
+             */
+            return rxbuf->run_left;
+
+        default:
+            return 0;
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Reply to block checksum query.
+  @anchor flashes_socket_reply_hashes
+
+  The flashes_socket_reply_hashes() function calculates CRC-32 of requested blocks of the image
+  we are running, and writes these to socket as 'h' reply. The sender uses these to decide
+  which blocks can be copied by the device instead of transferred. If the running image cannot
+  be read, no checksums are returned. Blocks past the end of flash bank are not returned.
+
+  The first call parses the query and writes reply header. Each call then checksums up to
+  FLASHES_SOCKET_HASH_GROUP blocks and writes these, until all requested blocks are done.
+
+  @param   state Programming state.
+  @param   rxbuf Received hash query frame. Payload is parsed first, then the buffer is used
+           for reading flash.
+  @param   done Set to OS_FALSE if there are still blocks to checksum.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_socket_reply_hashes(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf,
+    os_boolean *done)
+{
+    os_uchar reply[4 * FLASHES_SOCKET_HASH_GROUP];
+    os_memsz n_written;
+    os_uint block_nr, count, crc, n, addr;
+    osalStatus s;
+
+    if (rxbuf->pos == 0)
+    {
+        if (rxbuf->nbytes < FLASHES_HASH_QUERY_SZ) return OSAL_STATUS_FAILED;
+        block_nr = flashes_get_uint(rxbuf->buf, 4);
+        count = flashes_get_uint(rxbuf->buf + 4, 2);
+        if (count > FLASHES_HASH_QUERY_MAX) count = FLASHES_HASH_QUERY_MAX;
+
+        /* Only blocks within the flash bank can be checksummed.
+         */
+        n = FLASHES_BANK_SIZE / FLASHES_TRANSFER_BLOCK_SIZE;
+        if (block_nr >= n) count = 0;
+        else if (count > n - block_nr) count = n - block_nr;
+
+        /* If we cannot read running image, reply with no checksums.
+         */
+        addr = count ? block_nr * FLASHES_TRANSFER_BLOCK_SIZE : 0;
+        if (count && flashes_read(addr, rxbuf->buf, FLASHES_TRANSFER_BLOCK_SIZE, !state->bank2))
+        {
+            count = 0;
+        }
+
+        reply[0] = FLASHES_REPLY_HASH;
+        flashes_put_uint(reply + 1, count, 2);
+        s = osal_stream_write(state->socket, reply, FLASHES_HASH_REPLY_HDR_SZ, &n_written, OSAL_STREAM_WAIT);
+        if (s || n_written != FLASHES_HASH_REPLY_HDR_SZ) return OSAL_STATUS_FAILED;
+
+        rxbuf->run_left = count;
+        rxbuf->run_addr = addr;
+        rxbuf->pos = rxbuf->nbytes;
+    }
+
+    n = 0;
+    while (rxbuf->run_left && n < sizeof(reply))
+    {
+        s = flashes_read(rxbuf->run_addr, rxbuf->buf, FLASHES_TRANSFER_BLOCK_SIZE, !state->bank2);
+        if (s) return s;
+        crc = flashes_crc32(FLASHES_CRC32_INIT, rxbuf->buf, FLASHES_TRANSFER_BLOCK_SIZE);
+        rxbuf->run_addr += FLASHES_TRANSFER_BLOCK_SIZE;
+        rxbuf->run_left--;
+        state->work_n += FLASHES_TRANSFER_BLOCK_SIZE;
+
+        flashes_put_uint(reply + n, crc, 4);
+        n += 4;
+    }
+    if (n)
+    {
+        s = osal_stream_write(state->socket, reply, n, &n_written, OSAL_STREAM_WAIT);
+        if (s || n_written != (os_memsz)n) return OSAL_STATUS_FAILED;
+    }
+
+    if (rxbuf->run_left) *done = OS_FALSE;
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Reply to resume query.
+  @anchor flashes_socket_resume
+
+  The flashes_socket_resume() function checks if progress record saved by earlier connection,
+  or before reboot, is for the same image and bank. If so, write position and erase tracking
+  are restored, and the transfer continues from beginning of the last block written. Data
+  before that is not sent again, image CRC for it is calculated from flash. Sectors up to erase
+  frontier are not erased again, and data already in flash is not programmed again. Otherwise
+  new progress record is started.
+
+  The first call parses the query. Image CRC of data written before is calculated one block
+  per call, and the 'r' reply tells the sender where to continue once it is done.
+
+  @param   state Programming state.
+  @param   rxbuf Received resume frame, image size and CRC-32. Payload is parsed first, then
+           the buffer is used for reading flash.
+  @param   done Set to OS_FALSE if image CRC is still being calculated.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_socket_resume(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf,
+    os_boolean *done)
+{
+    flashesProgress *p;
+    os_uchar reply[FLASHES_RESUME_REPLY_SZ];
+    os_memsz n_written;
+    os_uint image_size, image_crc, pos;
+    osalStatus s;
+
+    if (rxbuf->pos == 0)
+    {
+        /* Resume query must come before anything is written.
+         */
+        if (rxbuf->nbytes < FLASHES_RESUME_SZ || state->addr || state->out_n)
+        {
+            return OSAL_STATUS_FAILED;
+        }
+        image_size = flashes_get_uint(rxbuf->buf, 4);
+        image_crc = flashes_get_uint(rxbuf->buf + 4, 4);
+
+        p = &state->progress;
+        pos = 0;
+        if (flashes_load_progress(p) == OSAL_SUCCESS &&
+            p->magic == FLASHES_PROGRESS_MAGIC &&
+            p->check == flashes_socket_progress_check(p) &&
+            p->bank2 == (os_uint)state->bank2 &&
+            p->image_size == image_size &&
+            image_size <= FLASHES_BANK_SIZE &&
+            p->image_crc == image_crc &&
+            p->addr <= image_size)
+        {
+            pos = p->addr - p->addr % FLASHES_TRANSFER_BLOCK_SIZE;
+            state->next_sector_to_erase = p->next_sector_to_erase;
+            osal_trace("resuming interrupted transfer");
+            FLASHES_TRACE(1, FLASHES_TRACE_RESUME, pos, 0);
+        }
+        else
+        {
+            os_memclear(p, sizeof(flashesProgress));
+            p->magic = FLASHES_PROGRESS_MAGIC;
+            p->bank2 = (os_uint)state->bank2;
+            p->image_size = image_size;
+            p->image_crc = image_crc;
+        }
+        state->resumable = OS_TRUE;
+        rxbuf->run_left = pos;
+        rxbuf->pos = rxbuf->nbytes;
+    }
+
+    /* Image CRC of data written before, from flash.
+     */
+    if (rxbuf->run_left)
+    {
+        s = flashes_read(state->addr, rxbuf->buf, FLASHES_TRANSFER_BLOCK_SIZE, state->bank2);
+        if (s) return s;
+        state->crc = flashes_crc32(state->crc, rxbuf->buf, FLASHES_TRANSFER_BLOCK_SIZE);
+        state->addr += FLASHES_TRANSFER_BLOCK_SIZE;
+        state->work_n += FLASHES_TRANSFER_BLOCK_SIZE;
+        rxbuf->run_left -= FLASHES_TRANSFER_BLOCK_SIZE;
+        *done = OS_FALSE;
+        return OSAL_SUCCESS;
+    }
+    flashes_socket_save_progress(state);
+
+    pos = state->addr;
+    reply[0] = FLASHES_REPLY_RESUME;
+    flashes_put_uint(reply + 1, pos, 4);
+    s = osal_stream_write(state->socket, reply, sizeof(reply), &n_written, OSAL_STREAM_WAIT);
+    if (s || n_written != sizeof(reply)) return OSAL_STATUS_FAILED;
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Reply to statistics query.
+  @anchor flashes_socket_reply_stats
+
+  The flashes_socket_reply_stats() function writes timing statistics as 's' reply, see
+  flashes_protocol.h. If the query has FLASHES_STATS_RESET flag, statistics are cleared after
+  the reply, so that the next query shows only what happened after this one. If statistics
+  are not compiled in, the reply has zero phases.
+
+  @param   state Programming state.
+  @param   rxbuf Received statistics query. Payload is parsed first, then the buffer is used
+           for the reply.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_socket_reply_stats(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf)
+{
+    os_uchar *p;
+    os_memsz n, n_written;
+    osalStatus s;
+#if FLASHES_STATS
+    const flashesStat *st;
+    os_uint v;
+    os_int phase, i;
+    os_boolean reset;
+
+    reset = (os_boolean)(rxbuf->nbytes > 0 && (rxbuf->buf[0] & FLASHES_STATS_RESET));
+#endif
+
+    /* Reply is 3 + 5 * 28 * 4 = 563 bytes, fits in frame buffer.
+     */
+    p = rxbuf->buf;
+    *(p++) = FLASHES_REPLY_STATS;
+#if FLASHES_STATS
+    *(p++) = FLASHES_NRO_STATS;
+    *(p++) = FLASHES_STATS_HIST_SZ;
+    for (phase = 0; phase < FLASHES_NRO_STATS; phase++)
+    {
+        st = flashes_stats_get(phase);
+        for (i = 0; i < 4 + FLASHES_STATS_HIST_SZ; i++)
+        {
+            switch (i)
+            {
+                case 0: v = st->count; break;
+                case 1: v = st->min_us; break;
+                case 2: v = st->max_us; break;
+                case 3: v = st->sum_us; break;
+                default: v = st->hist[i - 4]; break;
+            }
+            flashes_put_uint(p, v, 4);
+            p += 4;
+        }
+    }
+    if (reset) flashes_stats_reset();
+#else
+    *(p++) = 0;
+    *(p++) = 0;
+#endif
+
+    n = p - rxbuf->buf;
+    s = osal_stream_write(state->socket, rxbuf->buf, n, &n_written, OSAL_STREAM_WAIT);
+    if (s || n_written != n) return OSAL_STATUS_FAILED;
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Reply to trace query.
+  @anchor flashes_socket_reply_trace
+
+  The flashes_socket_reply_trace() function writes the newest trace events as 't' reply, see
+  flashes_protocol.h. Events are sent in binary, the computer formats them. Events stay in the
+  ring buffer.
+
+  @param   state Programming state.
+  @param   rxbuf Received trace query. The buffer is used for the reply.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_socket_reply_trace(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf)
+{
+    const flashesTraceEvent *ev;
+    os_uchar hdr[FLASHES_TRACE_REPLY_HDR_SZ], *p;
+    os_memsz n, n_written;
+    os_uint v;
+    os_int count, first, i, j;
+    osalStatus s;
+
+    count = flashes_trace_count();
+    first = count > FLASHES_TRACE_REPLY_MAX ? count - FLASHES_TRACE_REPLY_MAX : 0;
+    count -= first;
+    v = flashes_stats_cycles_per_us();
+
+    hdr[0] = FLASHES_REPLY_TRACE;
+    flashes_put_uint(hdr + 1, count, 2);
+    flashes_put_uint(hdr + 3, v, 4);
+    s = osal_stream_write(state->socket, hdr, sizeof(hdr), &n_written, OSAL_STREAM_WAIT);
+    if (s || n_written != sizeof(hdr)) return OSAL_STATUS_FAILED;
+    if (count == 0) return OSAL_SUCCESS;
+
+    p = rxbuf->buf;
+    for (i = 0; i < count; i++)
+    {
+        ev = flashes_trace_get(first + i);
+        for (j = 0; j < 4; j++)
+        {
+            switch (j)
+            {
+                case 0: v = ev->t; break;
+                case 1: v = ev->event; break;
+                case 2: v = ev->a; break;
+                default: v = ev->b; break;
+            }
+            flashes_put_uint(p, v, 4);
+            p += 4;
+        }
+    }
+
+    n = p - rxbuf->buf;
+    s = osal_stream_write(state->socket, rxbuf->buf, n, &n_written, OSAL_STREAM_WAIT);
+    if (s || n_written != n) return OSAL_STATUS_FAILED;
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Reply to gateway report query.
+  @anchor flashes_socket_reply_report
+
+  The flashes_socket_reply_report() function writes 'g' reply, see flashes_protocol.h. The
+  report function set by flashes_socket_set_report_func() fills in the report and text of
+  failed devices. Without one this is not a gateway, and the reply says there is nothing to
+  report.
+
+  @param   state Programming state.
+  @param   rxbuf Received report query. The buffer is used for the reply.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_socket_reply_report(
+    flashesProgrammingState *state,
+    flashesRxBuffer *rxbuf)
+{
+    flashesReport report;
+    os_uchar *p;
+    os_char *text;
+    os_memsz n, text_n, n_written;
+    osalStatus s;
+
+    /* Text is written straight to its place in the reply, 22 + 512 bytes fits in frame
+       buffer.
+     */
+    os_memclear(&report, sizeof(report));
+    text = (os_char*)rxbuf->buf + FLASHES_REPORT_REPLY_HDR_SZ;
+    text[0] = '\0';
+    if (flsock_report_func)
+    {
+        flsock_report_func(&report, text, FLASHES_REPORT_TEXT_MAX);
+    }
+    text_n = os_strlen(text) - 1;
+
+    p = rxbuf->buf;
+    p[0] = FLASHES_REPLY_REPORT;
+    p[1] = report.state;
+    flashes_put_uint(p + 2, report.image_size, 4);
+    flashes_put_uint(p + 6, report.image_crc, 4);
+    flashes_put_uint(p + 10, report.ndevices, 2);
+    flashes_put_uint(p + 12, report.nok, 2);
+    flashes_put_uint(p + 14, report.nfailed, 2);
+    flashes_put_uint(p + 16, report.time_ms, 4);
+    flashes_put_uint(p + 20, (os_uint)text_n, 2);
+
+    n = FLASHES_REPORT_REPLY_HDR_SZ + text_n;
+    s = osal_stream_write(state->socket, rxbuf->buf, n, &n_written, OSAL_STREAM_WAIT);
+    if (s || n_written != n) return OSAL_STATUS_FAILED;
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Save transfer progress.
+  @anchor flashes_socket_save_progress
+
+  The flashes_socket_save_progress() function updates progress record with current write
+  position and erase tracking and saves it. If transfer cannot be resumed, earlier progress
+  record is cleared once, since the bank is being overwritten.
+
+  @param   state Programming state.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_socket_save_progress(
+    flashesProgrammingState *state)
+{
+    if (!state->resumable)
+    {
+        if (!state->progress_cleared)
+        {
+            os_memclear(&state->progress, sizeof(flashesProgress));
+            flashes_save_progress(&state->progress);
+            state->progress_cleared = OS_TRUE;
+        }
+        return;
+    }
+
+    state->progress.addr = state->addr;
+    state->progress.next_sector_to_erase = state->next_sector_to_erase;
+    state->progress.check = flashes_socket_progress_check(&state->progress);
+    flashes_save_progress(&state->progress);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Calculate check value of progress record.
+  @anchor flashes_socket_progress_check
+
+  @param   progress Progress record.
+  @return  CRC-32 of all fields before check.
+
+****************************************************************************************************
+*/
+static os_uint flashes_socket_progress_check(
+    const flashesProgress *progress)
+{
+    return flashes_crc32(FLASHES_CRC32_INIT, (const os_uchar*)progress,
+        (os_memsz)((const os_uchar*)&progress->check - (const os_uchar*)progress));
 }
@@ -9,7 +9,14 @@
   The flashes_socket_setup() opens listening socket port 6827. The flashes_socket_loop()
   function is intended to be called from IO board's main loop. It checks for incoming socket
   connections. If one is establised, the binary program is read from it and written to flash.
-  The flashes_socket_cleanup() does the clean up.
+  The flashes_socket_cleanup() does the clean up. Each flashes_socket_loop() call does a limited
+  amount of work, see flashes_socket_set_budget(), so the application keeps running during
+  the transfer. The same functions run the UDP discovery responder and multicast image
+  receiver, see flashes_discovery.h and flashes_multicast.h.
+
+  In boot loader mode the application is started after a short fallback window, unless an
+  update is pending. To update, the application calls flashes_request_loader() and reboots,
+  and the boot loader then listens until the transfer is done.
 
   Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
   modified, and distributed under the terms of the project licensing. By continuing to use, modify,
@@ -19,16 +26,38 @@
 ****************************************************************************************************
 */
 
-/** Default flashes library socket port as string. This can be appended to IP address.
+/* Socket port and transfer block size are defined in flashes_protocol.h.
  */
-#define FLASHES_SOCKET_PORT_STR ":6827"
 
-/** Block size for transfer, bytes. Selected so that it easily fits on RAM of microcontroller and
-    in one Ethernet frame. This also needs to be divisible by 256, which is typical fast write
-    block size for flash. USING VALUES OTHER THAN 1024 MAY CAUSE PROBLEMS.
+/** Gateway report, answer to FLASHES_FRAME_REPORT query. See flashes_protocol.h.
  */
-#define FLASHES_TRANSFER_BLOCK_SIZE 1024
+typedef struct
+{
+    /* FLASHES_REPORT_NONE, FLASHES_REPORT_RUNNING or FLASHES_REPORT_DONE.
+     */
+    os_uchar state;
+
+    /* Size and CRC-32 of image being distributed.
+     */
+    os_uint image_size;
+    os_uint image_crc;
 
+    /* Number of devices, devices updated and devices failed, and time used in ms.
+     */
+    os_ushort ndevices;
+    os_ushort nok;
+    os_ushort nfailed;
+    os_uint time_ms;
+}
+flashesReport;
+
+/* Function to fill in gateway report. Text, one line for each failed device, is written
+   to text buffer of text_sz bytes, '\0' terminated.
+ */
+typedef void flashes_report_func(
+    flashesReport *report,
+    os_char *text,
+    os_memsz text_sz);
 
 /* API functions.
  */
@@ -41,5 +70,21 @@ void flashes_socket_setup(void);
  */
 void flashes_socket_cleanup(void);
 
+/* Set work budget of one flashes_socket_loop() call, bytes and microseconds, 0 for no limit.
+ */
+void flashes_socket_set_budget(
+    os_uint max_bytes,
+    os_uint max_us);
+
+/* Set function to answer gateway report queries, OS_NULL if this is not a gateway. Gateway
+   doesn't answer discovery or take part in multicast.
+ */
+void flashes_socket_set_report_func(
+    flashes_report_func *func);
+
 
 void flashes_socket_loop(void);
+
+/* Get number of frames received while flash erase was running.
+ */
+os_uint flashes_socket_frames_during_erase(void);
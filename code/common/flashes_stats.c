@@ -0,0 +1,128 @@
+/**
+
+  @file    flashes_stats.c
+  @brief   Timing statistics of program transfer phases.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Recording a measurement takes a few additions and comparisons, and the histogram bin is
+  the number of significant bits of the time. This can stay enabled in production builds.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashes.h"
+
+/* Phase names, in order of FLASHES_STAT_* defines.
+ */
+static const os_char *const flashes_stats_names[FLASHES_NRO_STATS] =
+{
+    "read wait", "erase", "program", "ack", "bank switch"
+};
+
+#if FLASHES_STATS
+
+/* Statistics of all phases.
+ */
+static flashesStat flashes_stats[FLASHES_NRO_STATS];
+
+
+/**
+****************************************************************************************************
+
+  @brief Record time of a phase.
+  @anchor flashes_stats_record
+
+  The flashes_stats_record() function calculates time elapsed since start and adds it to
+  statistics of the phase. Cycle counter wrap around is handled by unsigned subtraction,
+  phases longer than counter period are not measured correctly.
+
+  @param   phase Phase, FLASHES_STAT_READ_WAIT ... FLASHES_STAT_BANK_SWITCH.
+  @param   start Cycle counter value when the phase started.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_stats_record(
+    os_int phase,
+    os_uint start)
+{
+    flashesStat *st;
+    os_uint us, bin, x;
+
+    us = (flashes_stats_cycles() - start) / flashes_stats_cycles_per_us();
+    st = flashes_stats + phase;
+
+    if (st->count == 0 || us < st->min_us) st->min_us = us;
+    if (us > st->max_us) st->max_us = us;
+    st->sum_us += us;
+    st->count++;
+
+    /* Bin is number of significant bits.
+     */
+    bin = 0;
+    for (x = us; x; x >>= 1) bin++;
+    if (bin >= FLASHES_STATS_HIST_SZ) bin = FLASHES_STATS_HIST_SZ - 1;
+    st->hist[bin]++;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get statistics of a phase.
+  @anchor flashes_stats_get
+
+  @param   phase Phase, FLASHES_STAT_READ_WAIT ... FLASHES_STAT_BANK_SWITCH.
+  @return  Pointer to statistics.
+
+****************************************************************************************************
+*/
+const flashesStat *flashes_stats_get(
+    os_int phase)
+{
+    return flashes_stats + phase;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Clear statistics.
+  @anchor flashes_stats_reset
+
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_stats_reset(void)
+{
+    os_memclear(flashes_stats, sizeof(flashes_stats));
+}
+
+
+#endif
+
+
+/**
+****************************************************************************************************
+
+  @brief Get name of a phase.
+  @anchor flashes_stats_name
+
+  @param   phase Phase, FLASHES_STAT_READ_WAIT ... FLASHES_STAT_BANK_SWITCH.
+  @return  Name, "?" if phase is not known.
+
+****************************************************************************************************
+*/
+const os_char *flashes_stats_name(
+    os_int phase)
+{
+    if (phase < 0 || phase >= FLASHES_NRO_STATS) return "?";
+    return flashes_stats_names[phase];
+}
@@ -0,0 +1,112 @@
+/**
+
+  @file    flashes_stats.h
+  @brief   Timing statistics of program transfer phases.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  The device measures how long each phase of the transfer takes: Waiting for data from socket,
+  erasing flash, programming flash, writing acknowledgements and switching boot bank. Time is
+  taken from cycle counter of the flash layer, DWT CYCCNT on Cortex-M and clock_gettime() on
+  Linux. For each phase number of measurements, min, max and sum are kept, and a histogram
+  with log2 scale bins. The sender can query these with FLASHES_FRAME_STATS.
+
+  Define FLASHES_STATS 0 to leave the measurements out.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#ifndef FLASHES_STATS_INCLUDED
+#define FLASHES_STATS_INCLUDED
+
+/** Collect timing statistics.
+ */
+#ifndef FLASHES_STATS
+#define FLASHES_STATS 1
+#endif
+
+/** Measured phases.
+ */
+#define FLASHES_STAT_READ_WAIT 0
+#define FLASHES_STAT_ERASE 1
+#define FLASHES_STAT_PROGRAM 2
+#define FLASHES_STAT_ACK 3
+#define FLASHES_STAT_BANK_SWITCH 4
+#define FLASHES_NRO_STATS 5
+
+/** Number of histogram bins. Bin 0 counts measurements under 1 us, bin k measurements from
+    2^(k-1) to 2^k - 1 us. The last bin counts also all longer ones, 2^22 us is about 4 s.
+ */
+#define FLASHES_STATS_HIST_SZ 24
+
+/** Timing statistics of one phase, all times in microseconds.
+ */
+typedef struct
+{
+    os_uint count;
+    os_uint min_us;
+    os_uint max_us;
+    os_uint sum_us;
+    os_uint hist[FLASHES_STATS_HIST_SZ];
+}
+flashesStat;
+
+/* Macros to measure a phase. Variable to hold start time is declared only if FLASHES_STATS
+   is set.
+ */
+#if FLASHES_STATS
+#define FLASHES_STATS_BEGIN(t) (t) = flashes_stats_cycles()
+#define FLASHES_STATS_END(phase, t) flashes_stats_record((phase), (t))
+#else
+#define FLASHES_STATS_BEGIN(t)
+#define FLASHES_STATS_END(phase, t)
+#endif
+
+
+/**
+****************************************************************************************************
+
+  @name Statistics functions
+
+  Cycle counter functions are implemented by the flash layer.
+
+****************************************************************************************************
+ */
+/*@{*/
+
+/* Get cycle counter value.
+ */
+os_uint flashes_stats_cycles(void);
+
+/* Get number of cycle counter ticks per microsecond.
+ */
+os_uint flashes_stats_cycles_per_us(void);
+
+/* Record time of a phase which started at given cycle counter value.
+ */
+void flashes_stats_record(
+    os_int phase,
+    os_uint start);
+
+/* Get statistics of a phase.
+ */
+const flashesStat *flashes_stats_get(
+    os_int phase);
+
+/* Clear statistics.
+ */
+void flashes_stats_reset(void);
+
+/* Get name of a phase, for printing.
+ */
+const os_char *flashes_stats_name(
+    os_int phase);
+
+/*@}*/
+
+#endif
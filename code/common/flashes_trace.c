@@ -0,0 +1,238 @@
+/**
+
+  @file    flashes_trace.c
+  @brief   Binary trace of flash and transfer events.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Events are kept in a ring buffer of FLASHES_TRACE_SZ items. The counter of recorded events
+  is masked to get the index, so recording needs no division or comparisons.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashes.h"
+
+/* Event names and argument labels, indexed by event id. Argument label OS_NULL means that the
+   argument is not printed.
+ */
+static const os_char *const flashes_trace_names[FLASHES_NRO_TRACE_EVENTS][3] =
+{
+    {"?", "a", "b"},
+    {"write", "addr", "n"},
+    {"erase", "sector", OS_NULL},
+    {"erase start", "sector", OS_NULL},
+    {"erase done", "sector", OS_NULL},
+    {"bank query", "bank2", "bankmode"},
+    {"select bank", "bank2", OS_NULL},
+    {"connect", "bank2", OS_NULL},
+    {"resume", "pos", OS_NULL},
+    {"verify failed", "size", "crc"},
+    {"disconnect", "pos", "status"}
+};
+
+#if FLASHES_TRACE_LEVEL > 0
+
+/* Ring buffer and number of events recorded, wraps around.
+ */
+static flashesTraceEvent flashes_trace_ring[FLASHES_TRACE_SZ];
+static os_uint flashes_trace_n;
+
+
+/**
+****************************************************************************************************
+
+  @brief Record an event.
+  @anchor flashes_trace_event
+
+  The flashes_trace_event() function stores event with current cycle counter value in ring
+  buffer, overwriting the oldest event if the buffer is full. Use FLASHES_TRACE() macro, so
+  that events above trace level are not compiled in.
+
+  @param   event Event id, FLASHES_TRACE_WRITE...
+  @param   a First argument.
+  @param   b Second argument.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_trace_event(
+    os_uint event,
+    os_uint a,
+    os_uint b)
+{
+    flashesTraceEvent *ev;
+
+    ev = flashes_trace_ring + (flashes_trace_n++ & (FLASHES_TRACE_SZ - 1));
+    ev->t = flashes_stats_cycles();
+    ev->event = event;
+    ev->a = a;
+    ev->b = b;
+}
+
+#endif
+
+
+/**
+****************************************************************************************************
+
+  @brief Get number of events in ring buffer.
+  @anchor flashes_trace_count
+
+  @return  Number of events, at most FLASHES_TRACE_SZ.
+
+****************************************************************************************************
+*/
+os_int flashes_trace_count(void)
+{
+#if FLASHES_TRACE_LEVEL > 0
+    return flashes_trace_n < FLASHES_TRACE_SZ ? (os_int)flashes_trace_n : FLASHES_TRACE_SZ;
+#else
+    return 0;
+#endif
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get event from ring buffer.
+  @anchor flashes_trace_get
+
+  @param   i Index, 0 is the oldest event, flashes_trace_count() - 1 the newest.
+  @return  Pointer to event.
+
+****************************************************************************************************
+*/
+const flashesTraceEvent *flashes_trace_get(
+    os_int i)
+{
+#if FLASHES_TRACE_LEVEL > 0
+    return flashes_trace_ring +
+        ((flashes_trace_n - (os_uint)flashes_trace_count() + (os_uint)i) & (FLASHES_TRACE_SZ - 1));
+#else
+    return OS_NULL;
+#endif
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Clear the ring buffer.
+  @anchor flashes_trace_clear
+
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_trace_clear(void)
+{
+#if FLASHES_TRACE_LEVEL > 0
+    flashes_trace_n = 0;
+#endif
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Format an event as text.
+  @anchor flashes_trace_format
+
+  The flashes_trace_format() function generates one line like "+1520 us write addr=4096
+  n=1024 bank2". Time is given from previous event, so that cycle counter wrap around does
+  not matter. This function uses no device state, so the computer can decode events fetched
+  from the device.
+
+  @param   ev Event to format.
+  @param   prev_t Time stamp of the previous event. Same as ev->t for the first event.
+  @param   cycles_per_us Cycle counter ticks per microsecond on the device.
+  @param   buf Buffer for text, FLASHES_TRACE_TEXT_SZ bytes is enough.
+  @param   buf_sz Buffer size in bytes.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_trace_format(
+    const flashesTraceEvent *ev,
+    os_uint prev_t,
+    os_uint cycles_per_us,
+    os_char *buf,
+    os_memsz buf_sz)
+{
+    const os_char *const *names;
+    os_char nbuf[24];
+    os_uint b;
+
+    names = flashes_trace_names[ev->event < FLASHES_NRO_TRACE_EVENTS ? ev->event : 0];
+    b = ev->b;
+    if (cycles_per_us == 0) cycles_per_us = 1;
+
+    os_strncpy(buf, "+", buf_sz);
+    osal_int_to_string(nbuf, sizeof(nbuf), (ev->t - prev_t) / cycles_per_us);
+    os_strncat(buf, nbuf, buf_sz);
+    os_strncat(buf, " us ", buf_sz);
+    os_strncat(buf, names[0], buf_sz);
+
+    os_strncat(buf, " ", buf_sz);
+    os_strncat(buf, names[1], buf_sz);
+    os_strncat(buf, "=", buf_sz);
+    osal_int_to_string(nbuf, sizeof(nbuf), ev->a);
+    os_strncat(buf, nbuf, buf_sz);
+
+    if (ev->event == FLASHES_TRACE_WRITE) b &= ~FLASHES_TRACE_BANK2_FLAG;
+    if (names[2])
+    {
+        os_strncat(buf, " ", buf_sz);
+        os_strncat(buf, names[2], buf_sz);
+        os_strncat(buf, "=", buf_sz);
+        osal_int_to_string(nbuf, sizeof(nbuf), (os_int)b);
+        os_strncat(buf, nbuf, buf_sz);
+    }
+    if (ev->event == FLASHES_TRACE_WRITE && (ev->b & FLASHES_TRACE_BANK2_FLAG))
+    {
+        os_strncat(buf, " bank2", buf_sz);
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Print events to console.
+  @anchor flashes_trace_print
+
+  The flashes_trace_print() function writes events in ring buffer to console, one line each,
+  and clears the buffer. Call this when timing doesn't matter, like after the transfer.
+
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_trace_print(void)
+{
+    const flashesTraceEvent *ev;
+    os_char buf[FLASHES_TRACE_TEXT_SZ];
+    os_uint prev_t, per_us;
+    os_int n, i;
+
+    n = flashes_trace_count();
+    if (n == 0) return;
+    per_us = flashes_stats_cycles_per_us();
+    prev_t = flashes_trace_get(0)->t;
+    for (i = 0; i < n; i++)
+    {
+        ev = flashes_trace_get(i);
+        flashes_trace_format(ev, prev_t, per_us, buf, sizeof(buf));
+        prev_t = ev->t;
+        osal_console_write(buf);
+        osal_console_write("\n");
+    }
+    flashes_trace_clear();
+}
@@ -0,0 +1,137 @@
+/**
+
+  @file    flashes_trace.h
+  @brief   Binary trace of flash and transfer events.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Formatting trace text and writing it to serial console for every block takes milliseconds,
+  and changes the timing we are trying to see. Instead, events are recorded in a ring buffer
+  in binary: Event id, cycle counter time stamp and two integer arguments. Recording an event
+  is a few stores, so tracing can stay enabled in production builds. Events are formatted to
+  text only when looked at: flashes_trace_print() after the transfer, or flashit on the
+  computer, which fetches them with FLASHES_FRAME_TRACE.
+
+  FLASHES_TRACE_LEVEL selects at compile time which events are recorded: 0 none, 1 connection
+  and boot bank events, 2 also every flash write and sector erase.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#ifndef FLASHES_TRACE_INCLUDED
+#define FLASHES_TRACE_INCLUDED
+
+/** Trace level, events with higher level are left out at compile time.
+ */
+#ifndef FLASHES_TRACE_LEVEL
+#define FLASHES_TRACE_LEVEL 2
+#endif
+
+/** Print trace to console when transfer connection closes. Off by default, since console
+    may be in use for something else, like benchmark output. Use flashit -t instead.
+ */
+#ifndef FLASHES_TRACE_PRINT
+#define FLASHES_TRACE_PRINT 0
+#endif
+
+/** Number of events kept, must be power of two. The oldest events are overwritten.
+ */
+#ifndef FLASHES_TRACE_SZ
+#define FLASHES_TRACE_SZ 64
+#endif
+
+/** Trace events and their arguments.
+ */
+#define FLASHES_TRACE_WRITE 1           /* Level 2: Address, number of bytes, bank 2 flag. */
+#define FLASHES_TRACE_ERASE 2           /* Level 2: Sector erased while waiting. */
+#define FLASHES_TRACE_ERASE_START 3     /* Level 2: Sector erase started in background. */
+#define FLASHES_TRACE_ERASE_DONE 4      /* Level 2: Background erase of sector completed. */
+#define FLASHES_TRACE_BANK_QUERY 5      /* Level 1: Running from bank 2, bank mode. */
+#define FLASHES_TRACE_SELECT_BANK 6     /* Level 1: Boot from bank 2. */
+#define FLASHES_TRACE_CONNECT 7         /* Level 1: Programming bank 2. */
+#define FLASHES_TRACE_RESUME 8          /* Level 1: Position where transfer continues. */
+#define FLASHES_TRACE_VERIFY_FAILED 9   /* Level 1: Image size and CRC-32 written. */
+#define FLASHES_TRACE_DISCONNECT 10     /* Level 1: Write position, status. */
+#define FLASHES_NRO_TRACE_EVENTS 11
+
+/** Write event has bank 2 flag in the highest bit of second argument.
+ */
+#define FLASHES_TRACE_BANK2_FLAG 0x80000000U
+
+/** One recorded event. Time stamp is from flashes_stats_cycles().
+ */
+typedef struct
+{
+    os_uint t;
+    os_uint event;
+    os_uint a;
+    os_uint b;
+}
+flashesTraceEvent;
+
+/** Record an event, if level is enabled. The level is constant, so the compiler leaves out
+    disabled events.
+ */
+#if FLASHES_TRACE_LEVEL > 0
+#define FLASHES_TRACE(level, event, a, b) \
+    do { if ((level) <= FLASHES_TRACE_LEVEL) \
+        flashes_trace_event((event), (os_uint)(a), (os_uint)(b)); } while (0)
+#else
+#define FLASHES_TRACE(level, event, a, b)
+#endif
+
+/** Buffer size for one formatted event.
+ */
+#define FLASHES_TRACE_TEXT_SZ 96
+
+
+/**
+****************************************************************************************************
+
+  @name Trace functions
+
+****************************************************************************************************
+ */
+/*@{*/
+
+/* Record an event, use FLASHES_TRACE() macro instead.
+ */
+void flashes_trace_event(
+    os_uint event,
+    os_uint a,
+    os_uint b);
+
+/* Get number of events in ring buffer.
+ */
+os_int flashes_trace_count(void);
+
+/* Get event, 0 is the oldest.
+ */
+const flashesTraceEvent *flashes_trace_get(
+    os_int i);
+
+/* Clear the ring buffer.
+ */
+void flashes_trace_clear(void);
+
+/* Format an event as text, works also on computer for events fetched from device.
+ */
+void flashes_trace_format(
+    const flashesTraceEvent *ev,
+    os_uint prev_t,
+    os_uint cycles_per_us,
+    os_char *buf,
+    os_memsz buf_sz);
+
+/* Print events in ring buffer to console and clear it.
+ */
+void flashes_trace_print(void);
+
+/*@}*/
+
+#endif
@@ -6,7 +6,9 @@
   @version 1.0
   @date    24.9.2018
 
-  X...
+  Flash layer interface: Writing program binary to the bank which is not running, erasing
+  ahead, reading the running image, switching boot bank and keeping transfer progress over
+  reboots. Implemented separately for each platform, see code/arduino and code/linux.
 
   Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
   modified, and distributed under the terms of the project licensing. By continuing to use, modify,
@@ -18,14 +20,89 @@
 #ifndef FLASHES_WRITE_INCLUDED
 #define FLASHES_WRITE_INCLUDED
 
+/** Size of one flash bank, bytes. Image must fit in it, and this limits how much of the
+    running image can be read as source of copy or delta. Default is 1 MB bank of
+    STM32F42x/43x.
+ */
+#ifndef FLASHES_BANK_SIZE
+#define FLASHES_BANK_SIZE 0x100000
+#endif
+
+/** Transfer progress record. Kept over reconnects and reboots, so that interrupted transfer
+    can be resumed. The flash layer only stores and returns it, see flashes_socket.c.
+ */
+typedef struct
+{
+    /* FLASHES_PROGRESS_MAGIC if record is in use.
+     */
+    os_uint magic;
+
+    /* Bank being written, image size and CRC-32 of the whole image.
+     */
+    os_uint bank2;
+    os_uint image_size;
+    os_uint image_crc;
+
+    /* Number of image bytes written, and next sector to erase.
+     */
+    os_uint addr;
+    os_uint next_sector_to_erase;
+
+    /* CRC-32 of the fields above, to detect garbage.
+     */
+    os_uint check;
+}
+flashesProgress;
+
+#define FLASHES_PROGRESS_MAGIC 0x464C5052
+
+/** Record of the image installed by the last completed transfer, reported to discovery
+    queries. Kept over reboots like the progress record, see flashes_discovery.c.
+ */
+typedef struct
+{
+    /* FLASHES_IMAGE_INFO_MAGIC if record is in use.
+     */
+    os_uint magic;
+
+    /* Bank the image was written to, image size and CRC-32 of the whole image.
+     */
+    os_uint bank2;
+    os_uint image_size;
+    os_uint image_crc;
+
+    /* CRC-32 of the fields above, to detect garbage.
+     */
+    os_uint check;
+}
+flashesImageInfo;
+
+#define FLASHES_IMAGE_INFO_MAGIC 0x464C494D
+
+/** Value of loader request flag word, when the application has asked boot loader to stay
+    listening for program transfer after reboot.
+ */
+#define FLASHES_LOADER_REQUEST_MAGIC 0x464C4452
+
+/** Buffer for one block, aligned for the widest data type. When data given to flashes_write()
+    is in such buffer, the flash layer can program whole words and fast rows straight from it,
+    or give it to DMA.
+ */
+typedef union
+{
+    os_uchar buf[FLASHES_TRANSFER_BLOCK_SIZE];
+    os_int64 align_i;
+    os_double align_d;
+}
+flashesBlockBuf;
 
 
 /**
 ****************************************************************************************************
 
-  @name X...
+  @name Flash layer functions
 
-  The X..
+  Functions which platform specific flash layer implements.
 
 ****************************************************************************************************
  */
@@ -41,6 +118,27 @@ osalStatus flashes_write(
     os_boolean bank2,
     os_uint *next_sector_to_erase);
 
+/* Start erasing next flash sector needed for write, do not wait for erase to complete.
+ */
+osalStatus flashes_start_erase(
+    os_uint addr,
+    os_uint nbytes,
+    os_boolean bank2,
+    os_uint *next_sector_to_erase,
+    os_boolean *started);
+
+/* Check if flash erase started by flashes_start_erase() is still running.
+ */
+os_boolean flashes_is_busy(void);
+
+/* Read data from flash bank.
+ */
+osalStatus flashes_read(
+    os_uint addr,
+    os_uchar *buf,
+    os_uint nbytes,
+    os_boolean bank2);
+
 /* Check which bank is currently selected?
  */
 os_boolean flashes_is_bank2_selected(void);
@@ -54,6 +152,40 @@ osalStatus flashes_select_bank(
  */
 void flashes_jump_to_application(void);
 
+/* Save transfer progress record so that it survives reboot.
+ */
+osalStatus flashes_save_progress(
+    const flashesProgress *progress);
+
+/* Load transfer progress record.
+ */
+osalStatus flashes_load_progress(
+    flashesProgress *progress);
+
+/* Ask boot loader to stay listening for program transfer after next reboot, or cancel it.
+ */
+osalStatus flashes_request_loader(
+    os_boolean enable);
+
+/* Check if staying in boot loader has been requested, and clear the request.
+ */
+os_boolean flashes_take_loader_request(void);
+
+/* Save record of installed image so that it survives reboot.
+ */
+osalStatus flashes_save_image_info(
+    const flashesImageInfo *info);
+
+/* Load record of installed image.
+ */
+osalStatus flashes_load_image_info(
+    flashesImageInfo *info);
+
+/* Get unique id of the device, FLASHES_DEVICE_ID_SZ bytes.
+ */
+void flashes_get_device_id(
+    os_uchar *id);
+
 /*@}*/
 
 #endif
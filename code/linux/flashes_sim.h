@@ -0,0 +1,131 @@
+/**
+
+  @file    flashes_sim.h
+  @brief   Simulated dual bank flash for Linux.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  The Linux flashes_write.c simulates STM32F429 dual bank flash, so that the flashes library
+  and tools can be run and tested on a PC. Each bank is a file, mapped to memory. Settings
+  are optional: If flashes_sim_setup() is not called, the first flash function call sets up
+  simulation with flashes_sim_default_config() settings.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#ifndef FLASHES_SIM_INCLUDED
+#define FLASHES_SIM_INCLUDED
+
+/** Default directory for bank image and option files.
+ */
+#ifndef FLASHES_SIM_DEFAULT_DIR
+#define FLASHES_SIM_DEFAULT_DIR "."
+#endif
+
+/** Simulation settings.
+ */
+typedef struct
+{
+    /* Directory where bank images "flashes_bank1.bin" and "flashes_bank2.bin", boot bank
+       option "flashes_option.bin", transfer progress "flashes_progress.bin", boot loader
+       request "flashes_loader.bin" and installed image record "flashes_image.bin" are kept.
+       Bank files are created, erased, if they do not exist.
+     */
+    const os_char *dir;
+
+    /* Sector erase time is erase_base_us + erase_us_per_kb * sector size in kB. Defaults match
+       typical STM32F429 values, about 250 ms for 16 kB and one second for 128 kB sector.
+     */
+    os_long erase_base_us;
+    os_long erase_us_per_kb;
+
+    /* Program time per kB of data, not counting words flash already holds, which are skipped.
+     */
+    os_long program_us_per_kb;
+
+    /* Simulate timing. If OS_FALSE, erase and program complete at once.
+     */
+    os_boolean timing;
+}
+flashesSimConfig;
+
+/** Simulation statistics, for benchmarks.
+ */
+typedef struct
+{
+    /* Simulated erase time of all sectors erased, including background erase.
+     */
+    os_long erase_us;
+
+    /* Time the device waited for erase: Blocked in flashes_write(), or found flash busy
+       with background erase while having data to write.
+     */
+    os_long erase_wait_us;
+
+    /* Time spent programming.
+     */
+    os_long program_us;
+
+    /* Number of sectors erased and bytes programmed.
+     */
+    os_long erased_sectors;
+    os_long programmed_bytes;
+
+    /* Sectors not erased because they were blank already, and bytes not programmed because
+       flash already held the value.
+     */
+    os_long blank_sectors;
+    os_long unchanged_bytes;
+}
+flashesSimStats;
+
+
+/**
+****************************************************************************************************
+
+  @name Flash simulation functions
+
+  Setup, cleanup and statistics.
+
+****************************************************************************************************
+ */
+/*@{*/
+
+/* Get default settings. Environment variables FLASHES_SIM_DIR and FLASHES_SIM_TIMING
+   (0 = no delays) override built in defaults.
+ */
+void flashes_sim_default_config(
+    flashesSimConfig *config);
+
+/* Open or create bank image files and set timing model.
+ */
+osalStatus flashes_sim_setup(
+    const flashesSimConfig *config);
+
+/* Flush and unmap bank images.
+ */
+void flashes_sim_cleanup(void);
+
+/* Get statistics collected since setup or last reset.
+ */
+void flashes_sim_get_stats(
+    flashesSimStats *stats);
+
+/* Clear statistics.
+ */
+void flashes_sim_reset_stats(void);
+
+/* Fill bank with data, as if it held an old image, so that writing it needs erase.
+ */
+osalStatus flashes_sim_fill_bank(
+    os_boolean bank2,
+    os_uchar value);
+
+/*@}*/
+
+#endif
@@ -1,12 +1,25 @@
 /**
 
-  @file    flash_write.h
-  @brief   Write program to flash.
+  @file    flashes_write.c
+  @brief   Write program to simulated flash.
   @author  Pekka Lehtikoski
   @version 1.0
   @date    24.9.2018
 
-  X...
+  Linux implementation of flashes_write.h simulates STM32F429 dual bank flash, see flashes_sim.h.
+  Each 1 MB bank is a file mapped to memory, so written images persist and can be inspected
+  or compared with the binary sent. Bank has the STM32F429 sector layout: Four 16 kB sectors,
+  one 64 kB sector and seven 128 kB sectors. Bank 1 is sectors 0 - 11 and bank 2 sectors
+  12 - 23, as in the microcontroller version.
+
+  Flash is simulated as NOR flash: Erase sets all bytes of a sector to FLASHES_ERASED_BYTE and
+  programming can only clear bits. Programming which would need to set a bit back to one fails,
+  this catches writes to area which has not been erased. Boot bank selection is kept in option
+  file, so it persists over restarts like option bytes on the chip.
+
+  Sector erase and programming take time given by simple timing model. Erase started by
+  flashes_start_erase() runs in background, flashes_is_busy() returns OS_TRUE until the
+  erase time has passed. Programming blocks the caller.
 
   Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
   modified, and distributed under the terms of the project licensing. By continuing to use, modify,
@@ -16,23 +29,324 @@
 ****************************************************************************************************
 */
 #include "flashes.h"
+#include "code/linux/flashes_sim.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Number of sectors in one bank and first sector of bank 2.
+ */
+#define FLASHES_SIM_SECTORS_PER_BANK 12
+#define FIRST_BANK_2_SECTOR 12
+
+/* Program unit, bytes. Matches FLASHES_PROGRAM_WIDTH default of the microcontroller version.
+ */
+#define FLASHES_SIM_PROGRAM_WIDTH 4
+
+/* Simulation state.
+ */
+typedef struct
+{
+    /* Settings and directory path copy.
+     */
+    flashesSimConfig config;
+    os_char dir[256];
+
+    /* Memory mapped bank images, OS_NULL if not set up.
+     */
+    os_uchar *bank[2];
+
+    /* Bank we are running from, the boot bank selected in option file at setup.
+     */
+    os_boolean running_bank2;
+
+    /* Sector being erased by flashes_start_erase(), or -1 if none, and time when erase completes.
+     */
+    os_int erasing_sector;
+    os_long erase_done_us;
+
+    /* Time when caller first found flash busy with this erase, 0 if not yet.
+     */
+    os_long erase_wait_start_us;
+
+#if FLASHES_STATS
+    /* Cycle counter value when background erase was started.
+     */
+    os_uint erase_start;
+#endif
+
+    /* Set once "jump to application" has been printed.
+     */
+    os_boolean jump_reported;
+
+    /* Statistics.
+     */
+    flashesSimStats stats;
+}
+flashesSimState;
+
+static flashesSimState flsim = {.erasing_sector = -1};
+
+/* Sector start offsets within bank, last item is bank size.
+ */
+static const os_uint flashes_sim_sector_offs[FLASHES_SIM_SECTORS_PER_BANK + 1] =
+{
+    0x00000, 0x04000, 0x08000, 0x0C000, 0x10000, 0x20000, 0x40000,
+    0x60000, 0x80000, 0xA0000, 0xC0000, 0xE0000, 0x100000
+};
+
+static osalStatus flashes_sim_open(void);
+
+static os_uchar *flashes_sim_map_bank(
+    os_boolean bank2);
+
+static void flashes_sim_make_path(
+    os_char *path,
+    os_memsz path_sz,
+    const os_char *name);
+
+static osalStatus flashes_sim_check_range(
+    os_uint addr,
+    os_uint nbytes);
+
+static os_uint flashes_get_sector(
+    os_uint addr,
+    os_boolean bank2);
+
+static void flashes_sim_erase_sector(
+    os_uint sector);
+
+static os_boolean flashes_sim_is_sector_blank(
+    os_uint sector);
+
+static os_long flashes_sim_erase_time_us(
+    os_uint sector);
+
+static osalStatus flashes_program(
+    os_uchar *dst,
+    const os_uchar *buf,
+    os_uint nbytes);
+
+static os_boolean flashes_sim_erase_running(
+    os_boolean waiting);
+
+static os_long flashes_sim_now_us(void);
+
+static void flashes_sim_wait_until(
+    os_long t_us);
+
+
+/**
+****************************************************************************************************
+
+  @brief Get default simulation settings.
+  @anchor flashes_sim_default_config
+
+  The flashes_sim_default_config() function fills in default settings. Environment variable
+  FLASHES_SIM_DIR sets directory for bank images and FLASHES_SIM_TIMING=0 turns off delays.
+
+  @param   config Settings structure to fill in.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_sim_default_config(
+    flashesSimConfig *config)
+{
+    const os_char *p;
+
+    os_memclear(config, sizeof(flashesSimConfig));
+    p = getenv("FLASHES_SIM_DIR");
+    config->dir = p ? p : FLASHES_SIM_DEFAULT_DIR;
+    config->erase_base_us = 143000;
+    config->erase_us_per_kb = 6700;
+    config->program_us_per_kb = 4000;
+    p = getenv("FLASHES_SIM_TIMING");
+    config->timing = (p && *p == '0') ? OS_FALSE : OS_TRUE;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Set up flash simulation.
+  @anchor flashes_sim_setup
+
+  The flashes_sim_setup() function maps bank image files to memory, creating missing files
+  as erased flash, and reads the boot bank from option file. The bank selected in option
+  file is the bank we are running from, as after reset of the microcontroller.
+
+  @param   config Settings, OS_NULL for defaults.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_sim_setup(
+    const flashesSimConfig *config)
+{
+    os_char path[300];
+    os_uchar option;
+    int fd;
+
+    flashes_sim_cleanup();
+
+    if (config) flsim.config = *config;
+    else flashes_sim_default_config(&flsim.config);
+    os_strncpy(flsim.dir, flsim.config.dir ? flsim.config.dir : FLASHES_SIM_DEFAULT_DIR,
+        sizeof(flsim.dir));
+    flsim.config.dir = flsim.dir;
+
+    flsim.bank[0] = flashes_sim_map_bank(OS_FALSE);
+    flsim.bank[1] = flashes_sim_map_bank(OS_TRUE);
+    if (flsim.bank[0] == OS_NULL || flsim.bank[1] == OS_NULL)
+    {
+        flashes_sim_cleanup();
+        return OSAL_STATUS_FAILED;
+    }
+
+    /* Boot bank option. Missing file means bank 1.
+     */
+    option = 0;
+    flashes_sim_make_path(path, sizeof(path), "flashes_option.bin");
+    fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        if (read(fd, &option, 1) != 1) option = 0;
+        close(fd);
+    }
+    flsim.running_bank2 = option ? OS_TRUE : OS_FALSE;
+    flsim.erasing_sector = -1;
+    flsim.jump_reported = OS_FALSE;
+    flashes_sim_reset_stats();
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Clean up flash simulation.
+  @anchor flashes_sim_cleanup
+
+  The flashes_sim_cleanup() function completes erase in progress, writes bank images to disk and
+  unmaps them. Next flash function call sets up simulation again with default settings.
+
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_sim_cleanup(void)
+{
+    os_int i;
+
+    if (flsim.erasing_sector >= 0)
+    {
+        flashes_sim_erase_sector((os_uint)flsim.erasing_sector);
+        flsim.erasing_sector = -1;
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        if (flsim.bank[i] == OS_NULL) continue;
+        msync(flsim.bank[i], FLASHES_BANK_SIZE, MS_SYNC);
+        munmap(flsim.bank[i], FLASHES_BANK_SIZE);
+        flsim.bank[i] = OS_NULL;
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get simulation statistics.
+  @anchor flashes_sim_get_stats
+
+  The flashes_sim_get_stats() function gets time spent in flash operations and amount of flash
+  erased and programmed since setup or flashes_sim_reset_stats() call.
+
+  @param   stats Structure to fill in.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_sim_get_stats(
+    flashesSimStats *stats)
+{
+    *stats = flsim.stats;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Clear simulation statistics.
+  @anchor flashes_sim_reset_stats
+
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_sim_reset_stats(void)
+{
+    os_memclear(&flsim.stats, sizeof(flsim.stats));
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Fill flash bank with data.
+  @anchor flashes_sim_fill_bank
+
+  The flashes_sim_fill_bank() function sets every byte of the bank to value, without timing,
+  as if the bank held an old image. Benchmarks use this so that all sectors need erase, bank
+  files created as erased flash would need none. Erase in progress is completed first.
+
+  @param   bank2 OS_FALSE to fill bank1, OS_TRUE to fill bank 2.
+  @param   value Byte value to fill with, anything but FLASHES_ERASED_BYTE to need erase.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_sim_fill_bank(
+    os_boolean bank2,
+    os_uchar value)
+{
+    osalStatus s;
+
+    s = flashes_sim_open();
+    if (s) return s;
+
+    if (flsim.erasing_sector >= 0)
+    {
+        flashes_sim_erase_sector((os_uint)flsim.erasing_sector);
+        flsim.erasing_sector = -1;
+    }
+    memset(flsim.bank[bank2 ? 1 : 0], value, FLASHES_BANK_SIZE);
+    return OSAL_SUCCESS;
+}
 
 
 /**
 ****************************************************************************************************
 
   @brief Write program binary to flash memory.
-  @anchor flash_write
+  @anchor flashes_write
 
-  The flash_write() function writes nbytes data from buffer to flash memory. When writing a
+  The flashes_write() function writes nbytes data from buffer to flash memory. When writing a
   bigger block, this function is called repeatedly from smallest address to large
   one. This allows erashing flash as needed.
 
-  @param   addr Flash address. Address 0 is the beginning of the flags. This is bank 1
-           address. To write to bank 2 use bank 1 address, but set bank2 flag. This address
-           needs to be divisible by by 4 (minimum write size is dword).
+  @param   addr Flash address. Address 0 is the beginning of the bank. To write to bank 2 use
+           bank 1 address, but set bank2 flag. Any alignment works.
   @param   buf Pointer to data to write.
-  @param   nbytes This needs to be divisible by 4 (minimum write size is dword).
+  @param   nbytes Number of bytes to write, any number.
   @param   bank2 OS_FALSE to write to bank1, OS_TRUE to write to bank 2.
   @param   next_sector_to_erase Pointer to erase tracking variable. Set to value of
            next_sector_to_erase to zero before the first flash_write() call. For following
@@ -42,25 +356,207 @@
 
 ****************************************************************************************************
 */
-osalStatus flash_write(
+osalStatus flashes_write(
     os_uint addr,
     os_uchar* buf,
     os_uint nbytes,
     os_boolean bank2,
     os_uint *next_sector_to_erase)
 {
-    os_char strbuf[64];
+    os_uint first_sector, last_sector, sector;
+    os_long t, t_done;
+    osalStatus s;
+#if FLASHES_STATS
+    os_uint t_stat;
+#endif
+
+    if (nbytes == 0) return OSAL_SUCCESS;
+    s = flashes_sim_open();
+    if (s) return s;
+    s = flashes_sim_check_range(addr, nbytes);
+    if (s) return s;
+
+    FLASHES_TRACE(2, FLASHES_TRACE_WRITE, addr, nbytes | (bank2 ? FLASHES_TRACE_BANK2_FLAG : 0));
+
+    /* If erase started by flashes_start_erase() is still running, wait for it.
+     */
+    if (flashes_sim_erase_running(OS_TRUE))
+    {
+        flashes_sim_wait_until(flsim.erase_done_us);
+        flashes_sim_erase_running(OS_TRUE);
+    }
+
+    /* The first and last sector to write
+     */
+    first_sector = flashes_get_sector(addr, bank2);
+    last_sector = flashes_get_sector(addr + nbytes - 1, bank2);
+
+    /* Erase if not done already. Sectors which are already blank are not erased again.
+     */
+    if (last_sector >= *next_sector_to_erase)
+    {
+        if (first_sector < *next_sector_to_erase)
+        {
+            first_sector = *next_sector_to_erase;
+        }
+
+        FLASHES_STATS_BEGIN(t_stat);
+        t = t_done = flashes_sim_now_us();
+        for (sector = first_sector; sector <= last_sector; sector++)
+        {
+            if (flashes_sim_is_sector_blank(sector))
+            {
+                flsim.stats.blank_sectors++;
+                continue;
+            }
+            FLASHES_TRACE(2, FLASHES_TRACE_ERASE, sector, 0);
+            t_done += flashes_sim_erase_time_us(sector);
+            flashes_sim_erase_sector(sector);
+        }
+        flashes_sim_wait_until(t_done);
+        flsim.stats.erase_wait_us += flashes_sim_now_us() - t;
+        if (t_done > t)
+        {
+            FLASHES_STATS_END(FLASHES_STAT_ERASE, t_stat);
+        }
+
+        /* Maintain next unerased sector.
+         */
+        *next_sector_to_erase = last_sector + 1;
+    }
+
+    FLASHES_STATS_BEGIN(t_stat);
+    t = flashes_sim_now_us();
+    s = flashes_program(flsim.bank[bank2 ? 1 : 0] + addr, buf, nbytes);
+    flsim.stats.program_us += flashes_sim_now_us() - t;
+    FLASHES_STATS_END(FLASHES_STAT_PROGRAM, t_stat);
+    flsim.stats.programmed_bytes += nbytes;
+    return s;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Program data to erased flash.
+  @anchor flashes_program
+
+  The flashes_program() function simulates NOR flash programming: Bits can only be cleared.
+  Program units which flash already holds, like erased value bytes in erased flash, are skipped
+  as on the microcontroller. Other units take time given by the timing model.
+
+  @param   dst Pointer to mapped bank image.
+  @param   buf Pointer to data to write.
+  @param   nbytes Number of bytes to write, any number.
+  @return  OSAL_SUCCESS if all is fine. OSAL_STATUS_FAILED if data would need erase.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_program(
+    os_uchar *dst,
+    const os_uchar *buf,
+    os_uint nbytes)
+{
+    os_uint i, nprogrammed;
+    os_boolean same_unit;
+    osalStatus s = OSAL_SUCCESS;
 
-    osal_console_write("writing ");
-    osal_int_to_string(strbuf, sizeof(strbuf), nbytes);
-    osal_console_write(strbuf);
-    osal_console_write(" bytes at bank ");
-    osal_console_write(bank2 ? "2" : "1");
-    osal_console_write(" address ");
-    osal_int_to_string(strbuf, sizeof(strbuf), addr);
-    osal_console_write(strbuf);
-    osal_console_write("\n");
+    nprogrammed = 0;
+    same_unit = OS_TRUE;
+    for (i = 0; i < nbytes; i++)
+    {
+        if (dst[i] != buf[i])
+        {
+            if ((dst[i] & buf[i]) != buf[i]) s = OSAL_STATUS_FAILED;
+            dst[i] &= buf[i];
+            same_unit = OS_FALSE;
+        }
 
+        if ((i + 1) % FLASHES_SIM_PROGRAM_WIDTH == 0 || i + 1 == nbytes)
+        {
+            if (same_unit) flsim.stats.unchanged_bytes += (i % FLASHES_SIM_PROGRAM_WIDTH) + 1;
+            else nprogrammed += FLASHES_SIM_PROGRAM_WIDTH;
+            same_unit = OS_TRUE;
+        }
+    }
+
+    if (flsim.config.timing)
+    {
+        flashes_sim_wait_until(flashes_sim_now_us() +
+            flsim.config.program_us_per_kb * nprogrammed / 1024);
+    }
+
+    if (s)
+    {
+        osal_debug_error("flash program failed, area not erased");
+    }
+    return s;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Start erasing next flash sector needed for write.
+  @anchor flashes_start_erase
+
+  The flashes_start_erase() function checks if writing nbytes at addr needs a flash sector which
+  has not been erased yet. If so, erase of the first such sector is started and the function
+  returns without waiting for it to complete. Use flashes_is_busy() to check when erase is done.
+  Calling this function repeatedly, until started is OS_FALSE, erases all sectors needed.
+
+  @param   addr Flash address, as for flashes_write().
+  @param   nbytes Number of bytes to be written.
+  @param   bank2 OS_FALSE to write to bank1, OS_TRUE to write to bank 2.
+  @param   next_sector_to_erase Pointer to erase tracking variable, as for flashes_write().
+  @param   started Set to OS_TRUE if erase was started, OS_FALSE if nothing needs erasing.
+
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_start_erase(
+    os_uint addr,
+    os_uint nbytes,
+    os_boolean bank2,
+    os_uint *next_sector_to_erase,
+    os_boolean *started)
+{
+    os_uint first_sector, last_sector;
+    osalStatus s;
+
+    *started = OS_FALSE;
+    if (nbytes == 0 || flashes_sim_erase_running(OS_FALSE)) return OSAL_SUCCESS;
+    s = flashes_sim_open();
+    if (s) return s;
+    s = flashes_sim_check_range(addr, nbytes);
+    if (s) return s;
+
+    first_sector = flashes_get_sector(addr, bank2);
+    last_sector = flashes_get_sector(addr + nbytes - 1, bank2);
+    if (last_sector < *next_sector_to_erase) return OSAL_SUCCESS;
+    if (first_sector < *next_sector_to_erase)
+    {
+        first_sector = *next_sector_to_erase;
+    }
+
+    /* Sectors which are already blank need no erase.
+     */
+    while (first_sector <= last_sector && flashes_sim_is_sector_blank(first_sector))
+    {
+        flsim.stats.blank_sectors++;
+        first_sector++;
+    }
+    *next_sector_to_erase = first_sector;
+    if (first_sector > last_sector) return OSAL_SUCCESS;
+
+    FLASHES_TRACE(2, FLASHES_TRACE_ERASE_START, first_sector, 0);
+    flsim.erasing_sector = (os_int)first_sector;
+    flsim.erase_wait_start_us = 0;
+    FLASHES_STATS_BEGIN(flsim.erase_start);
+    flsim.erase_done_us = flashes_sim_now_us() + flashes_sim_erase_time_us(first_sector);
+    *next_sector_to_erase = first_sector + 1;
+    *started = OS_TRUE;
     return OSAL_SUCCESS;
 }
 
@@ -68,21 +564,77 @@ osalStatus flash_write(
 /**
 ****************************************************************************************************
 
-  @brief Check which bank is currently selected?
-  @anchor flash_is_bank2_selected
+  @brief Check if flash erase is in progress.
+  @anchor flashes_is_busy
+
+  The flashes_is_busy() function checks if sector erase started by flashes_start_erase() is still
+  running. When the erase time has passed, the sector is erased in bank image.
+
+  Caller checks this when it has something to write, so time from the first busy answer to
+  the end of erase is counted as time the device waited for erase.
+
+  @return  OS_TRUE if erase is still running, OS_FALSE if flash is free.
+
+****************************************************************************************************
+*/
+os_boolean flashes_is_busy(void)
+{
+    return flashes_sim_erase_running(OS_TRUE);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Read data from flash bank.
+  @anchor flashes_read
+
+  The flashes_read() function copies data from bank image to buffer.
+
+  @param   addr Flash address, as for flashes_write().
+  @param   buf Buffer where to store the data.
+  @param   nbytes Number of bytes to read.
+  @param   bank2 OS_FALSE to read bank1, OS_TRUE to read bank 2.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_read(
+    os_uint addr,
+    os_uchar *buf,
+    os_uint nbytes,
+    os_boolean bank2)
+{
+    osalStatus s;
+
+    s = flashes_sim_open();
+    if (s) return s;
+    s = flashes_sim_check_range(addr, nbytes);
+    if (s) return s;
+
+    os_memcpy(buf, flsim.bank[bank2 ? 1 : 0] + addr, nbytes);
+    return OSAL_SUCCESS;
+}
+
 
-  The flash_is_bank2_selected() function checks if we are currently running from flash bank 2.
+/**
+****************************************************************************************************
+
+  @brief Check which bank is currently selected?
+  @anchor flashes_is_bank2_selected
 
-  Option bit FLASH_OPTCR_BFB2 bit is "boot from bank 2".
+  The flashes_is_bank2_selected() function checks if we are currently running from flash bank 2.
 
   @return  OS_TRUE if running from bank 2, OS_FALSE if running from bank 1.
 
 ****************************************************************************************************
 */
-os_boolean flash_is_bank2_selected(void)
+os_boolean flashes_is_bank2_selected(void)
 {
-    osal_console_write("check for selected bank, bank 1 returned\n");
-    return OS_FALSE;
+    if (flashes_sim_open()) return OS_FALSE;
+
+    FLASHES_TRACE(1, FLASHES_TRACE_BANK_QUERY, flsim.running_bank2, 0);
+    return flsim.running_bank2;
 }
 
 
@@ -90,18 +642,680 @@ os_boolean flash_is_bank2_selected(void)
 ****************************************************************************************************
 
   @brief Set bank to boot from and reboot.
-  @anchor flash_select_bank
+  @anchor flashes_select_bank
 
-  The flash_is_bank2_selected() function checks if we are currently running from flash bank 2.
+  The flashes_select_bank() function writes boot bank to option file and flushes bank images
+  to disk. The osal_reboot() does not restart the process on Linux, so the reset which
+  follows is simulated here: The selected bank becomes the bank we are running from.
 
   @param   bank2 OS_TRUE to select flash bank 2, or OS_FALSE to select bank 1.
   @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
 
 ****************************************************************************************************
 */
-osalStatus flash_select_bank(
+osalStatus flashes_select_bank(
+    os_boolean bank2)
+{
+    os_char path[300];
+    os_uchar option;
+    os_int i;
+    int fd;
+    osalStatus s;
+
+    s = flashes_sim_open();
+    if (s) return s;
+
+    for (i = 0; i < 2; i++)
+    {
+        msync(flsim.bank[i], FLASHES_BANK_SIZE, MS_SYNC);
+    }
+
+    option = bank2 ? 1 : 0;
+    flashes_sim_make_path(path, sizeof(path), "flashes_option.bin");
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, &option, 1) != 1)
+    {
+        if (fd >= 0) close(fd);
+        osal_debug_error("writing flash option file failed");
+        return OSAL_STATUS_FAILED;
+    }
+    close(fd);
+
+    flsim.running_bank2 = bank2 ? OS_TRUE : OS_FALSE;
+    flsim.jump_reported = OS_FALSE;
+
+    FLASHES_TRACE(1, FLASHES_TRACE_SELECT_BANK, bank2, 0);
+
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Start user application.
+  @anchor flashes_jump_to_application
+
+  The flashes_jump_to_application() function cannot start the image on Linux. It only
+  reports once which bank would be started.
+
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_jump_to_application(void)
+{
+    if (flsim.jump_reported) return;
+    flsim.jump_reported = OS_TRUE;
+    osal_console_write(flsim.running_bank2
+        ? "jump to application in bank 2\n" : "jump to application in bank 1\n");
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Save transfer progress record so that it survives reboot.
+  @anchor flashes_save_progress
+
+  The flashes_save_progress() function writes progress record to "flashes_progress.bin" in
+  simulation directory, so it is kept when the process is restarted.
+
+  @param   progress Progress record to save.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_save_progress(
+    const flashesProgress *progress)
+{
+    os_char path[300];
+    int fd;
+    osalStatus s;
+
+    s = flashes_sim_open();
+    if (s) return s;
+
+    flashes_sim_make_path(path, sizeof(path), "flashes_progress.bin");
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0 || pwrite(fd, progress, sizeof(flashesProgress), 0) != sizeof(flashesProgress))
+    {
+        if (fd >= 0) close(fd);
+        osal_debug_error("writing progress file failed");
+        return OSAL_STATUS_FAILED;
+    }
+    close(fd);
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Load transfer progress record.
+  @anchor flashes_load_progress
+
+  @param   progress Where to store the progress record.
+  @return  OSAL_SUCCESS (0) if all is fine. OSAL_STATUS_FAILED if there is no saved record.
+
+****************************************************************************************************
+*/
+osalStatus flashes_load_progress(
+    flashesProgress *progress)
+{
+    os_char path[300];
+    int fd;
+    ssize_t n;
+    osalStatus s;
+
+    os_memclear(progress, sizeof(flashesProgress));
+    s = flashes_sim_open();
+    if (s) return s;
+
+    flashes_sim_make_path(path, sizeof(path), "flashes_progress.bin");
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return OSAL_STATUS_FAILED;
+    n = read(fd, progress, sizeof(flashesProgress));
+    close(fd);
+    return n == sizeof(flashesProgress) ? OSAL_SUCCESS : OSAL_STATUS_FAILED;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Ask boot loader to stay listening after next reboot.
+  @anchor flashes_request_loader
+
+  The flashes_request_loader() function creates "flashes_loader.bin" in simulation directory,
+  or removes it to cancel the request. The file plays the backup SRAM flag word of the
+  microcontroller version.
+
+  @param   enable OS_TRUE to request, OS_FALSE to cancel the request.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_request_loader(
+    os_boolean enable)
+{
+    os_char path[300];
+    os_uint magic;
+    int fd;
+    osalStatus s;
+
+    s = flashes_sim_open();
+    if (s) return s;
+
+    flashes_sim_make_path(path, sizeof(path), "flashes_loader.bin");
+    if (!enable)
+    {
+        unlink(path);
+        return OSAL_SUCCESS;
+    }
+
+    magic = FLASHES_LOADER_REQUEST_MAGIC;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, &magic, sizeof(magic)) != sizeof(magic))
+    {
+        if (fd >= 0) close(fd);
+        osal_debug_error("writing loader request file failed");
+        return OSAL_STATUS_FAILED;
+    }
+    close(fd);
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Check and clear boot loader request.
+  @anchor flashes_take_loader_request
+
+  @return  OS_TRUE if staying in boot loader was requested.
+
+****************************************************************************************************
+*/
+os_boolean flashes_take_loader_request(void)
+{
+    os_char path[300];
+    os_uint magic;
+    int fd;
+    ssize_t n;
+
+    if (flashes_sim_open()) return OS_FALSE;
+
+    flashes_sim_make_path(path, sizeof(path), "flashes_loader.bin");
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return OS_FALSE;
+    magic = 0;
+    n = read(fd, &magic, sizeof(magic));
+    close(fd);
+    unlink(path);
+    return (os_boolean)(n == sizeof(magic) && magic == FLASHES_LOADER_REQUEST_MAGIC);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Save record of installed image so that it survives reboot.
+  @anchor flashes_save_image_info
+
+  The flashes_save_image_info() function writes the record to "flashes_image.bin" in
+  simulation directory.
+
+  @param   info Image record to save.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+osalStatus flashes_save_image_info(
+    const flashesImageInfo *info)
+{
+    os_char path[300];
+    int fd;
+    osalStatus s;
+
+    s = flashes_sim_open();
+    if (s) return s;
+
+    flashes_sim_make_path(path, sizeof(path), "flashes_image.bin");
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0 || pwrite(fd, info, sizeof(flashesImageInfo), 0) != sizeof(flashesImageInfo))
+    {
+        if (fd >= 0) close(fd);
+        osal_debug_error("writing image info file failed");
+        return OSAL_STATUS_FAILED;
+    }
+    close(fd);
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Load record of installed image.
+  @anchor flashes_load_image_info
+
+  @param   info Where to store the image record.
+  @return  OSAL_SUCCESS (0) if all is fine. OSAL_STATUS_FAILED if there is no saved record.
+
+****************************************************************************************************
+*/
+osalStatus flashes_load_image_info(
+    flashesImageInfo *info)
+{
+    os_char path[300];
+    int fd;
+    ssize_t n;
+    osalStatus s;
+
+    os_memclear(info, sizeof(flashesImageInfo));
+    s = flashes_sim_open();
+    if (s) return s;
+
+    flashes_sim_make_path(path, sizeof(path), "flashes_image.bin");
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return OSAL_STATUS_FAILED;
+    n = read(fd, info, sizeof(flashesImageInfo));
+    close(fd);
+    return n == sizeof(flashesImageInfo) ? OSAL_SUCCESS : OSAL_STATUS_FAILED;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get unique id of the device.
+  @anchor flashes_get_device_id
+
+  The flashes_get_device_id() function makes id from host id and CRC-32 of the absolute path
+  to simulation directory. Simulated devices with different directories get different ids,
+  and the id stays the same when the process is restarted.
+
+  @param   id Buffer for FLASHES_DEVICE_ID_SZ bytes.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_get_device_id(
+    os_uchar *id)
+{
+    os_char *dir;
+    os_uint host, crc;
+    os_int i;
+
+    flashes_sim_open();
+    host = (os_uint)gethostid();
+    dir = realpath(flsim.config.dir ? flsim.config.dir : FLASHES_SIM_DEFAULT_DIR, OS_NULL);
+    crc = dir ? flashes_crc32(FLASHES_CRC32_INIT, (const os_uchar*)dir, os_strlen(dir) - 1) : 0;
+    free(dir);
+
+    os_memclear(id, FLASHES_DEVICE_ID_SZ);
+    for (i = 0; i < 4; i++)
+    {
+        id[i] = (os_uchar)(host >> (8 * i));
+        id[4 + i] = (os_uchar)(crc >> (8 * i));
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Set up simulation, if not done already.
+  @anchor flashes_sim_open
+
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_sim_open(void)
+{
+    if (flsim.bank[0]) return OSAL_SUCCESS;
+    return flashes_sim_setup(OS_NULL);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Map bank image file to memory.
+  @anchor flashes_sim_map_bank
+
+  The flashes_sim_map_bank() function opens bank image file, or creates it filled with erased
+  value, and maps it to memory. Shared mapping writes changes to the file.
+
+  @param   bank2 OS_FALSE for bank 1, OS_TRUE for bank 2.
+  @return  Pointer to mapped image, OS_NULL if failed.
+
+****************************************************************************************************
+*/
+static os_uchar *flashes_sim_map_bank(
     os_boolean bank2)
 {
-    osal_console_write(bank2 ? "bank 2 selected\n" : "bank 1 selected\n");
+    os_char path[300];
+    os_uchar *p;
+    off_t sz;
+    int fd;
+    os_boolean created;
+
+    flashes_sim_make_path(path, sizeof(path), bank2 ? "flashes_bank2.bin" : "flashes_bank1.bin");
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        osal_debug_error("opening flash bank image failed");
+        return OS_NULL;
+    }
+
+    sz = lseek(fd, 0, SEEK_END);
+    created = (sz < FLASHES_BANK_SIZE) ? OS_TRUE : OS_FALSE;
+    if (sz != FLASHES_BANK_SIZE && ftruncate(fd, FLASHES_BANK_SIZE))
+    {
+        close(fd);
+        osal_debug_error("sizing flash bank image failed");
+        return OS_NULL;
+    }
+
+    p = (os_uchar*)mmap(NULL, FLASHES_BANK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == (os_uchar*)MAP_FAILED)
+    {
+        osal_debug_error("mapping flash bank image failed");
+        return OS_NULL;
+    }
+
+    /* New or too short file: Erase the added part.
+     */
+    if (created)
+    {
+        memset(p + sz, FLASHES_ERASED_BYTE, FLASHES_BANK_SIZE - sz);
+    }
+    return p;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Make path to simulation file.
+  @anchor flashes_sim_make_path
+
+  @param   path Buffer for path.
+  @param   path_sz Buffer size, bytes.
+  @param   name File name.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_sim_make_path(
+    os_char *path,
+    os_memsz path_sz,
+    const os_char *name)
+{
+    os_strncpy(path, flsim.dir, path_sz);
+    os_strncat(path, "/", path_sz);
+    os_strncat(path, name, path_sz);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Check that address range is within bank.
+  @anchor flashes_sim_check_range
+
+  @param   addr Address within bank.
+  @param   nbytes Number of bytes.
+  @return  OSAL_SUCCESS if range is within bank, OSAL_STATUS_FAILED if not.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_sim_check_range(
+    os_uint addr,
+    os_uint nbytes)
+{
+    if (addr > FLASHES_BANK_SIZE || nbytes > FLASHES_BANK_SIZE - addr)
+    {
+        osal_debug_error("flash address out of bank");
+        return OSAL_STATUS_FAILED;
+    }
     return OSAL_SUCCESS;
 }
+
+
+/**
+****************************************************************************************************
+
+  @brief Get sector number by address.
+  @anchor flashes_get_sector
+
+  The flashes_get_sector() function converts address within bank to sector number, numbered
+  like STM32F429 sectors: Bank 1 is 0 - 11 and bank 2 is 12 - 23.
+
+  @param   addr Address within bank.
+  @param   bank2 OS_FALSE for bank 1, OS_TRUE for bank 2.
+  @return  Sector number for the given address.
+
+****************************************************************************************************
+*/
+static os_uint flashes_get_sector(
+    os_uint addr,
+    os_boolean bank2)
+{
+    os_uint sector;
+
+    sector = 0;
+    while (sector < FLASHES_SIM_SECTORS_PER_BANK - 1 && addr >= flashes_sim_sector_offs[sector + 1])
+    {
+        sector++;
+    }
+
+    return bank2 ? FIRST_BANK_2_SECTOR + sector : sector;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Erase sector in bank image.
+  @anchor flashes_sim_erase_sector
+
+  @param   sector Sector number, 0 - 23.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_sim_erase_sector(
+    os_uint sector)
+{
+    os_uchar *bank;
+
+    flsim.stats.erase_us += flashes_sim_erase_time_us(sector);
+    flsim.stats.erased_sectors++;
+
+    bank = flsim.bank[sector >= FIRST_BANK_2_SECTOR ? 1 : 0];
+    sector %= FIRST_BANK_2_SECTOR;
+    memset(bank + flashes_sim_sector_offs[sector], FLASHES_ERASED_BYTE,
+        flashes_sim_sector_offs[sector + 1] - flashes_sim_sector_offs[sector]);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Check if sector in bank image is already erased.
+  @anchor flashes_sim_is_sector_blank
+
+  The flashes_sim_is_sector_blank() function checks the sector 64 bits at a time. The loop
+  has no early exit inside a 64 byte block, so compiler can vectorize it.
+
+  @param   sector Sector number, 0 - 23.
+  @return  OS_TRUE if all bytes of the sector are FLASHES_ERASED_BYTE.
+
+****************************************************************************************************
+*/
+static os_boolean flashes_sim_is_sector_blank(
+    os_uint sector)
+{
+    const uint64_t *p, *e;
+    uint64_t v;
+    os_int i;
+
+    p = (const uint64_t*)(flsim.bank[sector >= FIRST_BANK_2_SECTOR ? 1 : 0]
+        + flashes_sim_sector_offs[sector % FIRST_BANK_2_SECTOR]);
+    e = p + (flashes_sim_sector_offs[sector % FIRST_BANK_2_SECTOR + 1]
+        - flashes_sim_sector_offs[sector % FIRST_BANK_2_SECTOR]) / sizeof(uint64_t);
+
+    for (; p < e; p += 8)
+    {
+        v = ~(uint64_t)0;
+        for (i = 0; i < 8; i++) v &= p[i];
+        if (v != ~(uint64_t)0) return OS_FALSE;
+    }
+    return OS_TRUE;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get time to erase sector.
+  @anchor flashes_sim_erase_time_us
+
+  @param   sector Sector number, 0 - 23.
+  @return  Erase time in microseconds, 0 if timing is not simulated.
+
+****************************************************************************************************
+*/
+static os_long flashes_sim_erase_time_us(
+    os_uint sector)
+{
+    os_uint kb;
+
+    if (!flsim.config.timing) return 0;
+    sector %= FIRST_BANK_2_SECTOR;
+    kb = (flashes_sim_sector_offs[sector + 1] - flashes_sim_sector_offs[sector]) / 1024;
+    return flsim.config.erase_base_us + flsim.config.erase_us_per_kb * kb;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Check if background erase is running.
+  @anchor flashes_sim_erase_running
+
+  The flashes_sim_erase_running() function completes background erase once its time has
+  passed, and keeps count of time callers waited for it.
+
+  @param   waiting OS_TRUE if caller waits for the erase to complete, OS_FALSE if only checking.
+  @return  OS_TRUE if erase is still running, OS_FALSE if flash is free.
+
+****************************************************************************************************
+*/
+static os_boolean flashes_sim_erase_running(
+    os_boolean waiting)
+{
+    os_long now;
+
+    if (flsim.erasing_sector < 0) return OS_FALSE;
+    now = flashes_sim_now_us();
+    if (now < flsim.erase_done_us)
+    {
+        if (waiting && flsim.erase_wait_start_us == 0) flsim.erase_wait_start_us = now;
+        return OS_TRUE;
+    }
+
+    flashes_sim_erase_sector((os_uint)flsim.erasing_sector);
+    FLASHES_TRACE(2, FLASHES_TRACE_ERASE_DONE, flsim.erasing_sector, 0);
+    flsim.erasing_sector = -1;
+    FLASHES_STATS_END(FLASHES_STAT_ERASE, flsim.erase_start);
+    if (flsim.erase_wait_start_us)
+    {
+        flsim.stats.erase_wait_us += flsim.erase_done_us - flsim.erase_wait_start_us;
+    }
+    return OS_FALSE;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get cycle counter value.
+  @anchor flashes_stats_cycles
+
+  Linux has no cycle counter we could read portably, so monotonic clock in microseconds is used
+  instead. Only the low 32 bits are returned, differences are still correct.
+
+  @return  Time in microseconds.
+
+****************************************************************************************************
+*/
+os_uint flashes_stats_cycles(void)
+{
+    return (os_uint)flashes_sim_now_us();
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get number of cycle counter ticks per microsecond.
+  @anchor flashes_stats_cycles_per_us
+
+  @return  Always 1, flashes_stats_cycles() counts microseconds.
+
+****************************************************************************************************
+*/
+os_uint flashes_stats_cycles_per_us(void)
+{
+    return 1;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get monotonic time.
+  @anchor flashes_sim_now_us
+
+  @return  Time in microseconds.
+
+****************************************************************************************************
+*/
+static os_long flashes_sim_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (os_long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Block until given time.
+  @anchor flashes_sim_wait_until
+
+  The flashes_sim_wait_until() function sleeps, as CPU would wait for flash operation.
+
+  @param   t_us Time to wait for, from flashes_sim_now_us().
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_sim_wait_until(
+    os_long t_us)
+{
+    os_long now;
+
+    while ((now = flashes_sim_now_us()) < t_us)
+    {
+        usleep((useconds_t)(t_us - now));
+    }
+}
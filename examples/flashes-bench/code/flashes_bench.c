@@ -0,0 +1,275 @@
+/**
+
+  @file    flashes_bench.c
+  @brief   Benchmark for flashes library.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Measures how well program binaries compress for transfer, how long compression and
+  decompression take, and estimates end to end transfer time with and without compression.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashit.h"
+
+/* Measure each operation repeatedly for at least this long, ms.
+ */
+#define FLASHES_BENCH_MIN_TIME_MS 200
+
+/* Default link speed for transfer time estimate, Mbit/s.
+ */
+#define FLASHES_BENCH_DEFAULT_MBPS 10
+
+static osalStatus flashes_bench_compress(
+    const os_char *path,
+    os_int mbps);
+
+static os_long flashes_bench_decompress(
+    const os_uchar *data,
+    os_memsz data_sz,
+    os_memsz image_sz);
+
+static void flashes_bench_print(
+    const os_char *label,
+    os_long x,
+    const os_char *unit);
+
+
+/**
+****************************************************************************************************
+
+  @brief Benchmark program main function.
+
+  The osal_main() function is OS independent entry point. Each binary file given as argument
+  is compressed and decompressed as flashit and the device would do it. Decompression runs
+  the device decoder into one transfer block buffer at a time, like flashes_socket.c, but on
+  this computer, so on microcontroller it takes longer in proportion to clock speed.
+
+  @param   argc Number of command line arguments.
+  @param   argv Array of string pointers, one for each command line argument. UTF8 encoded.
+
+  @return  0 if all is fine, 1 if benchmark failed.
+
+****************************************************************************************************
+*/
+os_int osal_main(
+    os_int argc,
+    os_char *argv[])
+{
+    os_int i, mbps, nfiles;
+
+    mbps = FLASHES_BENCH_DEFAULT_MBPS;
+    nfiles = 0;
+    for (i = 1; i < argc; i++)
+    {
+        if (argv[i][0] == '-')
+        {
+            if (!os_strncmp(argv[i], "-mbps=", 6))
+            {
+                mbps = (os_int)osal_str_to_int(argv[i] + 6, OS_NULL);
+                if (mbps < 1) goto showhelp;
+            }
+            else goto showhelp;
+            continue;
+        }
+        nfiles++;
+    }
+    if (nfiles == 0) goto showhelp;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (argv[i][0] == '-') continue;
+        if (flashes_bench_compress(argv[i], mbps)) return 1;
+    }
+    return 0;
+
+showhelp:
+    osal_console_write("flashes-bench [-mbps=10] program.bin ...\n");
+    osal_console_write("  -mbps=N  link speed for transfer time estimate, Mbit/s\n");
+    return 1;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Benchmark compression of one binary.
+  @anchor flashes_bench_compress
+
+  The flashes_bench_compress() function compresses the binary, verifies that it decompresses
+  back to the original and prints compression ratio, compression and decompression time per
+  run, and estimated end to end time to transfer the binary raw and compressed.
+
+  @param   path Path to binary file.
+  @param   mbps Link speed, Mbit/s.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate that the file could not be read
+           or decompressed data didn't match.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_bench_compress(
+    const os_char *path,
+    os_int mbps)
+{
+    static flashesLzEncoder e;
+    os_uchar *image = OS_NULL, *packed = OS_NULL;
+    os_memsz image_sz, image_alloc, packed_sz = 0, packed_alloc = 0;
+    os_timer start, now;
+    os_long nruns, compress_us, decompress_us, raw_us, packed_us, permille;
+    os_char nbuf[32];
+    osalStatus s = OSAL_STATUS_FAILED;
+
+    image = flashit_load_file(path, &image_sz, &image_alloc);
+    if (image == OS_NULL)
+    {
+        osal_console_write("reading file failed: ");
+        osal_console_write(path);
+        osal_console_write("\n");
+        return OSAL_STATUS_FAILED;
+    }
+    packed = (os_uchar*)os_malloc(FLASHES_LZ_MAX_COMPRESSED_SZ(image_sz), &packed_alloc);
+    if (packed == OS_NULL) goto getout;
+
+    /* Compress repeatedly to get measurable time.
+     */
+    nruns = 0;
+    os_get_timer(&start);
+    do
+    {
+        packed_sz = flashes_lz_compress(&e, image, image_sz, packed, packed_alloc);
+        nruns++;
+        os_get_timer(&now);
+    }
+    while (now - start < FLASHES_BENCH_MIN_TIME_MS);
+    compress_us = 1000 * (now - start) / nruns;
+    if (packed_sz == 0 && image_sz) goto getout;
+
+    /* Decompress and verify.
+     */
+    decompress_us = flashes_bench_decompress(packed, packed_sz, image_sz);
+    if (decompress_us < 0)
+    {
+        osal_console_write("decompression failed\n");
+        goto getout;
+    }
+
+    /* Time on wire, not counting frame headers.
+     */
+    raw_us = (os_long)image_sz * 8 / mbps;
+    packed_us = (os_long)packed_sz * 8 / mbps;
+    permille = image_sz ? (os_long)packed_sz * 1000 / image_sz : 1000;
+
+    osal_console_write(path);
+    osal_console_write("\n");
+    flashes_bench_print("  size", image_sz, " bytes\n");
+    flashes_bench_print("  compressed", packed_sz, " bytes, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), permille / 10);
+    osal_console_write(nbuf);
+    osal_console_write(".");
+    osal_int_to_string(nbuf, sizeof(nbuf), permille % 10);
+    osal_console_write(nbuf);
+    osal_console_write("% of original\n");
+    flashes_bench_print("  compress", compress_us, " us\n");
+    flashes_bench_print("  decompress", decompress_us, " us\n");
+    flashes_bench_print("  end to end raw", raw_us, " us\n");
+    flashes_bench_print("  end to end compressed", compress_us + packed_us + decompress_us, " us\n");
+    s = OSAL_SUCCESS;
+
+getout:
+    if (packed) os_free(packed, packed_alloc);
+    os_free(image, image_alloc);
+    return s;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Decompress as the device does and verify.
+  @anchor flashes_bench_decompress
+
+  The flashes_bench_decompress() function feeds compressed data to the decoder in transfer
+  block size pieces, and collects output one block at a time, repeatedly to measure time.
+  Total output size is checked.
+
+  @param   data Compressed data.
+  @param   data_sz Compressed data size, bytes.
+  @param   image_sz Original size, bytes.
+  @return  Time per run in microseconds, -1 if decompression failed.
+
+****************************************************************************************************
+*/
+static os_long flashes_bench_decompress(
+    const os_uchar *data,
+    os_memsz data_sz,
+    os_memsz image_sz)
+{
+    static flashesLz lz;
+    os_uchar out[FLASHES_TRANSFER_BLOCK_SIZE];
+    os_memsz pos, total;
+    os_uint n, used, out_n;
+    os_timer start, now;
+    os_long nruns;
+
+    nruns = 0;
+    os_get_timer(&start);
+    do
+    {
+        flashes_lz_init(&lz);
+        pos = total = 0;
+        out_n = 0;
+        while (OS_TRUE)
+        {
+            n = (os_uint)(data_sz - pos);
+            if (n > FLASHES_TRANSFER_BLOCK_SIZE) n = FLASHES_TRANSFER_BLOCK_SIZE;
+            if (flashes_lz_decode(&lz, data + pos, n, &used, out, sizeof(out), &out_n)) return -1;
+            pos += used;
+            if (out_n == sizeof(out) || pos == data_sz)
+            {
+                total += out_n;
+                if (out_n < sizeof(out) && pos == data_sz) break;
+                out_n = 0;
+            }
+        }
+        if (total != image_sz || !flashes_lz_is_complete(&lz)) return -1;
+        nruns++;
+        os_get_timer(&now);
+    }
+    while (now - start < FLASHES_BENCH_MIN_TIME_MS);
+
+    return 1000 * (now - start) / nruns;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Print labeled number.
+  @anchor flashes_bench_print
+
+  @param   label Text before number.
+  @param   x Number to print.
+  @param   unit Text after number.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_bench_print(
+    const os_char *label,
+    os_long x,
+    const os_char *unit)
+{
+    os_char nbuf[32];
+
+    osal_console_write(label);
+    osal_console_write(" ");
+    osal_int_to_string(nbuf, sizeof(nbuf), x);
+    osal_console_write(nbuf);
+    osal_console_write(unit);
+}
@@ -0,0 +1,426 @@
+/**
+
+  @file    flashes_gateway.c
+  @brief   Store-and-forward gateway which updates devices of a site.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  The gateway runs on a Linux computer at a site, on the same network with the devices. To the
+  sender it looks like one device: It runs the device side of flashes library, like the
+  mcu-flashes example, in a thread against simulated flash, see code/linux/flashes_sim.h. So all
+  transfer features work over the uplink, including resume, deduplication and delta patch
+  against the image the gateway got last time.
+
+  Once the transfer completes, the image is stored in cache directory, named by its size and
+  CRC-32, and the main thread updates devices listed in the site manifest concurrently with
+  flashit fleet code, see flashit_fleet.c. The uplink carries one image per site instead of
+  one per device. The sender asks result with FLASHES_FRAME_REPORT queries, "flashit -g", and
+  the gateway answers with number of devices updated and failed, see flashes_protocol.h.
+
+  The manifest is read again for every update, so devices can be added without restarting
+  the gateway. If a new image arrives while the previous one is being distributed, the new
+  one is distributed next and the earlier report is replaced.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashit.h"
+#include "code/linux/flashes_sim.h"
+
+#include <stdio.h>
+
+/* Default number of devices updated at the same time.
+ */
+#define FLASHES_GATEWAY_DEFAULT_CONCURRENCY 16
+
+/* Upstream thread sleeps this long between flashes_socket_loop() calls, ms. This keeps the
+   gateway idle when nothing is transferred. Each call receives all frames which have arrived,
+   as many as there are receive buffers, and programs up to its work budget, two blocks by
+   default. So this allows about 2 MB/s over the uplink, which is plenty for a site link.
+ */
+#define FLASHES_GATEWAY_LOOP_SLEEP_MS 1
+
+/* How often main thread checks for new image to distribute, ms.
+ */
+#define FLASHES_GATEWAY_POLL_MS 100
+
+/* Path buffer size.
+ */
+#define FLASHES_GATEWAY_PATH_SZ 512
+
+/** State shared by upstream thread, which receives images, and main thread, which
+    distributes them.
+ */
+typedef struct
+{
+    /* Protects everything below.
+     */
+    osalMutex lock;
+
+    /* Cached image to distribute next, empty string if none.
+     */
+    os_char pending[FLASHES_GATEWAY_PATH_SZ];
+
+    /* Report to the sender, failed devices as text, and when distribution of the image
+       started.
+     */
+    flashesReport report;
+    os_char text[FLASHES_REPORT_TEXT_MAX];
+    os_timer start;
+}
+flashesGateway;
+
+static flashesGateway gw;
+
+/* Directory of bank files and cached images.
+ */
+static const os_char *flashes_gateway_dir;
+
+static void flashes_gateway_upstream(
+    void *prm,
+    osalEvent done);
+
+static void flashes_gateway_store(
+    os_boolean bank2);
+
+static osalStatus flashes_gateway_write_file(
+    const os_char *path,
+    const os_uchar *data,
+    os_memsz data_sz);
+
+static void flashes_gateway_report(
+    flashesReport *report,
+    os_char *text,
+    os_memsz text_sz);
+
+
+/**
+****************************************************************************************************
+
+  @brief Gateway main function.
+
+  The osal_main() function is OS independent entry point. It sets up simulated flash in the
+  cache directory, starts upstream thread and then distributes each image received to devices
+  of the site. Runs until killed.
+
+  @param   argc Number of command line arguments.
+  @param   argv Array of string pointers, one for each command line argument. UTF8 encoded.
+
+  @return  1 if the gateway could not be started.
+
+****************************************************************************************************
+*/
+os_int osal_main(
+    os_int argc,
+    os_char *argv[])
+{
+    flashesSimConfig config;
+    flashitOptions opt;
+    flashitFleetSummary summary;
+    const os_char *manifest;
+    os_char path[FLASHES_GATEWAY_PATH_SZ];
+    os_int i, max_concurrent;
+
+    flashes_sim_default_config(&config);
+    os_memclear(&opt, sizeof(opt));
+    opt.window = FLASHES_DEFAULT_WINDOW;
+    manifest = OS_NULL;
+    max_concurrent = FLASHES_GATEWAY_DEFAULT_CONCURRENCY;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!os_strncmp(argv[i], "-f=", 3)) manifest = argv[i] + 3;
+        else if (!os_strncmp(argv[i], "-dir=", 5)) config.dir = argv[i] + 5;
+        else if (!os_strncmp(argv[i], "-j=", 3))
+        {
+            max_concurrent = (os_int)osal_str_to_int(argv[i] + 3, OS_NULL);
+            if (max_concurrent < 1) goto showhelp;
+        }
+        else if (!os_strncmp(argv[i], "-w=", 3))
+        {
+            opt.window = (os_int)osal_str_to_int(argv[i] + 3, OS_NULL);
+            if (opt.window < 1 || opt.window > FLASHES_MAX_WINDOW) goto showhelp;
+        }
+        else if (!os_strncmp(argv[i], "-d", 3)) opt.dedupe = OS_TRUE;
+        else if (!os_strncmp(argv[i], "-s", 3)) opt.sparse = OS_TRUE;
+        else if (!os_strncmp(argv[i], "-z", 3)) opt.compress = OS_TRUE;
+        else if (!os_strncmp(argv[i], "-r", 2))
+        {
+            opt.resume = OS_TRUE;
+            if (argv[i][2] == '=')
+            {
+                opt.retries = (os_int)osal_str_to_int(argv[i] + 3, OS_NULL);
+                if (opt.retries < 0) goto showhelp;
+            }
+            else if (argv[i][2] != '\0') goto showhelp;
+        }
+        else goto showhelp;
+    }
+    if (manifest == OS_NULL) goto showhelp;
+    if (opt.compress && opt.window == 1) goto showhelp;
+
+    /* Bank files are only a place to receive into, erase and program take no time.
+     */
+    config.timing = OS_FALSE;
+    flashes_gateway_dir = config.dir;
+    if (flashes_sim_setup(&config))
+    {
+        osal_console_write("flash simulation setup failed\n");
+        return 1;
+    }
+
+    os_memclear(&gw, sizeof(gw));
+    gw.lock = osal_mutex_create();
+    osal_thread_create(flashes_gateway_upstream, OS_NULL, OS_NULL, OSAL_THREAD_DETACHED);
+
+    while (OS_TRUE)
+    {
+        /* Take the newest image received.
+         */
+        osal_mutex_lock(gw.lock);
+        os_strncpy(path, gw.pending, sizeof(path));
+        gw.pending[0] = '\0';
+        osal_mutex_unlock(gw.lock);
+        if (path[0] == '\0')
+        {
+            os_sleep(FLASHES_GATEWAY_POLL_MS);
+            continue;
+        }
+
+        flashit_fleet(manifest, path, &opt, max_concurrent, &summary);
+
+        /* Report result, unless newer image arrived meanwhile and report is about that one.
+         */
+        osal_mutex_lock(gw.lock);
+        if (gw.pending[0] == '\0')
+        {
+            gw.report.state = FLASHES_REPORT_DONE;
+            gw.report.ndevices = (os_ushort)summary.ndevices;
+            gw.report.nok = (os_ushort)summary.nok;
+            gw.report.nfailed = (os_ushort)summary.nfailed;
+            gw.report.time_ms = (os_uint)summary.total_ms;
+            os_strncpy(gw.text, summary.ndevices ? summary.failed
+                : "reading manifest or binaries failed\n", sizeof(gw.text));
+        }
+        osal_mutex_unlock(gw.lock);
+    }
+    return 0;
+
+showhelp:
+    osal_console_write("flashes-gateway -f=devices.txt [-dir=.] [-j=16] [-w=8] [-d] [-s] [-z] [-r=N]\n");
+    osal_console_write("  -f=F    devices of the site, one \"address [program.bin]\" per line\n");
+    osal_console_write("  -dir=D  directory for bank files and cached images\n");
+    osal_console_write("  -j=N    number of devices updated at the same time\n");
+    osal_console_write("  -w=N    number of blocks in flight, 1 = stop and wait protocol\n");
+    osal_console_write("  -d      copy blocks which device already has in running image\n");
+    osal_console_write("  -s      skip areas of erased flash value 0xFF\n");
+    osal_console_write("  -z      send binary compressed\n");
+    osal_console_write("  -r=N    resume interrupted transfer, reconnect up to N times\n");
+    return 1;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Upstream thread.
+  @anchor flashes_gateway_upstream
+
+  The flashes_gateway_upstream() function receives images from the sender, like main loop of
+  mcu-flashes example, and answers report queries. Completed transfer switches the boot bank
+  of simulated flash, so a bank switch tells that there is a new image to store and
+  distribute. This is checked right after flashes_socket_loop() call which completed the
+  transfer, before next connection can be accepted, so the sender's report query always
+  sees the new image.
+
+  @param   prm Not used.
+  @param   done Event to set once thread has started and is listening.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_gateway_upstream(
+    void *prm,
+    osalEvent done)
+{
+    os_boolean bank2;
+
+    /* Report function puts the library in gateway mode, so the gateway doesn't answer
+       discovery or multicast on the site network as if it was one of the devices.
+     */
+    flashes_socket_set_report_func(flashes_gateway_report);
+    flashes_socket_setup();
+    bank2 = flashes_is_bank2_selected();
+    osal_event_set(done);
+
+    while (OS_TRUE)
+    {
+        flashes_socket_loop();
+        if (flashes_is_bank2_selected() != bank2)
+        {
+            bank2 = !bank2;
+            flashes_gateway_store(bank2);
+        }
+        os_sleep(FLASHES_GATEWAY_LOOP_SLEEP_MS);
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Store received image in cache and queue it for distribution.
+  @anchor flashes_gateway_store
+
+  The flashes_gateway_store() function copies the image from bank file to cache directory as
+  "flashes-<crc>-<size>.bin". Size and CRC-32 come from the installed image record, which
+  flashes_socket.c writes on completion. If the cache has this image already, it is not
+  written again. The image is checked against its CRC-32 before it is distributed.
+
+  @param   bank2 OS_TRUE if the image is in bank 2.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_gateway_store(
+    os_boolean bank2)
+{
+    static const os_char hex[] = "0123456789abcdef";
+    os_char path[FLASHES_GATEWAY_PATH_SZ], nbuf[32];
+    os_uchar *image = OS_NULL, *cached;
+    os_memsz image_alloc, cached_sz;
+    os_uint image_size, image_crc;
+    os_int i;
+    os_boolean intact;
+
+    if (flashes_discovery_get_image(&image_size, &image_crc))
+    {
+        osal_debug_error("gateway: no record of received image");
+        return;
+    }
+
+    os_strncpy(path, flashes_gateway_dir, sizeof(path));
+    os_strncat(path, "/flashes-", sizeof(path));
+    for (i = 0; i < 8; i++) nbuf[i] = hex[(image_crc >> (28 - 4 * i)) & 15];
+    nbuf[i] = '\0';
+    os_strncat(path, nbuf, sizeof(path));
+    os_strncat(path, "-", sizeof(path));
+    osal_int_to_string(nbuf, sizeof(nbuf), image_size);
+    os_strncat(path, nbuf, sizeof(path));
+    os_strncat(path, ".bin", sizeof(path));
+
+    /* Use cached image if it is there and intact.
+     */
+    cached = flashit_map_file(path, &cached_sz);
+    if (cached)
+    {
+        intact = (os_boolean)(cached_sz == image_size &&
+            flashes_crc32(FLASHES_CRC32_INIT, cached, cached_sz) == image_crc);
+        flashit_unmap_file(cached, cached_sz);
+        if (intact) goto queue;
+    }
+
+    image = (os_uchar*)os_malloc(image_size, &image_alloc);
+    if (image == OS_NULL) return;
+    if (flashes_read(0, image, image_size, bank2) ||
+        flashes_crc32(FLASHES_CRC32_INIT, image, image_size) != image_crc ||
+        flashes_gateway_write_file(path, image, image_size))
+    {
+        osal_debug_error("gateway: storing image in cache failed");
+        os_free(image, image_alloc);
+        return;
+    }
+    os_free(image, image_alloc);
+
+queue:
+    osal_console_write("gateway: received ");
+    osal_console_write(path);
+    osal_console_write("\n");
+
+    osal_mutex_lock(gw.lock);
+    os_strncpy(gw.pending, path, sizeof(gw.pending));
+    os_memclear(&gw.report, sizeof(gw.report));
+    gw.report.state = FLASHES_REPORT_RUNNING;
+    gw.report.image_size = image_size;
+    gw.report.image_crc = image_crc;
+    gw.text[0] = '\0';
+    os_get_timer(&gw.start);
+    osal_mutex_unlock(gw.lock);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Write file.
+  @anchor flashes_gateway_write_file
+
+  The flashes_gateway_write_file() function writes data to temporary file and renames it, so
+  that a cached image is never seen partially written.
+
+  @param   path Path to file.
+  @param   data Data to write.
+  @param   data_sz Data size, bytes.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_gateway_write_file(
+    const os_char *path,
+    const os_uchar *data,
+    os_memsz data_sz)
+{
+    osalStream f;
+    os_char tmp[FLASHES_GATEWAY_PATH_SZ];
+    os_memsz n_written;
+    osalStatus s;
+
+    os_strncpy(tmp, path, sizeof(tmp));
+    os_strncat(tmp, ".tmp", sizeof(tmp));
+    f = osal_file_open(tmp, OS_NULL, OS_NULL, OSAL_STREAM_WRITE);
+    if (f == OS_NULL) return OSAL_STATUS_FAILED;
+    s = osal_file_write(f, data, data_sz, &n_written, OSAL_STREAM_DEFAULT);
+    osal_file_close(f);
+    if (s || n_written != data_sz) return OSAL_STATUS_FAILED;
+    return rename(tmp, path) ? OSAL_STATUS_FAILED : OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Answer report query from the sender.
+  @anchor flashes_gateway_report
+
+  The flashes_gateway_report() function is set by flashes_socket_set_report_func() and called
+  from flashes_socket_loop() in upstream thread.
+
+  @param   report Report to fill in.
+  @param   text Buffer for failed devices, one per line.
+  @param   text_sz Text buffer size, bytes.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_gateway_report(
+    flashesReport *report,
+    os_char *text,
+    os_memsz text_sz)
+{
+    os_timer now;
+
+    osal_mutex_lock(gw.lock);
+    *report = gw.report;
+    os_strncpy(text, gw.text, text_sz);
+    if (report->state == FLASHES_REPORT_RUNNING)
+    {
+        os_get_timer(&now);
+        report->time_ms = (os_uint)(now - gw.start);
+    }
+    osal_mutex_unlock(gw.lock);
+}
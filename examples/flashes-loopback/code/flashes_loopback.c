@@ -0,0 +1,1007 @@
+/**
+
+  @file    flashes_loopback.c
+  @brief   End to end transfer benchmark over loopback.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Runs the device side of flashes library, flashes_socket_setup() and flashes_socket_loop()
+  as in mcu-flashes example, in a thread of this process against simulated flash, see
+  code/linux/flashes_sim.h. The flashit transfer code sends generated images to it over
+  localhost. Each image size is sent with each data frame size, and results are printed
+  as JSON, so that they can be compared between releases. With "-files=a.bin,b.bin" real
+  binaries are sent instead of generated images, and with "-z" windowed runs send them
+  compressed, so measured time of stop and wait, windowed and compressed transfer can be
+  compared.
+
+  For each run we report throughput, latency from sending a frame which carries image data
+  to its acknowledgement (p50, p99 and max), and how total time splits:
+  - erase: Device was blocked waiting for flash erase.
+  - program: Device was programming flash.
+  - ack: Rest of the time sender was waiting for acknowledgement, with window full.
+  - network: Sender was writing frames, socket buffers and window had room.
+
+  With "-rtt=0,50,100" transfers go through relay which emulates slow network, see
+  flashes_relay.c, and the runs are repeated for each round trip time. Together with list
+  of window sizes, "-w=1,8", this shows how update time grows with round trip time for stop
+  and wait versus windowed protocol. The "-plot" option prints this as a chart instead of JSON.
+  The relay can also be run alone between flashit and a device: "-relay=:6828".
+
+  Before each run the bank to be written is filled as if it held an old image, so every sector
+  needs erase as on a device in the field. With "-check" the benchmark is a test: Windowed runs
+  announce image size and the device erases ahead, so it must receive frames while flash is
+  busy erasing. Exit code is 1 if a windowed run with flash timing did not.
+
+  With "-mcast=N" each image is multicast to N simulated devices, each in a process of its own,
+  see flashes_loopback_mcast.c. "-drop=P" makes devices drop P% of data packets. Exit code is 1
+  unless every device switched to the image and it matches.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashes_loopback.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+/* Default image sizes and data frame sizes to run, bytes.
+ */
+#define FLASHES_LOOPBACK_DEFAULT_SIZES "65536,262144,1048576"
+#define FLASHES_LOOPBACK_DEFAULT_BLOCKS "256,1024"
+
+/* Relay port used by benchmark runs with emulated network, and width of plot bars.
+ */
+#define FLASHES_LOOPBACK_RELAY_PORT_STR ":6828"
+#define FLASHES_LOOPBACK_PLOT_WIDTH 50
+
+/* Maximum number of runs to keep for plot.
+ */
+#define FLASHES_LOOPBACK_MAX_RUNS 256
+
+/* Maximum number of sizes in a list.
+ */
+#define FLASHES_LOOPBACK_MAX_LIST 16
+
+/* Buffer size for list of binary files.
+ */
+#define FLASHES_LOOPBACK_FILES_SZ 1024
+
+/* Device sleeps one second before reboot after each transfer. Wait this long before next run,
+   so that it is listening again and connection time is not counted.
+ */
+#define FLASHES_LOOPBACK_REBOOT_WAIT_MS 1500
+
+/* JSON output buffer size.
+ */
+#define FLASHES_LOOPBACK_JSON_SZ 768
+
+/** Result of one run.
+ */
+typedef struct
+{
+    /* Binary file sent, OS_NULL for generated image. Image size, and bytes sent if
+       compressed, otherwise 0.
+     */
+    const os_char *path;
+    os_memsz image_sz;
+    os_memsz compressed_sz;
+
+    os_int block_size;
+    os_int window;
+    os_int rtt_ms;
+    os_boolean ok;
+    os_boolean verified;
+
+    /* Receive during erase was checked and result of the check.
+     */
+    os_boolean checked;
+    os_boolean check_ok;
+
+    /* Total time, and split to network, ack wait, erase and program, microseconds.
+     */
+    os_long total_us;
+    os_long network_us;
+    os_long ack_us;
+    os_long erase_us;
+    os_long program_us;
+
+    /* Simulated erase time of all sectors erased, including erase which ran in background.
+       Number of frames the device received while erase was running.
+     */
+    os_long erase_total_us;
+    os_uint frames_during_erase;
+
+    /* Number of data frames and their latency percentiles, microseconds.
+     */
+    os_int nframes;
+    os_long p50_us;
+    os_long p99_us;
+    os_long max_us;
+}
+flashesLoopbackResult;
+
+/* Device thread runs until this is set.
+ */
+static volatile os_boolean flashes_loopback_stop;
+
+static void flashes_loopback_device(
+    void *prm,
+    osalEvent done);
+
+static osalStatus flashes_loopback_load(
+    flashitImage *img,
+    const os_char *path,
+    os_memsz image_sz,
+    os_boolean compress);
+
+static osalStatus flashes_loopback_run(
+    const flashitImage *img,
+    os_int block_size,
+    const flashitOptions *opt,
+    flashesRelay *relay,
+    flashesLoopbackResult *r);
+
+static void flashes_loopback_check(
+    const flashesSimConfig *config,
+    const flashitOptions *opt,
+    flashesLoopbackResult *r);
+
+static void flashes_loopback_percentiles(
+    os_long *latency,
+    os_int n,
+    flashesLoopbackResult *r);
+
+static void flashes_loopback_print_result(
+    const flashesLoopbackResult *r,
+    os_boolean first);
+
+static void flashes_loopback_plot(
+    const flashesLoopbackResult *results,
+    os_int nresults);
+
+static os_int flashes_loopback_run_relay(
+    const os_char *listen_addr,
+    const os_char *target_addr,
+    const flashesRelayParams *prm);
+
+static os_int flashes_loopback_parse_list(
+    const os_char *str,
+    os_long *list);
+
+static os_int flashes_loopback_parse_files(
+    const os_char *str,
+    const os_char **files);
+
+static int flashes_loopback_compare(
+    const void *a,
+    const void *b);
+
+
+/**
+****************************************************************************************************
+
+  @brief Loopback benchmark main function.
+
+  The osal_main() function is OS independent entry point. It sets up simulated flash, starts
+  device thread and runs transfer for each image size, or binary file, and data frame size
+  combination.
+
+  @param   argc Number of command line arguments.
+  @param   argv Array of string pointers, one for each command line argument. UTF8 encoded.
+
+  @return  0 if all runs succeeded, 1 otherwise.
+
+****************************************************************************************************
+*/
+os_int osal_main(
+    os_int argc,
+    os_char *argv[])
+{
+    static flashesRelay relay;
+    static flashesLoopbackResult results[FLASHES_LOOPBACK_MAX_RUNS];
+    const os_char *files[FLASHES_LOOPBACK_MAX_LIST];
+    flashesSimConfig config;
+    flashitImage img;
+    flashitOptions opt;
+    flashesRelayParams prm;
+    flashesLoopbackResult *r;
+    const os_char *sizes_str, *blocks_str, *windows_str, *rtts_str, *relay_addr, *target_addr,
+        *files_str;
+    os_long sizes[FLASHES_LOOPBACK_MAX_LIST], blocks[FLASHES_LOOPBACK_MAX_LIST],
+        windows[FLASHES_LOOPBACK_MAX_LIST], rtts[FLASHES_LOOPBACK_MAX_LIST];
+    os_memsz count;
+    os_int i, nsizes, nblocks, nwindows, nrtts, nruns, run, rval, ndevices, drop_pct;
+    os_boolean plot, check, compress;
+
+    flashes_sim_default_config(&config);
+    os_memclear(&opt, sizeof(opt));
+    os_memclear(&prm, sizeof(prm));
+    sizes_str = FLASHES_LOOPBACK_DEFAULT_SIZES;
+    blocks_str = FLASHES_LOOPBACK_DEFAULT_BLOCKS;
+    windows_str = "8";
+    rtts_str = "";
+    relay_addr = OS_NULL;
+    target_addr = "127.0.0.1" FLASHES_SOCKET_PORT_STR;
+    files_str = OS_NULL;
+    plot = check = compress = OS_FALSE;
+    ndevices = drop_pct = 0;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!os_strncmp(argv[i], "-sizes=", 7)) sizes_str = argv[i] + 7;
+        else if (!os_strncmp(argv[i], "-files=", 7)) files_str = argv[i] + 7;
+        else if (!os_strncmp(argv[i], "-z", 3)) compress = OS_TRUE;
+        else if (!os_strncmp(argv[i], "-blocks=", 8)) blocks_str = argv[i] + 8;
+        else if (!os_strncmp(argv[i], "-w=", 3)) windows_str = argv[i] + 3;
+        else if (!os_strncmp(argv[i], "-rtt=", 5)) rtts_str = argv[i] + 5;
+        else if (!os_strncmp(argv[i], "-jitter=", 8))
+        {
+            prm.jitter_ms = (os_int)osal_str_to_int(argv[i] + 8, OS_NULL);
+        }
+        else if (!os_strncmp(argv[i], "-kbps=", 6))
+        {
+            prm.kbps = (os_int)osal_str_to_int(argv[i] + 6, OS_NULL);
+        }
+        else if (!os_strncmp(argv[i], "-stall=", 7))
+        {
+            prm.stall_every_ms = (os_int)osal_str_to_int(argv[i] + 7, &count);
+            if (argv[i][7 + count] != ',') goto showhelp;
+            prm.stall_ms = (os_int)osal_str_to_int(argv[i] + 8 + count, OS_NULL);
+            if (prm.stall_ms >= prm.stall_every_ms) goto showhelp;
+        }
+        else if (!os_strncmp(argv[i], "-relay=", 7)) relay_addr = argv[i] + 7;
+        else if (!os_strncmp(argv[i], "-target=", 8)) target_addr = argv[i] + 8;
+        else if (!os_strncmp(argv[i], "-plot", 6)) plot = OS_TRUE;
+        else if (!os_strncmp(argv[i], "-timing=", 8))
+        {
+            config.timing = (os_boolean)(osal_str_to_int(argv[i] + 8, OS_NULL) != 0);
+        }
+        else if (!os_strncmp(argv[i], "-dir=", 5)) config.dir = argv[i] + 5;
+        else if (!os_strncmp(argv[i], "-check", 7)) check = OS_TRUE;
+        else if (!os_strncmp(argv[i], "-mcast=", 7))
+        {
+            ndevices = (os_int)osal_str_to_int(argv[i] + 7, OS_NULL);
+            if (ndevices < 1 || ndevices > FLASHES_LOOPBACK_MAX_DEVICES) goto showhelp;
+        }
+        else if (!os_strncmp(argv[i], "-drop=", 6))
+        {
+            drop_pct = (os_int)osal_str_to_int(argv[i] + 6, OS_NULL);
+            if (drop_pct < 0 || drop_pct > 90 || (drop_pct && !FLASHES_MULTICAST_TEST))
+            {
+                goto showhelp;
+            }
+        }
+        else goto showhelp;
+    }
+
+    nrtts = flashes_loopback_parse_list(rtts_str, rtts);
+    if (nrtts < 0) goto showhelp;
+
+    /* Relay only, between flashit and a device.
+     */
+    if (relay_addr)
+    {
+        if (nrtts > 1) goto showhelp;
+        prm.delay_ms = nrtts ? (os_int)rtts[0] / 2 : 0;
+        return flashes_loopback_run_relay(relay_addr, target_addr, &prm);
+    }
+
+    nsizes = files_str ? flashes_loopback_parse_files(files_str, files)
+        : flashes_loopback_parse_list(sizes_str, sizes);
+    nblocks = flashes_loopback_parse_list(blocks_str, blocks);
+    nwindows = flashes_loopback_parse_list(windows_str, windows);
+    if (nsizes <= 0 || nblocks <= 0 || nwindows <= 0) goto showhelp;
+    for (i = 0; i < nsizes && files_str == OS_NULL; i++)
+    {
+        if (sizes[i] < 1 || sizes[i] > FLASHES_BANK_SIZE) goto showhelp;
+    }
+    for (i = 0; i < nblocks; i++)
+    {
+        if (blocks[i] < 16 || blocks[i] > FLASHES_TRANSFER_BLOCK_SIZE ||
+            FLASHES_TRANSFER_BLOCK_SIZE % blocks[i]) goto showhelp;
+    }
+    for (i = 0; i < nwindows; i++)
+    {
+        if (windows[i] < 1 || windows[i] > FLASHES_MAX_WINDOW) goto showhelp;
+    }
+
+    /* Multicast to simulated devices, each in a process of its own. Data frame size, window
+       and network emulation do not apply.
+     */
+    if (ndevices)
+    {
+        rval = 0;
+        for (i = 0; i < nsizes; i++)
+        {
+            if (i) os_sleep(FLASHES_LOOPBACK_REBOOT_WAIT_MS);
+            if (flashes_loopback_load(&img, files_str ? files[i] : OS_NULL,
+                files_str ? 0 : (os_memsz)sizes[i], OS_FALSE))
+            {
+                flashit_image_release(&img);
+                return 1;
+            }
+            if (flashes_loopback_multicast(&config, &img, ndevices, drop_pct)) rval = 1;
+            flashit_image_release(&img);
+        }
+        return rval;
+    }
+
+    /* Simulated flash, device thread and relay, if emulating network.
+     */
+    if (flashes_sim_setup(&config))
+    {
+        osal_console_write("flash simulation setup failed\n");
+        return 1;
+    }
+    osal_thread_create(flashes_loopback_device, OS_NULL, OS_NULL, OSAL_THREAD_DETACHED);
+    if (nrtts && flashes_relay_open(&relay, FLASHES_LOOPBACK_RELAY_PORT_STR, target_addr, &prm))
+    {
+        return 1;
+    }
+
+    /* Run all combinations, round trip time changing fastest.
+     */
+    rval = 0;
+    if (!plot)
+    {
+        osal_console_write("{\"benchmark\": \"flashes-loopback\", \"flash_timing\": ");
+        osal_console_write(config.timing ? "true" : "false");
+        osal_console_write(", \"runs\": [\n");
+    }
+    nruns = nsizes * nblocks * nwindows * (nrtts ? nrtts : 1);
+    if (nruns > FLASHES_LOOPBACK_MAX_RUNS) nruns = FLASHES_LOOPBACK_MAX_RUNS;
+    for (run = 0; run < nruns; run++)
+    {
+        i = run;
+        r = results + run;
+        if (nrtts)
+        {
+            relay.prm.delay_ms = (os_int)rtts[i % nrtts] / 2;
+            i /= nrtts;
+        }
+        opt.window = (os_int)windows[i % nwindows];
+        i /= nwindows;
+        opt.block_size = (os_int)blocks[i % nblocks];
+        i /= nblocks;
+
+        /* Stop and wait protocol cannot carry compressed frames, send these uncompressed.
+         */
+        if (run) os_sleep(FLASHES_LOOPBACK_REBOOT_WAIT_MS);
+        if (flashes_loopback_load(&img, files_str ? files[i] : OS_NULL,
+            files_str ? 0 : (os_memsz)sizes[i], (os_boolean)(compress && opt.window > 1)))
+        {
+            flashit_image_release(&img);
+            return 1;
+        }
+        if (flashes_loopback_run(&img, opt.block_size, &opt, nrtts ? &relay : OS_NULL, r))
+        {
+            rval = 1;
+        }
+        r->path = files_str ? files[i] : OS_NULL;
+        flashit_image_release(&img);
+        r->rtt_ms = nrtts ? 2 * relay.prm.delay_ms : 0;
+        if (check)
+        {
+            flashes_loopback_check(&config, &opt, r);
+            if (r->checked && !r->check_ok) rval = 1;
+        }
+        if (!plot) flashes_loopback_print_result(r, (os_boolean)(run == 0));
+    }
+
+    if (plot) flashes_loopback_plot(results, nruns);
+    else osal_console_write("\n]}\n");
+
+    if (nrtts) flashes_relay_close(&relay);
+    flashes_loopback_stop = OS_TRUE;
+    return rval;
+
+showhelp:
+    osal_console_write("flashes-loopback [-sizes=65536,262144] [-blocks=256,1024] [-w=1,8] [-timing=1] [-dir=.]\n");
+    osal_console_write("    [-files=a.bin,b.bin] [-z]\n");
+    osal_console_write("    [-rtt=0,100,300] [-jitter=0] [-kbps=0] [-stall=5000,500] [-plot] [-check]\n");
+    osal_console_write("flashes-loopback -mcast=8 [-drop=10] [-sizes=65536] [-files=a.bin] [-timing=1] [-dir=.]\n");
+    osal_console_write("flashes-loopback -relay=:6828 [-target=127.0.0.1:6827] [-rtt=100] [-jitter=0] ...\n");
+    osal_console_write("  -sizes=N,...   image sizes to send, bytes\n");
+    osal_console_write("  -files=F,...   send binary files instead of generated images\n");
+    osal_console_write("  -z             windowed runs send binary compressed\n");
+    osal_console_write("  -blocks=N,...  data frame sizes, bytes, must divide 1024\n");
+    osal_console_write("  -w=N,...       number of frames in flight, 1 = stop and wait protocol\n");
+    osal_console_write("  -timing=0      flash erase and program take no time\n");
+    osal_console_write("  -dir=D         directory for simulated flash bank files\n");
+    osal_console_write("  -rtt=N,...     send through relay with round trip time N ms\n");
+    osal_console_write("  -jitter=N      random extra delay up to N ms each way\n");
+    osal_console_write("  -kbps=N        bandwidth limit each way, kbit/s\n");
+    osal_console_write("  -stall=P,D     link stalls for D ms every P ms\n");
+    osal_console_write("  -plot          print update time against round trip time as chart\n");
+    osal_console_write("  -check         fail if windowed run does not receive frames during erase\n");
+    osal_console_write("  -mcast=N       multicast to N simulated devices, each in its own process\n");
+    osal_console_write("  -drop=P        devices drop P% of multicast data packets\n");
+    osal_console_write("  -relay=A       only run relay listening at A, forwarding to -target\n");
+    return 1;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Device thread.
+  @anchor flashes_loopback_device
+
+  The flashes_loopback_device() function runs device side of the transfer, like main loop
+  of mcu-flashes example, until the benchmark is finished.
+
+  @param   prm Not used.
+  @param   done Event to set once thread has started and is listening.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_loopback_device(
+    void *prm,
+    osalEvent done)
+{
+    flashes_socket_setup();
+    osal_event_set(done);
+
+    while (!flashes_loopback_stop)
+    {
+        flashes_socket_loop();
+        os_timeslice();
+    }
+
+    flashes_socket_cleanup();
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Load or generate image to transfer.
+  @anchor flashes_loopback_load
+
+  The flashes_loopback_load() function loads binary file, or generates pseudo random image
+  which doesn't look erased or repeat. The image is compressed if requested. Nothing is
+  printed, output is JSON. Call flashit_image_release() in either case.
+
+  @param   img Image structure to fill in, cleared by this function.
+  @param   path Binary file to load, OS_NULL to generate image.
+  @param   image_sz Size of image to generate, bytes.
+  @param   compress OS_TRUE to compress the image for transfer.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error, message is printed.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_loopback_load(
+    flashitImage *img,
+    const os_char *path,
+    os_memsz image_sz,
+    os_boolean compress)
+{
+    os_memsz i;
+    os_uint x;
+
+    os_memclear(img, sizeof(flashitImage));
+    if (path)
+    {
+        img->path = path;
+        img->image = flashit_load_file(path, &img->image_sz, &img->image_alloc);
+    }
+    else
+    {
+        img->path = "generated";
+        img->image = (os_uchar*)os_malloc(image_sz, &img->image_alloc);
+        img->image_sz = image_sz;
+        x = 2463534242U;
+        for (i = 0; img->image && i < image_sz; i++)
+        {
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            img->image[i] = (os_uchar)x;
+        }
+    }
+    if (img->image == OS_NULL || img->image_sz == 0 || img->image_sz > FLASHES_BANK_SIZE)
+    {
+        osal_console_write("loading image failed: ");
+        osal_console_write(img->path);
+        osal_console_write("\n");
+        return OSAL_STATUS_FAILED;
+    }
+    img->image_crc = flashes_crc32(FLASHES_CRC32_INIT, img->image, img->image_sz);
+
+    if (compress)
+    {
+        img->stream = flashit_compress(img->image, img->image_sz, &img->stream_sz,
+            &img->stream_alloc);
+        if (img->stream == OS_NULL)
+        {
+            osal_console_write("compressing image failed\n");
+            return OSAL_STATUS_FAILED;
+        }
+        img->stream_type = FLASHES_FRAME_COMPRESSED;
+    }
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Transfer one image and measure.
+  @anchor flashes_loopback_run
+
+  The flashes_loopback_run() function transfers image to the device thread and checks that
+  the bank written matches. The bank is filled first, as if it held an old image, so that all
+  sectors need erase. Frames are timed from the moment their header is written to the moment
+  acknowledgement covering them is processed. Flash erase and program times come from the
+  flash simulation.
+
+  @param   img Image to transfer.
+  @param   block_size Data frame size, bytes.
+  @param   opt Transfer options.
+  @param   relay Relay to send through, OS_NULL to connect device directly.
+  @param   r Where to store result.
+  @return  OSAL_SUCCESS if transfer succeeded and was verified.
+
+****************************************************************************************************
+*/
+static osalStatus flashes_loopback_run(
+    const flashitImage *img,
+    os_int block_size,
+    const flashitOptions *opt,
+    flashesRelay *relay,
+    flashesLoopbackResult *r)
+{
+    static flashitTransfer t;
+    flashitOptions o;
+    flashesSimStats stats;
+    os_uchar *readback = OS_NULL;
+    os_long *latency = OS_NULL, sent_us[FLASHES_MAX_WINDOW];
+    os_memsz readback_alloc, latency_alloc, prev_end, image_sz;
+    os_long start_us, t0, t1, ack_wait_us;
+    os_ushort seq, prev_sent, prev_acked;
+    os_boolean stalled;
+    os_int maxframes;
+    os_uint frames_during_erase;
+
+    os_memclear(r, sizeof(flashesLoopbackResult));
+    image_sz = img->image_sz;
+    r->image_sz = image_sz;
+    r->compressed_sz = img->stream ? img->stream_sz : 0;
+    r->block_size = block_size;
+    r->window = opt->window;
+
+    readback = (os_uchar*)os_malloc(image_sz, &readback_alloc);
+    maxframes = (os_int)((img->stream ? img->stream_sz : image_sz) / block_size) + 2;
+    latency = (os_long*)os_malloc(maxframes * sizeof(os_long), &latency_alloc);
+    if (readback == OS_NULL || latency == OS_NULL) goto getout;
+    o = *opt;
+    o.block_size = block_size;
+
+    /* The device writes to the bank it is not running from.
+     */
+    if (flashes_sim_fill_bank((os_boolean)!flashes_is_bank2_selected(), 0)) goto getout;
+
+    /* Transfer, timing each frame.
+     */
+    flashes_sim_reset_stats();
+    frames_during_erase = flashes_socket_frames_during_erase();
+    start_us = flashes_loopback_now_us();
+    ack_wait_us = 0;
+    prev_sent = prev_acked = 0;
+    prev_end = 0;
+    if (flashit_transfer_start(&t, relay ? "127.0.0.1" FLASHES_LOOPBACK_RELAY_PORT_STR
+        : "127.0.0.1" FLASHES_SOCKET_PORT_STR, img, &o) == OSAL_SUCCESS)
+    {
+        while (!t.done)
+        {
+            /* Nothing to send until acknowledgement is received.
+             */
+            stalled = (os_boolean)(!t.writing_block && (t.terminating_zero_packet_sent ||
+                (os_ushort)(t.sent_seq - t.acked_seq) >= (os_ushort)t.window));
+
+            t0 = flashes_loopback_now_us();
+            osal_socket_maintain();
+            if (relay) flashes_relay_run(relay);
+            if (flashit_transfer_run(&t)) break;
+            t1 = flashes_loopback_now_us();
+
+            /* Frames started and frames acknowledged by this call.
+             */
+            while (prev_sent != t.sent_seq)
+            {
+                prev_sent++;
+                sent_us[prev_sent % FLASHES_MAX_WINDOW] = t1;
+            }
+            while (prev_acked != t.acked_seq)
+            {
+                prev_acked++;
+                seq = (os_ushort)(prev_acked % FLASHES_MAX_WINDOW);
+                if (t.frame_end_pos[seq] != prev_end && r->nframes < maxframes)
+                {
+                    latency[r->nframes++] = t1 - sent_us[seq];
+                }
+                prev_end = t.frame_end_pos[seq];
+            }
+
+            os_timeslice();
+            if (stalled) ack_wait_us += flashes_loopback_now_us() - t0;
+        }
+    }
+    r->total_us = flashes_loopback_now_us() - start_us;
+    r->ok = t.done;
+    flashit_transfer_close(&t);
+    if (!r->ok) goto getout;
+
+    /* The device selected the bank it wrote to boot from.
+     */
+    if (flashes_read(0, readback, (os_uint)image_sz, flashes_is_bank2_selected()) == OSAL_SUCCESS)
+    {
+        r->verified = (os_boolean)(os_memcmp(readback, img->image, image_sz) == 0);
+    }
+
+    /* Time split. Sender waits for acknowledgement while device erases and programs, rest
+       of the wait is protocol round trip.
+     */
+    flashes_sim_get_stats(&stats);
+    r->erase_us = stats.erase_wait_us;
+    r->program_us = stats.program_us;
+    r->erase_total_us = stats.erase_us;
+    r->frames_during_erase = flashes_socket_frames_during_erase() - frames_during_erase;
+    r->ack_us = ack_wait_us - r->erase_us - r->program_us;
+    if (r->ack_us < 0) r->ack_us = 0;
+    r->network_us = r->total_us - ack_wait_us;
+    if (r->network_us < 0) r->network_us = 0;
+    flashes_loopback_percentiles(latency, r->nframes, r);
+
+getout:
+    if (latency) os_free(latency, latency_alloc);
+    if (readback) os_free(readback, readback_alloc);
+    return (r->ok && r->verified) ? OSAL_SUCCESS : OSAL_STATUS_FAILED;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Check that device received frames while erasing flash.
+  @anchor flashes_loopback_check
+
+  The flashes_loopback_check() function checks result of windowed run with flash timing: The
+  device erases ahead of the write position once image size is announced, and must receive
+  frames into free ring buffers while the erase runs. This holds at any round trip time, also
+  over localhost. Stop and wait runs erase in flashes_write() and are not checked. The check
+  fails also if nothing was erased, the run would not show anything then.
+
+  @param   config Flash simulation settings.
+  @param   opt Transfer options.
+  @param   r Result of the run, check result is stored here.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_loopback_check(
+    const flashesSimConfig *config,
+    const flashitOptions *opt,
+    flashesLoopbackResult *r)
+{
+    if (!config->timing || opt->window <= 1) return;
+    r->checked = OS_TRUE;
+    r->check_ok = (os_boolean)(r->ok && r->verified && r->erase_total_us > 0 &&
+        r->frames_during_erase > 0);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Calculate latency percentiles.
+  @anchor flashes_loopback_percentiles
+
+  @param   latency Array of frame latencies, sorted by this function.
+  @param   n Number of latencies.
+  @param   r Result where to store p50, p99 and max.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_loopback_percentiles(
+    os_long *latency,
+    os_int n,
+    flashesLoopbackResult *r)
+{
+    if (n <= 0) return;
+    qsort(latency, n, sizeof(os_long), flashes_loopback_compare);
+    r->p50_us = latency[(n - 1) * 50 / 100];
+    r->p99_us = latency[(n - 1) * 99 / 100];
+    r->max_us = latency[n - 1];
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Print result of one run as JSON object.
+  @anchor flashes_loopback_print_result
+
+  @param   r Result.
+  @param   first OS_TRUE for the first run, no separating comma.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_loopback_print_result(
+    const flashesLoopbackResult *r,
+    os_boolean first)
+{
+    os_char buf[FLASHES_LOOPBACK_JSON_SZ], nbuf[32];
+    os_long kbps;
+
+#define FLASHES_LOOPBACK_ADD(label, x) \
+    os_strncat(buf, label, sizeof(buf)); \
+    osal_int_to_string(nbuf, sizeof(nbuf), (x)); \
+    os_strncat(buf, nbuf, sizeof(buf));
+
+    os_strncpy(buf, first ? "  {" : ",\n  {", sizeof(buf));
+    if (r->path)
+    {
+        os_strncat(buf, "\"file\": \"", sizeof(buf));
+        os_strncat(buf, r->path, sizeof(buf));
+        os_strncat(buf, "\", ", sizeof(buf));
+    }
+    FLASHES_LOOPBACK_ADD("\"image_size\": ", r->image_sz)
+    if (r->compressed_sz)
+    {
+        FLASHES_LOOPBACK_ADD(", \"compressed_size\": ", r->compressed_sz)
+    }
+    FLASHES_LOOPBACK_ADD(", \"block_size\": ", r->block_size)
+    FLASHES_LOOPBACK_ADD(", \"window\": ", r->window)
+    FLASHES_LOOPBACK_ADD(", \"rtt_ms\": ", r->rtt_ms)
+    os_strncat(buf, r->ok ? ", \"ok\": true" : ", \"ok\": false", sizeof(buf));
+    os_strncat(buf, r->verified ? ", \"verified\": true" : ", \"verified\": false", sizeof(buf));
+    FLASHES_LOOPBACK_ADD(", \"time_us\": ", r->total_us)
+
+    /* MB/s with three decimals. Bytes per microsecond is MB/s.
+     */
+    kbps = r->total_us ? (os_long)r->image_sz * 1000 / r->total_us : 0;
+    FLASHES_LOOPBACK_ADD(", \"mb_per_s\": ", kbps / 1000)
+    os_strncat(buf, ".", sizeof(buf));
+    osal_int_to_string(nbuf, sizeof(nbuf), 1000 + kbps % 1000);
+    os_strncat(buf, nbuf + 1, sizeof(buf));
+
+    FLASHES_LOOPBACK_ADD(", \"frames\": ", r->nframes)
+    FLASHES_LOOPBACK_ADD(", \"latency_us\": {\"p50\": ", r->p50_us)
+    FLASHES_LOOPBACK_ADD(", \"p99\": ", r->p99_us)
+    FLASHES_LOOPBACK_ADD(", \"max\": ", r->max_us)
+    FLASHES_LOOPBACK_ADD("}, \"split_us\": {\"network\": ", r->network_us)
+    FLASHES_LOOPBACK_ADD(", \"erase\": ", r->erase_us)
+    FLASHES_LOOPBACK_ADD(", \"program\": ", r->program_us)
+    FLASHES_LOOPBACK_ADD(", \"ack\": ", r->ack_us)
+    FLASHES_LOOPBACK_ADD("}, \"erase_total_us\": ", r->erase_total_us)
+    FLASHES_LOOPBACK_ADD(", \"frames_during_erase\": ", r->frames_during_erase)
+    if (r->checked)
+    {
+        os_strncat(buf, r->check_ok ? ", \"check\": true" : ", \"check\": false", sizeof(buf));
+    }
+    os_strncat(buf, "}", sizeof(buf));
+
+#undef FLASHES_LOOPBACK_ADD
+
+    osal_console_write(buf);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Print update time against round trip time.
+  @anchor flashes_loopback_plot
+
+  The flashes_loopback_plot() function prints one bar for each run, length proportional to total
+  time. Runs are grouped by image size, frame size and window, round trip time changing fastest.
+
+  @param   results Results of runs.
+  @param   nresults Number of runs.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_loopback_plot(
+    const flashesLoopbackResult *results,
+    os_int nresults)
+{
+    const flashesLoopbackResult *r;
+    os_char line[FLASHES_LOOPBACK_PLOT_WIDTH + 2], nbuf[32];
+    os_long max_us;
+    os_int i, n;
+
+    max_us = 1;
+    for (i = 0; i < nresults; i++)
+    {
+        if (results[i].total_us > max_us) max_us = results[i].total_us;
+    }
+
+    for (i = 0; i < nresults; i++)
+    {
+        r = results + i;
+        if (i == 0 || r->image_sz != r[-1].image_sz || r->block_size != r[-1].block_size ||
+            r->window != r[-1].window)
+        {
+            osal_console_write("\nsize ");
+            osal_int_to_string(nbuf, sizeof(nbuf), r->image_sz);
+            osal_console_write(nbuf);
+            osal_console_write(", frame ");
+            osal_int_to_string(nbuf, sizeof(nbuf), r->block_size);
+            osal_console_write(nbuf);
+            osal_console_write(", window ");
+            osal_int_to_string(nbuf, sizeof(nbuf), r->window);
+            osal_console_write(nbuf);
+            osal_console_write("\n");
+        }
+
+        osal_console_write("  rtt ");
+        osal_int_to_string(nbuf, sizeof(nbuf), r->rtt_ms);
+        for (n = (os_int)os_strlen(nbuf); n <= 5; n++) osal_console_write(" ");
+        osal_console_write(nbuf);
+        osal_console_write(" ms |");
+
+        n = (os_int)(r->total_us * FLASHES_LOOPBACK_PLOT_WIDTH / max_us);
+        os_memclear(line, sizeof(line));
+        while (n > 0) line[--n] = '#';
+        osal_console_write(line);
+        osal_console_write(" ");
+        if (r->ok && r->verified)
+        {
+            osal_int_to_string(nbuf, sizeof(nbuf), r->total_us / 1000);
+            osal_console_write(nbuf);
+            osal_console_write(" ms\n");
+        }
+        else
+        {
+            osal_console_write("FAILED\n");
+        }
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Run relay only.
+  @anchor flashes_loopback_run_relay
+
+  The flashes_loopback_run_relay() function forwards connections between flashit and a device,
+  running or simulated elsewhere, with emulated network conditions. It runs until killed.
+
+  @param   listen_addr Address to listen, like ":6828".
+  @param   target_addr Device address, like "127.0.0.1:6827".
+  @param   prm Network conditions.
+  @return  1 if relay could not be started.
+
+****************************************************************************************************
+*/
+static os_int flashes_loopback_run_relay(
+    const os_char *listen_addr,
+    const os_char *target_addr,
+    const flashesRelayParams *prm)
+{
+    static flashesRelay relay;
+
+    if (flashes_relay_open(&relay, listen_addr, target_addr, prm)) return 1;
+    while (OS_TRUE)
+    {
+        osal_socket_maintain();
+        flashes_relay_run(&relay);
+        os_timeslice();
+    }
+    return 0;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Parse comma separated list of numbers.
+  @anchor flashes_loopback_parse_list
+
+  @param   str String to parse, like "256,1024".
+  @param   list Array to fill, FLASHES_LOOPBACK_MAX_LIST items.
+  @return  Number of items, -1 if string is not valid.
+
+****************************************************************************************************
+*/
+static os_int flashes_loopback_parse_list(
+    const os_char *str,
+    os_long *list)
+{
+    os_memsz count;
+    os_int n;
+
+    n = 0;
+    while (*str != '\0')
+    {
+        if (n >= FLASHES_LOOPBACK_MAX_LIST) return -1;
+        list[n++] = osal_str_to_int(str, &count);
+        if (count == 0) return -1;
+        str += count;
+        if (*str == ',') str++;
+        else if (*str != '\0') return -1;
+    }
+    return n;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Parse comma separated list of file paths.
+  @anchor flashes_loopback_parse_files
+
+  The string is copied to static buffer, so paths stay valid.
+
+  @param   str String to parse, like "a.bin,b.bin".
+  @param   files Array to fill, FLASHES_LOOPBACK_MAX_LIST items.
+  @return  Number of files, -1 if string is not valid.
+
+****************************************************************************************************
+*/
+static os_int flashes_loopback_parse_files(
+    const os_char *str,
+    const os_char **files)
+{
+    static os_char buf[FLASHES_LOOPBACK_FILES_SZ];
+    os_char *p;
+    os_int n;
+
+    if (os_strlen(str) > (os_memsz)sizeof(buf)) return -1;
+    os_strncpy(buf, str, sizeof(buf));
+    n = 0;
+    p = buf;
+    while (*p != '\0')
+    {
+        if (n >= FLASHES_LOOPBACK_MAX_LIST) return -1;
+        files[n++] = p;
+        while (*p != '\0' && *p != ',') p++;
+        if (*p == ',') *(p++) = '\0';
+    }
+    return n;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get monotonic time.
+  @anchor flashes_loopback_now_us
+
+  @return  Time in microseconds.
+
+****************************************************************************************************
+*/
+os_long flashes_loopback_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (os_long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Compare two latencies, for qsort().
+  @anchor flashes_loopback_compare
+
+****************************************************************************************************
+*/
+static int flashes_loopback_compare(
+    const void *a,
+    const void *b)
+{
+    os_long x = *(const os_long*)a, y = *(const os_long*)b;
+    return (x > y) - (x < y);
+}
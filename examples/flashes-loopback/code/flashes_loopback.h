@@ -0,0 +1,142 @@
+/**
+
+  @file    flashes_loopback.h
+  @brief   End to end transfer benchmark over loopback.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Types and functions shared between flashes-loopback source files.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#ifndef FLASHES_LOOPBACK_INCLUDED
+#define FLASHES_LOOPBACK_INCLUDED
+
+#include "flashit.h"
+#include "code/linux/flashes_sim.h"
+
+/* Size of one chunk of data kept by relay, and number of chunks queued in each direction.
+   Relay stops reading when queue is full, so the sender sees flow control.
+ */
+#define FLASHES_RELAY_CHUNK_SZ 1460
+#define FLASHES_RELAY_MAX_CHUNKS 256
+
+/* Maximum number of simulated devices in multicast test.
+ */
+#define FLASHES_LOOPBACK_MAX_DEVICES 64
+
+/** Network conditions emulated by relay.
+ */
+typedef struct
+{
+    /* Delay in each direction, ms. Round trip time is twice this.
+     */
+    os_int delay_ms;
+
+    /* Random additional delay, 0 - jitter_ms, for each chunk. Order of data is kept.
+     */
+    os_int jitter_ms;
+
+    /* Bandwidth cap in each direction, kbit/s. 0 for no limit.
+     */
+    os_int kbps;
+
+    /* Link stalls periodically: Every stall_every_ms nothing is delivered for stall_ms.
+       0 for no stalls.
+     */
+    os_int stall_every_ms;
+    os_int stall_ms;
+}
+flashesRelayParams;
+
+/** Data queued in one direction.
+ */
+typedef struct
+{
+    /* Chunk data, size, bytes already delivered and time when chunk may be delivered.
+     */
+    os_uchar data[FLASHES_RELAY_MAX_CHUNKS][FLASHES_RELAY_CHUNK_SZ];
+    os_int n[FLASHES_RELAY_MAX_CHUNKS];
+    os_int pos[FLASHES_RELAY_MAX_CHUNKS];
+    os_long release_us[FLASHES_RELAY_MAX_CHUNKS];
+
+    /* Queue head and number of chunks.
+     */
+    os_int head;
+    os_int count;
+
+    /* Time when bandwidth limited link is free, and release time of the last chunk queued.
+     */
+    os_long link_free_us;
+    os_long last_release_us;
+
+    /* Source socket was closed, forward what is queued and close.
+     */
+    os_boolean closing;
+}
+flashesRelayPipe;
+
+/** Relay state.
+ */
+typedef struct
+{
+    /* Network conditions and address to connect accepted connections to.
+     */
+    flashesRelayParams prm;
+    os_char target[OSAL_HOST_BUF_SZ];
+
+    /* Listening socket, accepted connection and connection to target.
+     */
+    osalStream listen_socket;
+    osalStream in_socket;
+    osalStream out_socket;
+
+    /* Data from accepted connection to target (up) and back (down).
+     */
+    flashesRelayPipe up;
+    flashesRelayPipe down;
+
+    /* Time when connection was accepted, for periodic stalls, and random number state.
+     */
+    os_long start_us;
+    os_uint rand;
+}
+flashesRelay;
+
+/* Start listening for connections to relay.
+ */
+osalStatus flashes_relay_open(
+    flashesRelay *relay,
+    const os_char *listen_addr,
+    const os_char *target_addr,
+    const flashesRelayParams *prm);
+
+/* Forward data without blocking.
+ */
+void flashes_relay_run(
+    flashesRelay *relay);
+
+/* Close relay and connections.
+ */
+void flashes_relay_close(
+    flashesRelay *relay);
+
+/* Get monotonic time in microseconds.
+ */
+os_long flashes_loopback_now_us(void);
+
+/* Multicast image to simulated devices, each in a process of its own.
+ */
+os_int flashes_loopback_multicast(
+    const flashesSimConfig *config,
+    const flashitImage *img,
+    os_int ndevices,
+    os_int drop_pct);
+
+#endif
@@ -0,0 +1,296 @@
+/**
+
+  @file    flashes_loopback_mcast.c
+  @brief   Multicast distribution test with simulated devices.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Multicast sends one image to many devices, so it cannot be tested with the single device
+  thread of the benchmark. Here each simulated device is a process of its own, forked from
+  the benchmark, with its own simulated flash in subdirectory "devN" of the simulation
+  directory. Device id is made from this path, so devices are told apart like on a network.
+  Multicast on one computer loses nothing, so devices can drop given percentage of data
+  packets at random, each its own, to exercise repair rounds.
+
+  The benchmark sends the image with flashit multicast code. Each device process runs the
+  device loop until the sender commits and the device has switched bank, then reads the image
+  back from the new bank, compares it and exits with code 0 if it matches.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashes_loopback.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Sending rate, kB/s, as flashit default. Simulated flash programs about 250 kB/s, sending
+   faster overruns socket buffers of the devices and they miss polls.
+ */
+#define FLASHES_LOOPBACK_MCAST_RATE_KB 200
+
+/* Time given to device processes to set up flash and join multicast group, ms.
+ */
+#define FLASHES_LOOPBACK_MCAST_JOIN_MS 500
+
+/* Time to wait for devices to switch bank and verify after the sender is done, ms. Device
+   reboots one second after commit.
+ */
+#define FLASHES_LOOPBACK_MCAST_EXIT_WAIT_MS 5000
+
+/* Device process gives up if it has not been committed in this time, ms.
+ */
+#define FLASHES_LOOPBACK_MCAST_DEVICE_TIMEOUT_MS 300000
+
+/* Path buffer size.
+ */
+#define FLASHES_LOOPBACK_PATH_SZ 300
+
+/* Image file for the sender, written to simulation directory.
+ */
+#define FLASHES_LOOPBACK_MCAST_IMAGE "flashes_mcast_image.bin"
+
+static void flashes_loopback_mcast_path(
+    os_char *buf,
+    os_memsz buf_sz,
+    const os_char *dir,
+    const os_char *name,
+    os_int nr);
+
+static os_int flashes_loopback_mcast_device(
+    const flashesSimConfig *config,
+    os_int devnr,
+    os_int drop_pct,
+    const flashitImage *img);
+
+
+/**
+****************************************************************************************************
+
+  @brief Multicast image to simulated devices.
+  @anchor flashes_loopback_multicast
+
+  The flashes_loopback_multicast() function starts device processes, multicasts the image to
+  them, waits for them to switch bank and verify, and prints how many were updated.
+
+  @param   config Flash simulation settings. Device directories are made under config->dir.
+  @param   img Image to send.
+  @param   ndevices Number of simulated devices.
+  @param   drop_pct Percentage of data packets each device drops.
+  @return  0 if all devices were updated, 1 otherwise.
+
+****************************************************************************************************
+*/
+os_int flashes_loopback_multicast(
+    const flashesSimConfig *config,
+    const flashitImage *img,
+    os_int ndevices,
+    os_int drop_pct)
+{
+    pid_t pid[FLASHES_LOOPBACK_MAX_DEVICES];
+    os_char path[FLASHES_LOOPBACK_PATH_SZ], nbuf[32];
+    os_long start_us, time_us;
+    os_timer start;
+    FILE *f;
+    os_int i, nrunning, nupdated, status;
+    os_boolean ok;
+
+    /* flashit multicast sends a binary file.
+     */
+    flashes_loopback_mcast_path(path, sizeof(path), config->dir,
+        FLASHES_LOOPBACK_MCAST_IMAGE, 0);
+    f = fopen(path, "wb");
+    ok = (os_boolean)(f && fwrite(img->image, 1, img->image_sz, f) == (size_t)img->image_sz);
+    if (f) fclose(f);
+    if (!ok)
+    {
+        osal_console_write("writing image file failed\n");
+        return 1;
+    }
+
+    /* Fork device processes. Nothing but the device loop runs in child.
+     */
+    for (i = 0; i < ndevices; i++)
+    {
+        pid[i] = fork();
+        if (pid[i] == 0)
+        {
+            _exit(flashes_loopback_mcast_device(config, i + 1, drop_pct, img));
+        }
+    }
+    os_sleep(FLASHES_LOOPBACK_MCAST_JOIN_MS);
+
+    start_us = flashes_loopback_now_us();
+    flashit_multicast(path, FLASHES_LOOPBACK_MCAST_RATE_KB);
+    time_us = flashes_loopback_now_us() - start_us;
+
+    /* Collect exit codes. Devices which have not finished in time have not been committed.
+     */
+    nupdated = 0;
+    nrunning = ndevices;
+    os_get_timer(&start);
+    while (nrunning)
+    {
+        for (i = 0; i < ndevices; i++)
+        {
+            if (pid[i] <= 0 || waitpid(pid[i], &status, WNOHANG) != pid[i]) continue;
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) nupdated++;
+            pid[i] = 0;
+            nrunning--;
+        }
+        if (nrunning == 0) break;
+        if (os_elapsed(&start, FLASHES_LOOPBACK_MCAST_EXIT_WAIT_MS))
+        {
+            for (i = 0; i < ndevices; i++)
+            {
+                if (pid[i] <= 0) continue;
+                kill(pid[i], SIGKILL);
+                waitpid(pid[i], &status, 0);
+            }
+            break;
+        }
+        os_sleep(10);
+    }
+
+    osal_console_write("multicast: ");
+    osal_int_to_string(nbuf, sizeof(nbuf), img->image_sz);
+    osal_console_write(nbuf);
+    osal_console_write(" bytes, drop ");
+    osal_int_to_string(nbuf, sizeof(nbuf), drop_pct);
+    osal_console_write(nbuf);
+    osal_console_write("%, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), nupdated);
+    osal_console_write(nbuf);
+    osal_console_write("/");
+    osal_int_to_string(nbuf, sizeof(nbuf), ndevices);
+    osal_console_write(nbuf);
+    osal_console_write(" devices updated and verified, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), time_us / 1000);
+    osal_console_write(nbuf);
+    osal_console_write(" ms\n");
+
+    return nupdated == ndevices ? 0 : 1;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Make path in simulation directory.
+  @anchor flashes_loopback_mcast_path
+
+  @param   buf Buffer for path.
+  @param   buf_sz Buffer size, bytes.
+  @param   dir Simulation directory.
+  @param   name File or directory name.
+  @param   nr Number to append to name, 0 for none.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_loopback_mcast_path(
+    os_char *buf,
+    os_memsz buf_sz,
+    const os_char *dir,
+    const os_char *name,
+    os_int nr)
+{
+    os_char nbuf[32];
+
+    os_strncpy(buf, dir, buf_sz);
+    os_strncat(buf, "/", buf_sz);
+    os_strncat(buf, name, buf_sz);
+    if (nr)
+    {
+        osal_int_to_string(nbuf, sizeof(nbuf), nr);
+        os_strncat(buf, nbuf, buf_sz);
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Run simulated device in child process.
+  @anchor flashes_loopback_mcast_device
+
+  The flashes_loopback_mcast_device() function sets up simulated flash in directory of its
+  own, fills the bank to be written as if it held an old image, and runs the device loop
+  until the boot bank is switched. Then it reads the new bank and compares it to the image.
+
+  Only one device can listen to the TCP transfer port, others report that listening failed.
+  This does not matter, multicast and discovery sockets are shared.
+
+  @param   config Flash simulation settings.
+  @param   devnr Device number, 1 - ndevices.
+  @param   drop_pct Percentage of data packets to drop.
+  @param   img Image being sent.
+  @return  Exit code, 0 if the device switched to the image and it matches.
+
+****************************************************************************************************
+*/
+static os_int flashes_loopback_mcast_device(
+    const flashesSimConfig *config,
+    os_int devnr,
+    os_int drop_pct,
+    const flashitImage *img)
+{
+    os_uchar buf[FLASHES_TRANSFER_BLOCK_SIZE];
+    os_char dir[FLASHES_LOOPBACK_PATH_SZ];
+    flashesSimConfig c;
+    os_memsz pos, n;
+    os_timer start;
+    os_boolean bank2;
+    os_int rval;
+
+    flashes_loopback_mcast_path(dir, sizeof(dir), config->dir, "dev", devnr);
+    mkdir(dir, 0755);
+    c = *config;
+    c.dir = dir;
+    if (flashes_sim_setup(&c)) return 1;
+    bank2 = flashes_is_bank2_selected();
+    if (flashes_sim_fill_bank(!bank2, 0)) return 1;
+
+#if FLASHES_MULTICAST_TEST
+    flashes_multicast_set_drop(drop_pct);
+#endif
+    flashes_socket_setup();
+    os_get_timer(&start);
+    rval = 1;
+    while (!os_elapsed(&start, FLASHES_LOOPBACK_MCAST_DEVICE_TIMEOUT_MS))
+    {
+        flashes_socket_loop();
+        if (flashes_is_bank2_selected() != bank2)
+        {
+            rval = 0;
+            break;
+        }
+        os_timeslice();
+    }
+
+    /* Read back the bank we now boot from.
+     */
+    for (pos = 0; rval == 0 && pos < img->image_sz; pos += n)
+    {
+        n = img->image_sz - pos;
+        if (n > FLASHES_TRANSFER_BLOCK_SIZE) n = FLASHES_TRANSFER_BLOCK_SIZE;
+        if (flashes_read((os_uint)pos, buf, (os_uint)n, !bank2) ||
+            os_memcmp(buf, img->image + pos, n))
+        {
+            rval = 1;
+        }
+    }
+
+    flashes_socket_cleanup();
+    flashes_sim_cleanup();
+    return rval;
+}
@@ -0,0 +1,275 @@
+/**
+
+  @file    flashes_relay.c
+  @brief   TCP relay which emulates slow network.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    24.9.2018
+
+  Relay accepts a connection, connects it to target address and forwards data both ways.
+  Data read from one side is queued in chunks, and each chunk is delivered to the other side
+  only after emulated network delay, jitter and bandwidth limit. Periodic stalls stop delivery
+  for a while, as cellular links do. This lets us see how protocol changes behave on VPN
+  and cellular links with long round trip time, without such links.
+
+  Relay is non blocking state machine: Call flashes_relay_run() repeatedly, for example from
+  the same loop which runs flashit transfer. One connection is relayed at a time.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashes_loopback.h"
+
+static void flashes_relay_forward(
+    flashesRelay *relay,
+    osalStream from,
+    osalStream to,
+    flashesRelayPipe *pipe,
+    os_long now);
+
+static void flashes_relay_disconnect(
+    flashesRelay *relay);
+
+
+/**
+****************************************************************************************************
+
+  @brief Start listening for connections to relay.
+  @anchor flashes_relay_open
+
+  @param   relay Relay state to set up.
+  @param   listen_addr Address to listen, like ":6828".
+  @param   target_addr Address where to connect accepted connections, like "127.0.0.1:6827".
+  @param   prm Network conditions to emulate. These may be changed later through relay->prm.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate that listening failed.
+
+****************************************************************************************************
+*/
+osalStatus flashes_relay_open(
+    flashesRelay *relay,
+    const os_char *listen_addr,
+    const os_char *target_addr,
+    const flashesRelayParams *prm)
+{
+    os_memclear(relay, sizeof(flashesRelay));
+    relay->prm = *prm;
+    os_strncpy(relay->target, target_addr, sizeof(relay->target));
+    relay->rand = 2463534242U;
+
+    relay->listen_socket = osal_stream_open(OSAL_SOCKET_IFACE, listen_addr, OS_NULL, OS_NULL,
+        OSAL_STREAM_LISTEN|OSAL_STREAM_NO_SELECT);
+    if (relay->listen_socket == OS_NULL)
+    {
+        osal_debug_error("relay: listening socket failed");
+        return OSAL_STATUS_FAILED;
+    }
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Forward data without blocking.
+  @anchor flashes_relay_run
+
+  The flashes_relay_run() function accepts incoming connection and connects it to target, if
+  no connection is being relayed. Then it moves data both ways as network conditions allow.
+  When either side closes, data already queued to the other side is delivered before closing it.
+
+  @param   relay Relay state.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_relay_run(
+    flashesRelay *relay)
+{
+    osalStream s;
+    os_long now;
+
+    /* Accept new connection.
+     */
+    s = osal_stream_accept(relay->listen_socket, OS_NULL, OSAL_STREAM_TCP_NODELAY);
+    if (s)
+    {
+        if (relay->in_socket)
+        {
+            osal_debug_error("relay: only one connection at a time");
+            osal_stream_close(s);
+        }
+        else
+        {
+            relay->out_socket = osal_stream_open(OSAL_SOCKET_IFACE, relay->target, OS_NULL,
+                OS_NULL, OSAL_STREAM_CONNECT|OSAL_STREAM_NO_SELECT|OSAL_STREAM_TCP_NODELAY);
+            if (relay->out_socket == OS_NULL)
+            {
+                osal_debug_error("relay: connecting target failed");
+                osal_stream_close(s);
+                return;
+            }
+            relay->in_socket = s;
+            os_memclear(&relay->up, sizeof(flashesRelayPipe));
+            os_memclear(&relay->down, sizeof(flashesRelayPipe));
+            relay->start_us = flashes_loopback_now_us();
+        }
+    }
+    if (relay->in_socket == OS_NULL) return;
+
+    now = flashes_loopback_now_us();
+    flashes_relay_forward(relay, relay->in_socket, relay->out_socket, &relay->up, now);
+    flashes_relay_forward(relay, relay->out_socket, relay->in_socket, &relay->down, now);
+
+    /* Close when one side has closed and everything from it is delivered.
+     */
+    if ((relay->up.closing && relay->up.count == 0) ||
+        (relay->down.closing && relay->down.count == 0))
+    {
+        flashes_relay_disconnect(relay);
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Close relay and connections.
+  @anchor flashes_relay_close
+
+  @param   relay Relay state.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashes_relay_close(
+    flashesRelay *relay)
+{
+    flashes_relay_disconnect(relay);
+    osal_stream_close(relay->listen_socket);
+    relay->listen_socket = OS_NULL;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Move data in one direction.
+  @anchor flashes_relay_forward
+
+  The flashes_relay_forward() function reads data from source into queue and timestamps it with
+  the time it may be delivered: When bandwidth limited link would have sent it, plus delay
+  and jitter, but never before the previous chunk. Chunks whose time has come are written to
+  destination, unless link is stalled.
+
+  @param   relay Relay state.
+  @param   from Source socket.
+  @param   to Destination socket.
+  @param   pipe Queue for this direction.
+  @param   now Current time, microseconds.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_relay_forward(
+    flashesRelay *relay,
+    osalStream from,
+    osalStream to,
+    flashesRelayPipe *pipe,
+    os_long now)
+{
+    flashesRelayParams *prm;
+    os_memsz n;
+    os_long t;
+    os_int i;
+
+    prm = &relay->prm;
+
+    /* Read into next free chunk.
+     */
+    while (!pipe->closing && pipe->count < FLASHES_RELAY_MAX_CHUNKS)
+    {
+        i = (pipe->head + pipe->count) % FLASHES_RELAY_MAX_CHUNKS;
+        if (osal_stream_read(from, pipe->data[i], FLASHES_RELAY_CHUNK_SZ, &n, OSAL_STREAM_DEFAULT))
+        {
+            pipe->closing = OS_TRUE;
+            break;
+        }
+        if (n == 0) break;
+
+        t = now;
+        if (prm->kbps > 0)
+        {
+            if (pipe->link_free_us > t) t = pipe->link_free_us;
+            t += (os_long)n * 8000 / prm->kbps;
+            pipe->link_free_us = t;
+        }
+        t += (os_long)prm->delay_ms * 1000;
+        if (prm->jitter_ms > 0)
+        {
+            relay->rand ^= relay->rand << 13;
+            relay->rand ^= relay->rand >> 17;
+            relay->rand ^= relay->rand << 5;
+            t += (os_long)(relay->rand % (os_uint)(prm->jitter_ms * 1000 + 1));
+        }
+        if (t < pipe->last_release_us) t = pipe->last_release_us;
+        pipe->last_release_us = t;
+
+        pipe->n[i] = (os_int)n;
+        pipe->pos[i] = 0;
+        pipe->release_us[i] = t;
+        pipe->count++;
+    }
+
+    /* Nothing is delivered during stall.
+     */
+    if (prm->stall_every_ms > 0 &&
+        (now - relay->start_us) % ((os_long)prm->stall_every_ms * 1000) < (os_long)prm->stall_ms * 1000)
+    {
+        return;
+    }
+
+    /* Deliver chunks whose time has come.
+     */
+    while (pipe->count > 0)
+    {
+        i = pipe->head;
+        if (pipe->release_us[i] > now) break;
+
+        if (osal_stream_write(to, pipe->data[i] + pipe->pos[i], pipe->n[i] - pipe->pos[i],
+            &n, OSAL_STREAM_DEFAULT))
+        {
+            pipe->closing = OS_TRUE;
+            pipe->count = 0;
+            break;
+        }
+        pipe->pos[i] += (os_int)n;
+        if (pipe->pos[i] < pipe->n[i]) break;
+
+        pipe->head = (pipe->head + 1) % FLASHES_RELAY_MAX_CHUNKS;
+        pipe->count--;
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Close relayed connection.
+  @anchor flashes_relay_disconnect
+
+  @param   relay Relay state.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashes_relay_disconnect(
+    flashesRelay *relay)
+{
+    osal_stream_close(relay->in_socket);
+    osal_stream_close(relay->out_socket);
+    relay->in_socket = relay->out_socket = OS_NULL;
+}
@@ -8,31 +8,24 @@
 
   Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
   modified, and distributed under the terms of the project licensing. By continuing to use, modify,
-  or distribute this file you indicate that you have read the license and understand and accept 
+  or distribute this file you indicate that you have read the license and understand and accept
   it fully.
 
 ****************************************************************************************************
 */
-#include "eosalx.h"
+#include "flashit.h"
 
-/* TCP port for transferring the program.
+/* Default number of concurrent transfers in fleet mode.
  */
-#ifndef FLASHES_SOCKET_PORT_STR
-#define FLASHES_SOCKET_PORT_STR ":6827"
-#endif
-
-/* Block size for the transfer. Selected to be small enough to fit easily to MCU RAM and
-   within an Ethernet frame, but large enough not to be a bottlenect in program transfer speed.
-   This must be also divisible by minimum transfer size. Changing block size from 1024 may
-   cause problems.
+#define FLASHIT_DEFAULT_CONCURRENCY 16
+
+/* Default time to collect discovery replies in scan mode, ms.
  */
-#ifndef FLASHES_TRANSFER_BLOCK_SIZE
-#define FLASHES_TRANSFER_BLOCK_SIZE 1024
-#endif
+#define FLASHIT_DEFAULT_SCAN_MS 500
 
-/* Time out if transfer connection becomes silent.
+/* Default multicast sending rate, kB/s. About what STM32F4 can program.
  */
-#define FLASHES_TRANSFER_TIMEOUT_MS 20000
+#define FLASHIT_DEFAULT_MCAST_KB 200
 
 
 /**
@@ -44,12 +37,50 @@
   code. The flashit is simple command line utility to transfer binary program to MCU
   over Ethernet.
 
+  Blocks are sent as windowed data frames: Up to "-w=N" frames can be in flight without
+  acknowledgement, and the MCU is asked to acknowledge every N/2 frame. Window size 1 selects
+  the original stop and wait protocol, which is understood also by older MCU software. If the
+  MCU closes the connection or does not reply to the first windowed frame, flashit prints a
+  message and falls back to stop and wait, so the default works with older MCU software too.
+  Patch and compressed transfers cannot fall back.
+
+  With "-d" option block checksums of the image MCU is running are queried first, and blocks
+  which are already there are copied by the MCU instead of transferred.
+
+  With "-p=old.bin" option delta patch from old.bin to the new binary is sent instead of the
+  binary. The MCU must be running exactly old.bin. With "-z" the binary is sent compressed.
+  With "-s" areas of erased flash value, 0xFF, are not sent, the MCU just skips over these.
+
+  With "-r=N" MCU is asked where to continue interrupted transfer of the same binary, and
+  broken connection is reconnected and resumed up to N times. MCU keeps progress record over
+  reboot. Resume is not used with delta patch or compression, reconnect then starts over.
+
+  With "-t" option timing statistics of MCU are fetched after the data and printed: How long
+  MCU waited for data, erased, programmed and wrote acknowledgements. If no binary is given,
+  only the statistics and the newest trace events are fetched.
+
+  With "-f=devices.txt" option many devices listed in the file are updated concurrently,
+  at most "-j=N" at a time, see flashit_fleet.c.
+
+  With "-l" option devices on the network are listed with one multicast query, see
+  flashit_scan.c. The list is in manifest format for "-f". If binary is given, devices which
+  already run it are left out.
+
+  With "-m" option the binary is multicast once to all devices listening, at "-m=N" kB/s,
+  and lost blocks are sent again as devices report them, see flashit_multicast.c. Devices
+  switch to the new image only once they have all of it verified.
+
+  With "-g" option the address is store-and-forward gateway of a site, see flashes-gateway
+  example. After the binary has been sent to the gateway, we wait until the gateway has
+  updated devices of the site and print its report. Without binary only the report of the
+  last update is fetched.
+
   This implementation uses non blocking sockets, but would be simpler using blocking sockets.
 
   @param   argc Number of command line arguments.
   @param   argv Array of string pointers, one for each command line argument. UTF8 encoded.
 
-  @return  None.
+  @return  0 if all transfers succeeded, 1 otherwise.
 
 ****************************************************************************************************
 */
@@ -57,23 +88,100 @@ os_int osal_main(
     os_int argc,
     os_char *argv[])
 {
-    osalStream f = OS_NULL, socket = OS_NULL;
-    osalStatus s;
-    os_char ipaddr[OSAL_HOST_BUF_SZ], *binfile, nbuf[64];
-    os_uchar buf[FLASHES_TRANSFER_BLOCK_SIZE], *pos = OS_NULL, reply[4], block_sz[2];
-    os_memsz n_read, n_written, buf_n;
-    os_int i, n, block_count;
-    os_timer timer;
-    os_boolean whole_file_read, waiting_for_reply, terminating_zero_packet_sent;
-
-    /* Get IP address/port and path to binary file.
+    static flashitTransfer t;
+    static flashitImage img;
+    flashitOptions opt;
+    os_char ipaddr[OSAL_HOST_BUF_SZ], *binfile, *manifest;
+    os_int i, max_concurrent, scan_ms, mcast_kb, rval;
+    os_boolean gateway;
+
+    /* Get IP address/port, path to binary file and options.
      */
     ipaddr[0] = '\0';
-    binfile = OS_NULL;
+    binfile = manifest = OS_NULL;
+    max_concurrent = FLASHIT_DEFAULT_CONCURRENCY;
+    scan_ms = mcast_kb = 0;
+    gateway = OS_FALSE;
+    os_memclear(&opt, sizeof(opt));
+    opt.window = FLASHES_DEFAULT_WINDOW;
     for (i = 1; i<argc; i++)
     {
-        if (argv[i][0] == '-') continue;
-        if (ipaddr[0] == '\0')
+        if (argv[i][0] == '-')
+        {
+            if (argv[i][1] == 'w' && argv[i][2] == '=')
+            {
+                opt.window = (os_int)osal_str_to_int(argv[i] + 3, OS_NULL);
+                if (opt.window < 1 || opt.window > FLASHES_MAX_WINDOW) goto showhelp;
+            }
+            else if (argv[i][1] == 'b' && argv[i][2] == '=')
+            {
+                opt.block_size = (os_int)osal_str_to_int(argv[i] + 3, OS_NULL);
+                if (opt.block_size < 16 || opt.block_size > FLASHES_TRANSFER_BLOCK_SIZE ||
+                    FLASHES_TRANSFER_BLOCK_SIZE % opt.block_size) goto showhelp;
+            }
+            else if (argv[i][1] == 'd')
+            {
+                opt.dedupe = OS_TRUE;
+            }
+            else if (argv[i][1] == 'p' && argv[i][2] == '=')
+            {
+                opt.oldfile = argv[i] + 3;
+            }
+            else if (argv[i][1] == 'z')
+            {
+                opt.compress = OS_TRUE;
+            }
+            else if (argv[i][1] == 's')
+            {
+                opt.sparse = OS_TRUE;
+            }
+            else if (argv[i][1] == 'r')
+            {
+                opt.resume = OS_TRUE;
+                if (argv[i][2] == '=')
+                {
+                    opt.retries = (os_int)osal_str_to_int(argv[i] + 3, OS_NULL);
+                    if (opt.retries < 0) goto showhelp;
+                }
+            }
+            else if (argv[i][1] == 't')
+            {
+                opt.stats = OS_TRUE;
+            }
+            else if (argv[i][1] == 'f' && argv[i][2] == '=')
+            {
+                manifest = argv[i] + 3;
+            }
+            else if (argv[i][1] == 'j' && argv[i][2] == '=')
+            {
+                max_concurrent = (os_int)osal_str_to_int(argv[i] + 3, OS_NULL);
+                if (max_concurrent < 1) goto showhelp;
+            }
+            else if (argv[i][1] == 'l')
+            {
+                scan_ms = FLASHIT_DEFAULT_SCAN_MS;
+                if (argv[i][2] == '=')
+                {
+                    scan_ms = (os_int)osal_str_to_int(argv[i] + 3, OS_NULL);
+                    if (scan_ms < 1) goto showhelp;
+                }
+            }
+            else if (argv[i][1] == 'g')
+            {
+                gateway = OS_TRUE;
+            }
+            else if (argv[i][1] == 'm')
+            {
+                mcast_kb = FLASHIT_DEFAULT_MCAST_KB;
+                if (argv[i][2] == '=')
+                {
+                    mcast_kb = (os_int)osal_str_to_int(argv[i] + 3, OS_NULL);
+                    if (mcast_kb < 1) goto showhelp;
+                }
+            }
+            continue;
+        }
+        if (ipaddr[0] == '\0' && manifest == OS_NULL && !scan_ms && !mcast_kb)
         {
             os_strncpy(ipaddr, argv[i], sizeof(ipaddr));
         }
@@ -82,175 +190,103 @@ os_int osal_main(
             binfile = argv[i];
         }
     }
-    if (binfile == OS_NULL) goto showhelp;
-    os_strncat(ipaddr, FLASHES_SOCKET_PORT_STR, sizeof(ipaddr));
+    if ((opt.oldfile || opt.compress) && opt.window == 1) goto showhelp;
+    if (opt.oldfile && opt.compress) goto showhelp;
 
-    /* Open source file.
+    /* Scan mode, the only argument is the binary.
      */
-    f = osal_file_open(binfile, OS_NULL, OS_NULL, OSAL_STREAM_READ);
-    if (f == OS_NULL)
+    if (scan_ms)
     {
-        osal_console_write("opening binary file failed\n");
-        goto getout;
+        return flashit_scan(binfile, scan_ms);
     }
-    osal_trace("binary file opened");
 
-    /* Connect socket.
+    /* Multicast mode, the only argument is the binary.
      */
-    socket = osal_stream_open(OSAL_SOCKET_IFACE, ipaddr, OS_NULL, OS_NULL,
-        OSAL_STREAM_CONNECT|OSAL_STREAM_NO_SELECT);
-    if (socket == OS_NULL)
+    if (mcast_kb)
     {
-        osal_console_write("socket connection failed\n");
-        goto getout;
+        if (binfile == OS_NULL) goto showhelp;
+        return flashit_multicast(binfile, mcast_kb);
     }
-    socket->write_timeout_ms = FLASHES_TRANSFER_TIMEOUT_MS;
-    osal_trace("socket connection initiated");
 
-    /* Transfer the program
+    /* Fleet mode.
      */
-    buf_n = 0;
-    whole_file_read = OS_FALSE;
-    waiting_for_reply = OS_FALSE;
-    terminating_zero_packet_sent = OS_FALSE;
-    block_count = 0;
-    while (OS_TRUE)
+    if (manifest)
     {
-        osal_socket_maintain();
-
-        /* Sending data.
-         */
-        if (!waiting_for_reply)
-        {
-            /* If we need to read more data.
-             */
-            if (buf_n == 0)
-            {
-                if (whole_file_read)
-                {
-                    buf_n = 0;
-                }
-                else
-                {
-                    s = osal_file_read(f, buf, sizeof(buf), &buf_n, OSAL_STREAM_DEFAULT);
-                    if (s)
-                    {
-                        osal_console_write("reading file failed\n");
-                        goto getout;
-                    }
-                }
-                pos = buf;
-
-                /* If all done, break.
-                 */
-                whole_file_read = (os_boolean)(buf_n < sizeof(buf));
-
-                /* Write block size with two bytes. Less significant byte first.
-                   We always write zero length block in the end to indicate end
-                   of the program.
-                 */
-                block_sz[0] = (os_uchar)buf_n;
-                block_sz[1] = (os_uchar)(buf_n >> 8);
-                n = 2;
-                s = osal_stream_write(socket, block_sz, n, &n_written, OSAL_STREAM_WAIT);
-                if (s || n_written != n)
-                {
-                    osal_console_write("socket connection failed\n");
-                    goto getout;
-                }
-                if (buf_n == 0)
-                {
-                    waiting_for_reply = terminating_zero_packet_sent = OS_TRUE;
-                    os_get_timer(&timer);
-                }
-                else
-                {
-                    osal_console_write("transferring block ");
-                    osal_int_to_string(nbuf, sizeof(nbuf), ++block_count);
-                    osal_console_write(nbuf);
-                    osal_console_write("... ");
-                }
-            }
+        return flashit_fleet(manifest, binfile, &opt, max_concurrent, OS_NULL);
+    }
 
-            /* Write data to socket.
-             */
-            if (buf_n)
-            {
-                s = osal_stream_write(socket, pos, buf_n, &n_written, OSAL_STREAM_DEFAULT);
-                if (s)
-                {
-                    osal_console_write("socket connection failed\n");
-                    goto getout;
-                }
-                buf_n -= n_written;
-                pos += n_written;
-                waiting_for_reply = (os_boolean)(buf_n == 0);
-                os_get_timer(&timer);
-            }
-        }
+    /* Only fetch report of the last update from gateway.
+     */
+    if (gateway && binfile == OS_NULL)
+    {
+        if (ipaddr[0] == '\0') goto showhelp;
+        return flashit_report(ipaddr, 0, 0);
+    }
 
-        /* Waiting for reply
-         */
-        else
-        {
-            /* Try to get MCU reply.
-             */
-            os_memclear(reply, sizeof(reply));
-            if (osal_stream_read(socket, reply, sizeof(reply), &n_read, OSAL_STREAM_DEFAULT))
-            {
-                osal_console_write("socket connection broken\n");
-                goto getout;
-            }
+    if (binfile == OS_NULL && !(opt.stats && opt.window > 1)) goto showhelp;
+    opt.verbose = OS_TRUE;
 
-            /* If we got the replay.
-             */
-            if (n_read > 0)
-            {
-                /* If reply is OK (small 'o' letter), then all is fine. Other replies
-                   indicate error. Interrupt the transfer.
-                 */
-                if (reply[0] == 'o')
-                {
-                    osal_console_write("ok\n");
-                }
-                else
-                {
-                    osal_console_write("error\n");
-                    osal_console_write("program transfer failed\n");
-                    goto getout;
-                }
+    /* Load the binary file to send, unless only fetching statistics.
+     */
+    rval = 1;
+    if (binfile)
+    {
+        if (flashit_image_load(&img, binfile, &opt)) goto getout;
+    }
 
-                /* No longer waiting for replay, we can move on to next packet.
-                   If this is reply to terminating zero package, all is done.
-                   Skip timeout checking by "continue".
-                 */
-                waiting_for_reply = OS_FALSE;
-                if (terminating_zero_packet_sent) break;
-                continue;
-            }
+    /* Transfer the program
+     */
+    if (flashit_transfer_start(&t, ipaddr, &img, &opt) == OSAL_SUCCESS)
+    {
+        while (!t.done)
+        {
+            osal_socket_maintain();
+            if (flashit_transfer_run(&t)) break;
+            if (t.done) break;
 
-            /* Check for time out.
+            /* Sleep until MCU replies or socket accepts more data.
              */
-            if (os_elapsed(&timer, FLASHES_TRANSFER_TIMEOUT_MS))
-            {
-                osal_console_write("waiting MCU reply timed out\n");
-                goto getout;
-            }
+            if (flashit_transfer_wait(&t, 1)) os_timeslice();
         }
-
-        /* Do not eat up all time of a processor core.
-         */
-        os_timeslice();
     }
+    if (t.done)
+    {
+        if (binfile) osal_console_write("Program succesfully transferred: ");
+        rval = 0;
+    }
+    flashit_transfer_report(&t);
+    flashit_transfer_close(&t);
 
-    osal_console_write("Program succesfully transferred\n");
+    /* The gateway has the binary now, wait until it has updated the site.
+     */
+    if (gateway && rval == 0)
+    {
+        rval = flashit_report(ipaddr, (os_uint)img.image_sz, img.image_crc);
+    }
 
 getout:
-    osal_file_close(f);
-    osal_stream_close(socket);
-    return 0;
+    flashit_image_release(&img);
+    return rval;
 
 showhelp:
-    osal_console_write("flashit 192.168.1.177 program.bin\n");
-    return 0;
+    osal_console_write("flashit [-w=8] [-b=1024] [-d] [-s] [-r=N] [-p=old.bin] [-z] [-t] 192.168.1.177[:port] program.bin\n");
+    osal_console_write("flashit -t 192.168.1.177[:port]\n");
+    osal_console_write("flashit -f=devices.txt [-j=16] [options] [program.bin]\n");
+    osal_console_write("flashit -l[=500] [program.bin]\n");
+    osal_console_write("flashit -m[=200] program.bin\n");
+    osal_console_write("flashit -g [options] gateway[:port] [program.bin]\n");
+    osal_console_write("  -w=N  number of blocks in flight, 1 = stop and wait protocol\n");
+    osal_console_write("  -b=N  data frame size, bytes, must divide 1024\n");
+    osal_console_write("  -d    copy blocks which MCU already has in running image\n");
+    osal_console_write("  -s    skip areas of erased flash value 0xFF\n");
+    osal_console_write("  -r=N  resume interrupted transfer, reconnect up to N times\n");
+    osal_console_write("  -p=F  send delta patch from F, which MCU must be running\n");
+    osal_console_write("  -z    send binary compressed\n");
+    osal_console_write("  -t    print MCU timing statistics, only these and trace if no program.bin\n");
+    osal_console_write("  -f=F  update devices listed in F, one \"address [program.bin]\" per line\n");
+    osal_console_write("  -j=N  number of devices updated at the same time in fleet mode\n");
+    osal_console_write("  -l=N  list devices replying within N ms, leave out those running program.bin\n");
+    osal_console_write("  -m=N  multicast program.bin to all devices at N kB/s\n");
+    osal_console_write("  -g    address is site gateway, wait for it to update devices and print report\n");
+    return 1;
 }
@@ -0,0 +1,391 @@
+/**
+
+  @file    flashit.h
+  @brief   Command line utility for Windows/Linux to transfer program to MCU over Ethernet.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    20.9.2018
+
+  Types and functions shared between flashit source files.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#ifndef FLASHIT_INCLUDED
+#define FLASHIT_INCLUDED
+
+#include "flashes.h"
+
+/* Time out if transfer connection becomes silent.
+ */
+#define FLASHES_TRANSFER_TIMEOUT_MS 20000
+
+/* Reply buffer size, must fit largest reply: Hash reply with FLASHES_HASH_QUERY_MAX checksums.
+   Trace reply with FLASHES_TRACE_REPLY_MAX events is a bit smaller.
+ */
+#define FLASHIT_REPLY_BUF_SZ (FLASHES_HASH_REPLY_HDR_SZ + 4 * FLASHES_HASH_QUERY_MAX + 16)
+
+/* Shortest run of erased value bytes sent as skip frame.
+ */
+#define FLASHIT_MIN_SKIP 32
+
+/* Control frame payload buffer size.
+ */
+#define FLASHIT_CTRL_BUF_SZ 16
+
+/* Delay before reconnecting broken transfer, ms.
+ */
+#define FLASHIT_RETRY_DELAY_MS 1000
+
+/* Maximum number of sockets to wait on at once, and how long to wait if there are more
+   running transfers than that, ms.
+ */
+#define FLASHIT_SELECT_MAX 64
+#define FLASHIT_POLL_MS 1
+
+/* How often to ask gateway how distribution is going, ms.
+ */
+#define FLASHIT_REPORT_POLL_MS 1000
+
+/** Transfer options from command line, same for all devices.
+ */
+typedef struct
+{
+    /* Window size in frames, 1 for stop and wait protocol.
+     */
+    os_int window;
+
+    /* Data frame size, bytes. Must divide FLASHES_TRANSFER_BLOCK_SIZE. 0 for default, which
+       is FLASHES_TRANSFER_BLOCK_SIZE.
+     */
+    os_int block_size;
+
+    /* Block deduplication, skip erased areas, compress.
+     */
+    os_boolean dedupe;
+    os_boolean sparse;
+    os_boolean compress;
+
+    /* Path to image MCU is running, to send delta patch. OS_NULL if not used.
+     */
+    const os_char *oldfile;
+
+    /* Ask MCU where to continue interrupted transfer, and number of times to reconnect
+       if connection breaks.
+     */
+    os_boolean resume;
+    os_int retries;
+
+    /* Fetch timing statistics from MCU after transfer, or only fetch these and trace events
+       if no binary is given.
+     */
+    os_boolean stats;
+
+    /* Print progress of each block.
+     */
+    os_boolean verbose;
+}
+flashitOptions;
+
+/** Binary to transfer, loaded into memory. When several devices get the same file, this
+    is shared by the transfers.
+ */
+typedef struct flashitImage
+{
+    /* Path to binary file.
+     */
+    const os_char *path;
+
+    /* File content. The file is mapped to memory if the operating system supports it,
+       otherwise read into allocated buffer.
+     */
+    os_uchar *image;
+    os_memsz image_sz;
+    os_memsz image_alloc;
+    os_boolean image_mapped;
+
+    /* CRC-32 of the whole file, identifies the image when resuming.
+     */
+    os_uint image_crc;
+
+    /* Delta patch or compressed image to send instead of image, OS_NULL if neither. Frame
+       type, FLASHES_FRAME_PATCH or FLASHES_FRAME_COMPRESSED.
+     */
+    os_uchar *stream;
+    os_memsz stream_sz;
+    os_memsz stream_alloc;
+    os_uint stream_type;
+
+    /* Next loaded image, used by fleet mode.
+     */
+    struct flashitImage *next;
+}
+flashitImage;
+
+/** Result of fleet update.
+ */
+typedef struct
+{
+    /* Number of devices, devices updated and devices failed.
+     */
+    os_int ndevices;
+    os_int nok;
+    os_int nfailed;
+
+    /* Total time and time of the slowest device, ms.
+     */
+    os_long total_ms;
+    os_long slowest_ms;
+
+    /* One line for each failed device, address and reason. Truncated if it doesn't fit.
+     */
+    os_char failed[FLASHES_REPORT_TEXT_MAX];
+}
+flashitFleetSummary;
+
+/** State of one program transfer.
+ */
+typedef struct
+{
+    /* Socket connected to MCU.
+     */
+    osalStream socket;
+
+    /* Device address with port, for messages.
+     */
+    os_char ipaddr[OSAL_HOST_BUF_SZ];
+
+    /* Binary to transfer, points to flashitImage, and CRC-32 of it.
+     */
+    const os_uchar *image;
+    os_memsz image_sz;
+    os_uint image_crc;
+
+    /* Position in image of the next byte to send or copy.
+     */
+    os_memsz image_pos;
+
+    /* Delta patch or compressed image, points to flashitImage, and position of the next
+       byte to send.
+     */
+    const os_uchar *stream;
+    os_memsz stream_sz;
+    os_uint stream_type;
+    os_memsz stream_pos;
+
+    /* Options: Window size in frames, data frame size, acknowledge every N frames, stop and
+       wait protocol, MCU has replied in windowed mode, block deduplication, skip erased areas,
+       print progress.
+     */
+    os_int window;
+    os_int block_size;
+    os_int ack_every;
+    os_boolean legacy;
+    os_boolean confirmed;
+    os_boolean dedupe;
+    os_boolean sparse;
+    os_boolean verbose;
+
+    /* Ask MCU where to continue, number of reconnects left, and reconnect after delay
+       is pending. MCU closed connection or did not reply to the first windowed frame.
+     */
+    os_boolean resume;
+    os_int retries_left;
+    os_boolean reconnecting;
+    os_boolean rejected;
+    os_timer retry_timer;
+
+    /* Fetch MCU timing statistics before terminating block, or only fetch them. Sequence
+       number of the query frame and statistics received.
+     */
+    os_boolean stats;
+    os_boolean stats_only;
+    os_boolean stats_sent;
+    os_boolean stats_received;
+    os_ushort stats_seq;
+    flashesStat mcu_stats[FLASHES_NRO_STATS];
+
+    /* Trace events fetched from MCU when only fetching statistics, and MCU cycle counter
+       ticks per microsecond.
+     */
+    os_boolean trace_sent;
+    os_boolean trace_received;
+    os_int trace_count;
+    os_uint trace_cycles_per_us;
+    flashesTraceEvent trace[FLASHES_TRACE_REPLY_MAX];
+
+    /* CRC-32 checksums of blocks of the image MCU is running, for deduplication. Number of
+       blocks in image, number of blocks queried so far and number of valid checksums.
+     */
+    os_uint *hashes;
+    os_memsz hashes_alloc;
+    os_int nblocks;
+    os_int query_block;
+    os_int nhashes;
+
+    /* Sequence numbers of last frame sent and last frame acknowledged.
+     */
+    os_ushort sent_seq;
+    os_ushort acked_seq;
+
+    /* Image position after each frame in flight, indexed by sequence number.
+     */
+    os_memsz frame_end_pos[FLASHES_MAX_WINDOW];
+
+    /* Frame being written: Header and payload are copied to frame buffer, so that the frame
+       goes to socket with one write. Control frame payload is prepared in ctrl buffer.
+     */
+    const os_uchar *pos;
+    os_memsz buf_n;
+    os_boolean writing_block;
+    os_uchar ctrl[FLASHIT_CTRL_BUF_SZ];
+    os_uchar frame[FLASHES_FRAME_HDR_SZ + FLASHES_TRANSFER_BLOCK_SIZE];
+
+    /* Transfer state. Error is description of why transfer failed, OS_NULL if not failed.
+     */
+    os_boolean terminating_zero_packet_sent;
+    os_boolean image_info_sent;
+    os_boolean digest_sent;
+    os_boolean resume_pending;
+    os_boolean hash_query_pending;
+    os_boolean done;
+    const os_char *error;
+
+    /* Replies were processed by last run, so window may have room: Run again before waiting.
+     */
+    os_boolean run_again;
+
+    /* Replies received from MCU, not yet processed.
+     */
+    os_uchar reply[FLASHIT_REPLY_BUF_SZ];
+    os_memsz reply_n;
+
+    /* Timer for detecting silent connection, and time when transfer was started.
+     */
+    os_timer timer;
+    os_timer start_timer;
+
+    /* Statistics: Bytes sent in data frames, bytes copied by MCU and erased bytes skipped.
+       Image position where the last connection resumed and number of reconnects.
+     */
+    os_memsz sent_bytes;
+    os_memsz copied_bytes;
+    os_memsz skipped_bytes;
+    os_int block_count;
+    os_memsz resumed_pos;
+    os_int reconnects;
+}
+flashitTransfer;
+
+
+/* Load binary and generate delta patch or compressed stream from it, if needed.
+ */
+osalStatus flashit_image_load(
+    flashitImage *img,
+    const os_char *path,
+    const flashitOptions *opt);
+
+/* Release memory allocated for image.
+ */
+void flashit_image_release(
+    flashitImage *img);
+
+/* Load whole file into memory.
+ */
+os_uchar *flashit_load_file(
+    const os_char *path,
+    os_memsz *file_sz,
+    os_memsz *alloc_sz);
+
+/* Map file to memory for reading.
+ */
+os_uchar *flashit_map_file(
+    const os_char *path,
+    os_memsz *file_sz);
+
+/* Unmap file mapped by flashit_map_file().
+ */
+void flashit_unmap_file(
+    os_uchar *data,
+    os_memsz file_sz);
+
+/* Connect to device and start transfer.
+ */
+osalStatus flashit_transfer_start(
+    flashitTransfer *t,
+    const os_char *ipaddr,
+    const flashitImage *img,
+    const flashitOptions *opt);
+
+/* Move transfer forward without blocking.
+ */
+osalStatus flashit_transfer_run(
+    flashitTransfer *t);
+
+/* Wait until one of transfers can move forward.
+ */
+osalStatus flashit_transfer_wait(
+    flashitTransfer *transfers,
+    os_int n);
+
+/* Close transfer and release memory.
+ */
+void flashit_transfer_close(
+    flashitTransfer *t);
+
+/* Print transfer result.
+ */
+void flashit_transfer_report(
+    flashitTransfer *t);
+
+/* Update many devices concurrently.
+ */
+os_int flashit_fleet(
+    const os_char *manifest,
+    const os_char *binfile,
+    const flashitOptions *opt,
+    os_int max_concurrent,
+    flashitFleetSummary *summary);
+
+/* Wait until gateway has distributed image to its site and print the report.
+ */
+os_int flashit_report(
+    const os_char *ipaddr,
+    os_uint image_size,
+    os_uint image_crc);
+
+/* List devices on the network.
+ */
+os_int flashit_scan(
+    const os_char *binfile,
+    os_int wait_ms);
+
+/* Send image to all listening devices with multicast.
+ */
+os_int flashit_multicast(
+    const os_char *binfile,
+    os_int rate_kb);
+
+/* Generate delta patch which turns old image into new one.
+ */
+os_uchar *flashit_delta_generate(
+    const os_uchar *old_image,
+    os_memsz old_sz,
+    const os_uchar *new_image,
+    os_memsz new_sz,
+    os_memsz *patch_sz,
+    os_memsz *alloc_sz);
+
+/* Compress binary.
+ */
+os_uchar *flashit_compress(
+    const os_uchar *image,
+    os_memsz image_sz,
+    os_memsz *compressed_sz,
+    os_memsz *alloc_sz);
+
+#endif
@@ -0,0 +1,59 @@
+/**
+
+  @file    flashit_compress.c
+  @brief   Compress binary for transfer.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    20.9.2018
+
+  The binary is compressed by the flashes library encoder, so that format is always the same
+  as the device decodes. See flashes_lz.h.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashit.h"
+
+
+/**
+****************************************************************************************************
+
+  @brief Compress binary.
+  @anchor flashit_compress
+
+  The flashit_compress() function compresses whole binary into buffer allocated by os_malloc().
+
+  @param   image Binary to compress.
+  @param   image_sz Binary size in bytes.
+  @param   compressed_sz Pointer where to store compressed size in bytes.
+  @param   alloc_sz Pointer where to store allocated buffer size, needed for os_free().
+  @return  Pointer to compressed data, or OS_NULL if out of memory.
+
+****************************************************************************************************
+*/
+os_uchar *flashit_compress(
+    const os_uchar *image,
+    os_memsz image_sz,
+    os_memsz *compressed_sz,
+    os_memsz *alloc_sz)
+{
+    flashesLzEncoder *e;
+    os_uchar *buf;
+    os_memsz e_alloc;
+
+    *compressed_sz = *alloc_sz = 0;
+    e = (flashesLzEncoder*)os_malloc(sizeof(flashesLzEncoder), &e_alloc);
+    if (e == OS_NULL) return OS_NULL;
+
+    buf = (os_uchar*)os_malloc(FLASHES_LZ_MAX_COMPRESSED_SZ(image_sz), alloc_sz);
+    if (buf)
+    {
+        *compressed_sz = flashes_lz_compress(e, image, image_sz, buf, *alloc_sz);
+    }
+    os_free(e, e_alloc);
+    return buf;
+}
@@ -0,0 +1,401 @@
+/**
+
+  @file    flashit_delta.c
+  @brief   Generate binary delta patch.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    20.9.2018
+
+  Delta patch generator for flashit. The patch format is described in flashes_delta.h.
+
+  Matches are searched with hash table of 8 byte sequences of the old image. Byte ranges
+  between matches are encoded as ADD against the old image, continuing from the previous match,
+  if most bytes are the same. This is typical when code has been recompiled and only addresses
+  within it have moved. Otherwise bytes are sent as INSERT.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashit.h"
+
+/* Number of bytes hashed to find match candidates, and hash table size as bits.
+ */
+#define FLASHIT_DELTA_KEY 8
+#define FLASHIT_DELTA_HASH_BITS 18
+
+/* Shorter matches at new position in old image are not worth an operation. Match which
+   continues from the previous one needs no seek, so it is taken when at least key long.
+ */
+#define FLASHIT_DELTA_MIN_MATCH 16
+
+/* Maximum number of candidates checked for each position.
+ */
+#define FLASHIT_DELTA_MAX_CHAIN 64
+
+/** Patch being generated.
+ */
+typedef struct
+{
+    os_uchar *buf;
+    os_memsz n;
+    os_memsz alloc;
+    os_boolean failed;
+
+    /* Old and new image.
+     */
+    const os_uchar *old_image;
+    os_memsz old_sz;
+    const os_uchar *new_image;
+
+    /* Position in old image, as the decoder will have it.
+     */
+    os_memsz old_pos;
+}
+flashitDelta;
+
+static void flashit_delta_gap(
+    flashitDelta *d,
+    os_memsz start,
+    os_memsz end);
+
+static void flashit_delta_op(
+    flashitDelta *d,
+    os_uchar op,
+    os_memsz len,
+    os_long seek);
+
+static void flashit_delta_put(
+    flashitDelta *d,
+    const os_uchar *data,
+    os_memsz n);
+
+static os_memsz flashit_delta_match_len(
+    flashitDelta *d,
+    os_memsz old_pos,
+    os_memsz new_pos,
+    os_memsz new_sz);
+
+static os_uint flashit_delta_hash(
+    const os_uchar *p);
+
+
+/**
+****************************************************************************************************
+
+  @brief Generate delta patch which turns old image into new one.
+  @anchor flashit_delta_generate
+
+  The flashit_delta_generate() function compares the new image to the old one, which the MCU
+  is running, and generates patch which the MCU can apply by flashes_delta_decode().
+
+  @param   old_image Image MCU is running.
+  @param   old_sz Old image size in bytes.
+  @param   new_image Image to transfer.
+  @param   new_sz New image size in bytes.
+  @param   patch_sz Pointer where to store patch size in bytes.
+  @param   alloc_sz Pointer where to store allocated buffer size, needed for os_free().
+  @return  Pointer to patch allocated by os_malloc(), or OS_NULL if out of memory.
+
+****************************************************************************************************
+*/
+os_uchar *flashit_delta_generate(
+    const os_uchar *old_image,
+    os_memsz old_sz,
+    const os_uchar *new_image,
+    os_memsz new_sz,
+    os_memsz *patch_sz,
+    os_memsz *alloc_sz)
+{
+    flashitDelta d;
+    os_int *head = OS_NULL, *next = OS_NULL;
+    os_memsz head_alloc = 0, next_alloc = 0, p, lit, q, len, best_len, best_pos;
+    os_int i, c;
+
+    *patch_sz = *alloc_sz = 0;
+    os_memclear(&d, sizeof(d));
+    d.old_image = old_image;
+    d.old_sz = old_sz;
+    d.new_image = new_image;
+
+    /* Index every position of the old image by hash of the bytes starting from it.
+       Later positions are in front of the chain.
+     */
+    head = (os_int*)os_malloc(sizeof(os_int) << FLASHIT_DELTA_HASH_BITS, &head_alloc);
+    if (old_sz) next = (os_int*)os_malloc(old_sz * sizeof(os_int), &next_alloc);
+    if (head == OS_NULL || (old_sz && next == OS_NULL)) goto failed;
+    for (i = 0; i < (1 << FLASHIT_DELTA_HASH_BITS); i++) head[i] = -1;
+    for (q = 0; q + FLASHIT_DELTA_KEY <= old_sz; q++)
+    {
+        i = (os_int)flashit_delta_hash(old_image + q);
+        next[q] = head[i];
+        head[i] = (os_int)q;
+    }
+
+    /* Scan new image for matches. Bytes from lit to p have no match yet.
+     */
+    p = lit = 0;
+    while (p + FLASHIT_DELTA_KEY <= new_sz)
+    {
+        /* Continuing from previous match, as if bytes between were replaced.
+         */
+        best_len = best_pos = 0;
+        q = d.old_pos + (p - lit);
+        len = flashit_delta_match_len(&d, q, p, new_sz);
+        if (len >= FLASHIT_DELTA_KEY)
+        {
+            best_len = len;
+            best_pos = q;
+        }
+
+        /* Longest match elsewhere in old image.
+         */
+        i = head[flashit_delta_hash(new_image + p)];
+        for (c = 0; i >= 0 && c < FLASHIT_DELTA_MAX_CHAIN; c++, i = next[i])
+        {
+            len = flashit_delta_match_len(&d, (os_memsz)i, p, new_sz);
+            if (len >= FLASHIT_DELTA_MIN_MATCH && len > best_len + 2)
+            {
+                best_len = len;
+                best_pos = (os_memsz)i;
+            }
+        }
+
+        if (best_len == 0)
+        {
+            p++;
+            continue;
+        }
+
+        flashit_delta_gap(&d, lit, p);
+        flashit_delta_op(&d, FLASHES_DELTA_COPY, best_len,
+            (os_long)best_pos - (os_long)d.old_pos);
+        d.old_pos = best_pos + best_len;
+        p += best_len;
+        lit = p;
+    }
+    flashit_delta_gap(&d, lit, new_sz);
+    if (d.failed) goto failed;
+
+    os_free(head, head_alloc);
+    if (next) os_free(next, next_alloc);
+    *patch_sz = d.n;
+    *alloc_sz = d.alloc;
+    return d.buf;
+
+failed:
+    if (head) os_free(head, head_alloc);
+    if (next) os_free(next, next_alloc);
+    if (d.buf) os_free(d.buf, d.alloc);
+    return OS_NULL;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Encode bytes which have no match.
+  @anchor flashit_delta_gap
+
+  The flashit_delta_gap() function writes new image bytes from start to end as ADD operation,
+  if at least half of them are equal to old image at current old position, or as INSERT
+  otherwise.
+
+  @param   d Patch being generated.
+  @param   start Position of the first byte in new image.
+  @param   end Position after the last byte.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashit_delta_gap(
+    flashitDelta *d,
+    os_memsz start,
+    os_memsz end)
+{
+    os_uchar diff[256];
+    os_memsz n, i, same, k;
+
+    n = end - start;
+    if (n == 0) return;
+
+    same = 0;
+    if (d->old_pos + n <= d->old_sz)
+    {
+        for (i = 0; i < n; i++)
+        {
+            if (d->old_image[d->old_pos + i] == d->new_image[start + i]) same++;
+        }
+    }
+
+    if (2 * same < n)
+    {
+        flashit_delta_op(d, FLASHES_DELTA_INSERT, n, 0);
+        flashit_delta_put(d, d->new_image + start, n);
+        return;
+    }
+
+    flashit_delta_op(d, FLASHES_DELTA_ADD, n, 0);
+    for (i = 0; i < n; i += k)
+    {
+        k = n - i;
+        if (k > (os_memsz)sizeof(diff)) k = sizeof(diff);
+        for (same = 0; same < k; same++)
+        {
+            diff[same] = (os_uchar)(d->new_image[start + i + same] -
+                d->old_image[d->old_pos + i + same]);
+        }
+        flashit_delta_put(d, diff, k);
+    }
+    d->old_pos += n;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Write operation code, length and seek.
+  @anchor flashit_delta_op
+
+  Length and seek are written as variable length integers, seek zig-zag encoded. INSERT has
+  no seek.
+
+  @param   d Patch being generated.
+  @param   op Operation code, FLASHES_DELTA_COPY, FLASHES_DELTA_ADD or FLASHES_DELTA_INSERT.
+  @param   len Operation length in bytes.
+  @param   seek Change of old image position before the operation.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashit_delta_op(
+    flashitDelta *d,
+    os_uchar op,
+    os_memsz len,
+    os_long seek)
+{
+    os_uchar buf[12];
+    os_int n, i;
+    os_ulong x;
+
+    n = 0;
+    buf[n++] = op;
+    for (i = 0; i < 2; i++)
+    {
+        if (i == 0) x = (os_ulong)len;
+        else if (op == FLASHES_DELTA_INSERT) break;
+        else x = seek < 0 ? ((os_ulong)(-seek - 1) << 1) | 1 : (os_ulong)seek << 1;
+
+        while (x >= 0x80)
+        {
+            buf[n++] = (os_uchar)(x | 0x80);
+            x >>= 7;
+        }
+        buf[n++] = (os_uchar)x;
+    }
+    flashit_delta_put(d, buf, n);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Append bytes to patch.
+  @anchor flashit_delta_put
+
+  The patch buffer is grown as needed. If memory allocation fails, failed flag is set.
+
+  @param   d Patch being generated.
+  @param   data Bytes to append.
+  @param   n Number of bytes.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashit_delta_put(
+    flashitDelta *d,
+    const os_uchar *data,
+    os_memsz n)
+{
+    os_uchar *newbuf;
+    os_memsz alloc, sz;
+
+    if (d->failed) return;
+    if (d->n + n > d->alloc)
+    {
+        sz = d->alloc ? 2 * d->alloc : 64 * FLASHES_TRANSFER_BLOCK_SIZE;
+        while (sz < d->n + n) sz *= 2;
+        newbuf = (os_uchar*)os_malloc(sz, &alloc);
+        if (newbuf == OS_NULL)
+        {
+            d->failed = OS_TRUE;
+            return;
+        }
+        if (d->buf)
+        {
+            os_memcpy(newbuf, d->buf, d->n);
+            os_free(d->buf, d->alloc);
+        }
+        d->buf = newbuf;
+        d->alloc = alloc;
+    }
+    os_memcpy(d->buf + d->n, data, n);
+    d->n += n;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Get length of matching byte sequence.
+  @anchor flashit_delta_match_len
+
+  @param   d Patch being generated.
+  @param   old_pos Position in old image.
+  @param   new_pos Position in new image.
+  @param   new_sz New image size.
+  @return  Number of equal bytes.
+
+****************************************************************************************************
+*/
+static os_memsz flashit_delta_match_len(
+    flashitDelta *d,
+    os_memsz old_pos,
+    os_memsz new_pos,
+    os_memsz new_sz)
+{
+    os_memsz n;
+
+    n = 0;
+    while (old_pos + n < d->old_sz && new_pos + n < new_sz &&
+        d->old_image[old_pos + n] == d->new_image[new_pos + n])
+    {
+        n++;
+    }
+    return n;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Hash FLASHIT_DELTA_KEY bytes.
+  @anchor flashit_delta_hash
+
+  @param   p Pointer to bytes.
+  @return  Hash table index.
+
+****************************************************************************************************
+*/
+static os_uint flashit_delta_hash(
+    const os_uchar *p)
+{
+    os_uint a, b;
+
+    a = (os_uint)p[0] | ((os_uint)p[1] << 8) | ((os_uint)p[2] << 16) | ((os_uint)p[3] << 24);
+    b = (os_uint)p[4] | ((os_uint)p[5] << 8) | ((os_uint)p[6] << 16) | ((os_uint)p[7] << 24);
+    return ((a * 2654435761U) ^ (b * 2246822519U)) >> (32 - FLASHIT_DELTA_HASH_BITS);
+}
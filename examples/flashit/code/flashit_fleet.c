@@ -0,0 +1,396 @@
+/**
+
+  @file    flashit_fleet.c
+  @brief   Update many devices concurrently.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    20.9.2018
+
+  Fleet mode reads list of devices from manifest file and runs transfers to these side by side
+  from one thread, at most given number at a time. Each transfer is non blocking state machine,
+  see flashit_transfer.c, so total update time is set by the slowest devices, not by the sum
+  over all devices.
+
+  Manifest has one device per line: Address, optionally followed by path to binary for this
+  device. If binary is not given, the one from command line is used. Text after '#' is
+  comment, empty lines are ignored. For example:
+
+    # line 1
+    192.168.1.201
+    192.168.1.202 special.bin   # different board
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashit.h"
+
+/** Device state in fleet.
+ */
+#define FLASHIT_DEVICE_WAITING 0
+#define FLASHIT_DEVICE_RUNNING 1
+#define FLASHIT_DEVICE_OK 2
+#define FLASHIT_DEVICE_FAILED 3
+
+/** Device listed in manifest.
+ */
+typedef struct
+{
+    /* Device address, port is optional.
+     */
+    os_char ipaddr[OSAL_HOST_BUF_SZ];
+
+    /* Binary for this device.
+     */
+    flashitImage *img;
+
+    /* Device state, FLASHIT_DEVICE_WAITING... Reason for failure and time used.
+     */
+    os_int state;
+    const os_char *error;
+    os_long time_ms;
+}
+flashitFleetDevice;
+
+static os_int flashit_fleet_parse(
+    os_char *text,
+    os_memsz text_sz,
+    flashitFleetDevice *devices,
+    const os_char *binfile,
+    const flashitOptions *opt,
+    flashitImage **images);
+
+static void flashit_fleet_finish(
+    flashitTransfer *t,
+    flashitFleetDevice *dev);
+
+
+/**
+****************************************************************************************************
+
+  @brief Update many devices concurrently.
+  @anchor flashit_fleet
+
+  The flashit_fleet() function reads manifest and loads all binaries first, so that errors
+  in these are reported before any device is touched. Then transfers are run, at most
+  max_concurrent at a time. Result of each device is printed when it completes, summary
+  in the end.
+
+  @param   manifest Path to manifest file.
+  @param   binfile Binary for devices which have none in manifest, may be OS_NULL.
+  @param   opt Transfer options.
+  @param   max_concurrent Maximum number of transfers running at the same time.
+  @param   summary Where to store summary, may be OS_NULL. Zero devices if manifest or
+           binaries could not be read.
+  @return  0 if all devices were updated, 1 otherwise.
+
+****************************************************************************************************
+*/
+os_int flashit_fleet(
+    const os_char *manifest,
+    const os_char *binfile,
+    const flashitOptions *opt,
+    os_int max_concurrent,
+    flashitFleetSummary *summary)
+{
+    os_char *text = OS_NULL, nbuf[32];
+    os_memsz text_sz, text_alloc, devices_alloc = 0, transfers_alloc = 0, slots_alloc = 0;
+    flashitFleetDevice *devices = OS_NULL, *dev;
+    flashitTransfer *transfers = OS_NULL, *t;
+    flashitImage *images = OS_NULL, *img;
+    os_int *slot_dev = OS_NULL;
+    os_int ndevices, i, next, running, nok, nfailed, rval = 1;
+    os_long slowest_ms;
+    os_timer start, now;
+
+    if (summary) os_memclear(summary, sizeof(flashitFleetSummary));
+
+    /* Read manifest. The buffer is always bigger than the file, so there is space for
+       terminating '\0'. One device per line at most, so count lines for allocation.
+     */
+    text = (os_char*)flashit_load_file(manifest, &text_sz, &text_alloc);
+    if (text == OS_NULL)
+    {
+        osal_console_write("reading manifest failed\n");
+        return 1;
+    }
+    text[text_sz] = '\0';
+    ndevices = 1;
+    for (i = 0; i < text_sz; i++)
+    {
+        if (text[i] == '\n') ndevices++;
+    }
+    devices = (flashitFleetDevice*)os_malloc(ndevices * sizeof(flashitFleetDevice), &devices_alloc);
+    if (devices == OS_NULL) goto getout;
+    os_memclear(devices, ndevices * sizeof(flashitFleetDevice));
+
+    ndevices = flashit_fleet_parse(text, text_sz, devices, binfile, opt, &images);
+    if (ndevices <= 0) goto getout;
+
+    /* Transfer state for each concurrent slot, and which device runs in it.
+     */
+    if (max_concurrent > ndevices) max_concurrent = ndevices;
+    transfers = (flashitTransfer*)os_malloc(max_concurrent * sizeof(flashitTransfer),
+        &transfers_alloc);
+    slot_dev = (os_int*)os_malloc(max_concurrent * sizeof(os_int), &slots_alloc);
+    if (transfers == OS_NULL || slot_dev == OS_NULL) goto getout;
+    os_memclear(transfers, max_concurrent * sizeof(flashitTransfer));
+    for (i = 0; i < max_concurrent; i++) slot_dev[i] = -1;
+
+    /* Run transfers until all devices have been done.
+     */
+    os_get_timer(&start);
+    next = running = 0;
+    while (next < ndevices || running)
+    {
+        osal_socket_maintain();
+
+        for (i = 0; i < max_concurrent; i++)
+        {
+            t = transfers + i;
+
+            /* Start next device in free slot.
+             */
+            if (slot_dev[i] < 0)
+            {
+                if (next >= ndevices) continue;
+                dev = devices + next;
+                if (flashit_transfer_start(t, dev->ipaddr, dev->img, opt))
+                {
+                    flashit_fleet_finish(t, dev);
+                    next++;
+                    continue;
+                }
+                dev->state = FLASHIT_DEVICE_RUNNING;
+                slot_dev[i] = next++;
+                running++;
+            }
+
+            /* Move running transfer forward.
+             */
+            dev = devices + slot_dev[i];
+            if (flashit_transfer_run(t) || t->done)
+            {
+                flashit_fleet_finish(t, dev);
+                slot_dev[i] = -1;
+                running--;
+            }
+        }
+
+        /* Sleep until one of devices replies or socket accepts more data. Free slot is
+           filled on the next round without waiting.
+         */
+        if (running == 0 || (next < ndevices && running < max_concurrent)) continue;
+        if (flashit_transfer_wait(transfers, max_concurrent)) os_timeslice();
+    }
+    os_get_timer(&now);
+
+    /* Summary.
+     */
+    nok = nfailed = 0;
+    slowest_ms = 0;
+    for (i = 0; i < ndevices; i++)
+    {
+        dev = devices + i;
+        if (dev->state == FLASHIT_DEVICE_OK) nok++;
+        else nfailed++;
+        if (dev->time_ms > slowest_ms) slowest_ms = dev->time_ms;
+    }
+
+    osal_console_write("fleet: ");
+    osal_int_to_string(nbuf, sizeof(nbuf), ndevices);
+    osal_console_write(nbuf);
+    osal_console_write(" devices, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), nok);
+    osal_console_write(nbuf);
+    osal_console_write(" updated, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), nfailed);
+    osal_console_write(nbuf);
+    osal_console_write(" failed, total ");
+    osal_int_to_string(nbuf, sizeof(nbuf), now - start);
+    osal_console_write(nbuf);
+    osal_console_write(" ms, slowest device ");
+    osal_int_to_string(nbuf, sizeof(nbuf), slowest_ms);
+    osal_console_write(nbuf);
+    osal_console_write(" ms\n");
+
+    for (i = 0; i < ndevices; i++)
+    {
+        dev = devices + i;
+        if (dev->state == FLASHIT_DEVICE_OK) continue;
+        osal_console_write("  failed: ");
+        osal_console_write(dev->ipaddr);
+        osal_console_write(" (");
+        osal_console_write(dev->error ? dev->error : "not completed");
+        osal_console_write(")\n");
+
+        if (summary)
+        {
+            os_strncat(summary->failed, dev->ipaddr, sizeof(summary->failed));
+            os_strncat(summary->failed, " (", sizeof(summary->failed));
+            os_strncat(summary->failed, dev->error ? dev->error : "not completed",
+                sizeof(summary->failed));
+            os_strncat(summary->failed, ")\n", sizeof(summary->failed));
+        }
+    }
+    if (nfailed == 0) rval = 0;
+
+    if (summary)
+    {
+        summary->ndevices = ndevices;
+        summary->nok = nok;
+        summary->nfailed = nfailed;
+        summary->total_ms = now - start;
+        summary->slowest_ms = slowest_ms;
+    }
+
+getout:
+    while (images)
+    {
+        img = images;
+        images = img->next;
+        flashit_image_release(img);
+        os_free(img, sizeof(flashitImage));
+    }
+    if (slot_dev) os_free(slot_dev, slots_alloc);
+    if (transfers) os_free(transfers, transfers_alloc);
+    if (devices) os_free(devices, devices_alloc);
+    os_free(text, text_alloc);
+    return rval;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Parse manifest and load binaries.
+  @anchor flashit_fleet_parse
+
+  The flashit_fleet_parse() function splits manifest text in place into address and binary
+  path strings. Each different binary is loaded once, and appended to images list.
+
+  @param   text Manifest text, modified by this function. There must be space for terminating
+           '\0' after the text. Must stay in memory while images are used, since image paths
+           point to it.
+  @param   text_sz Text size in bytes.
+  @param   devices Array to fill in, at least as many items as there are lines.
+  @param   binfile Default binary, may be OS_NULL.
+  @param   opt Transfer options.
+  @param   images Pointer to head of loaded image list.
+  @return  Number of devices, 0 if none or -1 if error.
+
+****************************************************************************************************
+*/
+static os_int flashit_fleet_parse(
+    os_char *text,
+    os_memsz text_sz,
+    flashitFleetDevice *devices,
+    const os_char *binfile,
+    const flashitOptions *opt,
+    flashitImage **images)
+{
+    flashitFleetDevice *dev;
+    flashitImage *img;
+    os_char *word[2];
+    const os_char *path;
+    os_memsz pos;
+    os_int ndevices, nwords;
+
+    ndevices = 0;
+    pos = 0;
+    while (pos < text_sz)
+    {
+        /* Split line into words. Comment ends the line.
+         */
+        nwords = 0;
+        while (pos < text_sz && text[pos] != '\n')
+        {
+            if (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r')
+            {
+                text[pos++] = '\0';
+                continue;
+            }
+            if (text[pos] == '#')
+            {
+                while (pos < text_sz && text[pos] != '\n') text[pos++] = '\0';
+                break;
+            }
+
+            if (nwords < 2) word[nwords] = text + pos;
+            nwords++;
+            while (pos < text_sz && text[pos] != '\n' && text[pos] != ' ' &&
+                text[pos] != '\t' && text[pos] != '\r')
+            {
+                pos++;
+            }
+        }
+        if (pos < text_sz) text[pos++] = '\0';
+        if (nwords == 0) continue;
+
+        /* Device address and binary.
+         */
+        dev = devices + ndevices++;
+        os_strncpy(dev->ipaddr, word[0], sizeof(dev->ipaddr));
+        path = nwords > 1 ? word[1] : binfile;
+        if (path == OS_NULL)
+        {
+            osal_console_write("no binary for device ");
+            osal_console_write(word[0]);
+            osal_console_write("\n");
+            return -1;
+        }
+
+        /* Load the binary, unless already loaded for another device.
+         */
+        for (img = *images; img; img = img->next)
+        {
+            if (!os_strcmp(img->path, path)) break;
+        }
+        if (img == OS_NULL)
+        {
+            img = (flashitImage*)os_malloc(sizeof(flashitImage), OS_NULL);
+            if (img == OS_NULL) return -1;
+            if (flashit_image_load(img, path, opt))
+            {
+                flashit_image_release(img);
+                os_free(img, sizeof(flashitImage));
+                return -1;
+            }
+            img->next = *images;
+            *images = img;
+        }
+        dev->img = img;
+    }
+
+    return ndevices;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Record and print result of device.
+  @anchor flashit_fleet_finish
+
+  @param   t Transfer state, closed by this function.
+  @param   dev Device.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashit_fleet_finish(
+    flashitTransfer *t,
+    flashitFleetDevice *dev)
+{
+    os_timer now;
+
+    os_get_timer(&now);
+    dev->state = t->done ? FLASHIT_DEVICE_OK : FLASHIT_DEVICE_FAILED;
+    dev->error = t->error;
+    dev->time_ms = now - t->start_timer;
+    flashit_transfer_report(t);
+    flashit_transfer_close(t);
+}
@@ -0,0 +1,300 @@
+/**
+
+  @file    flashit_image.c
+  @brief   Load binary to transfer.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    20.9.2018
+
+  The binary to send is mapped to memory on systems which support it, so that a large image
+  is not copied and transfer can start without reading the whole file first. Where mapping is
+  not available, the file is read into memory.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashit.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FLASHIT_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define FLASHIT_MMAP 0
+#endif
+
+
+/**
+****************************************************************************************************
+
+  @brief Load binary and generate delta patch or compressed stream from it, if needed.
+  @anchor flashit_image_load
+
+  The flashit_image_load() function reads binary file into memory. If options ask for delta
+  patch, patch from the old image is generated. If options ask for compression, the binary
+  is compressed. Sizes are printed. Empty binary and binary bigger than FLASHES_BANK_SIZE
+  are refused.
+
+  @param   img Image structure to fill in, cleared by this function.
+  @param   path Path to binary file. The string must stay in memory while image is used.
+  @param   opt Transfer options.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error, which has been
+           printed. Call flashit_image_release() in either case.
+
+****************************************************************************************************
+*/
+osalStatus flashit_image_load(
+    flashitImage *img,
+    const os_char *path,
+    const flashitOptions *opt)
+{
+    os_uchar *old_image;
+    os_memsz old_sz, old_alloc;
+    os_char nbuf[32];
+
+    os_memclear(img, sizeof(flashitImage));
+    img->path = path;
+
+    /* Map the binary file to send, or load it if it cannot be mapped.
+     */
+    img->image = flashit_map_file(path, &img->image_sz);
+    img->image_mapped = (os_boolean)(img->image != OS_NULL);
+    if (img->image == OS_NULL)
+    {
+        img->image = flashit_load_file(path, &img->image_sz, &img->image_alloc);
+    }
+    if (img->image == OS_NULL)
+    {
+        osal_console_write("opening binary file failed: ");
+        osal_console_write(path);
+        osal_console_write("\n");
+        return OSAL_STATUS_FAILED;
+    }
+
+    /* Empty image would switch MCU to empty bank, and image bigger than flash bank cannot
+       be written. Refuse these before connecting.
+     */
+    if (img->image_sz == 0 || img->image_sz > FLASHES_BANK_SIZE)
+    {
+        osal_console_write(img->image_sz ? "binary file does not fit in flash bank: "
+            : "binary file is empty: ");
+        osal_console_write(path);
+        osal_console_write("\n");
+        return OSAL_STATUS_FAILED;
+    }
+    img->image_crc = flashes_crc32(FLASHES_CRC32_INIT, img->image, img->image_sz);
+    osal_trace("binary file loaded");
+
+    /* Generate delta patch from the image MCU is running, if requested.
+     */
+    if (opt->oldfile)
+    {
+        old_image = flashit_load_file(opt->oldfile, &old_sz, &old_alloc);
+        if (old_image == OS_NULL)
+        {
+            osal_console_write("opening old binary file failed\n");
+            return OSAL_STATUS_FAILED;
+        }
+        img->stream = flashit_delta_generate(old_image, old_sz, img->image, img->image_sz,
+            &img->stream_sz, &img->stream_alloc);
+        os_free(old_image, old_alloc);
+        if (img->stream == OS_NULL)
+        {
+            osal_console_write("generating delta patch failed\n");
+            return OSAL_STATUS_FAILED;
+        }
+        img->stream_type = FLASHES_FRAME_PATCH;
+        osal_console_write("delta patch ");
+    }
+
+    /* Compress the binary, if requested.
+     */
+    else if (opt->compress)
+    {
+        img->stream = flashit_compress(img->image, img->image_sz, &img->stream_sz,
+            &img->stream_alloc);
+        if (img->stream == OS_NULL)
+        {
+            osal_console_write("compressing binary failed\n");
+            return OSAL_STATUS_FAILED;
+        }
+        img->stream_type = FLASHES_FRAME_COMPRESSED;
+        osal_console_write("compressed ");
+    }
+
+    if (img->stream)
+    {
+        osal_int_to_string(nbuf, sizeof(nbuf), img->stream_sz);
+        osal_console_write(nbuf);
+        osal_console_write(" bytes for ");
+        osal_int_to_string(nbuf, sizeof(nbuf), img->image_sz);
+        osal_console_write(nbuf);
+        osal_console_write(" byte image ");
+        osal_console_write(path);
+        osal_console_write("\n");
+    }
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Release memory allocated for image.
+  @anchor flashit_image_release
+
+  @param   img Image structure.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashit_image_release(
+    flashitImage *img)
+{
+    if (img->image_mapped) flashit_unmap_file(img->image, img->image_sz);
+    else if (img->image) os_free(img->image, img->image_alloc);
+    if (img->stream) os_free(img->stream, img->stream_alloc);
+    img->image = img->stream = OS_NULL;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Load whole binary file into memory.
+  @anchor flashit_load_file
+
+  The flashit_load_file() function reads the file into buffer allocated by os_malloc(). The
+  buffer is grown as needed, since we do not know file size beforehand.
+
+  @param   path Path to file.
+  @param   file_sz Pointer where to store file size in bytes.
+  @param   alloc_sz Pointer where to store allocated buffer size, needed for os_free().
+  @return  Pointer to file content, or OS_NULL if reading the file failed.
+
+****************************************************************************************************
+*/
+os_uchar *flashit_load_file(
+    const os_char *path,
+    os_memsz *file_sz,
+    os_memsz *alloc_sz)
+{
+    osalStream f;
+    os_uchar *data, *newdata;
+    os_memsz n, n_read, sz;
+    osalStatus s;
+
+    *file_sz = *alloc_sz = 0;
+    f = osal_file_open(path, OS_NULL, OS_NULL, OSAL_STREAM_READ);
+    if (f == OS_NULL) return OS_NULL;
+
+    sz = 0;
+    n = 64 * FLASHES_TRANSFER_BLOCK_SIZE;
+    data = (os_uchar*)os_malloc(n, OS_NULL);
+    while (data)
+    {
+        s = osal_file_read(f, data + sz, n - sz, &n_read, OSAL_STREAM_DEFAULT);
+        if (s)
+        {
+            os_free(data, n);
+            data = OS_NULL;
+            break;
+        }
+        sz += n_read;
+        if (sz < n) break;
+
+        newdata = (os_uchar*)os_malloc(2 * n, OS_NULL);
+        if (newdata) os_memcpy(newdata, data, sz);
+        os_free(data, n);
+        data = newdata;
+        n *= 2;
+    }
+    osal_file_close(f);
+
+    if (data)
+    {
+        *file_sz = sz;
+        *alloc_sz = n;
+    }
+    return data;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Map file to memory for reading.
+  @anchor flashit_map_file
+
+  The flashit_map_file() function maps the whole file read only. Pages are read from disk
+  as the transfer touches them, and nothing is copied. Empty file cannot be mapped.
+
+  @param   path Path to file.
+  @param   file_sz Pointer where to store file size in bytes.
+  @return  Pointer to file content, or OS_NULL if mapping is not supported or failed. Release
+           with flashit_unmap_file().
+
+****************************************************************************************************
+*/
+os_uchar *flashit_map_file(
+    const os_char *path,
+    os_memsz *file_sz)
+{
+#if FLASHIT_MMAP
+    struct stat st;
+    void *data;
+    int fd;
+
+    *file_sz = 0;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return OS_NULL;
+
+    data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        data = mmap(OS_NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    /* The mapping stays valid after the file is closed.
+     */
+    close(fd);
+    if (data == MAP_FAILED) return OS_NULL;
+
+    /* We read the file from start to end.
+     */
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    *file_sz = (os_memsz)st.st_size;
+    return (os_uchar*)data;
+#else
+    *file_sz = 0;
+    return OS_NULL;
+#endif
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Unmap file.
+  @anchor flashit_unmap_file
+
+  @param   data Pointer returned by flashit_map_file().
+  @param   file_sz File size in bytes.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashit_unmap_file(
+    os_uchar *data,
+    os_memsz file_sz)
+{
+#if FLASHIT_MMAP
+    munmap(data, (size_t)file_sz);
+#endif
+}
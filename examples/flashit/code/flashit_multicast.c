@@ -0,0 +1,561 @@
+/**
+
+  @file    flashit_multicast.c
+  @brief   Send image to many devices with one multicast stream.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    20.9.2018
+
+  Multicast mode sends the image once to all devices listening, instead of a TCP transfer to
+  each. Transfer goes in rounds, see flashes_protocol.h:
+
+  - Poll until no device is erasing flash. The first poll announces the image, and devices
+    start erasing.
+  - Send all blocks, paced to given rate. UDP has no flow control, sending faster than
+    devices can write just loses blocks.
+  - Poll. Each device replies with blocks it is missing. Send the union of these again, and
+    poll again, until no device misses anything or round limit is reached.
+  - Send commit. Devices which have verified the image switch boot bank and reboot.
+
+  Devices are known only from their replies, so a device which hears nothing is not counted.
+  Use "-l" scan first to see which devices are there.
+
+  To try this on one Linux computer, start several mcu-flashes processes, each with its own
+  FLASHES_SIM_DIR directory for simulated flash, and run "flashit -m program.bin". All of them
+  join the multicast groups on loopback. Only the first one gets TCP port 6827, which multicast
+  does not need.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashit.h"
+
+/** Reply spread asked in poll, and extra time to wait for replies after it, ms.
+ */
+#define FLASHIT_MCAST_SPREAD_MS 200
+#define FLASHIT_MCAST_MARGIN_MS 100
+
+/** Give up waiting for devices to erase flash after this time, ms.
+ */
+#define FLASHIT_MCAST_ERASE_TIMEOUT_MS 60000
+
+/** Maximum number of repair rounds.
+ */
+#define FLASHIT_MCAST_MAX_ROUNDS 20
+
+/** Number of times commit is sent, and interval, ms.
+ */
+#define FLASHIT_MCAST_COMMITS 3
+#define FLASHIT_MCAST_COMMIT_INTERVAL_MS 20
+
+/** Status reply buffer size.
+ */
+#define FLASHIT_MCAST_BUF_SZ (FLASHES_MCAST_STATUS_HDR_SZ + \
+    FLASHES_MCAST_MAX_RANGES * FLASHES_MCAST_RANGE_SZ + 16)
+
+/** Device which has replied to poll.
+ */
+typedef struct
+{
+    /* Address the reply came from, and device id.
+     */
+    os_char ipaddr[OSAL_HOST_BUF_SZ];
+    os_uchar id[FLASHES_DEVICE_ID_SZ];
+
+    /* Flags and number of missing blocks from the latest reply, set if the device replied
+       to the latest poll.
+     */
+    os_uint flags;
+    os_uint nmissing;
+    os_boolean replied;
+}
+flashitMcastDevice;
+
+/** Multicast transfer state.
+ */
+typedef struct
+{
+    /* Image to send, session id and number of blocks.
+     */
+    flashitImage *img;
+    os_uint session;
+    os_uint nblocks;
+
+    /* Sockets to send image and polls, and to receive status replies.
+     */
+    osalStream data_socket;
+    osalStream status_socket;
+
+    /* Packet buffer, header filled in once.
+     */
+    os_uchar pkt[FLASHES_MCAST_DATA_HDR_SZ + FLASHES_TRANSFER_BLOCK_SIZE];
+
+    /* Bit for each block to be sent in next pass.
+     */
+    os_uchar *resend;
+    os_memsz resend_alloc;
+
+    /* Devices which have replied.
+     */
+    flashitMcastDevice *devices;
+    os_int ndevices;
+    os_memsz devices_alloc;
+
+    /* Sending rate, bytes per ms, and number of blocks sent in total.
+     */
+    os_long rate;
+    os_long blocks_sent;
+}
+flashitMcast;
+
+static osalStatus flashit_multicast_send_marked(
+    flashitMcast *m);
+
+static osalStatus flashit_multicast_poll(
+    flashitMcast *m,
+    os_int *nerasing,
+    os_int *nwaiting);
+
+static osalStatus flashit_multicast_receive(
+    flashitMcast *m);
+
+static osalStatus flashit_multicast_send(
+    flashitMcast *m,
+    os_uint type,
+    os_memsz n);
+
+static void flashit_multicast_report(
+    flashitMcast *m,
+    os_long time_ms,
+    os_int rounds);
+
+
+/**
+****************************************************************************************************
+
+  @brief Send image to all listening devices.
+  @anchor flashit_multicast
+
+  The flashit_multicast() function runs the whole multicast transfer and prints result for
+  each device which replied.
+
+  @param   binfile Binary to send.
+  @param   rate_kb Sending rate, kB/s.
+  @return  0 if all devices which replied were updated or already run the image, 1 otherwise.
+
+****************************************************************************************************
+*/
+os_int flashit_multicast(
+    const os_char *binfile,
+    os_int rate_kb)
+{
+    static flashitImage img;
+    static flashitMcast m;
+    flashitOptions opt;
+    os_int nerasing, nwaiting, rounds, i, rval = 1;
+    os_timer start, now;
+
+    os_memclear(&m, sizeof(m));
+    os_memclear(&opt, sizeof(opt));
+    if (flashit_image_load(&img, binfile, &opt)) goto getout;
+    if (img.image_sz == 0 || img.image_sz > FLASHES_BANK_SIZE)
+    {
+        osal_console_write("binary does not fit in flash bank\n");
+        goto getout;
+    }
+
+    m.img = &img;
+    m.nblocks = (os_uint)((img.image_sz + FLASHES_TRANSFER_BLOCK_SIZE - 1) /
+        FLASHES_TRANSFER_BLOCK_SIZE);
+    m.rate = (os_long)rate_kb * 1024 / 1000;
+    if (m.rate < 1) m.rate = 1;
+    m.resend = (os_uchar*)os_malloc((m.nblocks + 7) / 8, &m.resend_alloc);
+    if (m.resend == OS_NULL) goto getout;
+    os_memclear(m.resend, (m.nblocks + 7) / 8);
+
+    m.status_socket = osal_stream_open(OSAL_SOCKET_IFACE, FLASHES_MCAST_STATUS_ADDR,
+        OS_NULL, OS_NULL, OSAL_STREAM_MULTICAST|OSAL_STREAM_LISTEN|OSAL_STREAM_SELECT);
+    m.data_socket = osal_stream_open(OSAL_SOCKET_IFACE, FLASHES_MCAST_DATA_ADDR,
+        OS_NULL, OS_NULL, OSAL_STREAM_MULTICAST);
+    if (m.status_socket == OS_NULL || m.data_socket == OS_NULL)
+    {
+        osal_console_write("opening multicast socket failed\n");
+        goto getout;
+    }
+
+    /* Header common to all packets, session id from the clock.
+     */
+    os_get_timer(&start);
+    m.session = (os_uint)start;
+    flashes_put_uint(m.pkt, FLASHES_MCAST_MAGIC, 4);
+    flashes_put_uint(m.pkt + 5, m.session, 4);
+    flashes_put_uint(m.pkt + 9, (os_uint)img.image_sz, 4);
+    flashes_put_uint(m.pkt + 13, img.image_crc, 4);
+
+    /* Announce the image and wait until devices have erased flash.
+     */
+    do
+    {
+        if (flashit_multicast_poll(&m, &nerasing, &nwaiting)) goto getout;
+        os_get_timer(&now);
+        if (now - start > FLASHIT_MCAST_ERASE_TIMEOUT_MS) break;
+    }
+    while (nerasing);
+    if (m.ndevices == 0)
+    {
+        osal_console_write("no devices replied\n");
+        goto getout;
+    }
+
+    /* Send the whole image, then repair until every device has verified the image, failed,
+       or stopped replying. Nothing is sent while devices verify, only polled.
+     */
+    for (i = 0; i < (os_int)m.nblocks; i++) m.resend[i >> 3] |= (os_uchar)(1 << (i & 7));
+    for (rounds = 0; nwaiting && rounds < FLASHIT_MCAST_MAX_ROUNDS; rounds++)
+    {
+        if (flashit_multicast_send_marked(&m)) goto getout;
+        if (flashit_multicast_poll(&m, &nerasing, &nwaiting)) goto getout;
+    }
+
+    /* Devices which have verified the image switch to it.
+     */
+    for (i = 0; i < FLASHIT_MCAST_COMMITS; i++)
+    {
+        if (i) os_sleep(FLASHIT_MCAST_COMMIT_INTERVAL_MS);
+        if (flashit_multicast_send(&m, FLASHES_MCAST_COMMIT, FLASHES_MCAST_HDR_SZ))
+        {
+            goto getout;
+        }
+    }
+
+    os_get_timer(&now);
+    flashit_multicast_report(&m, now - start, rounds);
+    rval = 0;
+    for (i = 0; i < m.ndevices; i++)
+    {
+        if (!(m.devices[i].flags & (FLASHES_MCAST_DONE|FLASHES_MCAST_CURRENT))) rval = 1;
+    }
+
+getout:
+    osal_stream_close(m.data_socket);
+    osal_stream_close(m.status_socket);
+    os_free(m.resend, m.resend_alloc);
+    os_free(m.devices, m.devices_alloc);
+    flashit_image_release(&img);
+    return rval;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Send blocks marked in resend bitmap.
+  @anchor flashit_multicast_send_marked
+
+  The flashit_multicast_send_marked() function sends the marked blocks in order and clears
+  the bitmap. Sending is paced: If more bytes have been sent than rate allows for the time
+  elapsed, we sleep a millisecond.
+
+  @param   m Multicast transfer state.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashit_multicast_send_marked(
+    flashitMcast *m)
+{
+    os_uint block, addr, n;
+    os_long sent;
+    os_timer start, now;
+    osalStatus s;
+
+    os_get_timer(&start);
+    sent = 0;
+    for (block = 0; block < m->nblocks; block++)
+    {
+        if (!(m->resend[block >> 3] & (1 << (block & 7)))) continue;
+
+        while (OS_TRUE)
+        {
+            os_get_timer(&now);
+            if (sent <= (now - start + 1) * m->rate) break;
+            os_sleep(1);
+        }
+
+        addr = block * FLASHES_TRANSFER_BLOCK_SIZE;
+        n = (os_uint)m->img->image_sz - addr;
+        if (n > FLASHES_TRANSFER_BLOCK_SIZE) n = FLASHES_TRANSFER_BLOCK_SIZE;
+        flashes_put_uint(m->pkt + FLASHES_MCAST_HDR_SZ, block, 4);
+        os_memcpy(m->pkt + FLASHES_MCAST_DATA_HDR_SZ, m->img->image + addr, n);
+        s = flashit_multicast_send(m, FLASHES_MCAST_DATA, FLASHES_MCAST_DATA_HDR_SZ + n);
+        if (s) return s;
+        sent += n;
+        m->blocks_sent++;
+    }
+    os_memclear(m->resend, (m->nblocks + 7) / 8);
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Poll devices and collect their status.
+  @anchor flashit_multicast_poll
+
+  The flashit_multicast_poll() function sends poll and receives replies for reply spread
+  and margin. Missing blocks reported by devices are marked in resend bitmap.
+
+  @param   m Multicast transfer state.
+  @param   nerasing Where to store number of devices which are erasing flash.
+  @param   nwaiting Where to store number of devices which replied and are not yet done,
+           missing blocks, erasing or verifying.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashit_multicast_poll(
+    flashitMcast *m,
+    os_int *nerasing,
+    os_int *nwaiting)
+{
+    osalSelectData selectdata;
+    os_int wait_ms, i;
+    os_timer start, now;
+    osalStatus s;
+
+    /* Forget flags of previous round, so that devices which do not reply are not counted.
+     */
+    for (i = 0; i < m->ndevices; i++)
+    {
+        m->devices[i].flags &= FLASHES_MCAST_DONE|FLASHES_MCAST_CURRENT;
+        m->devices[i].nmissing = 0;
+        m->devices[i].replied = OS_FALSE;
+    }
+
+    flashes_put_uint(m->pkt + FLASHES_MCAST_HDR_SZ, FLASHIT_MCAST_SPREAD_MS, 2);
+    s = flashit_multicast_send(m, FLASHES_MCAST_POLL, FLASHES_MCAST_POLL_SZ);
+    if (s) return s;
+
+    wait_ms = FLASHIT_MCAST_SPREAD_MS + FLASHIT_MCAST_MARGIN_MS;
+    os_get_timer(&start);
+    while (OS_TRUE)
+    {
+        os_get_timer(&now);
+        if (now - start >= wait_ms) break;
+        if (osal_stream_select(&m->status_socket, 1, OS_NULL, &selectdata,
+            (os_int)(wait_ms - (now - start)), OSAL_STREAM_DEFAULT))
+        {
+            os_sleep(FLASHIT_POLL_MS);
+        }
+        s = flashit_multicast_receive(m);
+        if (s) return s;
+    }
+
+    *nerasing = *nwaiting = 0;
+    for (i = 0; i < m->ndevices; i++)
+    {
+        if (!m->devices[i].replied) continue;
+        if (m->devices[i].flags & FLASHES_MCAST_ERASING) (*nerasing)++;
+        if (!(m->devices[i].flags & (FLASHES_MCAST_DONE|FLASHES_MCAST_CURRENT|
+            FLASHES_MCAST_FAILED|FLASHES_MCAST_BUSY))) (*nwaiting)++;
+    }
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Receive status replies waiting in socket.
+  @anchor flashit_multicast_receive
+
+  The flashit_multicast_receive() function updates the device list from replies to this
+  session, and marks reported missing blocks for resend.
+
+  @param   m Multicast transfer state.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashit_multicast_receive(
+    flashitMcast *m)
+{
+    os_uchar buf[FLASHIT_MCAST_BUF_SZ], *r;
+    os_char remote[OSAL_HOST_BUF_SZ];
+    flashitMcastDevice *dev, *p;
+    os_memsz n_read, alloc;
+    os_uint nranges, first, count, block;
+    os_int i;
+    osalStatus s;
+
+    while (OS_TRUE)
+    {
+        s = osal_stream_receive_packet(m->status_socket, (os_char*)buf, sizeof(buf), &n_read,
+            remote, sizeof(remote), OSAL_STREAM_DEFAULT);
+        if (s) return s;
+        if (n_read == 0) return OSAL_SUCCESS;
+
+        if (n_read < FLASHES_MCAST_STATUS_HDR_SZ ||
+            flashes_get_uint(buf, 4) != FLASHES_MCAST_STATUS_MAGIC ||
+            flashes_get_uint(buf + 4, 4) != m->session)
+        {
+            continue;
+        }
+        nranges = flashes_get_uint(buf + 9 + FLASHES_DEVICE_ID_SZ, 2);
+        if (n_read < FLASHES_MCAST_STATUS_HDR_SZ + nranges * FLASHES_MCAST_RANGE_SZ) continue;
+
+        /* Find device, add if new. Grow the array by doubling.
+         */
+        for (i = 0; i < m->ndevices; i++)
+        {
+            if (!os_memcmp(m->devices[i].id, buf + 9, FLASHES_DEVICE_ID_SZ)) break;
+        }
+        if (i == m->ndevices)
+        {
+            if ((os_memsz)(i + 1) * (os_memsz)sizeof(flashitMcastDevice) > m->devices_alloc)
+            {
+                p = (flashitMcastDevice*)os_malloc((2 * i + 16) * sizeof(flashitMcastDevice),
+                    &alloc);
+                if (p == OS_NULL) return OSAL_STATUS_MEMORY_ALLOCATION_FAILED;
+                if (i) os_memcpy(p, m->devices, i * sizeof(flashitMcastDevice));
+                os_free(m->devices, m->devices_alloc);
+                m->devices = p;
+                m->devices_alloc = alloc;
+            }
+            os_memclear(m->devices + i, sizeof(flashitMcastDevice));
+            os_memcpy(m->devices[i].id, buf + 9, FLASHES_DEVICE_ID_SZ);
+            m->ndevices++;
+        }
+        dev = m->devices + i;
+        os_strncpy(dev->ipaddr, remote, sizeof(dev->ipaddr));
+        dev->flags = buf[8];
+        dev->nmissing = 0;
+        dev->replied = OS_TRUE;
+
+        r = buf + FLASHES_MCAST_STATUS_HDR_SZ;
+        while (nranges--)
+        {
+            first = flashes_get_uint(r, 4);
+            count = flashes_get_uint(r + 4, 2);
+            r += FLASHES_MCAST_RANGE_SZ;
+            for (block = first; block < first + count && block < m->nblocks; block++)
+            {
+                m->resend[block >> 3] |= (os_uchar)(1 << (block & 7));
+            }
+            dev->nmissing += count;
+        }
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Send packet in packet buffer.
+  @anchor flashit_multicast_send
+
+  @param   m Multicast transfer state.
+  @param   type Packet type, FLASHES_MCAST_DATA, FLASHES_MCAST_POLL or FLASHES_MCAST_COMMIT.
+  @param   n Packet size, bytes.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashit_multicast_send(
+    flashitMcast *m,
+    os_uint type,
+    os_memsz n)
+{
+    m->pkt[4] = (os_uchar)type;
+    return osal_stream_send_packet(m->data_socket, (const os_char*)m->pkt, n,
+        OSAL_STREAM_DEFAULT);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Print result of each device and summary.
+  @anchor flashit_multicast_report
+
+  @param   m Multicast transfer state.
+  @param   time_ms Time used for the whole transfer.
+  @param   rounds Number of send rounds, the first one included.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashit_multicast_report(
+    flashitMcast *m,
+    os_long time_ms,
+    os_int rounds)
+{
+    static const os_char hex[] = "0123456789abcdef";
+    flashitMcastDevice *dev;
+    os_char buf[2 * FLASHES_DEVICE_ID_SZ + 1], nbuf[32];
+    os_int i, j, nok = 0;
+
+    for (i = 0; i < m->ndevices; i++)
+    {
+        dev = m->devices + i;
+        for (j = 0; j < FLASHES_DEVICE_ID_SZ; j++)
+        {
+            buf[2 * j] = hex[dev->id[j] >> 4];
+            buf[2 * j + 1] = hex[dev->id[j] & 15];
+        }
+        buf[2 * FLASHES_DEVICE_ID_SZ] = '\0';
+        osal_console_write(dev->ipaddr);
+        osal_console_write(" id=");
+        osal_console_write(buf);
+
+        if (dev->flags & FLASHES_MCAST_CURRENT)
+        {
+            osal_console_write(" already running the binary\n");
+            nok++;
+        }
+        else if (dev->flags & FLASHES_MCAST_DONE)
+        {
+            osal_console_write(" updated\n");
+            nok++;
+        }
+        else if (dev->flags & FLASHES_MCAST_FAILED)
+        {
+            osal_console_write(" FAILED\n");
+        }
+        else if (dev->flags & FLASHES_MCAST_BUSY)
+        {
+            osal_console_write(" busy with TCP transfer\n");
+        }
+        else
+        {
+            osal_console_write(" incomplete, ");
+            osal_int_to_string(nbuf, sizeof(nbuf), dev->nmissing);
+            osal_console_write(nbuf);
+            osal_console_write(" blocks missing\n");
+        }
+    }
+
+    osal_int_to_string(nbuf, sizeof(nbuf), nok);
+    osal_console_write(nbuf);
+    osal_console_write("/");
+    osal_int_to_string(nbuf, sizeof(nbuf), m->ndevices);
+    osal_console_write(nbuf);
+    osal_console_write(" devices ok, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), rounds);
+    osal_console_write(nbuf);
+    osal_console_write(" rounds, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), m->blocks_sent);
+    osal_console_write(nbuf);
+    osal_console_write(" blocks sent for ");
+    osal_int_to_string(nbuf, sizeof(nbuf), m->nblocks);
+    osal_console_write(nbuf);
+    osal_console_write(" block image, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), time_ms);
+    osal_console_write(nbuf);
+    osal_console_write(" ms\n");
+}
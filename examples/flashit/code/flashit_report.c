@@ -0,0 +1,232 @@
+/**
+
+  @file    flashit_report.c
+  @brief   Fetch distribution report from store-and-forward gateway.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    20.9.2018
+
+  A gateway at a site receives the image once, like a device, and then updates devices of
+  the site from its own cache, see examples/flashes-gateway. So flashit's transfer completes
+  once the gateway has the image, not once devices have it. The flashit_report() function
+  connects to the gateway again and asks how distribution is going with FLASHES_FRAME_REPORT
+  queries, until the gateway is done, and prints the aggregated result.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashit.h"
+
+static osalStatus flashit_report_query(
+    osalStream socket,
+    os_uchar *reply,
+    os_memsz *reply_n);
+
+static void flashit_report_print(
+    const os_uchar *reply);
+
+
+/**
+****************************************************************************************************
+
+  @brief Wait until gateway has distributed image to its site and print the report.
+  @anchor flashit_report
+
+  The flashit_report() function asks gateway report every FLASHIT_REPORT_POLL_MS, until the
+  gateway has tried all devices of its site. If image size and CRC-32 are given, the report
+  must be about this image: The gateway marks distribution running as soon as it has the
+  image, before it accepts next connection, so report of an earlier image is never mistaken
+  for this one.
+
+  @param   ipaddr Gateway address with optional port.
+  @param   image_size Size of image sent to gateway, 0 to print whatever the gateway reports.
+  @param   image_crc CRC-32 of image sent to gateway.
+  @return  0 if all devices of the site were updated, 1 otherwise.
+
+****************************************************************************************************
+*/
+os_int flashit_report(
+    const os_char *ipaddr,
+    os_uint image_size,
+    os_uint image_crc)
+{
+    osalStream socket;
+    os_uchar reply[FLASHES_REPORT_REPLY_HDR_SZ + FLASHES_REPORT_TEXT_MAX];
+    os_memsz reply_n;
+    os_uint ndevices, nok;
+    os_boolean announced;
+    os_int rval = 1;
+
+    socket = osal_stream_open(OSAL_SOCKET_IFACE, ipaddr, OS_NULL, OS_NULL,
+        OSAL_STREAM_CONNECT|OSAL_STREAM_SELECT|OSAL_STREAM_TCP_NODELAY);
+    if (socket == OS_NULL)
+    {
+        osal_console_write("gateway: socket connection failed\n");
+        return 1;
+    }
+    socket->write_timeout_ms = FLASHES_TRANSFER_TIMEOUT_MS;
+
+    announced = OS_FALSE;
+    while (OS_TRUE)
+    {
+        if (flashit_report_query(socket, reply, &reply_n))
+        {
+            osal_console_write("gateway: no report, not a gateway or connection broken\n");
+            goto getout;
+        }
+        if (reply[1] == FLASHES_REPORT_NONE)
+        {
+            osal_console_write("gateway: nothing distributed\n");
+            goto getout;
+        }
+        if (image_size && (flashes_get_uint(reply + 2, 4) != image_size ||
+            flashes_get_uint(reply + 6, 4) != image_crc))
+        {
+            osal_console_write("gateway: distributing another image\n");
+            goto getout;
+        }
+        if (reply[1] == FLASHES_REPORT_DONE) break;
+
+        if (!announced)
+        {
+            osal_console_write("gateway: updating devices of the site\n");
+            announced = OS_TRUE;
+        }
+        os_sleep(FLASHIT_REPORT_POLL_MS);
+    }
+
+    flashit_report_print(reply);
+    ndevices = flashes_get_uint(reply + 10, 2);
+    nok = flashes_get_uint(reply + 12, 2);
+    if (ndevices && nok == ndevices) rval = 0;
+
+getout:
+    osal_stream_close(socket);
+    return rval;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Send report query and receive reply.
+  @anchor flashit_report_query
+
+  The flashit_report_query() function writes FLASHES_FRAME_REPORT frame and reads 'g' reply.
+  The header tells length of text which follows it. Text is '\0' terminated in the buffer.
+
+  @param   socket Socket connected to gateway.
+  @param   reply Buffer for reply, FLASHES_REPORT_REPLY_HDR_SZ + FLASHES_REPORT_TEXT_MAX bytes.
+  @param   reply_n Where to store reply size, bytes.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashit_report_query(
+    osalStream socket,
+    os_uchar *reply,
+    os_memsz *reply_n)
+{
+    os_uchar hdr[FLASHES_FRAME_HDR_SZ];
+    osalSelectData selectdata;
+    os_memsz n, n_read, n_written;
+    os_ushort frame_hdr;
+    os_timer start;
+    osalStatus s;
+
+    frame_hdr = FLASHES_FRAME_HDR(FLASHES_FRAME_REPORT, 0, 0);
+    flashes_put_uint(hdr, frame_hdr, 2);
+    s = osal_stream_write(socket, hdr, sizeof(hdr), &n_written, OSAL_STREAM_WAIT);
+    if (s || n_written != sizeof(hdr)) return OSAL_STATUS_FAILED;
+
+    n = FLASHES_REPORT_REPLY_HDR_SZ;
+    *reply_n = 0;
+    os_get_timer(&start);
+    while (*reply_n < n)
+    {
+        s = osal_stream_read(socket, reply + *reply_n, n - *reply_n, &n_read,
+            OSAL_STREAM_DEFAULT);
+        if (s) return s;
+        *reply_n += n_read;
+        if (*reply_n && reply[0] != FLASHES_REPLY_REPORT) return OSAL_STATUS_FAILED;
+
+        /* Once header is in, we know how much text follows.
+         */
+        if (*reply_n == FLASHES_REPORT_REPLY_HDR_SZ && n == FLASHES_REPORT_REPLY_HDR_SZ)
+        {
+            n += flashes_get_uint(reply + 20, 2);
+            if (n >= FLASHES_REPORT_REPLY_HDR_SZ + FLASHES_REPORT_TEXT_MAX)
+            {
+                return OSAL_STATUS_FAILED;
+            }
+        }
+        if (n_read) continue;
+
+        if (os_elapsed(&start, FLASHES_TRANSFER_TIMEOUT_MS)) return OSAL_STATUS_TIMEOUT;
+        if (osal_stream_select(&socket, 1, OS_NULL, &selectdata, FLASHIT_REPORT_POLL_MS,
+            OSAL_STREAM_DEFAULT))
+        {
+            os_sleep(FLASHIT_POLL_MS);
+        }
+    }
+    reply[n] = '\0';
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Print gateway report.
+  @anchor flashit_report_print
+
+  The flashit_report_print() function prints summary line like fleet mode, and failed devices
+  from report text.
+
+  @param   reply Complete 'g' reply, text '\0' terminated.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashit_report_print(
+    const os_uchar *reply)
+{
+    os_char nbuf[32], line[OSAL_HOST_BUF_SZ + 64];
+    const os_char *p;
+    os_memsz i;
+
+    osal_console_write("gateway: ");
+    osal_int_to_string(nbuf, sizeof(nbuf), flashes_get_uint(reply + 10, 2));
+    osal_console_write(nbuf);
+    osal_console_write(" devices, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), flashes_get_uint(reply + 12, 2));
+    osal_console_write(nbuf);
+    osal_console_write(" updated, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), flashes_get_uint(reply + 14, 2));
+    osal_console_write(nbuf);
+    osal_console_write(" failed, total ");
+    osal_int_to_string(nbuf, sizeof(nbuf), flashes_get_uint(reply + 16, 4));
+    osal_console_write(nbuf);
+    osal_console_write(" ms\n");
+
+    /* Text has one line for each failed device.
+     */
+    p = (const os_char*)reply + FLASHES_REPORT_REPLY_HDR_SZ;
+    while (*p != '\0')
+    {
+        for (i = 0; p[i] != '\0' && p[i] != '\n' && i < (os_memsz)sizeof(line) - 1; i++)
+        {
+            line[i] = p[i];
+        }
+        line[i] = '\0';
+        osal_console_write("  failed: ");
+        osal_console_write(line);
+        osal_console_write("\n");
+        while (*p != '\0' && *p != '\n') p++;
+        if (*p == '\n') p++;
+    }
+}
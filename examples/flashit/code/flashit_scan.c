@@ -0,0 +1,324 @@
+/**
+
+  @file    flashit_scan.c
+  @brief   List devices on the network.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    20.9.2018
+
+  Scan mode sends one discovery query to the multicast group where devices listen, and collects
+  replies for a fixed time, see flashes_discovery.c. All devices answer the same query, so
+  listing hundreds of devices takes one round trip instead of a TCP connection attempt to
+  each address.
+
+  Output is in fleet manifest format, one device per line with details as comment, so it can be
+  given to "-f" option. If a binary is given, devices which already run it are commented out,
+  and the output lists only the devices which need update. For example:
+
+    flashit -l program.bin > devices.txt
+    flashit -f=devices.txt program.bin
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashit.h"
+
+/** Number of times the query is sent, back to back, in case a packet is lost. Devices reply
+    once to queries received close together.
+ */
+#define FLASHIT_SCAN_QUERIES 2
+
+/** Receive buffer size, bytes. Longer replies are accepted, extra bytes are ignored.
+ */
+#define FLASHIT_SCAN_BUF_SZ 128
+
+/** Device which replied.
+ */
+typedef struct
+{
+    /* Address and TCP port for program transfer, as "ip:port".
+     */
+    os_char ipaddr[OSAL_HOST_BUF_SZ];
+
+    /* Device id, reply flags, running image size and CRC-32, flash bank size.
+     */
+    os_uchar id[FLASHES_DEVICE_ID_SZ];
+    os_uint flags;
+    os_uint image_size;
+    os_uint image_crc;
+    os_uint capacity;
+}
+flashitScanDevice;
+
+static osalStatus flashit_scan_receive(
+    osalStream socket,
+    os_uint nonce,
+    flashitScanDevice **devices,
+    os_int *ndevices,
+    os_memsz *devices_alloc);
+
+static void flashit_scan_print(
+    const flashitScanDevice *dev,
+    const flashitImage *img);
+
+
+/**
+****************************************************************************************************
+
+  @brief List devices on the network.
+  @anchor flashit_scan
+
+  The flashit_scan() function sends discovery query and prints devices which reply within
+  wait_ms. Devices are asked to spread their replies over the first half of the wait time.
+
+  @param   binfile Binary to compare running images to, OS_NULL to only list the devices.
+  @param   wait_ms How long to collect replies, ms.
+  @return  0 if at least one device replied, 1 otherwise.
+
+****************************************************************************************************
+*/
+os_int flashit_scan(
+    const os_char *binfile,
+    os_int wait_ms)
+{
+    static flashitImage img;
+    flashitOptions opt;
+    flashitScanDevice *devices = OS_NULL;
+    osalStream query_socket = OS_NULL, reply_socket = OS_NULL;
+    osalSelectData selectdata;
+    os_memsz devices_alloc = 0;
+    os_uchar query[FLASHES_DISCOVERY_QUERY_SZ];
+    os_char nbuf[32];
+    os_uint nonce, spread;
+    os_int ndevices = 0, i, rval = 1;
+    os_timer start, now;
+
+    /* Load the binary to get its size and CRC-32.
+     */
+    if (binfile)
+    {
+        os_memclear(&opt, sizeof(opt));
+        if (flashit_image_load(&img, binfile, &opt)) goto getout;
+    }
+
+    /* Listen to replies before sending the query, so that no reply is missed.
+     */
+    reply_socket = osal_stream_open(OSAL_SOCKET_IFACE, FLASHES_DISCOVERY_REPLY_ADDR,
+        OS_NULL, OS_NULL, OSAL_STREAM_MULTICAST|OSAL_STREAM_LISTEN|OSAL_STREAM_SELECT);
+    query_socket = osal_stream_open(OSAL_SOCKET_IFACE, FLASHES_DISCOVERY_QUERY_ADDR,
+        OS_NULL, OS_NULL, OSAL_STREAM_MULTICAST);
+    if (reply_socket == OS_NULL || query_socket == OS_NULL)
+    {
+        osal_console_write("opening discovery socket failed\n");
+        goto getout;
+    }
+
+    /* Nonce from the clock tells replies to this query from replies to earlier ones.
+     */
+    os_get_timer(&start);
+    nonce = (os_uint)start;
+    spread = (os_uint)wait_ms / 2;
+    if (spread > 0xFFFF) spread = 0xFFFF;
+    flashes_put_uint(query, FLASHES_DISCOVERY_QUERY_MAGIC, 4);
+    query[4] = FLASHES_DISCOVERY_VERSION;
+    flashes_put_uint(query + 5, nonce, 4);
+    flashes_put_uint(query + 9, spread, 2);
+
+    for (i = 0; i < FLASHIT_SCAN_QUERIES; i++)
+    {
+        if (osal_stream_send_packet(query_socket, (const os_char*)query, sizeof(query),
+            OSAL_STREAM_DEFAULT))
+        {
+            osal_console_write("sending discovery query failed\n");
+            goto getout;
+        }
+    }
+
+    /* Collect replies until wait time is up.
+     */
+    while (OS_TRUE)
+    {
+        os_get_timer(&now);
+        if (now - start >= wait_ms) break;
+        if (osal_stream_select(&reply_socket, 1, OS_NULL, &selectdata,
+            (os_int)(wait_ms - (now - start)), OSAL_STREAM_DEFAULT))
+        {
+            os_sleep(FLASHIT_POLL_MS);
+        }
+        if (flashit_scan_receive(reply_socket, nonce, &devices, &ndevices, &devices_alloc))
+        {
+            osal_console_write("receiving discovery reply failed\n");
+            goto getout;
+        }
+    }
+    os_get_timer(&now);
+
+    for (i = 0; i < ndevices; i++)
+    {
+        flashit_scan_print(devices + i, binfile ? &img : OS_NULL);
+    }
+    osal_console_write("# ");
+    osal_int_to_string(nbuf, sizeof(nbuf), ndevices);
+    osal_console_write(nbuf);
+    osal_console_write(" devices in ");
+    osal_int_to_string(nbuf, sizeof(nbuf), now - start);
+    osal_console_write(nbuf);
+    osal_console_write(" ms\n");
+    if (ndevices) rval = 0;
+
+getout:
+    osal_stream_close(query_socket);
+    osal_stream_close(reply_socket);
+    os_free(devices, devices_alloc);
+    flashit_image_release(&img);
+    return rval;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Receive discovery replies waiting in socket.
+  @anchor flashit_scan_receive
+
+  The flashit_scan_receive() function reads all replies waiting, and adds devices which
+  answered this query to the list. A device which replies twice is listed once.
+
+  @param   socket Socket listening to discovery replies.
+  @param   nonce Nonce of our query.
+  @param   devices Pointer to device array, grown as needed.
+  @param   ndevices Pointer to number of devices in array.
+  @param   devices_alloc Pointer to allocated size of array, bytes.
+  @return  OSAL_SUCCESS (0) if all is fine. Other values indicate an error.
+
+****************************************************************************************************
+*/
+static osalStatus flashit_scan_receive(
+    osalStream socket,
+    os_uint nonce,
+    flashitScanDevice **devices,
+    os_int *ndevices,
+    os_memsz *devices_alloc)
+{
+    os_uchar buf[FLASHIT_SCAN_BUF_SZ];
+    os_char remote[OSAL_HOST_BUF_SZ], nbuf[16];
+    flashitScanDevice *dev, *p;
+    os_memsz n_read, alloc;
+    os_int i, n;
+    osalStatus s;
+
+    while (OS_TRUE)
+    {
+        s = osal_stream_receive_packet(socket, (os_char*)buf, sizeof(buf), &n_read,
+            remote, sizeof(remote), OSAL_STREAM_DEFAULT);
+        if (s) return s;
+        if (n_read == 0) return OSAL_SUCCESS;
+
+        if (n_read < FLASHES_DISCOVERY_REPLY_SZ ||
+            flashes_get_uint(buf, 4) != FLASHES_DISCOVERY_REPLY_MAGIC ||
+            buf[4] != FLASHES_DISCOVERY_VERSION ||
+            flashes_get_uint(buf + 6, 4) != nonce)
+        {
+            continue;
+        }
+
+        n = *ndevices;
+        for (i = 0; i < n; i++)
+        {
+            if (!os_memcmp((*devices)[i].id, buf + 10, FLASHES_DEVICE_ID_SZ)) break;
+        }
+        if (i < n) continue;
+
+        /* Grow the array by doubling.
+         */
+        if ((os_memsz)(n + 1) * (os_memsz)sizeof(flashitScanDevice) > *devices_alloc)
+        {
+            p = (flashitScanDevice*)os_malloc((2 * n + 16) * sizeof(flashitScanDevice), &alloc);
+            if (p == OS_NULL) return OSAL_STATUS_MEMORY_ALLOCATION_FAILED;
+            if (n) os_memcpy(p, *devices, n * sizeof(flashitScanDevice));
+            os_free(*devices, *devices_alloc);
+            *devices = p;
+            *devices_alloc = alloc;
+        }
+
+        dev = *devices + n;
+        os_memclear(dev, sizeof(flashitScanDevice));
+        os_strncpy(dev->ipaddr, remote, sizeof(dev->ipaddr));
+        os_strncat(dev->ipaddr, ":", sizeof(dev->ipaddr));
+        osal_int_to_string(nbuf, sizeof(nbuf),
+            flashes_get_uint(buf + 10 + FLASHES_DEVICE_ID_SZ, 2));
+        os_strncat(dev->ipaddr, nbuf, sizeof(dev->ipaddr));
+        os_memcpy(dev->id, buf + 10, FLASHES_DEVICE_ID_SZ);
+        dev->flags = buf[5];
+        dev->image_size = flashes_get_uint(buf + 12 + FLASHES_DEVICE_ID_SZ, 4);
+        dev->image_crc = flashes_get_uint(buf + 16 + FLASHES_DEVICE_ID_SZ, 4);
+        dev->capacity = flashes_get_uint(buf + 20 + FLASHES_DEVICE_ID_SZ, 4);
+        (*ndevices)++;
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Print one device as manifest line.
+  @anchor flashit_scan_print
+
+  The flashit_scan_print() function writes address and port, and details as comment. If
+  the device already runs the binary, the whole line is comment.
+
+  @param   dev Device to print.
+  @param   img Binary to compare running image to, OS_NULL if none.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashit_scan_print(
+    const flashitScanDevice *dev,
+    const flashitImage *img)
+{
+    static const os_char hex[] = "0123456789abcdef";
+    os_char buf[2 * FLASHES_DEVICE_ID_SZ + 1], nbuf[32];
+    os_boolean up_to_date;
+    os_int i;
+
+    up_to_date = (os_boolean)(img && dev->image_size == (os_uint)img->image_sz &&
+        dev->image_crc == img->image_crc);
+
+    if (up_to_date) osal_console_write("# ");
+    osal_console_write(dev->ipaddr);
+    osal_console_write(" # id=");
+    for (i = 0; i < FLASHES_DEVICE_ID_SZ; i++)
+    {
+        buf[2 * i] = hex[dev->id[i] >> 4];
+        buf[2 * i + 1] = hex[dev->id[i] & 15];
+    }
+    buf[2 * FLASHES_DEVICE_ID_SZ] = '\0';
+    osal_console_write(buf);
+
+    osal_console_write((dev->flags & FLASHES_DISCOVERY_BANK2) ? " bank=2" : " bank=1");
+    osal_console_write(" image=");
+    if (dev->image_size)
+    {
+        osal_int_to_string(nbuf, sizeof(nbuf), dev->image_size);
+        osal_console_write(nbuf);
+        osal_console_write("/");
+        for (i = 0; i < 8; i++) buf[i] = hex[(dev->image_crc >> (28 - 4 * i)) & 15];
+        buf[8] = '\0';
+        osal_console_write(buf);
+    }
+    else
+    {
+        osal_console_write("unknown");
+    }
+    osal_console_write(" capacity=");
+    osal_int_to_string(nbuf, sizeof(nbuf), dev->capacity);
+    osal_console_write(nbuf);
+    if (dev->flags & FLASHES_DISCOVERY_BUSY) osal_console_write(" busy");
+    if (up_to_date) osal_console_write(" up to date");
+    osal_console_write("\n");
+}
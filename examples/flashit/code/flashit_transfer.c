@@ -0,0 +1,1157 @@
+/**
+
+  @file    flashit_transfer.c
+  @brief   Transfer program to one MCU.
+  @author  Pekka Lehtikoski
+  @version 1.0
+  @date    20.9.2018
+
+  State machine for transferring binary to one device through non blocking socket. Call
+  flashit_transfer_start() to connect, then flashit_transfer_run() repeatedly until transfer is
+  done or fails. Since nothing blocks, one thread can run many transfers side by side. Between
+  the calls flashit_transfer_wait() sleeps until a socket has something for us or a timer
+  expires, so waiting for the MCU takes no processor time.
+
+  If resume is enabled, the transfer asks MCU where to continue, and broken connection is
+  reconnected and resumed, up to given number of times. Timing statistics of MCU can be
+  fetched after the data, or alone with trace events without transferring anything.
+
+  Copyright 2018 Pekka Lehtikoski. This file is part of the iocom project and shall only be used,
+  modified, and distributed under the terms of the project licensing. By continuing to use, modify,
+  or distribute this file you indicate that you have read the license and understand and accept
+  it fully.
+
+****************************************************************************************************
+*/
+#include "flashit.h"
+
+static osalStatus flashit_transfer_connect(
+    flashitTransfer *t);
+
+static osalStatus flashit_transfer_step(
+    flashitTransfer *t);
+
+static osalStatus flashit_transfer_retry(
+    flashitTransfer *t);
+
+static void flashit_transfer_check_rejected(
+    flashitTransfer *t);
+
+static osalStatus flashit_start_frame(
+    flashitTransfer *t);
+
+static osalStatus flashit_process_replies(
+    flashitTransfer *t);
+
+static void flashit_parse_stats(
+    flashitTransfer *t);
+
+static void flashit_print_stats(
+    flashitTransfer *t);
+
+static void flashit_parse_trace(
+    flashitTransfer *t);
+
+static void flashit_print_trace(
+    flashitTransfer *t);
+
+static os_memsz flashit_erased_run(
+    const os_uchar *p,
+    os_memsz n);
+
+
+/**
+****************************************************************************************************
+
+  @brief Connect to device and start transfer.
+  @anchor flashit_transfer_start
+
+  The flashit_transfer_start() function sets up transfer state and initiates socket connection.
+  Connecting completes in background, flashit_transfer_run() continues from here.
+
+  @param   t Transfer state to set up.
+  @param   ipaddr Device address. If it has no port, the default flashes port is used.
+  @param   img Binary to transfer. Must stay in memory until transfer is closed. If image
+           is empty and statistics are requested, only statistics and trace are fetched.
+  @param   opt Transfer options.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate that transfer could not be started,
+           t->error tells why. Call flashit_transfer_close() in either case.
+
+****************************************************************************************************
+*/
+osalStatus flashit_transfer_start(
+    flashitTransfer *t,
+    const os_char *ipaddr,
+    const flashitImage *img,
+    const flashitOptions *opt)
+{
+    const os_char *p;
+    os_boolean has_port;
+
+    os_memclear(t, sizeof(flashitTransfer));
+    os_strncpy(t->ipaddr, ipaddr, sizeof(t->ipaddr));
+
+    /* Append default port, unless address has one. Colons within brackets are IPv6 address.
+     */
+    has_port = OS_FALSE;
+    for (p = ipaddr; *p != '\0'; p++)
+    {
+        if (*p == ':') has_port = OS_TRUE;
+        else if (*p == ']') has_port = OS_FALSE;
+    }
+    if (!has_port) os_strncat(t->ipaddr, FLASHES_SOCKET_PORT_STR, sizeof(t->ipaddr));
+    t->image = img->image;
+    t->image_sz = img->image_sz;
+    t->image_crc = img->image_crc;
+    t->stream = img->stream;
+    t->stream_sz = img->stream_sz;
+    t->stream_type = img->stream_type;
+
+    t->window = opt->window;
+    t->block_size = opt->block_size ? opt->block_size : FLASHES_TRANSFER_BLOCK_SIZE;
+    t->legacy = (os_boolean)(opt->window == 1);
+    t->ack_every = opt->window / 2;
+    if (t->ack_every < 1) t->ack_every = 1;
+    t->dedupe = (os_boolean)(opt->dedupe && !t->legacy && t->stream == OS_NULL);
+    t->sparse = (os_boolean)(opt->sparse && !t->legacy && t->stream == OS_NULL);
+    t->resume = (os_boolean)(opt->resume && !t->legacy && t->stream == OS_NULL);
+    t->retries_left = opt->retries;
+    t->stats = (os_boolean)(opt->stats && !t->legacy);
+    t->stats_only = (os_boolean)(t->stats && t->image == OS_NULL);
+    t->verbose = opt->verbose;
+    os_get_timer(&t->start_timer);
+    t->timer = t->start_timer;
+
+    /* Allocate space for block checksums, if deduplicating.
+     */
+    t->nblocks = (os_int)((t->image_sz + FLASHES_TRANSFER_BLOCK_SIZE - 1) / FLASHES_TRANSFER_BLOCK_SIZE);
+    if (t->dedupe && t->nblocks)
+    {
+        t->hashes = (os_uint*)os_malloc(t->nblocks * sizeof(os_uint), &t->hashes_alloc);
+        if (t->hashes == OS_NULL)
+        {
+            t->error = "out of memory";
+            return OSAL_STATUS_FAILED;
+        }
+    }
+
+    return flashit_transfer_connect(t);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Move transfer forward without blocking.
+  @anchor flashit_transfer_run
+
+  The flashit_transfer_run() function writes frames as long as there is room in window and
+  socket accepts them, and processes replies from MCU. It returns without waiting. If replies
+  were received, run_again flag is set: The window may have room now, so the transfer should
+  be run again before waiting. The done flag is set once terminating zero length block has
+  been acknowledged.
+
+  If the transfer fails and reconnects are left, the connection is closed and opened again
+  after a delay, and the transfer resumes.
+
+  @param   t Transfer state.
+  @return  OSAL_SUCCESS if transfer is progressing or done. Other values indicate that transfer
+           failed, t->error tells why.
+
+****************************************************************************************************
+*/
+osalStatus flashit_transfer_run(
+    flashitTransfer *t)
+{
+    if (t->done) return OSAL_SUCCESS;
+
+    if (t->reconnecting)
+    {
+        if (!os_elapsed(&t->retry_timer, FLASHIT_RETRY_DELAY_MS)) return OSAL_SUCCESS;
+        t->reconnecting = OS_FALSE;
+        if (flashit_transfer_connect(t)) return flashit_transfer_retry(t);
+    }
+
+    if (flashit_transfer_step(t)) return flashit_transfer_retry(t);
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Wait until one of transfers can move forward.
+  @anchor flashit_transfer_wait
+
+  The flashit_transfer_wait() function blocks on sockets of the transfers until one has
+  data to read, room to write after a blocked write, completes connecting or closes. It also
+  returns when the nearest timer of the transfers expires: Reconnect delay or time out of
+  silent connection. Call flashit_transfer_run() for each transfer after this returns.
+
+  Transfers which are done or closed are ignored. If a transfer has run_again flag set, this
+  function returns at once. If there are more running transfers than FLASHIT_SELECT_MAX, the
+  wait is limited to FLASHIT_POLL_MS, so that the rest are polled.
+
+  @param   transfers Array of transfer states.
+  @param   n Number of transfers in array.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate that the socket layer could
+           not wait, caller should then yield processor time by other means.
+
+****************************************************************************************************
+*/
+osalStatus flashit_transfer_wait(
+    flashitTransfer *transfers,
+    os_int n)
+{
+    flashitTransfer *t;
+    osalStream streams[FLASHIT_SELECT_MAX];
+    osalSelectData selectdata;
+    os_timer now;
+    os_long left_ms, timeout_ms;
+    os_int nstreams, i;
+
+    os_get_timer(&now);
+    timeout_ms = FLASHES_TRANSFER_TIMEOUT_MS;
+    nstreams = 0;
+    for (i = 0; i < n; i++)
+    {
+        t = transfers + i;
+        if (t->done) continue;
+        if (t->run_again) return OSAL_SUCCESS;
+
+        /* Waiting to reconnect, wake up when the delay has passed.
+         */
+        if (t->reconnecting)
+        {
+            left_ms = FLASHIT_RETRY_DELAY_MS - (now - t->retry_timer);
+            if (left_ms < timeout_ms) timeout_ms = left_ms;
+            continue;
+        }
+        if (t->socket == OS_NULL) continue;
+
+        /* Wake up in time to detect silent connection.
+         */
+        left_ms = FLASHES_TRANSFER_TIMEOUT_MS - (now - t->timer);
+        if (left_ms < timeout_ms) timeout_ms = left_ms;
+
+        if (nstreams < FLASHIT_SELECT_MAX) streams[nstreams++] = t->socket;
+        else if (timeout_ms > FLASHIT_POLL_MS) timeout_ms = FLASHIT_POLL_MS;
+    }
+    if (timeout_ms < 0) timeout_ms = 0;
+
+    if (nstreams == 0)
+    {
+        os_sleep((os_int)timeout_ms);
+        return OSAL_SUCCESS;
+    }
+    return osal_stream_select(streams, nstreams, OS_NULL, &selectdata, (os_int)timeout_ms,
+        OSAL_STREAM_DEFAULT);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Connect socket to device.
+  @anchor flashit_transfer_connect
+
+  The flashit_transfer_connect() function initiates socket connection. Connecting completes
+  in background. The socket is opened with select support for flashit_transfer_wait().
+  Nagle's algorithm is disabled: Every frame is written with one call and we wait for
+  acknowledgement, so holding back a partial segment would only delay the reply by delayed
+  ACK time of the MCU's stack.
+
+  @param   t Transfer state.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate an error, t->error tells why.
+
+****************************************************************************************************
+*/
+static osalStatus flashit_transfer_connect(
+    flashitTransfer *t)
+{
+    t->socket = osal_stream_open(OSAL_SOCKET_IFACE, t->ipaddr, OS_NULL, OS_NULL,
+        OSAL_STREAM_CONNECT|OSAL_STREAM_SELECT|OSAL_STREAM_TCP_NODELAY);
+    if (t->socket == OS_NULL)
+    {
+        t->error = "socket connection failed";
+        return OSAL_STATUS_FAILED;
+    }
+    t->socket->write_timeout_ms = FLASHES_TRANSFER_TIMEOUT_MS;
+    os_get_timer(&t->timer);
+    osal_trace("socket connection initiated");
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Reconnect failed transfer, if reconnects are left.
+  @anchor flashit_transfer_retry
+
+  The flashit_transfer_retry() function closes the socket and clears state of the connection,
+  and sets up reconnect after FLASHIT_RETRY_DELAY_MS. Statistics are kept. Once terminating
+  block has been sent, the MCU may have switched banks already, so transfer is not retried.
+  If the MCU did not accept windowed frame, the transfer falls back to stop and wait protocol
+  instead, once.
+
+  @param   t Transfer state, t->error tells why the transfer failed.
+  @return  OSAL_SUCCESS if reconnect is pending. OSAL_STATUS_FAILED if transfer failed.
+
+****************************************************************************************************
+*/
+static osalStatus flashit_transfer_retry(
+    flashitTransfer *t)
+{
+    /* Fall back to stop and wait, this is not counted as a retry. Delta patch or compressed
+       binary cannot be sent so, and statistics cannot be fetched without windowed frames.
+     */
+    if (t->rejected)
+    {
+        t->rejected = OS_FALSE;
+        if (t->stream)
+        {
+            t->error = "MCU did not accept windowed frame, cannot send patch or compressed";
+            return OSAL_STATUS_FAILED;
+        }
+        if (t->stats_only)
+        {
+            t->error = "MCU did not accept windowed frame, cannot fetch statistics";
+            return OSAL_STATUS_FAILED;
+        }
+        osal_console_write(t->ipaddr);
+        osal_console_write(": MCU did not accept windowed frame, falling back to stop and wait\n");
+        t->legacy = OS_TRUE;
+        t->window = t->ack_every = 1;
+        t->dedupe = t->sparse = t->resume = t->stats = OS_FALSE;
+    }
+    else
+    {
+        if (t->retries_left <= 0 || t->terminating_zero_packet_sent) return OSAL_STATUS_FAILED;
+        t->retries_left--;
+        t->reconnects++;
+
+        if (t->verbose)
+        {
+            osal_console_write(t->ipaddr);
+            osal_console_write(": ");
+            osal_console_write(t->error ? t->error : "transfer failed");
+            osal_console_write(", reconnecting\n");
+        }
+    }
+
+    osal_stream_close(t->socket);
+    t->socket = OS_NULL;
+    t->error = OS_NULL;
+    t->image_pos = t->stream_pos = 0;
+    t->query_block = t->nhashes = 0;
+    t->sent_seq = t->acked_seq = 0;
+    t->buf_n = 0;
+    t->writing_block = OS_FALSE;
+    t->image_info_sent = t->digest_sent = OS_FALSE;
+    t->resume_pending = t->hash_query_pending = OS_FALSE;
+    t->stats_sent = t->stats_received = OS_FALSE;
+    t->trace_sent = t->trace_received = OS_FALSE;
+    t->reply_n = 0;
+    t->run_again = OS_FALSE;
+
+    t->reconnecting = OS_TRUE;
+    os_get_timer(&t->retry_timer);
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Move transfer forward by one step.
+  @anchor flashit_transfer_step
+
+  @param   t Transfer state.
+  @return  OSAL_SUCCESS if transfer is progressing or done. Other values indicate that
+           connection failed, t->error tells why.
+
+****************************************************************************************************
+*/
+static osalStatus flashit_transfer_step(
+    flashitTransfer *t)
+{
+    os_memsz n;
+
+    t->run_again = OS_FALSE;
+
+    /* Start sending next frame if we have room in window, and write it to socket. Continue
+       with next frame until window is full or socket does not accept more.
+     */
+    while (OS_TRUE)
+    {
+        if (!t->writing_block)
+        {
+            if (flashit_start_frame(t))
+            {
+                t->error = "socket connection failed";
+                return OSAL_STATUS_FAILED;
+            }
+            if (!t->writing_block) break;
+        }
+
+        if (osal_stream_write(t->socket, t->pos, t->buf_n, &n, OSAL_STREAM_DEFAULT))
+        {
+            t->error = "socket connection failed";
+            return OSAL_STATUS_FAILED;
+        }
+        t->buf_n -= n;
+        t->pos += n;
+        if (t->buf_n) break;
+        t->writing_block = OS_FALSE;
+        os_get_timer(&t->timer);
+    }
+
+    /* Nothing in flight, no need to check for reply.
+     */
+    if (t->sent_seq == t->acked_seq) return OSAL_SUCCESS;
+
+    /* Try to get MCU reply.
+     */
+    if (osal_stream_read(t->socket, t->reply + t->reply_n, sizeof(t->reply) - t->reply_n,
+        &n, OSAL_STREAM_DEFAULT))
+    {
+        t->error = "socket connection broken";
+        flashit_transfer_check_rejected(t);
+        return OSAL_STATUS_FAILED;
+    }
+    if (n)
+    {
+        t->reply_n += n;
+        if (flashit_process_replies(t))
+        {
+            if (t->error == OS_NULL) t->error = "program transfer failed";
+            return OSAL_STATUS_FAILED;
+        }
+        os_get_timer(&t->timer);
+        t->run_again = OS_TRUE;
+    }
+
+    /* If terminating zero package is acknowledged, all is done.
+     */
+    if (t->done) return OSAL_SUCCESS;
+
+    /* Check for time out.
+     */
+    if (os_elapsed(&t->timer, FLASHES_TRANSFER_TIMEOUT_MS))
+    {
+        t->error = "waiting MCU reply timed out";
+        flashit_transfer_check_rejected(t);
+        return OSAL_STATUS_FAILED;
+    }
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Check if MCU rejected windowed transfer.
+  @anchor flashit_transfer_check_rejected
+
+  The flashit_transfer_check_rejected() function is called when connection broke or MCU did
+  not reply. Loaders which know only stop and wait protocol read the first windowed frame,
+  which is not a plain data block, as too long block and close the connection without reply.
+  If the first frame has been written and the MCU has not replied to anything yet, the
+  rejected flag is set, and flashit_transfer_retry() falls back to stop and wait. Failures to
+  connect or write, and failures after MCU has replied, do not set it.
+
+  @param   t Transfer state.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashit_transfer_check_rejected(
+    flashitTransfer *t)
+{
+    if (!t->legacy && !t->confirmed && !t->writing_block && t->sent_seq &&
+        !t->terminating_zero_packet_sent)
+    {
+        t->rejected = OS_TRUE;
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Close transfer and release memory.
+  @anchor flashit_transfer_close
+
+  @param   t Transfer state.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashit_transfer_close(
+    flashitTransfer *t)
+{
+    osal_stream_close(t->socket);
+    t->socket = OS_NULL;
+    if (t->hashes)
+    {
+        os_free(t->hashes, t->hashes_alloc);
+        t->hashes = OS_NULL;
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Print transfer result.
+  @anchor flashit_transfer_report
+
+  The flashit_transfer_report() function prints one line: Device address, result, time used
+  and byte counts, or reason why the transfer failed. MCU timing statistics are printed after
+  it, if these were fetched.
+
+  @param   t Transfer state.
+  @return  None.
+
+****************************************************************************************************
+*/
+void flashit_transfer_report(
+    flashitTransfer *t)
+{
+    os_char nbuf[32];
+    os_timer now;
+
+    os_get_timer(&now);
+    osal_console_write(t->ipaddr);
+    if (!t->done)
+    {
+        osal_console_write(" FAILED: ");
+        osal_console_write(t->error ? t->error : "not completed");
+        osal_console_write("\n");
+        return;
+    }
+    if (t->stats_only)
+    {
+        osal_console_write(" statistics:\n");
+        flashit_print_stats(t);
+        osal_console_write("trace:\n");
+        flashit_print_trace(t);
+        return;
+    }
+
+    osal_console_write(" ok, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), now - t->start_timer);
+    osal_console_write(nbuf);
+    osal_console_write(" ms, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), t->sent_bytes);
+    osal_console_write(nbuf);
+    osal_console_write(t->stream ? " encoded bytes sent, " : " bytes sent, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), t->copied_bytes);
+    osal_console_write(nbuf);
+    osal_console_write(" bytes copied by MCU, ");
+    osal_int_to_string(nbuf, sizeof(nbuf), t->skipped_bytes);
+    osal_console_write(nbuf);
+    osal_console_write(" erased bytes skipped");
+    if (t->reconnects)
+    {
+        osal_console_write(", ");
+        osal_int_to_string(nbuf, sizeof(nbuf), t->reconnects);
+        osal_console_write(nbuf);
+        osal_console_write(" reconnects, resumed at ");
+        osal_int_to_string(nbuf, sizeof(nbuf), t->resumed_pos);
+        osal_console_write(nbuf);
+    }
+    osal_console_write("\n");
+    if (t->stats_received) flashit_print_stats(t);
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Start sending next frame.
+  @anchor flashit_start_frame
+
+  The flashit_start_frame() function selects the next frame to send, if there is room in
+  window, and builds it with header in frame buffer. The frame is written by the caller's loop.
+
+  In windowed mode the first frame requests a reply and nothing more is sent until it comes, to
+  know that MCU understands windowed frames. If resuming, the first frame asks MCU where to
+  continue and we wait for the reply. In windowed mode the next frame announces image size, so
+  the MCU can erase flash ahead. If deduplicating, hash queries are sent next, one at a time.
+  Then data blocks follow, or copy frames for runs of blocks which MCU already has, or skip
+  frames for areas of erased flash value. Data frames do not cross block boundaries, so that
+  following blocks stay aligned for deduplication. Smaller data frame size may be selected, it
+  must divide the block size. When sending delta patch or compressed binary, it is sent in
+  patch or compressed frames instead of data. In stop and wait mode the window is one frame.
+  In windowed mode image size and CRC-32 are sent after the data, so that the MCU can verify
+  the image, followed by timing statistics query if requested. Statistics only transfer sends
+  just statistics and trace queries. We always write zero length block in the end to indicate
+  end of the program. The 'o' reply to it acknowledges all frames.
+
+  @param   t Transfer state.
+  @return  OSAL_SUCCESS if all is fine, even if there was nothing to send now. Other values
+           indicate broken socket.
+
+****************************************************************************************************
+*/
+static osalStatus flashit_start_frame(
+    flashitTransfer *t)
+{
+    os_char nbuf[32];
+    os_memsz block_sz, end, k;
+    os_uint hdr, frame_type, count;
+    os_int block_nr;
+    os_ushort seq;
+
+    if (t->terminating_zero_packet_sent ||
+        (os_ushort)(t->sent_seq - t->acked_seq) >= (os_ushort)t->window ||
+        (!t->legacy && !t->confirmed && t->sent_seq))
+    {
+        return OSAL_SUCCESS;
+    }
+    seq = (os_ushort)(t->sent_seq + 1);
+
+    /* Only fetch statistics and trace: Query statistics without clearing these, then trace.
+       Close once trace has been received.
+     */
+    if (t->stats_only)
+    {
+        if (t->trace_sent) return OSAL_SUCCESS;
+        if (!t->stats_sent)
+        {
+            frame_type = FLASHES_FRAME_STATS;
+            t->ctrl[0] = 0;
+            t->buf_n = 1;
+            t->stats_sent = OS_TRUE;
+            t->stats_seq = seq;
+        }
+        else
+        {
+            frame_type = FLASHES_FRAME_TRACE;
+            t->buf_n = 0;
+            t->trace_sent = OS_TRUE;
+        }
+        t->pos = t->ctrl;
+    }
+
+    /* Ask where to continue interrupted transfer.
+     */
+    else if (t->resume && seq == 1)
+    {
+        frame_type = FLASHES_FRAME_RESUME;
+        flashes_put_uint(t->ctrl, (os_uint)t->image_sz, 4);
+        flashes_put_uint(t->ctrl + 4, t->image_crc, 4);
+        t->pos = t->ctrl;
+        t->buf_n = FLASHES_RESUME_SZ;
+        t->resume_pending = OS_TRUE;
+    }
+    else if (t->resume_pending)
+    {
+        return OSAL_SUCCESS;
+    }
+
+    /* Announce image size.
+     */
+    else if (!t->legacy && !t->image_info_sent)
+    {
+        frame_type = FLASHES_FRAME_IMAGE_INFO;
+        flashes_put_uint(t->ctrl, (os_uint)t->image_sz, FLASHES_IMAGE_INFO_SZ);
+        t->pos = t->ctrl;
+        t->buf_n = FLASHES_IMAGE_INFO_SZ;
+        t->image_info_sent = OS_TRUE;
+    }
+
+    /* Query block checksums, one query in flight at a time.
+     */
+    else if (t->dedupe && t->query_block < t->nblocks)
+    {
+        if (t->hash_query_pending) return OSAL_SUCCESS;
+        count = (os_uint)(t->nblocks - t->query_block);
+        if (count > FLASHES_HASH_QUERY_MAX) count = FLASHES_HASH_QUERY_MAX;
+        frame_type = FLASHES_FRAME_HASH_QUERY;
+        flashes_put_uint(t->ctrl, (os_uint)t->query_block, 4);
+        flashes_put_uint(t->ctrl + 4, count, 2);
+        t->pos = t->ctrl;
+        t->buf_n = FLASHES_HASH_QUERY_SZ;
+        t->hash_query_pending = OS_TRUE;
+    }
+
+    /* Wait for all checksums before deciding what to send.
+     */
+    else if (t->hash_query_pending)
+    {
+        return OSAL_SUCCESS;
+    }
+
+    /* Delta patch or compressed frame, or terminating zero length block.
+     */
+    else if (t->stream)
+    {
+        frame_type = t->stream_type;
+        t->pos = t->stream + t->stream_pos;
+        t->buf_n = t->stream_sz - t->stream_pos;
+        if (t->buf_n > t->block_size) t->buf_n = t->block_size;
+        if (t->buf_n == 0) frame_type = FLASHES_FRAME_BLOCK;
+        t->stream_pos += t->buf_n;
+        t->sent_bytes += t->buf_n;
+    }
+
+    /* Data or copy frame, or terminating zero length block.
+     */
+    else
+    {
+        frame_type = t->legacy ? FLASHES_FRAME_BLOCK : FLASHES_FRAME_DATA;
+        t->pos = t->image + t->image_pos;
+        t->buf_n = t->block_size - t->image_pos % t->block_size;
+        if (t->buf_n > t->image_sz - t->image_pos) t->buf_n = t->image_sz - t->image_pos;
+
+        /* If MCU has the same block in running image, send copy frame instead. Combine
+           run of such blocks to one frame. Only whole blocks are compared.
+         */
+        block_nr = (os_int)(t->image_pos / FLASHES_TRANSFER_BLOCK_SIZE);
+        block_sz = 0;
+        while (t->image_pos % FLASHES_TRANSFER_BLOCK_SIZE == 0 && block_nr < t->nhashes &&
+            t->image_pos + block_sz + FLASHES_TRANSFER_BLOCK_SIZE <= t->image_sz &&
+            t->hashes[block_nr] == flashes_crc32(FLASHES_CRC32_INIT,
+                t->image + t->image_pos + block_sz, FLASHES_TRANSFER_BLOCK_SIZE))
+        {
+            block_sz += FLASHES_TRANSFER_BLOCK_SIZE;
+            block_nr++;
+        }
+
+        /* Erased area is skipped. The skip ends at block boundary, unless at the end of
+           image, and data frame ends where such skip can start.
+         */
+        end = 0;
+        if (t->sparse && block_sz == 0)
+        {
+            end = t->image_pos + flashit_erased_run(t->pos, t->image_sz - t->image_pos);
+            if (end < t->image_sz) end -= end % FLASHES_TRANSFER_BLOCK_SIZE;
+            if (end < t->image_pos + FLASHIT_MIN_SKIP) end = 0;
+
+            k = 0;
+            while (k < t->buf_n && t->pos[t->buf_n - k - 1] == FLASHES_ERASED_BYTE) k++;
+            if (k >= FLASHIT_MIN_SKIP && k < t->buf_n) t->buf_n -= k;
+        }
+
+        if (block_sz)
+        {
+            frame_type = FLASHES_FRAME_COPY;
+            flashes_put_uint(t->ctrl, (os_uint)block_sz, FLASHES_COPY_SZ);
+            t->pos = t->ctrl;
+            t->buf_n = FLASHES_COPY_SZ;
+            t->image_pos += block_sz;
+            t->copied_bytes += block_sz;
+        }
+        else if (end)
+        {
+            frame_type = FLASHES_FRAME_SKIP;
+            flashes_put_uint(t->ctrl, (os_uint)(end - t->image_pos), FLASHES_SKIP_SZ);
+            t->skipped_bytes += end - t->image_pos;
+            t->image_pos = end;
+            t->pos = t->ctrl;
+            t->buf_n = FLASHES_SKIP_SZ;
+        }
+        else if (t->buf_n == 0)
+        {
+            frame_type = FLASHES_FRAME_BLOCK;
+        }
+        else
+        {
+            t->image_pos += t->buf_n;
+            t->sent_bytes += t->buf_n;
+        }
+    }
+
+    /* Before terminating block, send image size and CRC-32 for MCU to verify.
+     */
+    if (frame_type == FLASHES_FRAME_BLOCK && t->buf_n == 0 && !t->legacy && !t->digest_sent)
+    {
+        frame_type = FLASHES_FRAME_DIGEST;
+        flashes_put_uint(t->ctrl, (os_uint)t->image_sz, 4);
+        flashes_put_uint(t->ctrl + 4, t->image_crc, 4);
+        t->pos = t->ctrl;
+        t->buf_n = FLASHES_DIGEST_SZ;
+        t->digest_sent = OS_TRUE;
+    }
+
+    /* Fetch statistics of this transfer, before MCU switches bank and reboots. Clear them
+       so that next transfer shows only its own.
+     */
+    else if (frame_type == FLASHES_FRAME_BLOCK && t->buf_n == 0 && t->stats && !t->stats_sent)
+    {
+        frame_type = FLASHES_FRAME_STATS;
+        t->ctrl[0] = FLASHES_STATS_RESET;
+        t->pos = t->ctrl;
+        t->buf_n = 1;
+        t->stats_sent = OS_TRUE;
+        t->stats_seq = seq;
+    }
+
+    /* Frame header is two bytes, less significant byte first. Copy header and payload
+       to frame buffer, so that small header is not sent as separate TCP segment.
+     */
+    hdr = FLASHES_FRAME_HDR(frame_type, t->buf_n, (frame_type != FLASHES_FRAME_BLOCK &&
+        ((seq % t->ack_every) == 0 || !t->confirmed)) ? FLASHES_FRAME_ACK : 0);
+    flashes_put_uint(t->frame, hdr, 2);
+    if (t->buf_n) os_memcpy(t->frame + FLASHES_FRAME_HDR_SZ, t->pos, t->buf_n);
+    t->sent_seq = seq;
+    t->frame_end_pos[seq % FLASHES_MAX_WINDOW] = t->stream ? t->stream_pos : t->image_pos;
+
+    if (frame_type == FLASHES_FRAME_BLOCK && t->buf_n == 0)
+    {
+        t->terminating_zero_packet_sent = OS_TRUE;
+        os_get_timer(&t->timer);
+    }
+    else if (t->buf_n)
+    {
+        if (t->legacy && t->verbose)
+        {
+            osal_console_write("transferring block ");
+            osal_int_to_string(nbuf, sizeof(nbuf), ++(t->block_count));
+            osal_console_write(nbuf);
+            osal_console_write("... ");
+        }
+    }
+
+    t->pos = t->frame;
+    t->buf_n += FLASHES_FRAME_HDR_SZ;
+    t->writing_block = OS_TRUE;
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Process replies received from MCU.
+  @anchor flashit_process_replies
+
+  The flashit_process_replies() function processes complete replies in reply buffer. If reply
+  is OK (small 'o' letter), then block or terminating zero block has been written.
+  Acknowledgement 'a' is followed by sequence number of last processed frame. Hash reply 'h'
+  carries block checksums and resume reply 'r' image position where to continue. Statistics
+  reply 's' carries MCU timing statistics and trace reply 't' trace events. Error 'e' tells
+  that written image did not match image size and CRC-32 we sent, or that announced image
+  size does not fit in MCU flash bank. Other replies indicate error.
+
+  @param   t Transfer state.
+  @return  OSAL_SUCCESS if all is fine. Other values indicate that MCU reported an error
+           or sent something we do not understand.
+
+****************************************************************************************************
+*/
+static osalStatus flashit_process_replies(
+    flashitTransfer *t)
+{
+    os_char nbuf[64];
+    os_uchar *p;
+    os_memsz n;
+    os_int count, i;
+
+    /* Any reply tells that MCU understands windowed protocol.
+     */
+    if (t->reply_n > 0) t->confirmed = OS_TRUE;
+
+    while (t->reply_n > 0)
+    {
+        switch (t->reply[0])
+        {
+            case FLASHES_REPLY_OK:
+                n = 1;
+                t->acked_seq = t->sent_seq;
+                if (t->terminating_zero_packet_sent) t->done = OS_TRUE;
+                else if (t->legacy && t->verbose) osal_console_write("ok\n");
+                break;
+
+            case FLASHES_REPLY_ACK:
+                if (t->reply_n < FLASHES_ACK_REPLY_SZ) return OSAL_SUCCESS;
+                n = FLASHES_ACK_REPLY_SZ;
+                t->acked_seq = (os_ushort)flashes_get_uint(t->reply + 1, 2);
+                if (t->verbose)
+                {
+                    osal_console_write("written ");
+                    osal_int_to_string(nbuf, sizeof(nbuf),
+                        t->frame_end_pos[t->acked_seq % FLASHES_MAX_WINDOW]);
+                    osal_console_write(nbuf);
+                    osal_console_write(t->stream ? " encoded bytes\n" : " bytes\n");
+                }
+                break;
+
+            case FLASHES_REPLY_HASH:
+                if (t->reply_n < FLASHES_HASH_REPLY_HDR_SZ) return OSAL_SUCCESS;
+                count = (os_int)flashes_get_uint(t->reply + 1, 2);
+                n = FLASHES_HASH_REPLY_HDR_SZ + 4 * count;
+                if (n > (os_memsz)sizeof(t->reply)) return OSAL_STATUS_FAILED;
+                if (t->reply_n < n) return OSAL_SUCCESS;
+
+                /* Store checksums. If MCU returned less than we asked, it cannot copy
+                   more: Stop querying.
+                 */
+                p = t->reply + FLASHES_HASH_REPLY_HDR_SZ;
+                for (i = 0; i < count && t->nhashes < t->nblocks; i++, p += 4)
+                {
+                    t->hashes[t->nhashes++] = flashes_get_uint(p, 4);
+                }
+                t->query_block = (count < FLASHES_HASH_QUERY_MAX) ? t->nblocks : t->nhashes;
+                t->hash_query_pending = OS_FALSE;
+                t->acked_seq = t->sent_seq;
+                break;
+
+            case FLASHES_REPLY_RESUME:
+                if (t->reply_n < FLASHES_RESUME_REPLY_SZ) return OSAL_SUCCESS;
+                n = FLASHES_RESUME_REPLY_SZ;
+                t->resumed_pos = (os_memsz)flashes_get_uint(t->reply + 1, 4);
+                if (t->resumed_pos > t->image_sz) return OSAL_STATUS_FAILED;
+                t->image_pos = t->resumed_pos;
+                t->resume_pending = OS_FALSE;
+                t->acked_seq = t->sent_seq;
+                if (t->verbose && t->resumed_pos)
+                {
+                    osal_console_write("resuming at ");
+                    osal_int_to_string(nbuf, sizeof(nbuf), t->resumed_pos);
+                    osal_console_write(nbuf);
+                    osal_console_write(" bytes\n");
+                }
+                break;
+
+            case FLASHES_REPLY_STATS:
+                if (t->reply_n < FLASHES_STATS_REPLY_HDR_SZ) return OSAL_SUCCESS;
+                n = FLASHES_STATS_REPLY_HDR_SZ + 4 * (os_memsz)t->reply[1] * (4 + t->reply[2]);
+                if (n > (os_memsz)sizeof(t->reply)) return OSAL_STATUS_FAILED;
+                if (t->reply_n < n) return OSAL_SUCCESS;
+                flashit_parse_stats(t);
+                t->acked_seq = t->stats_seq;
+                break;
+
+            case FLASHES_REPLY_TRACE:
+                if (t->reply_n < FLASHES_TRACE_REPLY_HDR_SZ) return OSAL_SUCCESS;
+                count = (os_int)flashes_get_uint(t->reply + 1, 2);
+                if (count > FLASHES_TRACE_REPLY_MAX) return OSAL_STATUS_FAILED;
+                n = FLASHES_TRACE_REPLY_HDR_SZ + FLASHES_TRACE_EVENT_SZ * count;
+                if (t->reply_n < n) return OSAL_SUCCESS;
+                flashit_parse_trace(t);
+                t->acked_seq = t->sent_seq;
+                if (t->stats_only) t->done = OS_TRUE;
+                break;
+
+            case FLASHES_REPLY_ERROR:
+                t->error = t->digest_sent ? "MCU image verification failed"
+                    : "MCU rejected image size";
+                return OSAL_STATUS_FAILED;
+
+            default:
+                t->error = "MCU reported error";
+                return OSAL_STATUS_FAILED;
+        }
+
+        t->reply_n -= n;
+        os_memmove(t->reply, t->reply + n, t->reply_n);
+    }
+
+    return OSAL_SUCCESS;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Store statistics from 's' reply.
+  @anchor flashit_parse_stats
+
+  The flashit_parse_stats() function copies MCU timing statistics from complete 's' reply in
+  reply buffer. Phases and histogram bins which MCU has, but we do not know, are ignored.
+
+  @param   t Transfer state.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashit_parse_stats(
+    flashitTransfer *t)
+{
+    flashesStat *st;
+    const os_uchar *p;
+    os_uint v;
+    os_int nphases, nbins, phase, i;
+
+    nphases = t->reply[1];
+    nbins = t->reply[2];
+    os_memclear(t->mcu_stats, sizeof(t->mcu_stats));
+
+    p = t->reply + FLASHES_STATS_REPLY_HDR_SZ;
+    for (phase = 0; phase < nphases; phase++)
+    {
+        for (i = 0; i < 4 + nbins; i++, p += 4)
+        {
+            if (phase >= FLASHES_NRO_STATS || i >= 4 + FLASHES_STATS_HIST_SZ) continue;
+            st = t->mcu_stats + phase;
+            v = flashes_get_uint(p, 4);
+            switch (i)
+            {
+                case 0: st->count = v; break;
+                case 1: st->min_us = v; break;
+                case 2: st->max_us = v; break;
+                case 3: st->sum_us = v; break;
+                default: st->hist[i - 4] = v; break;
+            }
+        }
+    }
+    t->stats_received = OS_TRUE;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Print MCU timing statistics.
+  @anchor flashit_print_stats
+
+  The flashit_print_stats() function prints one line for each phase which was measured:
+  Number of measurements, min, average and max time, and non empty histogram bins as
+  "<limit:count", time under limit in microseconds. The last bin is ">=limit:count".
+
+  @param   t Transfer state.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashit_print_stats(
+    flashitTransfer *t)
+{
+    const flashesStat *st;
+    os_char nbuf[32];
+    os_int phase, i;
+
+    for (phase = 0; phase < FLASHES_NRO_STATS; phase++)
+    {
+        st = t->mcu_stats + phase;
+        if (st->count == 0) continue;
+
+        osal_console_write("  ");
+        osal_console_write(flashes_stats_name(phase));
+        osal_console_write(": n=");
+        osal_int_to_string(nbuf, sizeof(nbuf), st->count);
+        osal_console_write(nbuf);
+        osal_console_write(" min=");
+        osal_int_to_string(nbuf, sizeof(nbuf), st->min_us);
+        osal_console_write(nbuf);
+        osal_console_write(" avg=");
+        osal_int_to_string(nbuf, sizeof(nbuf), st->sum_us / st->count);
+        osal_console_write(nbuf);
+        osal_console_write(" max=");
+        osal_int_to_string(nbuf, sizeof(nbuf), st->max_us);
+        osal_console_write(nbuf);
+        osal_console_write(" us, hist");
+
+        for (i = 0; i < FLASHES_STATS_HIST_SZ; i++)
+        {
+            if (st->hist[i] == 0) continue;
+            osal_console_write(i == FLASHES_STATS_HIST_SZ - 1 ? " >=" : " <");
+            osal_int_to_string(nbuf, sizeof(nbuf),
+                i == FLASHES_STATS_HIST_SZ - 1 ? (1L << (i - 1)) : (1L << i));
+            osal_console_write(nbuf);
+            osal_console_write(":");
+            osal_int_to_string(nbuf, sizeof(nbuf), st->hist[i]);
+            osal_console_write(nbuf);
+        }
+        osal_console_write("\n");
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Store trace events from 't' reply.
+  @anchor flashit_parse_trace
+
+  @param   t Transfer state, complete 't' reply at beginning of reply buffer.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashit_parse_trace(
+    flashitTransfer *t)
+{
+    flashesTraceEvent *ev;
+    const os_uchar *p;
+    os_uint v[4];
+    os_int i, j;
+
+    p = t->reply + 1;
+    t->trace_count = (os_int)flashes_get_uint(p, 2);
+    t->trace_cycles_per_us = flashes_get_uint(p + 2, 4);
+
+    p = t->reply + FLASHES_TRACE_REPLY_HDR_SZ;
+    for (i = 0; i < t->trace_count; i++)
+    {
+        for (j = 0; j < 4; j++, p += 4)
+        {
+            v[j] = flashes_get_uint(p, 4);
+        }
+        ev = t->trace + i;
+        ev->t = v[0];
+        ev->event = v[1];
+        ev->a = v[2];
+        ev->b = v[3];
+    }
+    t->trace_received = OS_TRUE;
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Print trace events fetched from MCU.
+  @anchor flashit_print_trace
+
+  The flashit_print_trace() function formats events with the same function MCU would use,
+  one line each, the oldest first.
+
+  @param   t Transfer state.
+  @return  None.
+
+****************************************************************************************************
+*/
+static void flashit_print_trace(
+    flashitTransfer *t)
+{
+    os_char buf[FLASHES_TRACE_TEXT_SZ];
+    os_int i;
+
+    for (i = 0; i < t->trace_count; i++)
+    {
+        flashes_trace_format(t->trace + i, i ? t->trace[i - 1].t : t->trace[0].t,
+            t->trace_cycles_per_us, buf, sizeof(buf));
+        osal_console_write("  ");
+        osal_console_write(buf);
+        osal_console_write("\n");
+    }
+}
+
+
+/**
+****************************************************************************************************
+
+  @brief Count erased value bytes.
+  @anchor flashit_erased_run
+
+  @param   p Pointer to data.
+  @param   n Number of bytes available.
+  @return  Number of FLASHES_ERASED_BYTE bytes at beginning of data.
+
+****************************************************************************************************
+*/
+static os_memsz flashit_erased_run(
+    const os_uchar *p,
+    os_memsz n)
+{
+    os_memsz i;
+
+    i = 0;
+    while (i < n && p[i] == FLASHES_ERASED_BYTE) i++;
+    return i;
+}
@@ -35,8 +35,16 @@ OSAL_C_HEADER_BEGINS
 
 /* Include all flashes library headers.
  */
+#include "code/common/flashes_protocol.h"
+#include "code/common/flashes_crc32.h"
+#include "code/common/flashes_stats.h"
+#include "code/common/flashes_trace.h"
 #include "code/common/flashes_write.h"
 #include "code/common/flashes_socket.h"
+#include "code/common/flashes_discovery.h"
+#include "code/common/flashes_multicast.h"
+#include "code/common/flashes_delta.h"
+#include "code/common/flashes_lz.h"
 
 /* If C++ compilation, end the undecorated code.
  */